@@ -28,13 +28,38 @@
  * License: MIT
  */
 
+#define _DEFAULT_SOURCE /* DT_REG and friends under -std=c99 */
+#define _DARWIN_C_SOURCE
+
 #include "raylib.h"
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
 
 /* ============================================================================
  * Platform Detection
@@ -49,6 +74,22 @@
 #define IS_MACOS 0
 #endif
 
+/* x86-64 builds carry an AVX2 search kernel that is used when the CPU has
+ * AVX2; the check happens at run time, so no -mavx2 is needed */
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_AVX2_KERNEL 1
+#else
+#define HAVE_AVX2_KERNEL 0
+#endif
+
+/* Linux reports changes to the vault folder through inotify; elsewhere the
+ * vault watcher lists the folder from time to time instead */
+#if defined(__linux__)
+#define HAVE_INOTIFY 1
+#else
+#define HAVE_INOTIFY 0
+#endif
+
 /* ============================================================================
  * Application Configuration
  * ============================================================================
@@ -58,11 +99,16 @@
 #define WINDOW_HEIGHT 800        /* Initial window height in pixels */
 #define SIDEBAR_WIDTH 280        /* Width of the left sidebar */
 #define HEADER_HEIGHT 50         /* Height of the top header bar */
-#define MAX_NOTES 100            /* Maximum number of notes */
 #define MAX_TITLE_LENGTH 128     /* Maximum characters in note title */
-#define MAX_CONTENT_LENGTH 32768 /* Maximum characters in note content */
+#define EDITOR_LINE_HEIGHT 24    /* Height of one line of text in the editor */
+#define SCROLL_LINES 3           /* Visual lines scrolled per wheel notch */
+#define SCROLL_SMOOTHING 15.0f   /* Higher values make scrolling snappier */
 #define VAULT_FOLDER "vault"     /* Folder where notes are stored */
 
+/* Vertical extent of the editor's scrollable text area */
+#define EDITOR_TEXT_TOP (HEADER_HEIGHT + 100)
+#define EDITOR_TEXT_BOTTOM (WINDOW_HEIGHT - 30)
+
 /* ============================================================================
  * Color Palette
  * ============================================================================
@@ -92,33 +138,141 @@
 #define ACCENT_BLUE (Color){66, 165, 245, 255} /* Secondary accent   Blue */
 #define BORDER_COLOR (Color){50, 50, 50, 255}  /* Border/divider     #323232 */
 
+/* Find-in-note highlights, drawn behind the text */
+#define FIND_MATCH (Color){66, 165, 245, 60}    /* Every match        Blue    */
+#define FIND_CURRENT (Color){138, 79, 255, 140} /* Current match      Purple  */
+
 /* ============================================================================
  * Data Structures
  * ============================================================================
  */
 
+/**
+ * @brief Gap buffer holding the text of one note
+ */
+typedef struct {
+  char *data;       /* Backing storage (NULL if not allocated) */
+  size_t capacity;  /* Total bytes allocated for data */
+  size_t gap_start; /* Offset of the first byte of the gap */
+  size_t gap_end;   /* Offset one past the last byte of the gap */
+  bool mapped;      /* data is a read-only mapping of the note's file */
+  int fd;           /* The mapped file, read again if it shrinks */
+} TextBuffer;
+
+/**
+ * @brief Markdown style of a paragraph, as rendered by the editor
+ */
+typedef enum {
+  LINE_STYLE_TEXT,   /* Plain text */
+  LINE_STYLE_H1,     /* "# " heading */
+  LINE_STYLE_H2,     /* "## " heading */
+  LINE_STYLE_BULLET, /* "- " bullet point */
+} LineStyle;
+
+/**
+ * @brief One wrapped visual line of a paragraph
+ */
+typedef struct {
+  size_t start;        /* Offset of the line from the paragraph start */
+  size_t len;          /* Bytes in the line (excluding a wrapping space) */
+  float width;         /* Drawn width of the line in pixels */
+  unsigned char style; /* LineStyle of the paragraph */
+  unsigned char skip;  /* Markup bytes not drawn ("# "), first line only */
+} VisualLine;
+
+/**
+ * @brief One line in a note's line index (a node of an implicit treap)
+ *
+ * A node also owns the cached word wrap of its line. Edits replace the nodes
+ * of the lines they touch, so only those paragraphs are wrapped again. The
+ * number of visual lines is summed over subtrees so the editor can find the
+ * paragraph at a given scroll height in O(log n).
+ */
+typedef struct {
+  int left, right;   /* Child nodes (-1 if none) */
+  unsigned priority; /* Random heap priority that keeps the tree balanced */
+  size_t len;        /* Bytes in this line, including its '\n' */
+  size_t sum;        /* Total bytes of all lines in this subtree */
+  int count;         /* Number of lines in this subtree */
+  VisualLine *wraps; /* Cached visual lines (NULL until laid out) */
+  int wrap_count;    /* Entries in wraps */
+  int height;        /* Visual lines (estimated until laid out) */
+  long height_sum;   /* Total visual lines of all lines in this subtree */
+} LineNode;
+
+/**
+ * @brief Balanced index of line lengths for offset <-> line lookups
+ */
+typedef struct {
+  LineNode *nodes;   /* Node pool */
+  int node_count;    /* Nodes handed out from the pool */
+  int node_capacity; /* Allocated nodes in the pool */
+  int free_list;     /* First released node (-1 if none) */
+  int root;          /* Root of the treap (-1 if empty) */
+  int wrap_estimate; /* Bytes per visual line assumed before layout */
+} LineIndex;
+
 /**
  * @brief Represents a single note
+ *
+ * Only the metadata is kept resident for every note in the vault. The body is
+ * read from disk the first time the note is selected and released again once
+ * the note is deselected without unsaved changes.
  */
 typedef struct {
-  char title[MAX_TITLE_LENGTH];     /* Note title (also used as filename) */
-  char content[MAX_CONTENT_LENGTH]; /* Note content in plain text */
-  char filepath[256];               /* Full path to the .md file */
-  bool modified;                    /* True if note has unsaved changes */
+  int id;                       /* Stable id, used by the search index */
+  char title[MAX_TITLE_LENGTH]; /* Note title (also used as filename) */
+  TextBuffer content;           /* Note content (data is NULL until loaded) */
+  LineIndex lines;              /* Line index (valid while content is loaded) */
+  char *folded;                 /* Case-folded content (NULL until searched) */
+  size_t folded_len;            /* Length of folded */
+  unsigned generation;          /* Bumped whenever content changes */
+  float layout_width;           /* Wrap width the cached layout was built for */
+  long word_count;              /* Words in content (kept current on edits) */
+  long char_count;              /* UTF-8 characters in content */
+  long size;                    /* Size of the .md file in bytes */
+  time_t mtime;                 /* Last modification time of the .md file */
+  bool modified;                /* True if note has unsaved changes */
+  bool indexed;                 /* Search indexes hold the note's saved text */
 } Note;
 
+/**
+ * @brief A visual line as drawn by the editor in the last frame
+ */
+typedef struct {
+  size_t start;  /* Offset of the first byte of the line */
+  size_t len;    /* Bytes in the line (excluding a wrapping space or '\n') */
+  int skip;      /* Markup bytes at the start that are not drawn ("# ") */
+  int x, y;      /* Where the first drawn character is placed */
+  Font font;     /* Font the line is drawn with */
+  int font_size; /* Font size the line is drawn with */
+} EditorLine;
+
 /**
  * @brief Application state container
  */
 typedef struct {
-  Note notes[MAX_NOTES]; /* Array of all notes */
-  int count;             /* Number of notes currently loaded */
-  int selected;          /* Index of currently selected note (-1 if none) */
-  bool editingTitle;     /* True if user is editing note title */
-  int cursorPos;         /* Cursor position in editor */
-  int scrollOffset;      /* Scroll offset for sidebar */
-  char searchQuery[128]; /* Current search query */
-  bool showSearch;       /* True if search bar is visible */
+  Note *notes;              /* Growable table of all notes */
+  int count;                /* Number of notes currently loaded */
+  int capacity;             /* Allocated slots in the notes table */
+  int selected;             /* Index of currently selected note (-1 if none) */
+  int nextNoteId;           /* Id given to the next note created or loaded */
+  unsigned removals;        /* Notes dropped so far (later ones shift down) */
+  bool editingTitle;        /* True if user is editing note title */
+  size_t cursorPos;         /* Cursor position in editor (byte offset) */
+  int preferredColumn;      /* Column kept across up/down moves (-1 if none) */
+  bool scrollToCursor;      /* Bring the cursor into view on the next draw */
+  float editorScroll;       /* Scroll offset of the editor text in pixels */
+  float editorScrollTarget; /* Offset the editor is smoothly scrolling to */
+  int scrollOffset;         /* Scroll offset for sidebar */
+  char searchQuery[128];    /* Current search query */
+  bool showSearch;          /* True if search bar is visible */
+  bool searchFocused;       /* Typing goes to the search box */
+  int *searchResults;       /* Best matches, best first (NULL = no filter) */
+  int searchResultCount;    /* Entries in searchResults */
+  int searchMatchCount;     /* Notes matching searchQuery */
+  bool searchStale;         /* searchResults must be recomputed */
+  bool searchInvalid;       /* searchQuery is a regex that does not compile */
 } Notebook;
 
 /* ============================================================================
@@ -130,6 +284,10 @@ static Notebook notebook = {0}; /* Main application state */
 static Font mainFont;           /* Regular text font */
 static Font boldFont;           /* Bold text font */
 
+#define MAX_EDITOR_LINES 128 /* Visual lines remembered for mouse hit-tests */
+static EditorLine editor_lines[MAX_EDITOR_LINES]; /* Lines drawn last frame */
+static int editor_line_count;                     /* Entries in editor_lines */
+
 /* ============================================================================
  * UTF-8 Encoding Utilities
  * ============================================================================
@@ -170,6 +328,48 @@ static int encode_utf8(unsigned int codepoint, char *out) {
   return 0;
 }
 
+/**
+ * @brief Decode one UTF-8 character
+ * @param text Bytes to decode from
+ * @param len Number of bytes available
+ * @param codepoint Receives the codepoint ('?' for malformed input)
+ * @return Number of bytes consumed (1-4, at least 1 if len > 0)
+ */
+static int decode_utf8(const char *text, size_t len, int *codepoint) {
+  const unsigned char *s = (const unsigned char *)text;
+  int size = 0;
+  int cp = '?';
+
+  if (s[0] < 0x80) {
+    cp = s[0];
+    size = 1;
+  } else if ((s[0] & 0xE0) == 0xC0) {
+    cp = s[0] & 0x1F;
+    size = 2;
+  } else if ((s[0] & 0xF0) == 0xE0) {
+    cp = s[0] & 0x0F;
+    size = 3;
+  } else if ((s[0] & 0xF8) == 0xF0) {
+    cp = s[0] & 0x07;
+    size = 4;
+  }
+
+  /* Reject truncated sequences and stray continuation bytes */
+  if (size == 0 || (size_t)size > len) {
+    *codepoint = '?';
+    return 1;
+  }
+  for (int i = 1; i < size; i++) {
+    if ((s[i] & 0xC0) != 0x80) {
+      *codepoint = '?';
+      return 1;
+    }
+    cp = (cp << 6) | (s[i] & 0x3F);
+  }
+  *codepoint = cp;
+  return size;
+}
+
 /**
  * @brief Check if the platform modifier key is pressed
  * @return True if Cmd (macOS) or Ctrl (Linux) is held down
@@ -182,322 +382,10333 @@ static bool is_modifier_down(void) {
 #endif
 }
 
-/**
- * @brief Get the byte length of the last UTF-8 character in a string
- * @param str The string to analyze
- * @param len Length of the string
- * @return Number of bytes in the last character (1-4)
- */
-static int get_last_utf8_char_bytes(const char *str, int len) {
-  if (len == 0)
-    return 0;
-
-  /* Walk backwards to find the start of the last UTF-8 character */
-  int i = len - 1;
-  while (i > 0 && (str[i] & 0xC0) == 0x80) {
-    i--;
-  }
-  return len - i;
-}
-
 /* ============================================================================
- * File System Operations
+ * Case Folding
  * ============================================================================
+ * Search and the quick switcher ignore case by comparing case-folded text.
+ * Folding works codepoint by codepoint through a table that covers Latin-1,
+ * Latin Extended-A (Turkish among others), Greek and Cyrillic; everything
+ * else is left as it is. In a Turkish locale (LC_ALL, LC_CTYPE or LANG
+ * starting with "tr") the dotted and dotless i stay apart: I folds to ı and
+ * İ to i. Elsewhere both I and İ fold to i.
+ *
+ * Text is folded once and then searched byte for byte, so a case-insensitive
+ * search costs the same as an exact one.
  */
 
-/**
- * @brief Ensure the vault folder exists, create if needed
- */
-static void ensure_vault_exists(void) {
-  struct stat st = {0};
-  if (stat(VAULT_FOLDER, &st) == -1) {
-    mkdir(VAULT_FOLDER, 0700);
-  }
-}
+#define CASE_FOLD_RANGE 0x500 /* Codepoints below this are in the table */
+
+static unsigned short case_fold_table[CASE_FOLD_RANGE]; /* Folded forms */
+static bool case_fold_turkish; /* Turkish dotted/dotless i rules */
 
 /**
- * @brief Load all notes from the vault folder
+ * @brief Build the folding table for the current locale
+ *
+ * Must run before any text is folded.
  */
-static void load_notes(void) {
-  notebook.count = 0;
-  DIR *dir = opendir(VAULT_FOLDER);
-  if (dir == NULL)
-    return;
+static void case_fold_init(void) {
+  const char *locale = getenv("LC_ALL");
+  if (locale == NULL || *locale == '\0')
+    locale = getenv("LC_CTYPE");
+  if (locale == NULL || *locale == '\0')
+    locale = getenv("LANG");
+  case_fold_turkish = locale != NULL && strncmp(locale, "tr", 2) == 0;
 
-  struct dirent *entry;
-  while ((entry = readdir(dir)) != NULL && notebook.count < MAX_NOTES) {
-    if (entry->d_type == DT_REG) {
-      const char *ext = strrchr(entry->d_name, '.');
-      if (ext && strcmp(ext, ".md") == 0) {
-        Note *note = &notebook.notes[notebook.count];
-
-        /* Extract title from filename (remove .md extension) */
-        size_t name_len = strlen(entry->d_name) - 3;
-        strncpy(note->title, entry->d_name, name_len);
-        note->title[name_len] = '\0';
-
-        /* Build full file path */
-        snprintf(note->filepath, sizeof(note->filepath), "%s/%s", VAULT_FOLDER,
-                 entry->d_name);
-
-        /* Load file content */
-        FILE *file = fopen(note->filepath, "r");
-        if (file) {
-          size_t bytes_read =
-              fread(note->content, 1, MAX_CONTENT_LENGTH - 1, file);
-          note->content[bytes_read] = '\0';
-          fclose(file);
-        }
+  for (int cp = 0; cp < CASE_FOLD_RANGE; cp++)
+    case_fold_table[cp] = (unsigned short)cp;
 
-        note->modified = false;
-        notebook.count++;
-      }
-    }
+  /* ASCII and Latin-1 (except the multiplication sign) */
+  for (int cp = 'A'; cp <= 'Z'; cp++)
+    case_fold_table[cp] = (unsigned short)(cp + 32);
+  for (int cp = 0xC0; cp <= 0xDE; cp++) {
+    if (cp != 0xD7)
+      case_fold_table[cp] = (unsigned short)(cp + 32);
   }
-  closedir(dir);
 
-  /* Create a welcome note if the vault is empty */
-  if (notebook.count == 0) {
-    Note *note = &notebook.notes[0];
-    strcpy(note->title, "Welcome");
-    snprintf(note->filepath, sizeof(note->filepath), "%s/Welcome.md",
-             VAULT_FOLDER);
+  /* Latin Extended-A: pairs with the capital first, odd or even */
+  for (int cp = 0x100; cp < 0x180; cp++) {
+    bool odd_capitals =
+        (cp >= 0x139 && cp <= 0x148) || (cp >= 0x179 && cp <= 0x17E);
+    if (cp == 0x130 || cp == 0x131 || cp == 0x138 || cp == 0x149 ||
+        cp == 0x178 || cp == 0x17F)
+      continue;
+    if ((cp % 2 == 1) == odd_capitals)
+      case_fold_table[cp] = (unsigned short)(cp + 1);
+  }
+  case_fold_table[0x178] = 0xFF; /* Ÿ */
+  case_fold_table[0x130] = 'i';  /* İ */
+  if (case_fold_turkish)
+    case_fold_table['I'] = 0x131; /* ı */
 
-#if IS_MACOS
-    strcpy(note->content,
-           "# Welcome to Notes! 📝\n\n"
-           "This is your personal notebook, inspired by Obsidian.\n\n"
-           "## Features\n\n"
-           "- **Create** new notes with the + button\n"
-           "- **Edit** notes in the editor panel\n"
-           "- **Delete** notes with right-click\n"
-           "- **Search** notes with ⌘F\n\n"
-           "## Keyboard Shortcuts\n\n"
-           "- `⌘N` - New note\n"
-           "- `⌘S` - Save note\n"
-           "- `⌘F` - Search\n\n"
-           "Supports Turkish keyboard: ş, ğ, ü, ö, ç, ı\n\n"
-           "Start writing your notes!\n");
-#else
-    strcpy(note->content,
-           "# Welcome to Notes! 📝\n\n"
-           "This is your personal notebook, inspired by Obsidian.\n\n"
-           "## Features\n\n"
-           "- **Create** new notes with the + button\n"
-           "- **Edit** notes in the editor panel\n"
-           "- **Delete** notes with right-click\n"
-           "- **Search** notes with Ctrl+F\n\n"
-           "## Keyboard Shortcuts\n\n"
-           "- `Ctrl+N` - New note\n"
-           "- `Ctrl+S` - Save note\n"
-           "- `Ctrl+F` - Search\n\n"
-           "Supports Turkish keyboard: ş, ğ, ü, ö, ç, ı\n\n"
-           "Start writing your notes!\n");
-#endif
-    note->modified = true;
-    notebook.count = 1;
-    notebook.selected = 0;
+  /* Greek, with the accented capitals and final sigma */
+  for (int cp = 0x391; cp <= 0x3A9; cp++) {
+    if (cp != 0x3A2)
+      case_fold_table[cp] = (unsigned short)(cp + 32);
+  }
+  case_fold_table[0x386] = 0x3AC;
+  for (int cp = 0x388; cp <= 0x38A; cp++)
+    case_fold_table[cp] = (unsigned short)(cp + 37);
+  case_fold_table[0x38C] = 0x3CC;
+  case_fold_table[0x38E] = 0x3CD;
+  case_fold_table[0x38F] = 0x3CE;
+  case_fold_table[0x3C2] = 0x3C3;
+
+  /* Cyrillic, and the pairs of its extensions */
+  for (int cp = 0x400; cp <= 0x40F; cp++)
+    case_fold_table[cp] = (unsigned short)(cp + 80);
+  for (int cp = 0x410; cp <= 0x42F; cp++)
+    case_fold_table[cp] = (unsigned short)(cp + 32);
+  for (int cp = 0x460; cp < CASE_FOLD_RANGE; cp += 2) {
+    if ((cp >= 0x460 && cp <= 0x480) || (cp >= 0x48A && cp <= 0x4BE) ||
+        cp >= 0x4D0)
+      case_fold_table[cp] = (unsigned short)(cp + 1);
   }
 }
 
 /**
- * @brief Save a single note to disk
- * @param note Pointer to the note to save
+ * @brief Fold one UTF-8 character
+ * @param text The character
+ * @param len Bytes available at text
+ * @param out Receives the folded character (4 bytes)
+ * @param consumed Receives the number of input bytes used
+ * @return Bytes written to out (malformed bytes are copied unchanged)
  */
-static void save_note(Note *note) {
-  if (!note->modified)
-    return;
-
-  /* Update filepath in case title changed */
-  snprintf(note->filepath, sizeof(note->filepath), "%s/%s.md", VAULT_FOLDER,
-           note->title);
-
-  FILE *file = fopen(note->filepath, "w");
-  if (file) {
-    fprintf(file, "%s", note->content);
-    fclose(file);
-    note->modified = false;
+static int case_fold_next(const char *text, size_t len, char *out,
+                          int *consumed) {
+  int codepoint;
+  int size = decode_utf8(text, len, &codepoint);
+  *consumed = size;
+  bool malformed = size == 1 && (unsigned char)text[0] >= 0x80;
+  if (malformed || codepoint >= CASE_FOLD_RANGE) {
+    memcpy(out, text, (size_t)size);
+    return size;
   }
+  return encode_utf8(case_fold_table[codepoint], out);
 }
 
 /**
- * @brief Save all notes to disk
+ * @brief Fold UTF-8 text
+ * @param text The text
+ * @param len Length of the text
+ * @param out Receives the folded text; must hold 2 * len bytes, since a
+ *            Turkish I grows into a two-byte ı
+ * @return Length of the folded text
  */
-static void save_all_notes(void) {
-  for (int i = 0; i < notebook.count; i++) {
-    save_note(&notebook.notes[i]);
+static size_t case_fold(const char *text, size_t len, char *out) {
+  size_t n = 0;
+  for (size_t i = 0; i < len;) {
+    unsigned char c = (unsigned char)text[i];
+    if (c < 0x80 && case_fold_table[c] < 0x80) {
+      out[n++] = (char)case_fold_table[c];
+      i++;
+      continue;
+    }
+    int consumed;
+    n += case_fold_next(text + i, len - i, out + n, &consumed);
+    i += consumed;
   }
+  return n;
 }
 
-/**
- * @brief Create a new empty note
+/* ============================================================================
+ * Frame Scheduling
+ * ============================================================================
+ * The window is only redrawn when something changed: input arrived, the
+ * editor is still scrolling, the cursor blinked, or some code called
+ * request_redraw(). Between such frames the main loop sleeps instead of
+ * rendering at the target FPS. In low-power mode (--low-power) the cursor
+ * does not blink and an idle window blocks until the next input event; the
+ * same happens whenever the window is not focused. While a background
+ * thread is working on something the main loop is waiting for, it keeps
+ * polling instead, since raylib cannot be woken from another thread.
  */
-static void create_new_note(void) {
-  if (notebook.count >= MAX_NOTES)
-    return;
 
-  Note *note = &notebook.notes[notebook.count];
+#define IDLE_POLL_INTERVAL (1.0 / 60.0) /* Input polling period when idle */
+#define CURSOR_BLINK_PERIOD 0.5         /* Seconds per cursor blink phase */
+#define BACKGROUND_SEARCH 0x1u          /* background_busy: query running */
+#define BACKGROUND_LOAD 0x2u            /* background_busy: notes indexing */
+#define BACKGROUND_BACKLOG 0x4u         /* background_busy: do not sleep */
+#define BACKGROUND_WATCH 0x8u           /* background_busy: files changed */
+#define BACKGROUND_SAVE 0x10u           /* background_busy: notes writing */
+#define BACKGROUND_REPLACE 0x20u        /* background_busy: matches counting */
 
-  /* Generate unique title */
-  int note_num = notebook.count + 1;
-  snprintf(note->title, MAX_TITLE_LENGTH, "Untitled %d", note_num);
-  snprintf(note->filepath, sizeof(note->filepath), "%s/%s.md", VAULT_FOLDER,
-           note->title);
+static bool low_power_mode;          /* No cursor blink, block when idle */
+static bool redraw_requested = true; /* Next loop iteration must draw */
+static double cursor_blink_start;    /* Time the cursor last became visible */
+static bool cursor_drawn_visible;    /* Blink phase of the last drawn frame */
+static unsigned background_busy;     /* BACKGROUND_* work being waited for */
 
-  note->content[0] = '\0';
-  note->modified = true;
+/**
+ * @brief Ask for the window to be redrawn on the next loop iteration
+ */
+static void request_redraw(void) { redraw_requested = true; }
 
-  notebook.selected = notebook.count;
-  notebook.count++;
-  notebook.cursorPos = 0;
+/**
+ * @brief Restart the cursor blink so the cursor shows right after a change
+ */
+static void cursor_blink_reset(void) {
+  cursor_blink_start = GetTime();
+  request_redraw();
 }
 
 /**
- * @brief Delete a note by index
- * @param index Index of the note to delete
+ * @brief Check whether the blinking cursor is in its visible phase
+ * @return True if the cursor should be drawn this frame
  */
-static void delete_note(int index) {
-  if (index < 0 || index >= notebook.count)
-    return;
+static bool cursor_visible(void) {
+  if (low_power_mode || !IsWindowFocused())
+    return true;
+  double elapsed = GetTime() - cursor_blink_start;
+  return (long)(elapsed / CURSOR_BLINK_PERIOD) % 2 == 0;
+}
 
-  /* Delete the file from disk */
-  remove(notebook.notes[index].filepath);
+/**
+ * @brief Check whether this loop iteration has to draw a frame
+ * @return True if input arrived or something on screen changed
+ */
+static bool frame_needs_redraw(void) {
+  if (IsWindowMinimized())
+    return false;
 
-  /* Shift remaining notes to fill the gap */
-  for (int i = index; i < notebook.count - 1; i++) {
-    notebook.notes[i] = notebook.notes[i + 1];
-  }
-  notebook.count--;
+  Vector2 mouse_delta = GetMouseDelta();
+  bool input = GetKeyPressed() != 0 || GetMouseWheelMove() != 0 ||
+               mouse_delta.x != 0 || mouse_delta.y != 0 ||
+               IsMouseButtonPressed(MOUSE_BUTTON_LEFT) ||
+               IsMouseButtonPressed(MOUSE_BUTTON_RIGHT) ||
+               IsMouseButtonReleased(MOUSE_BUTTON_LEFT) ||
+               IsMouseButtonReleased(MOUSE_BUTTON_RIGHT) || IsWindowResized();
+  bool scrolling = notebook.editorScroll != notebook.editorScrollTarget;
+  bool blinked = cursor_visible() != cursor_drawn_visible;
 
-  /* Adjust selection */
-  if (notebook.selected >= notebook.count) {
-    notebook.selected = notebook.count - 1;
+  bool redraw = redraw_requested || input || scrolling || blinked;
+  redraw_requested = false;
+  return redraw;
+}
+
+/**
+ * @brief Sleep until there may be something to draw, then poll input
+ */
+static void idle_wait(void) {
+  bool blocking = low_power_mode || !IsWindowFocused() || IsWindowMinimized();
+  if (background_busy & BACKGROUND_BACKLOG) {
+    /* The last frame ran out of time for its work: go on right away */
+    PollInputEvents();
+    return;
   }
-  if (notebook.selected < 0) {
-    notebook.selected = 0;
+  if (blocking && background_busy != 0) {
+    WaitTime(IDLE_POLL_INTERVAL);
+    PollInputEvents();
+    return;
+  }
+  if (blocking) {
+    /* Nothing animates: block until the OS delivers an event */
+    EnableEventWaiting();
+    PollInputEvents();
+    DisableEventWaiting();
+    return;
   }
+
+  /* Wake up for the next blink, or to look at input again */
+  double elapsed = GetTime() - cursor_blink_start;
+  double until_blink =
+      CURSOR_BLINK_PERIOD - fmod(elapsed, CURSOR_BLINK_PERIOD);
+  WaitTime(until_blink < IDLE_POLL_INTERVAL ? until_blink
+                                            : IDLE_POLL_INTERVAL);
+  PollInputEvents();
 }
 
 /* ============================================================================
- * Drawing Functions
+ * Glyph Metrics
  * ============================================================================
+ * Line breaking and cursor placement need the width of text one character at
+ * a time. Instead of calling MeasureTextEx on ever longer prefixes, each
+ * (font, size) pair gets a table of scaled glyph advances: a dense array for
+ * ASCII through Latin Extended-B (which covers Turkish), and a small hash
+ * table filled on demand for everything else. Widths match MeasureTextEx.
  */
 
+#define GLYPH_DENSE_RANGE 0x250 /* Codepoints below this use the dense array */
+#define MAX_GLYPH_TABLES 8      /* Distinct (font, size) pairs cached */
+#define TEXT_SPACING 1          /* Spacing passed to DrawTextEx everywhere */
+
 /**
- * @brief Draw the header bar
+ * @brief Cached advance of one codepoint outside the dense range
  */
-static void draw_header(void) {
-  /* Background */
-  DrawRectangle(0, 0, WINDOW_WIDTH, HEADER_HEIGHT, BG_HEADER);
-  DrawRectangle(0, HEADER_HEIGHT - 1, WINDOW_WIDTH, 1, BORDER_COLOR);
+typedef struct {
+  int codepoint; /* Codepoint (0 marks an empty slot) */
+  float advance; /* Advance in pixels, including TEXT_SPACING */
+} GlyphAdvance;
 
-  /* App title */
-  DrawTextEx(mainFont, "📓 Notes", (Vector2){20, 14}, 22, 1, TEXT_PRIMARY);
+/**
+ * @brief Advance widths of one font at one size
+ */
+typedef struct {
+  Font font;                      /* Font the table was built for */
+  int font_size;                  /* Font size the table was built for */
+  float dense[GLYPH_DENSE_RANGE]; /* Advances of codepoints 0..0x24F */
+  GlyphAdvance *sparse;           /* Open-addressed table for the rest */
+  int sparse_capacity;            /* Slots in sparse (a power of two) */
+  int sparse_count;               /* Used slots in sparse */
+} GlyphMetrics;
 
-  /* Current note title */
-  if (notebook.count > 0 && notebook.selected >= 0) {
-    Note *note = &notebook.notes[notebook.selected];
-    char title_display[150];
-    snprintf(title_display, sizeof(title_display), " / %s%s", note->title,
-             note->modified ? " •" : "");
-    DrawTextEx(mainFont, title_display, (Vector2){130, 14}, 22, 1,
-               TEXT_SECONDARY);
+static GlyphMetrics glyph_tables[MAX_GLYPH_TABLES]; /* Built tables */
+static int glyph_table_count;                       /* Entries in use */
+
+/**
+ * @brief Compute a glyph's advance the way raylib's text functions do
+ * @param font The font
+ * @param font_size Font size in pixels
+ * @param codepoint The codepoint
+ * @return Advance in pixels, including TEXT_SPACING
+ */
+static float glyph_compute_advance(Font font, int font_size, int codepoint) {
+  int index = GetGlyphIndex(font, codepoint);
+  float advance = font.glyphs[index].advanceX != 0
+                      ? font.glyphs[index].advanceX
+                      : font.recs[index].width + font.glyphs[index].offsetX;
+  return advance * font_size / (float)font.baseSize + TEXT_SPACING;
+}
+
+/**
+ * @brief Get (building on first use) the advance table for a font and size
+ * @param font The font
+ * @param font_size Font size in pixels
+ * @return The table
+ */
+static GlyphMetrics *glyph_metrics_get(Font font, int font_size) {
+  for (int i = 0; i < glyph_table_count; i++) {
+    GlyphMetrics *gm = &glyph_tables[i];
+    if (gm->font.glyphs == font.glyphs &&
+        gm->font.texture.id == font.texture.id && gm->font_size == font_size)
+      return gm;
   }
 
-  /* Search box (when visible) */
-  if (notebook.showSearch) {
-    DrawRectangleRounded((Rectangle){WINDOW_WIDTH - 250, 10, 230, 30}, 0.3f, 8,
-                         BG_SIDEBAR);
-    DrawTextEx(mainFont, "🔍", (Vector2){WINDOW_WIDTH - 240, 14}, 18, 1,
-               TEXT_SECONDARY);
-    DrawTextEx(mainFont, notebook.searchQuery,
-               (Vector2){WINDOW_WIDTH - 215, 14}, 18, 1, TEXT_PRIMARY);
+  /* Reuse the oldest slot once the cache is full */
+  int slot = glyph_table_count < MAX_GLYPH_TABLES ? glyph_table_count++ : 0;
+  GlyphMetrics *gm = &glyph_tables[slot];
+  free(gm->sparse);
+  memset(gm, 0, sizeof(*gm));
+  gm->font = font;
+  gm->font_size = font_size;
+  for (int cp = 0; cp < GLYPH_DENSE_RANGE; cp++) {
+    gm->dense[cp] = glyph_compute_advance(font, font_size, cp);
   }
+  return gm;
 }
 
 /**
- * @brief Draw the sidebar with note list
+ * @brief Get the advance of a codepoint
+ * @param gm The table
+ * @param codepoint The codepoint
+ * @return Advance in pixels, including TEXT_SPACING
  */
-static void draw_sidebar(void) {
-  /* Background */
-  DrawRectangle(0, HEADER_HEIGHT, SIDEBAR_WIDTH, WINDOW_HEIGHT - HEADER_HEIGHT,
-                BG_SIDEBAR);
-  DrawRectangle(SIDEBAR_WIDTH - 1, HEADER_HEIGHT, 1, WINDOW_HEIGHT,
-                BORDER_COLOR);
-
-  /* Section header */
-  DrawTextEx(mainFont, "NOTES", (Vector2){20, HEADER_HEIGHT + 15}, 12, 1,
-             TEXT_MUTED);
+static float glyph_advance(GlyphMetrics *gm, int codepoint) {
+  if (codepoint >= 0 && codepoint < GLYPH_DENSE_RANGE)
+    return gm->dense[codepoint];
 
-  /* New note button */
-  Rectangle new_btn = {15, HEADER_HEIGHT + 40, SIDEBAR_WIDTH - 30, 35};
-  bool hover_new = CheckCollisionPointRec(GetMousePosition(), new_btn);
-  DrawRectangleRounded(new_btn, 0.2f, 8, hover_new ? ACCENT_PURPLE : BG_HOVER);
-  DrawTextEx(mainFont, "+ New Note", (Vector2){new_btn.x + 70, new_btn.y + 8},
-             16, 1, TEXT_PRIMARY);
+  /* Keep the hash table at most half full */
+  if ((gm->sparse_count + 1) * 2 > gm->sparse_capacity) {
+    int new_capacity = gm->sparse_capacity > 0 ? gm->sparse_capacity * 2 : 64;
+    GlyphAdvance *grown = calloc(new_capacity, sizeof(GlyphAdvance));
+    if (grown == NULL)
+      return glyph_compute_advance(gm->font, gm->font_size, codepoint);
+    for (int i = 0; i < gm->sparse_capacity; i++) {
+      if (gm->sparse[i].codepoint == 0)
+        continue;
+      unsigned h = (unsigned)gm->sparse[i].codepoint * 2654435761u;
+      int slot = (int)(h & (new_capacity - 1));
+      while (grown[slot].codepoint != 0) {
+        slot = (slot + 1) & (new_capacity - 1);
+      }
+      grown[slot] = gm->sparse[i];
+    }
+    free(gm->sparse);
+    gm->sparse = grown;
+    gm->sparse_capacity = new_capacity;
+  }
 
-  if (hover_new && IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) {
-    create_new_note();
+  unsigned h = (unsigned)codepoint * 2654435761u;
+  int slot = (int)(h & (gm->sparse_capacity - 1));
+  while (gm->sparse[slot].codepoint != 0) {
+    if (gm->sparse[slot].codepoint == codepoint)
+      return gm->sparse[slot].advance;
+    slot = (slot + 1) & (gm->sparse_capacity - 1);
   }
 
-  /* Note list */
-  int start_y = HEADER_HEIGHT + 90;
-  int item_height = 40;
+  gm->sparse[slot].codepoint = codepoint;
+  gm->sparse[slot].advance =
+      glyph_compute_advance(gm->font, gm->font_size, codepoint);
+  gm->sparse_count++;
+  return gm->sparse[slot].advance;
+}
 
-  for (int i = 0; i < notebook.count; i++) {
-    int y = start_y + i * item_height - notebook.scrollOffset;
+/**
+ * @brief Release the sparse parts of all cached tables
+ */
+static void glyph_metrics_free(void) {
+  for (int i = 0; i < glyph_table_count; i++) {
+    free(glyph_tables[i].sparse);
+    glyph_tables[i].sparse = NULL;
+  }
+  glyph_table_count = 0;
+}
 
-    /* Skip items outside visible area */
-    if (y < HEADER_HEIGHT + 85 || y > WINDOW_HEIGHT - item_height)
-      continue;
+/* ============================================================================
+ * Text Buffer
+ * ============================================================================
+ * Note bodies are stored in a gap buffer: the text lives at both ends of one
+ * allocation with a movable hole ("gap") in between. Edits happen at the gap,
+ * so inserting or deleting at the cursor is O(1) amortized; only moving the
+ * gap to a different position costs a memmove of the bytes in between.
+ *
+ *   data: [ text before gap | ....gap.... | text after gap ]
+ *          0          gap_start      gap_end         capacity
+ *
+ * Large files are mapped instead of read (text_buffer_map_file()). A mapped
+ * buffer is the file itself with an empty gap at its end, so it reads like
+ * any other buffer without its text ever being copied, and the kernel can
+ * drop its pages under memory pressure. The first edit copies the text into
+ * memory of the buffer's own (text_buffer_unshare()); notes that are only
+ * read never are.
+ *
+ * A program that truncates a mapped file in place makes every read of the
+ * lost pages raise SIGBUS. Mapped text is therefore only read through
+ * text_buffer_read(), which catches the signal, reads the file normally into
+ * the mapping's place and runs the read again.
+ */
 
-    Rectangle item_rect = {10, y, SIDEBAR_WIDTH - 20, item_height - 5};
-    bool hover = CheckCollisionPointRec(GetMousePosition(), item_rect);
-    bool selected = (i == notebook.selected);
+#define TEXT_BUFFER_MIN_GAP 4096       /* Gap size reserved on (re)allocation */
+#define TEXT_BUFFER_MAP_MIN (64 << 10) /* Files this large or more are mapped */
 
-    /* Draw background */
-    if (selected) {
-      DrawRectangleRounded(item_rect, 0.2f, 8, BG_SELECTED);
-    } else if (hover) {
-      DrawRectangleRounded(item_rect, 0.2f, 8, BG_HOVER);
-    }
+/**
+ * @brief A read of a buffer's text, run by text_buffer_read()
+ *
+ * It may be cut short and run again from the start, so it must start over
+ * cleanly and keep nothing it allocates in local variables only.
+ */
+typedef void (*TextBufferRead)(const TextBuffer *tb, void *arg);
 
-    /* Draw note title with icon */
-    Note *note = &notebook.notes[i];
-    char display[150];
-    snprintf(display, sizeof(display), "📄 %s%s", note->title,
-             note->modified ? " •" : "");
-    DrawTextEx(mainFont, display, (Vector2){item_rect.x + 10, item_rect.y + 10},
-               15, 1, selected ? TEXT_PRIMARY : TEXT_SECONDARY);
+/* The read of a mapped buffer in progress on this thread, if any */
+static __thread const TextBuffer *volatile text_map_reading;
+static __thread sigjmp_buf text_map_jump; /* Where a faulting read resumes */
 
-    /* Handle clicks */
-    if (hover && IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) {
-      notebook.selected = i;
-      notebook.cursorPos = strlen(note->content);
-    }
+/**
+ * @brief SIGBUS handler: abandon the read of a mapping whose file shrank
+ */
+static void text_map_fault(int sig, siginfo_t *info, void *context) {
+  (void)context;
+  const TextBuffer *tb = text_map_reading;
+  uintptr_t addr = (uintptr_t)info->si_addr;
+  if (tb != NULL && addr >= (uintptr_t)tb->data &&
+      addr < (uintptr_t)tb->data + tb->capacity)
+    siglongjmp(text_map_jump, 1);
 
-    /* Right-click to delete */
-    if (hover && IsMouseButtonPressed(MOUSE_BUTTON_RIGHT)) {
-      delete_note(i);
-    }
-  }
+  /* Any other fault is a real one: take the default action after all */
+  signal(sig, SIG_DFL);
+  raise(sig);
 }
 
 /**
- * @brief Draw the main editor area
+ * @brief Install the SIGBUS handler, once
+ * @return False if it could not be installed (files are not mapped then)
  */
-static void draw_editor(void) {
-  int editor_x = SIDEBAR_WIDTH;
-  int editor_y = HEADER_HEIGHT;
-  int editor_width = WINDOW_WIDTH - SIDEBAR_WIDTH;
-  int editor_height = WINDOW_HEIGHT - HEADER_HEIGHT;
+static bool text_map_guard_install(void) {
+  static int installed = -1;
+  if (installed < 0) {
+    /* SA_NODEFER: leaving the handler by siglongjmp() must not keep SIGBUS
+     * blocked, and sigsetjmp() then need not save the signal mask */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = text_map_fault;
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    installed = sigaction(SIGBUS, &sa, NULL) == 0;
+  }
+  return installed;
+}
 
-  /* Background */
-  DrawRectangle(editor_x, editor_y, editor_width, editor_height, BG_EDITOR);
+/**
+ * @brief Replace a mapping whose file shrank by what the file holds now
+ *
+ * The file is read normally into anonymous memory at the same address, so
+ * the buffer keeps its length and layout; bytes past the file's new end
+ * read as zeros. The watcher reloads the note once the file settles.
+ *
+ * @param tb The mapped buffer
+ * @return False if the memory could not be replaced
+ */
+static bool text_buffer_recover(const TextBuffer *tb) {
+  void *map = mmap(tb->data, tb->capacity, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  if (map == MAP_FAILED)
+    return false;
+
+  size_t done = 0;
+  while (done < tb->capacity) {
+    ssize_t n = pread(tb->fd, tb->data + done, tb->capacity - done,
+                      (off_t)done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    done += (size_t)n;
+  }
+  mprotect(tb->data, tb->capacity, PROT_READ);
+  return true;
+}
+
+/**
+ * @brief Run a read of a buffer's text, safe against its file shrinking
+ *
+ * The read runs once, guarded by text_map_fault() if the buffer is mapped.
+ * If it touches a page the file no longer has, the buffer is recovered
+ * (text_buffer_recover()) and the read runs again on the copy.
+ *
+ * @param tb The buffer
+ * @param read The read
+ * @param arg Passed to read
+ * @return False if the read had to be run again on different text
+ */
+static bool text_buffer_read(const TextBuffer *tb, TextBufferRead read,
+                             void *arg) {
+  if (!tb->mapped) {
+    read(tb, arg);
+    return true;
+  }
+
+  volatile bool intact = true;
+  text_map_reading = tb;
+  if (sigsetjmp(text_map_jump, 0) != 0) {
+    /* If the copy cannot be made either, the next fault is not caught */
+    text_map_reading = NULL;
+    intact = false;
+    if (text_buffer_recover(tb))
+      text_map_reading = tb;
+  }
+  read(tb, arg);
+  text_map_reading = NULL;
+  return intact;
+}
+
+/**
+ * @brief Get the number of text bytes stored in the buffer
+ * @param tb The buffer
+ * @return Length of the text in bytes (excluding the gap)
+ */
+static size_t text_buffer_length(const TextBuffer *tb) {
+  return tb->capacity - (tb->gap_end - tb->gap_start);
+}
+
+/**
+ * @brief A range to copy out of a buffer (see text_buffer_copy())
+ */
+typedef struct {
+  size_t start; /* Position of the first byte */
+  size_t len;   /* Number of bytes */
+  char *out;    /* Destination */
+} TextBufferSpan;
+
+/**
+ * @brief Copy a span, on either side of the gap (a TextBufferRead)
+ */
+static void text_buffer_copy_span(const TextBuffer *tb, void *arg) {
+  const TextBufferSpan *span = arg;
+  size_t start = span->start;
+  size_t len = span->len;
+  char *out = span->out;
+  if (start < tb->gap_start) {
+    size_t before = tb->gap_start - start;
+    if (before > len)
+      before = len;
+    memcpy(out, tb->data + start, before);
+    out += before;
+    start += before;
+    len -= before;
+  }
+  if (len > 0) {
+    memcpy(out, tb->data + start + (tb->gap_end - tb->gap_start), len);
+  }
+}
+
+/**
+ * @brief Copy a range of text out of the buffer
+ * @param tb The buffer
+ * @param start Position of the first byte to copy
+ * @param len Number of bytes to copy
+ * @param out Destination (receives exactly len bytes, no terminator)
+ */
+static void text_buffer_copy(const TextBuffer *tb, size_t start, size_t len,
+                             char *out) {
+  TextBufferSpan span = {start, len, out};
+  text_buffer_read(tb, text_buffer_copy_span, &span);
+}
+
+/**
+ * @brief Get the byte at a logical text position
+ * @param tb The buffer
+ * @param pos Position in the text (must be < text_buffer_length)
+ * @return The byte at that position
+ */
+static char text_buffer_at(const TextBuffer *tb, size_t pos) {
+  if (tb->mapped) {
+    char c;
+    text_buffer_copy(tb, pos, 1, &c);
+    return c;
+  }
+  return pos < tb->gap_start ? tb->data[pos]
+                             : tb->data[pos + (tb->gap_end - tb->gap_start)];
+}
+
+/**
+ * @brief Initialize a buffer with a copy of the given text
+ * @param tb The buffer to initialize
+ * @param text Initial text (NULL leaves the len bytes for the caller to fill)
+ * @param len Length of the initial text in bytes
+ * @return True on success
+ */
+static bool text_buffer_init(TextBuffer *tb, const char *text, size_t len) {
+  tb->capacity = len + TEXT_BUFFER_MIN_GAP;
+  tb->data = malloc(tb->capacity);
+  if (tb->data == NULL) {
+    tb->capacity = 0;
+    tb->gap_start = tb->gap_end = 0;
+    return false;
+  }
+  if (text != NULL && len > 0)
+    memcpy(tb->data, text, len);
+  tb->gap_start = len;
+  tb->gap_end = tb->capacity;
+  tb->mapped = false;
+  tb->fd = -1;
+  return true;
+}
+
+/**
+ * @brief Release the buffer's storage
+ * @param tb The buffer
+ */
+static void text_buffer_free(TextBuffer *tb) {
+  if (tb->mapped) {
+    munmap(tb->data, tb->capacity);
+    close(tb->fd);
+  } else {
+    free(tb->data);
+  }
+  tb->data = NULL;
+  tb->capacity = tb->gap_start = tb->gap_end = 0;
+  tb->mapped = false;
+  tb->fd = -1;
+}
+
+/**
+ * @brief Give a mapped buffer a copy of its text that can be edited
+ * @param tb The buffer
+ * @return False if memory ran out (the buffer stays mapped)
+ */
+static bool text_buffer_unshare(TextBuffer *tb) {
+  if (!tb->mapped)
+    return true;
+
+  /* A mapped buffer's text is all in front of its gap */
+  TextBuffer copy;
+  if (!text_buffer_init(&copy, NULL, tb->gap_start))
+    return false;
+  text_buffer_copy(tb, 0, tb->gap_start, copy.data);
+  text_buffer_free(tb);
+  *tb = copy;
+  return true;
+}
+
+/**
+ * @brief Move the gap so that it starts at the given text position
+ * @param tb The buffer
+ * @param pos Text position (clamped to the text length)
+ */
+static void text_buffer_move_gap(TextBuffer *tb, size_t pos) {
+  size_t len = text_buffer_length(tb);
+  if (pos > len)
+    pos = len;
+  if (pos != tb->gap_start && !text_buffer_unshare(tb))
+    return;
+
+  if (pos < tb->gap_start) {
+    /* Move the bytes between pos and the gap to the end of the gap */
+    size_t n = tb->gap_start - pos;
+    memmove(tb->data + tb->gap_end - n, tb->data + pos, n);
+    tb->gap_start -= n;
+    tb->gap_end -= n;
+  } else if (pos > tb->gap_start) {
+    /* Move the bytes after the gap to its start */
+    size_t n = pos - tb->gap_start;
+    memmove(tb->data + tb->gap_start, tb->data + tb->gap_end, n);
+    tb->gap_start += n;
+    tb->gap_end += n;
+  }
+}
+
+/**
+ * @brief Make sure the gap can hold at least the given number of bytes
+ * @param tb The buffer
+ * @param needed Number of bytes about to be inserted
+ * @return True on success
+ */
+static bool text_buffer_reserve(TextBuffer *tb, size_t needed) {
+  if (!text_buffer_unshare(tb))
+    return false;
+  if (tb->gap_end - tb->gap_start >= needed)
+    return true;
+
+  /* Grow geometrically so a run of inserts stays O(1) amortized */
+  size_t len = text_buffer_length(tb);
+  size_t new_capacity = tb->capacity * 2;
+  if (new_capacity < len + needed + TEXT_BUFFER_MIN_GAP)
+    new_capacity = len + needed + TEXT_BUFFER_MIN_GAP;
+
+  char *grown = realloc(tb->data, new_capacity);
+  if (grown == NULL)
+    return false;
+
+  /* Slide the text after the gap to the end of the new allocation */
+  size_t tail = tb->capacity - tb->gap_end;
+  memmove(grown + new_capacity - tail, grown + tb->gap_end, tail);
+  tb->data = grown;
+  tb->gap_end = new_capacity - tail;
+  tb->capacity = new_capacity;
+  return true;
+}
+
+/**
+ * @brief Insert bytes at a text position
+ * @param tb The buffer
+ * @param pos Text position to insert at
+ * @param bytes Bytes to insert
+ * @param len Number of bytes to insert
+ * @return True on success
+ */
+static bool text_buffer_insert(TextBuffer *tb, size_t pos, const char *bytes,
+                               size_t len) {
+  if (!text_buffer_reserve(tb, len))
+    return false;
+  text_buffer_move_gap(tb, pos);
+  memcpy(tb->data + tb->gap_start, bytes, len);
+  tb->gap_start += len;
+  return true;
+}
+
+/**
+ * @brief Delete a range of bytes
+ * @param tb The buffer
+ * @param pos Position of the first byte to delete
+ * @param len Number of bytes to delete
+ */
+static void text_buffer_delete(TextBuffer *tb, size_t pos, size_t len) {
+  size_t total = text_buffer_length(tb);
+  if (pos >= total || !text_buffer_unshare(tb))
+    return;
+  if (len > total - pos)
+    len = total - pos;
+
+  /* Deleting is just widening the gap over the removed bytes */
+  text_buffer_move_gap(tb, pos);
+  tb->gap_end += len;
+}
+
+/**
+ * @brief Find the start of the UTF-8 character before a position
+ * @param tb The buffer
+ * @param pos Text position
+ * @return Position of the first byte of the preceding character
+ */
+static size_t text_buffer_prev_char(const TextBuffer *tb, size_t pos) {
+  if (pos == 0)
+    return 0;
+
+  /* Walk backwards over continuation bytes (10xxxxxx) */
+  pos--;
+  while (pos > 0 && (text_buffer_at(tb, pos) & 0xC0) == 0x80) {
+    pos--;
+  }
+  return pos;
+}
+
+/**
+ * @brief Read an entire file into a buffer, without any size limit
+ * @param tb The buffer to initialize
+ * @param file Open file to read from
+ * @return True on success
+ */
+static bool text_buffer_load_file(TextBuffer *tb, FILE *file) {
+  if (!text_buffer_init(tb, NULL, 0))
+    return false;
+
+  /* Read straight into the gap, growing it until the file is exhausted */
+  for (;;) {
+    if (!text_buffer_reserve(tb, TEXT_BUFFER_MIN_GAP)) {
+      text_buffer_free(tb);
+      return false;
+    }
+    size_t room = tb->gap_end - tb->gap_start;
+    size_t n = fread(tb->data + tb->gap_start, 1, room, file);
+    tb->gap_start += n;
+    if (n < room)
+      break;
+  }
+  return true;
+}
+
+/**
+ * @brief Load a file into a buffer, mapping it if it is large
+ *
+ * A mapped buffer keeps a descriptor of the file open, to read the file
+ * again if another program truncates it (text_buffer_read()).
+ *
+ * @param tb The buffer to initialize
+ * @param file Open file, at its start (may be closed once this returns)
+ * @return True on success
+ */
+static bool text_buffer_map_file(TextBuffer *tb, FILE *file) {
+  struct stat st;
+  if (text_map_guard_install() && fstat(fileno(file), &st) == 0 &&
+      S_ISREG(st.st_mode) && st.st_size >= TEXT_BUFFER_MAP_MIN &&
+      (uintmax_t)st.st_size <= SIZE_MAX) {
+    size_t size = (size_t)st.st_size;
+    int fd = dup(fileno(file));
+    void *map = fd >= 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                        : MAP_FAILED;
+    if (map != MAP_FAILED) {
+      tb->data = map;
+      tb->capacity = tb->gap_start = tb->gap_end = size;
+      tb->mapped = true;
+      tb->fd = fd;
+      return true;
+    }
+    if (fd >= 0)
+      close(fd);
+  }
+  return text_buffer_load_file(tb, file);
+}
+
+/* ============================================================================
+ * Text Statistics
+ * ============================================================================
+ * The status bar shows the word and character count of the current note.
+ * Counting walks the whole note once when it is loaded; after that every
+ * edit adjusts the totals by the difference it made, looking only at the
+ * inserted or deleted bytes and their two neighbours.
+ *
+ * A word starts at every non-whitespace byte that follows whitespace (or the
+ * start of the text). Characters are UTF-8 codepoints, i.e. every byte that
+ * is not a continuation byte (10xxxxxx), so Turkish letters count once.
+ */
+
+/**
+ * @brief Word and character totals of a piece of text
+ */
+typedef struct {
+  long words; /* Number of words */
+  long chars; /* Number of UTF-8 characters */
+} TextStats;
+
+/**
+ * @brief Check whether a byte separates words
+ */
+static bool is_word_separator(char c) {
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+/**
+ * @brief Count words and characters in a run of bytes
+ * @param bytes The text
+ * @param len Length of the text in bytes
+ * @param prev The byte before the run (' ' at the start of the text)
+ * @return Word starts and characters inside the run
+ */
+static TextStats text_stats_count(const char *bytes, size_t len, char prev) {
+  TextStats stats = {0, 0};
+  size_t i = 0;
+  bool prev_sep = is_word_separator(prev);
+
+#if defined(__SSE2__)
+  /* 16 bytes at a time: compare, turn into bit masks and count bits */
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i cont_limit = _mm_set1_epi8(-64); /* 0x80..0xBF are < -64 */
+  unsigned carry = prev_sep ? 1 : 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(bytes + i));
+    __m128i sep = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, newline)),
+        _mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, cr)));
+    unsigned sep_mask = (unsigned)_mm_movemask_epi8(sep);
+    unsigned cont_mask =
+        (unsigned)_mm_movemask_epi8(_mm_cmplt_epi8(v, cont_limit));
+
+    /* A word starts where this byte is not a separator but the last was */
+    unsigned prev_mask = ((sep_mask << 1) | carry) & 0xFFFF;
+    stats.words += __builtin_popcount(prev_mask & ~sep_mask & 0xFFFF);
+    stats.chars += 16 - __builtin_popcount(cont_mask);
+    carry = (sep_mask >> 15) & 1;
+  }
+  prev_sep = carry != 0;
+#endif
+
+  for (; i < len; i++) {
+    bool sep = is_word_separator(bytes[i]);
+    if (!sep && prev_sep)
+      stats.words++;
+    if ((bytes[i] & 0xC0) != 0x80)
+      stats.chars++;
+    prev_sep = sep;
+  }
+  return stats;
+}
+
+/**
+ * @brief Count both halves of a buffer (a TextBufferRead)
+ * @param arg Receives the totals (TextStats)
+ */
+static void text_buffer_count(const TextBuffer *tb, void *arg) {
+  TextStats *stats = arg;
+  size_t tail = tb->capacity - tb->gap_end;
+  TextStats before = text_stats_count(tb->data, tb->gap_start, ' ');
+  char last = tb->gap_start > 0 ? tb->data[tb->gap_start - 1] : ' ';
+  TextStats after = text_stats_count(tb->data + tb->gap_end, tail, last);
+  stats->words = before.words + after.words;
+  stats->chars = before.chars + after.chars;
+}
+
+/**
+ * @brief Count words and characters of a whole buffer
+ * @param tb The buffer
+ * @return Totals for the buffer's text
+ */
+static TextStats text_buffer_stats(const TextBuffer *tb) {
+  TextStats stats;
+  text_buffer_read(tb, text_buffer_count, &stats);
+  return stats;
+}
+
+/**
+ * @brief Compute how an insertion changes a buffer's totals
+ * @param tb The buffer before the insertion
+ * @param pos Where the text goes
+ * @param bytes The inserted text
+ * @param len Length of the inserted text (at least 1)
+ * @return Change in words and characters
+ */
+static TextStats text_stats_insert_delta(const TextBuffer *tb, size_t pos,
+                                         const char *bytes, size_t len) {
+  char before = pos > 0 ? text_buffer_at(tb, pos - 1) : ' ';
+  char after = pos < text_buffer_length(tb) ? text_buffer_at(tb, pos) : ' ';
+
+  /* The byte after the insertion may stop or start being a word start */
+  TextStats delta = text_stats_count(bytes, len, before);
+  bool was_start = !is_word_separator(after) && is_word_separator(before);
+  bool is_start =
+      !is_word_separator(after) && is_word_separator(bytes[len - 1]);
+  delta.words += (long)is_start - (long)was_start;
+  return delta;
+}
+
+/**
+ * @brief Compute how a deletion changes a buffer's totals
+ * @param tb The buffer before the deletion (not mapped)
+ * @param pos Start of the deleted range
+ * @param len Length of the range (at least 1, inside the text)
+ * @return Change in words and characters
+ */
+static TextStats text_stats_delete_delta(const TextBuffer *tb, size_t pos,
+                                         size_t len) {
+  char before = pos > 0 ? text_buffer_at(tb, pos - 1) : ' ';
+  char after = pos + len < text_buffer_length(tb)
+                   ? text_buffer_at(tb, pos + len)
+                   : ' ';
+
+  /* Count the removed range in place, segment by segment around the gap */
+  TextStats removed = {0, 0};
+  char prev = before;
+  size_t end = pos + len;
+  if (pos < tb->gap_start) {
+    size_t n = (end < tb->gap_start ? end : tb->gap_start) - pos;
+    removed = text_stats_count(tb->data + pos, n, prev);
+    prev = tb->data[pos + n - 1];
+    pos += n;
+  }
+  if (pos < end) {
+    TextStats rest = text_stats_count(
+        tb->data + pos + (tb->gap_end - tb->gap_start), end - pos, prev);
+    removed.words += rest.words;
+    removed.chars += rest.chars;
+  }
+
+  char last = text_buffer_at(tb, end - 1);
+  bool was_start = !is_word_separator(after) && is_word_separator(last);
+  bool is_start = !is_word_separator(after) && is_word_separator(before);
+  TextStats delta = {(long)is_start - (long)was_start - removed.words,
+                     -removed.chars};
+  return delta;
+}
+
+/* ============================================================================
+ * Line Index
+ * ============================================================================
+ * Every loaded note keeps an index of its lines so that the editor can map
+ * between byte offsets and (line, column) without rescanning the text. The
+ * index is an implicit treap: an in-order walk visits the lines from top to
+ * bottom, and each node caches the byte length and line count of its
+ * subtree. Lookups, inserts and deletes are O(log n) in the number of lines.
+ *
+ * Every line's length includes its trailing '\n'. The last line never has
+ * one, so a note with k newlines always has k + 1 lines.
+ */
+
+/**
+ * @brief Get a pseudo-random treap priority
+ * @return Next value of a xorshift32 sequence
+ */
+static unsigned line_index_random(void) {
+  static unsigned state = 2463534242u;
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+/**
+ * @brief Guess how many visual lines a line wraps into before laying it out
+ * @param li The index
+ * @param len Length of the line in bytes
+ * @return Estimated number of visual lines (at least 1)
+ */
+static int line_height_estimate(const LineIndex *li, size_t len) {
+  size_t per_line = li->wrap_estimate > 0 ? (size_t)li->wrap_estimate : 80;
+  return len > per_line ? (int)((len + per_line - 1) / per_line) : 1;
+}
+
+/**
+ * @brief Allocate a node for a line of the given length
+ * @param li The index
+ * @param len Length of the line in bytes
+ * @return Index of the new node, or -1 if out of memory
+ */
+static int line_node_new(LineIndex *li, size_t len) {
+  int n;
+  if (li->free_list >= 0) {
+    n = li->free_list;
+    li->free_list = li->nodes[n].left;
+  } else {
+    if (li->node_count == li->node_capacity) {
+      int new_capacity = li->node_capacity > 0 ? li->node_capacity * 2 : 256;
+      LineNode *grown = realloc(li->nodes, new_capacity * sizeof(LineNode));
+      if (grown == NULL)
+        return -1;
+      li->nodes = grown;
+      li->node_capacity = new_capacity;
+    }
+    n = li->node_count++;
+  }
+
+  LineNode *node = &li->nodes[n];
+  node->left = node->right = -1;
+  node->priority = line_index_random();
+  node->len = node->sum = len;
+  node->count = 1;
+  node->wraps = NULL;
+  node->wrap_count = 0;
+  node->height = line_height_estimate(li, len);
+  node->height_sum = node->height;
+  return n;
+}
+
+/**
+ * @brief Return a subtree's nodes to the free list
+ * @param li The index
+ * @param t Root of the subtree (-1 for none)
+ */
+static void line_index_release(LineIndex *li, int t) {
+  if (t < 0)
+    return;
+  line_index_release(li, li->nodes[t].left);
+  line_index_release(li, li->nodes[t].right);
+  free(li->nodes[t].wraps);
+  li->nodes[t].wraps = NULL;
+  li->nodes[t].wrap_count = 0;
+  li->nodes[t].left = li->free_list;
+  li->free_list = t;
+}
+
+/**
+ * @brief Recompute a node's cached subtree totals from its children
+ * @param li The index
+ * @param t The node
+ */
+static void line_node_update(LineIndex *li, int t) {
+  LineNode *node = &li->nodes[t];
+  node->sum = node->len;
+  node->count = 1;
+  node->height_sum = node->height;
+  if (node->left >= 0) {
+    node->sum += li->nodes[node->left].sum;
+    node->count += li->nodes[node->left].count;
+    node->height_sum += li->nodes[node->left].height_sum;
+  }
+  if (node->right >= 0) {
+    node->sum += li->nodes[node->right].sum;
+    node->count += li->nodes[node->right].count;
+    node->height_sum += li->nodes[node->right].height_sum;
+  }
+}
+
+/**
+ * @brief Split a subtree into its first k lines and the rest
+ * @param li The index
+ * @param t Root of the subtree to split
+ * @param k Number of lines that go into the left result
+ * @param left Receives the root of the first k lines
+ * @param right Receives the root of the remaining lines
+ */
+static void line_index_split(LineIndex *li, int t, int k, int *left,
+                             int *right) {
+  if (t < 0) {
+    *left = *right = -1;
+    return;
+  }
+
+  int left_count = li->nodes[t].left >= 0 ? li->nodes[li->nodes[t].left].count
+                                          : 0;
+  if (k <= left_count) {
+    int l, r;
+    line_index_split(li, li->nodes[t].left, k, &l, &r);
+    li->nodes[t].left = r;
+    line_node_update(li, t);
+    *left = l;
+    *right = t;
+  } else {
+    int l, r;
+    line_index_split(li, li->nodes[t].right, k - left_count - 1, &l, &r);
+    li->nodes[t].right = l;
+    line_node_update(li, t);
+    *left = t;
+    *right = r;
+  }
+}
+
+/**
+ * @brief Concatenate two subtrees (all lines of a before all lines of b)
+ * @param li The index
+ * @param a Root of the first subtree
+ * @param b Root of the second subtree
+ * @return Root of the merged subtree
+ */
+static int line_index_merge(LineIndex *li, int a, int b) {
+  if (a < 0)
+    return b;
+  if (b < 0)
+    return a;
+
+  if (li->nodes[a].priority > li->nodes[b].priority) {
+    li->nodes[a].right = line_index_merge(li, li->nodes[a].right, b);
+    line_node_update(li, a);
+    return a;
+  }
+  li->nodes[b].left = line_index_merge(li, a, li->nodes[b].left);
+  line_node_update(li, b);
+  return b;
+}
+
+/**
+ * @brief Build a treap over a sequence of fresh nodes in O(n)
+ * @param li The index
+ * @param ids Node indices in line order
+ * @param n Number of nodes
+ * @return Root of the new subtree, or -1 if out of memory
+ */
+static int line_index_build_nodes(LineIndex *li, const int *ids, int n) {
+  if (n == 0)
+    return -1;
+
+  /* Classic Cartesian tree construction over the right spine */
+  int *stack = malloc(n * sizeof(int));
+  if (stack == NULL)
+    return -1;
+
+  int depth = 0;
+  for (int i = 0; i < n; i++) {
+    int x = ids[i];
+    int last = -1;
+    while (depth > 0 &&
+           li->nodes[stack[depth - 1]].priority < li->nodes[x].priority) {
+      last = stack[--depth];
+      line_node_update(li, last);
+    }
+    li->nodes[x].left = last;
+    if (depth > 0)
+      li->nodes[stack[depth - 1]].right = x;
+    stack[depth++] = x;
+  }
+  while (depth > 0) {
+    line_node_update(li, stack[--depth]);
+  }
+
+  int root = stack[0];
+  free(stack);
+  return root;
+}
+
+/**
+ * @brief Create nodes for a run of line lengths and build them into a treap
+ * @param li The index
+ * @param lens Line lengths in order
+ * @param n Number of lines
+ * @return Root of the new subtree, or -1 if out of memory
+ */
+static int line_index_build_lines(LineIndex *li, const size_t *lens, int n) {
+  int *ids = malloc(n * sizeof(int));
+  if (ids == NULL)
+    return -1;
+
+  for (int i = 0; i < n; i++) {
+    ids[i] = line_node_new(li, lens[i]);
+    if (ids[i] < 0) {
+      for (int j = 0; j < i; j++) {
+        line_index_release(li, ids[j]);
+      }
+      free(ids);
+      return -1;
+    }
+  }
+
+  int root = line_index_build_nodes(li, ids, n);
+  free(ids);
+  return root;
+}
+
+/**
+ * @brief Release all memory held by an index
+ * @param li The index
+ */
+static void line_index_free(LineIndex *li) {
+  for (int i = 0; i < li->node_count; i++) {
+    free(li->nodes[i].wraps);
+  }
+  free(li->nodes);
+  li->nodes = NULL;
+  li->node_count = li->node_capacity = 0;
+  li->free_list = li->root = -1;
+  li->wrap_estimate = 0;
+}
+
+/**
+ * @brief Split a run of text into line lengths
+ * @param bytes The text
+ * @param len Length of the text
+ * @param count Receives the number of lines (newlines + 1)
+ * @return Array of line lengths (caller frees), or NULL if out of memory
+ */
+static size_t *line_lengths_of(const char *bytes, size_t len, int *count) {
+  int lines = 1;
+  for (size_t i = 0; i < len; i++) {
+    if (bytes[i] == '\n')
+      lines++;
+  }
+
+  size_t *lens = malloc(lines * sizeof(size_t));
+  if (lens == NULL)
+    return NULL;
+
+  int k = 0;
+  size_t start = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (bytes[i] == '\n') {
+      lens[k++] = i + 1 - start;
+      start = i + 1;
+    }
+  }
+  lens[k] = len - start;
+  *count = lines;
+  return lens;
+}
+
+/**
+ * @brief Line count or line lengths of a buffer (see line_index_build())
+ */
+typedef struct {
+  int count;    /* Number of lines (newlines + 1) */
+  size_t *lens; /* Their lengths, once counted (NULL while counting) */
+} LineScan;
+
+/**
+ * @brief Count a buffer's lines, or measure them (a TextBufferRead)
+ *
+ * At most scan->count lengths are written, in case the text changed since
+ * it was counted.
+ */
+static void line_index_scan(const TextBuffer *tb, void *arg) {
+  LineScan *scan = arg;
+  const char *half[2] = {tb->data, tb->data + tb->gap_end};
+  size_t half_len[2] = {tb->gap_start, tb->capacity - tb->gap_end};
+
+  if (scan->lens == NULL) {
+    scan->count = 1;
+    for (int h = 0; h < 2; h++) {
+      for (size_t i = 0; i < half_len[h]; i++) {
+        if (half[h][i] == '\n')
+          scan->count++;
+      }
+    }
+    return;
+  }
+
+  /* The line that straddles the gap goes on across it */
+  int k = 0;
+  size_t run = 0;
+  for (int h = 0; h < 2; h++) {
+    for (size_t i = 0; i < half_len[h]; i++) {
+      run++;
+      if (half[h][i] == '\n' && k + 1 < scan->count) {
+        scan->lens[k++] = run;
+        run = 0;
+      }
+    }
+  }
+  scan->lens[k] = run;
+}
+
+/**
+ * @brief Build the index for a buffer's current text
+ * @param li The index to (re)initialize
+ * @param tb The text
+ * @return True on success
+ */
+static bool line_index_build(LineIndex *li, const TextBuffer *tb) {
+  line_index_free(li);
+
+  /* Both halves of the gap buffer are scanned in place: counted, then
+   * measured, and counted again if the text changed in between */
+  LineScan scan = {0, NULL};
+  do {
+    free(scan.lens);
+    scan.lens = NULL;
+    text_buffer_read(tb, line_index_scan, &scan);
+    scan.lens = malloc(scan.count * sizeof(size_t));
+    if (scan.lens == NULL)
+      return false;
+  } while (!text_buffer_read(tb, line_index_scan, &scan));
+
+  li->root = line_index_build_lines(li, scan.lens, scan.count);
+  free(scan.lens);
+  return li->root >= 0;
+}
+
+/**
+ * @brief Get the number of lines in the index
+ * @param li The index
+ * @return Number of lines (at least 1 for a built index)
+ */
+static int line_index_count(const LineIndex *li) {
+  return li->root >= 0 ? li->nodes[li->root].count : 0;
+}
+
+/**
+ * @brief Look up a line by number
+ * @param li The index
+ * @param line Zero-based line number (must be < line_index_count)
+ * @param len Receives the line's length including its '\n' (may be NULL)
+ * @return Byte offset of the first character of the line
+ */
+static size_t line_index_line_start(const LineIndex *li, int line,
+                                    size_t *len) {
+  size_t start = 0;
+  int t = li->root;
+  while (t >= 0) {
+    const LineNode *node = &li->nodes[t];
+    int left_count = node->left >= 0 ? li->nodes[node->left].count : 0;
+    if (line < left_count) {
+      t = node->left;
+    } else {
+      if (node->left >= 0)
+        start += li->nodes[node->left].sum;
+      if (line == left_count) {
+        if (len)
+          *len = node->len;
+        return start;
+      }
+      start += node->len;
+      line -= left_count + 1;
+      t = node->right;
+    }
+  }
+  if (len)
+    *len = 0;
+  return start;
+}
+
+/**
+ * @brief Look up the node of a line by number
+ * @param li The index
+ * @param line Zero-based line number (must be < line_index_count)
+ * @param start Receives the byte offset of the line's start (may be NULL)
+ * @return Index of the line's node
+ */
+static int line_index_node_at(const LineIndex *li, int line, size_t *start) {
+  size_t base = 0;
+  int t = li->root;
+  while (t >= 0) {
+    const LineNode *node = &li->nodes[t];
+    int left_count = node->left >= 0 ? li->nodes[node->left].count : 0;
+    size_t left_sum = node->left >= 0 ? li->nodes[node->left].sum : 0;
+    if (line < left_count) {
+      t = node->left;
+    } else if (line == left_count) {
+      if (start)
+        *start = base + left_sum;
+      return t;
+    } else {
+      base += left_sum + node->len;
+      line -= left_count + 1;
+      t = node->right;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Find the line that contains a byte offset
+ * @param li The index
+ * @param offset Byte offset (the text length maps to the last line)
+ * @param start Receives the byte offset of the line's start (may be NULL)
+ * @return Zero-based line number
+ */
+static int line_index_line_at(const LineIndex *li, size_t offset,
+                              size_t *start) {
+  int count = line_index_count(li);
+  if (count == 0 || offset >= li->nodes[li->root].sum) {
+    /* The end of the text is on the last line */
+    int last = count > 0 ? count - 1 : 0;
+    size_t last_start = count > 0 ? line_index_line_start(li, last, NULL) : 0;
+    if (start)
+      *start = last_start;
+    return last;
+  }
+
+  int line = 0;
+  size_t base = 0;
+  int t = li->root;
+  while (t >= 0) {
+    const LineNode *node = &li->nodes[t];
+    size_t left_sum = node->left >= 0 ? li->nodes[node->left].sum : 0;
+    int left_count = node->left >= 0 ? li->nodes[node->left].count : 0;
+    if (offset < base + left_sum) {
+      t = node->left;
+    } else if (offset < base + left_sum + node->len) {
+      if (start)
+        *start = base + left_sum;
+      return line + left_count;
+    } else {
+      base += left_sum + node->len;
+      line += left_count + 1;
+      t = node->right;
+    }
+  }
+  if (start)
+    *start = base;
+  return line;
+}
+
+/**
+ * @brief Get the total number of visual lines
+ * @param li The index
+ * @return Sum of all line heights
+ */
+static long line_index_height(const LineIndex *li) {
+  return li->root >= 0 ? li->nodes[li->root].height_sum : 0;
+}
+
+/**
+ * @brief Set the height of a line and update the subtree sums above it
+ * @param li The index
+ * @param t Root of the subtree that contains the line
+ * @param line Line number within that subtree
+ * @param height New height in visual lines
+ */
+static void line_index_set_height(LineIndex *li, int t, int line, int height) {
+  LineNode *node = &li->nodes[t];
+  int left_count = node->left >= 0 ? li->nodes[node->left].count : 0;
+  if (line < left_count)
+    line_index_set_height(li, node->left, line, height);
+  else if (line > left_count)
+    line_index_set_height(li, node->right, line - left_count - 1, height);
+  else
+    node->height = height;
+  line_node_update(li, t);
+}
+
+/**
+ * @brief Count the visual lines above a line
+ * @param li The index
+ * @param line Line number
+ * @return Sum of the heights of all earlier lines
+ */
+static long line_index_height_before(const LineIndex *li, int line) {
+  long height = 0;
+  int t = li->root;
+  while (t >= 0) {
+    const LineNode *node = &li->nodes[t];
+    int left_count = node->left >= 0 ? li->nodes[node->left].count : 0;
+    if (line < left_count) {
+      t = node->left;
+      continue;
+    }
+    if (node->left >= 0)
+      height += li->nodes[node->left].height_sum;
+    if (line == left_count)
+      break;
+    height += node->height;
+    line -= left_count + 1;
+    t = node->right;
+  }
+  return height;
+}
+
+/**
+ * @brief Find the line that contains a visual line
+ * @param li The index
+ * @param visual Visual line number counted from the top (clamped)
+ * @param row Receives the visual line's row within the found line
+ * @return Line number
+ */
+static int line_index_line_at_height(const LineIndex *li, long visual,
+                                     int *row) {
+  int line = 0;
+  int t = li->root;
+  if (visual < 0)
+    visual = 0;
+
+  while (t >= 0) {
+    const LineNode *node = &li->nodes[t];
+    long left_height = node->left >= 0 ? li->nodes[node->left].height_sum : 0;
+    int left_count = node->left >= 0 ? li->nodes[node->left].count : 0;
+    if (visual < left_height) {
+      t = node->left;
+    } else if (visual < left_height + node->height || node->right < 0) {
+      long r = visual - left_height;
+      *row = (int)(r < node->height ? r : node->height - 1);
+      return line + left_count;
+    } else {
+      visual -= left_height + node->height;
+      line += left_count + 1;
+      t = node->right;
+    }
+  }
+  *row = 0;
+  return line;
+}
+
+/**
+ * @brief Reset every line to its estimated height (after a width change)
+ * @param li The index
+ * @param t Root of the subtree to reset
+ */
+static void line_index_reset_heights(LineIndex *li, int t) {
+  if (t < 0)
+    return;
+  line_index_reset_heights(li, li->nodes[t].left);
+  line_index_reset_heights(li, li->nodes[t].right);
+  li->nodes[t].height = line_height_estimate(li, li->nodes[t].len);
+  line_node_update(li, t);
+}
+
+/**
+ * @brief Replace a run of lines with lines of new lengths
+ * @param li The index
+ * @param first First line to replace
+ * @param count Number of lines to replace
+ * @param lens New line lengths
+ * @param n Number of new lines
+ * @return True on success (the index is unchanged on failure)
+ */
+static bool line_index_replace(LineIndex *li, int first, int count,
+                               const size_t *lens, int n) {
+  int replacement = line_index_build_lines(li, lens, n);
+  if (replacement < 0)
+    return false;
+
+  int before, rest, old, after;
+  line_index_split(li, li->root, first, &before, &rest);
+  line_index_split(li, rest, count, &old, &after);
+  line_index_release(li, old);
+  li->root =
+      line_index_merge(li, line_index_merge(li, before, replacement), after);
+  return true;
+}
+
+/**
+ * @brief Update the index for text inserted at an offset
+ * @param li The index
+ * @param offset Where the text was inserted
+ * @param bytes The inserted text
+ * @param len Length of the inserted text
+ * @return True on success
+ */
+static bool line_index_insert(LineIndex *li, size_t offset, const char *bytes,
+                              size_t len) {
+  size_t start, line_len;
+  int line = line_index_line_at(li, offset, &start);
+  line_index_line_start(li, line, &line_len);
+
+  /* The line is cut at the insertion point and the new text spliced in */
+  int n;
+  size_t *lens = line_lengths_of(bytes, len, &n);
+  if (lens == NULL)
+    return false;
+  lens[0] += offset - start;
+  lens[n - 1] += line_len - (offset - start);
+
+  bool ok = line_index_replace(li, line, 1, lens, n);
+  free(lens);
+  return ok;
+}
+
+/**
+ * @brief Update the index for a deleted byte range
+ * @param li The index
+ * @param offset Start of the deleted range
+ * @param len Length of the deleted range
+ * @return True on success
+ */
+static bool line_index_delete(LineIndex *li, size_t offset, size_t len) {
+  size_t first_start, last_start, last_len;
+  int first = line_index_line_at(li, offset, &first_start);
+  int last = line_index_line_at(li, offset + len, &last_start);
+  line_index_line_start(li, last, &last_len);
+
+  /* What is left of the first and last lines joins into one line */
+  size_t joined = (offset - first_start) + (last_start + last_len) -
+                  (offset + len);
+  return line_index_replace(li, first, last - first + 1, &joined, 1);
+}
+
+/* ============================================================================
+ * Search Index
+ * ============================================================================
+ * Searching uses an inverted index rather than reading note bodies. Each
+ * term maps to a posting list of the notes that contain it, sorted by note
+ * id. Each posting points at the positions of the term in that note. The
+ * index is built once at load time. A note is re-indexed every time it is
+ * saved, so the index always matches what is on disk.
+ *
+ * Notes are referred to by their stable id (Note.id). Their index in the
+ * note table is not used because it shifts when a note is deleted.
+ *
+ * A term is a run of letters, digits, '_' or non-ASCII bytes, taken from
+ * case-folded text (see Case Folding): note bodies are folded before they
+ * are indexed, titles and queries as they come in.
+ * A query matches the notes that contain all of its terms. While the last
+ * term is still being typed it also matches as a prefix. Words inside
+ * double quotes must appear next to each other.
+ */
+
+#define SEARCH_MAX_TERM 64        /* Longer runs (hashes, base64) are skipped */
+#define SEARCH_MAX_QUERY 128      /* Longest query (size of searchQuery) */
+#define SEARCH_MAX_QUERY_TERMS 32 /* Terms considered from one query */
+#define SEARCH_MIN_SUBSTRING 3    /* Shortest fragment matched as a substring */
+
+/**
+ * @brief One note in a term's posting list
+ */
+typedef struct {
+  int doc;     /* Id of the note */
+  int tf;      /* Occurrences of the term in the note */
+  int pos_off; /* First of those positions in the note's position list */
+} Posting;
+
+/**
+ * @brief A distinct term and the notes it occurs in
+ */
+typedef struct {
+  char *text;           /* Folded term, NUL-terminated */
+  unsigned hash;        /* Hash of text */
+  Posting *postings;    /* Notes containing the term, sorted by id */
+  int posting_count;    /* Entries in postings */
+  int posting_capacity; /* Allocated entries in postings */
+} SearchTerm;
+
+/**
+ * @brief What the index holds for one note (the forward index)
+ *
+ * Removing a note walks its own term list instead of every posting list.
+ */
+typedef struct {
+  char *title;        /* Title the note was indexed under */
+  int length;         /* Words in the title and text (for ranking) */
+  int *terms;         /* Ids of the terms that occur in the note */
+  int term_count;     /* Entries in terms */
+  int *positions;     /* Word positions, grouped by term in terms order */
+  int position_count; /* Entries in positions */
+} SearchDoc;
+
+/**
+ * @brief The inverted index over all notes
+ */
+typedef struct {
+  SearchTerm *terms; /* All terms ever seen (lists may become empty) */
+  int term_count;    /* Entries in terms */
+  int term_capacity; /* Allocated entries in terms */
+  int *slots;        /* Open-addressing table of term id + 1 (0 = empty) */
+  int slot_capacity; /* Size of slots (a power of two) */
+  SearchDoc *docs;   /* Per-note data, indexed by note id */
+  int doc_capacity;  /* Allocated entries in docs */
+  int doc_count;     /* Notes in the index */
+  long total_length; /* Sum of the lengths of all notes */
+} SearchIndex;
+
+/**
+ * @brief A term occurrence collected while indexing a note
+ */
+typedef struct {
+  int term; /* Term id */
+  int pos;  /* Word position in the note */
+} SearchToken;
+
+static SearchIndex search_index;     /* Index over every note in the vault */
+static SearchToken *search_tokens;   /* Scratch list used while indexing */
+static size_t search_token_capacity; /* Allocated entries in search_tokens */
+
+/* The search worker reads both indexes while the main thread updates them;
+ * search_lock keeps the two apart */
+static pthread_rwlock_t search_lock = PTHREAD_RWLOCK_INITIALIZER;
+static unsigned search_generation;      /* Bumped per query; stops old ones */
+static unsigned search_data_generation; /* Bumped when note text changes */
+static bool search_index_dirty;         /* Index File is behind the indexes */
+
+/**
+ * @brief Check whether a byte can be part of a term
+ */
+static bool search_is_term_byte(unsigned char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_' || c >= 0x80;
+}
+
+/**
+ * @brief Fold an ASCII byte (the substring scanner's case-insensitive mode)
+ */
+static char search_fold(char c) {
+  return (c >= 'A' && c <= 'Z') ? (char)(c + 32) : c;
+}
+
+/**
+ * @brief Find the next term in a text
+ * @param text The text, case-folded
+ * @param len Length of the text
+ * @param pos In: where to start looking; out: just past the term found
+ * @param out Receives the term (SEARCH_MAX_TERM bytes)
+ * @param out_len Receives the length of the term
+ * @return False once there are no more terms
+ */
+static bool search_next_term(const char *text, size_t len, size_t *pos,
+                             char *out, size_t *out_len) {
+  size_t i = *pos;
+  for (;;) {
+    while (i < len && !search_is_term_byte((unsigned char)text[i]))
+      i++;
+    if (i >= len) {
+      *pos = i;
+      return false;
+    }
+
+    size_t start = i;
+    while (i < len && search_is_term_byte((unsigned char)text[i]))
+      i++;
+    if (i - start > SEARCH_MAX_TERM)
+      continue;
+
+    memcpy(out, text + start, i - start);
+    *out_len = i - start;
+    *pos = i;
+    return true;
+  }
+}
+
+/**
+ * @brief FNV-1a hash of a term
+ */
+static unsigned search_hash(const char *text, size_t len) {
+  unsigned h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)text[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/**
+ * @brief Look up a term
+ * @param idx The index
+ * @param text The folded term
+ * @param len Length of the term
+ * @return Term id, or -1 if the term does not occur anywhere
+ */
+static int search_term_find(const SearchIndex *idx, const char *text,
+                            size_t len) {
+  if (idx->slot_capacity == 0)
+    return -1;
+
+  unsigned h = search_hash(text, len);
+  unsigned mask = (unsigned)idx->slot_capacity - 1;
+  for (unsigned s = h & mask;; s = (s + 1) & mask) {
+    int id = idx->slots[s] - 1;
+    if (id < 0)
+      return -1;
+    const SearchTerm *term = &idx->terms[id];
+    if (term->hash == h && strncmp(term->text, text, len) == 0 &&
+        term->text[len] == '\0')
+      return id;
+  }
+}
+
+/**
+ * @brief Double the term hash table and re-insert every term
+ * @param idx The index
+ * @return False if memory ran out
+ */
+static bool search_grow_slots(SearchIndex *idx) {
+  int capacity = idx->slot_capacity > 0 ? idx->slot_capacity * 2 : 1024;
+  int *slots = calloc((size_t)capacity, sizeof(int));
+  if (slots == NULL)
+    return false;
+
+  unsigned mask = (unsigned)capacity - 1;
+  for (int id = 0; id < idx->term_count; id++) {
+    unsigned s = idx->terms[id].hash & mask;
+    while (slots[s] != 0)
+      s = (s + 1) & mask;
+    slots[s] = id + 1;
+  }
+  free(idx->slots);
+  idx->slots = slots;
+  idx->slot_capacity = capacity;
+  return true;
+}
+
+/**
+ * @brief Look up a term, adding it to the dictionary if it is new
+ * @param idx The index
+ * @param text The folded term
+ * @param len Length of the term
+ * @return Term id, or -1 if memory ran out
+ */
+static int search_term_intern(SearchIndex *idx, const char *text, size_t len) {
+  int id = search_term_find(idx, text, len);
+  if (id >= 0)
+    return id;
+
+  /* Keep the table at most half full */
+  if ((idx->term_count + 1) * 2 > idx->slot_capacity &&
+      !search_grow_slots(idx))
+    return -1;
+  if (idx->term_count == idx->term_capacity) {
+    int capacity = idx->term_capacity > 0 ? idx->term_capacity * 2 : 1024;
+    SearchTerm *grown =
+        realloc(idx->terms, (size_t)capacity * sizeof(SearchTerm));
+    if (grown == NULL)
+      return -1;
+    idx->terms = grown;
+    idx->term_capacity = capacity;
+  }
+
+  SearchTerm *term = &idx->terms[idx->term_count];
+  memset(term, 0, sizeof(*term));
+  term->text = malloc(len + 1);
+  if (term->text == NULL)
+    return -1;
+  memcpy(term->text, text, len);
+  term->text[len] = '\0';
+  term->hash = search_hash(text, len);
+
+  unsigned mask = (unsigned)idx->slot_capacity - 1;
+  unsigned s = term->hash & mask;
+  while (idx->slots[s] != 0)
+    s = (s + 1) & mask;
+  idx->slots[s] = idx->term_count + 1;
+  return idx->term_count++;
+}
+
+/**
+ * @brief Find the first posting whose note id is not below doc
+ * @param list A posting list, sorted by id
+ * @param count Entries in list
+ * @param doc Note id
+ * @return Index into the list (count if there is none)
+ */
+static int search_posting_lower_bound(const Posting *list, int count, int doc) {
+  int lo = 0, hi = count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (list[mid].doc < doc)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/**
+ * @brief Find a note in a posting list
+ * @param list A posting list, sorted by id
+ * @param count Entries in list
+ * @param doc Note id
+ * @return The posting, or NULL if the note does not contain the term
+ */
+static const Posting *search_posting_find(const Posting *list, int count,
+                                          int doc) {
+  int i = search_posting_lower_bound(list, count, doc);
+  if (i < count && list[i].doc == doc)
+    return &list[i];
+  return NULL;
+}
+
+/**
+ * @brief Drop a note from the index
+ * @param idx The index
+ * @param doc Note id
+ */
+static void search_index_remove(SearchIndex *idx, int doc) {
+  if (doc < 0 || doc >= idx->doc_capacity)
+    return;
+
+  SearchDoc *d = &idx->docs[doc];
+  if (d->title != NULL) {
+    idx->doc_count--;
+    idx->total_length -= d->length;
+  }
+  for (int i = 0; i < d->term_count; i++) {
+    SearchTerm *term = &idx->terms[d->terms[i]];
+    int at =
+        search_posting_lower_bound(term->postings, term->posting_count, doc);
+    if (at < term->posting_count && term->postings[at].doc == doc) {
+      memmove(&term->postings[at], &term->postings[at + 1],
+              (size_t)(term->posting_count - at - 1) * sizeof(Posting));
+      term->posting_count--;
+    }
+  }
+  free(d->title);
+  free(d->terms);
+  free(d->positions);
+  memset(d, 0, sizeof(*d));
+}
+
+/**
+ * @brief Order tokens by term, then by position
+ */
+static int search_token_compare(const void *a, const void *b) {
+  const SearchToken *x = a, *y = b;
+  if (x->term != y->term)
+    return x->term < y->term ? -1 : 1;
+  return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+/**
+ * @brief Collect the terms of a text into the token scratch list
+ * @param idx The index (new terms are added to its dictionary)
+ * @param text The text, case-folded
+ * @param len Length of the text
+ * @param count In/out: tokens collected so far
+ * @param pos In/out: position of the next word
+ * @return False if memory ran out
+ */
+static bool search_collect_tokens(SearchIndex *idx, const char *text,
+                                  size_t len, size_t *count, int *pos) {
+  char term_text[SEARCH_MAX_TERM];
+  size_t term_len, at = 0;
+  while (search_next_term(text, len, &at, term_text, &term_len)) {
+    if (*count == search_token_capacity) {
+      size_t capacity =
+          search_token_capacity > 0 ? search_token_capacity * 2 : 4096;
+      SearchToken *grown =
+          realloc(search_tokens, capacity * sizeof(SearchToken));
+      if (grown == NULL)
+        return false;
+      search_tokens = grown;
+      search_token_capacity = capacity;
+    }
+    int term = search_term_intern(idx, term_text, term_len);
+    if (term < 0)
+      return false;
+    search_tokens[*count].term = term;
+    search_tokens[*count].pos = (*pos)++;
+    (*count)++;
+  }
+  return true;
+}
+
+/**
+ * @brief Add a note to the index, replacing what was indexed for it before
+ * @param idx The index
+ * @param doc Note id
+ * @param title The note's title (its words come first)
+ * @param body The note's text, case-folded
+ * @param len Length of the text
+ * @return False if memory ran out (the note is then not searchable)
+ */
+static bool search_index_add(SearchIndex *idx, int doc, const char *title,
+                             const char *body, size_t len) {
+  if (doc < 0)
+    return false;
+  search_index_remove(idx, doc);
+
+  if (doc >= idx->doc_capacity) {
+    int capacity = idx->doc_capacity > 0 ? idx->doc_capacity : 64;
+    while (capacity <= doc)
+      capacity *= 2;
+    SearchDoc *grown = realloc(idx->docs, (size_t)capacity * sizeof(SearchDoc));
+    if (grown == NULL)
+      return false;
+    memset(grown + idx->doc_capacity, 0,
+           (size_t)(capacity - idx->doc_capacity) * sizeof(SearchDoc));
+    idx->docs = grown;
+    idx->doc_capacity = capacity;
+  }
+
+  SearchDoc *d = &idx->docs[doc];
+  d->title = malloc(strlen(title) + 1);
+  if (d->title == NULL)
+    return false;
+  strcpy(d->title, title);
+  idx->doc_count++;
+
+  /* Title and body are numbered as one text, with a gap so that a phrase
+   * cannot run from the end of the title into the body */
+  char folded_title[2 * MAX_TITLE_LENGTH];
+  size_t title_len = case_fold(title, strlen(title), folded_title);
+  size_t count = 0;
+  int pos = 0;
+  if (!search_collect_tokens(idx, folded_title, title_len, &count, &pos))
+    return false;
+  pos++;
+  if (!search_collect_tokens(idx, body, len, &count, &pos))
+    return false;
+  d->length = (int)count;
+  idx->total_length += d->length;
+  if (count == 0)
+    return true;
+  qsort(search_tokens, count, sizeof(SearchToken), search_token_compare);
+
+  d->positions = malloc(count * sizeof(int));
+  d->terms = malloc(count * sizeof(int));
+  if (d->positions == NULL || d->terms == NULL) {
+    search_index_remove(idx, doc);
+    return false;
+  }
+  for (size_t i = 0; i < count; i++)
+    d->positions[i] = search_tokens[i].pos;
+  d->position_count = (int)count;
+
+  /* One posting per distinct term, pointing at its run of positions */
+  for (size_t i = 0; i < count;) {
+    size_t run = i;
+    while (run < count && search_tokens[run].term == search_tokens[i].term)
+      run++;
+
+    SearchTerm *term = &idx->terms[search_tokens[i].term];
+    if (term->posting_count == term->posting_capacity) {
+      int capacity =
+          term->posting_capacity > 0 ? term->posting_capacity * 2 : 4;
+      Posting *grown =
+          realloc(term->postings, (size_t)capacity * sizeof(Posting));
+      if (grown == NULL) {
+        search_index_remove(idx, doc);
+        return false;
+      }
+      term->postings = grown;
+      term->posting_capacity = capacity;
+    }
+
+    /* Notes are indexed in id order at load, so this is usually an append */
+    int at =
+        search_posting_lower_bound(term->postings, term->posting_count, doc);
+    memmove(&term->postings[at + 1], &term->postings[at],
+            (size_t)(term->posting_count - at) * sizeof(Posting));
+    term->postings[at] = (Posting){doc, (int)(run - i), (int)i};
+    term->posting_count++;
+    d->terms[d->term_count++] = search_tokens[i].term;
+    i = run;
+  }
+  return true;
+}
+
+/**
+ * @brief Release everything the index holds
+ * @param idx The index
+ */
+static void search_index_free(SearchIndex *idx) {
+  for (int i = 0; i < idx->term_count; i++) {
+    free(idx->terms[i].text);
+    free(idx->terms[i].postings);
+  }
+  for (int i = 0; i < idx->doc_capacity; i++) {
+    free(idx->docs[i].title);
+    free(idx->docs[i].terms);
+    free(idx->docs[i].positions);
+  }
+  free(idx->terms);
+  free(idx->slots);
+  free(idx->docs);
+  memset(idx, 0, sizeof(*idx));
+  free(search_tokens);
+  search_tokens = NULL;
+  search_token_capacity = 0;
+}
+
+/**
+ * @brief A term of a parsed query
+ */
+typedef struct {
+  char text[SEARCH_MAX_QUERY]; /* Folded term */
+  size_t len;                  /* Length of text */
+  int phrase;                  /* Quoted phrase it belongs to (-1 if none) */
+  bool prefix;                 /* Match any term starting with text */
+  bool substring;              /* Match anywhere in the text, not by words */
+  int id;                      /* Term id (exact terms only) */
+} QueryTerm;
+
+/**
+ * @brief Split a query into terms
+ *
+ * Unquoted fragments of SEARCH_MIN_SUBSTRING bytes or more are kept whole,
+ * punctuation included, and matched as substrings (see the Trigram Index).
+ * Shorter fragments and quoted words are split into index terms.
+ *
+ * @param raw The query as typed (folded here)
+ * @param terms Receives up to SEARCH_MAX_QUERY_TERMS terms
+ * @return Number of terms
+ */
+static int search_parse_query(const char *raw, QueryTerm *terms) {
+  char query[2 * SEARCH_MAX_QUERY];
+  size_t len = case_fold(raw, strlen(raw), query);
+  int count = 0, phrase = -1, phrases = 0;
+  size_t i = 0;
+  while (i < len && count < SEARCH_MAX_QUERY_TERMS) {
+    if (query[i] == '"') {
+      phrase = phrase < 0 ? phrases++ : -1;
+      i++;
+      continue;
+    }
+    if (query[i] == ' ' || query[i] == '\t') {
+      i++;
+      continue;
+    }
+
+    size_t end = i;
+    while (end < len && query[end] != ' ' && query[end] != '\t' &&
+           query[end] != '"')
+      end++;
+
+    if (phrase < 0 && end - i >= SEARCH_MIN_SUBSTRING &&
+        end - i < SEARCH_MAX_QUERY) {
+      QueryTerm *t = &terms[count++];
+      memcpy(t->text, query + i, end - i);
+      t->len = end - i;
+      t->phrase = -1;
+      t->prefix = false;
+      t->substring = true;
+      t->id = -1;
+    } else {
+      size_t at = i;
+      while (count < SEARCH_MAX_QUERY_TERMS &&
+             search_next_term(query, end, &at, terms[count].text,
+                              &terms[count].len)) {
+        QueryTerm *t = &terms[count++];
+        t->phrase = phrase;
+        t->prefix = false;
+        t->substring = false;
+        t->id = -1;
+      }
+    }
+    i = end;
+  }
+
+  /* A short trailing word outside quotes may still be incomplete */
+  if (count > 0 && terms[count - 1].phrase < 0 &&
+      !terms[count - 1].substring &&
+      search_is_term_byte((unsigned char)query[len - 1]))
+    terms[count - 1].prefix = true;
+  return count;
+}
+
+/**
+ * @brief Check whether typing goes to the search box
+ */
+static bool search_has_focus(void) {
+  return notebook.showSearch && notebook.searchFocused;
+}
+
+/**
+ * @brief Mark the search results as out of date
+ *
+ * Called when the query changes and whenever notes are saved, created or
+ * deleted, since results are stored as indices into the note table. The
+ * query runs again once the current frame's input has been handled.
+ */
+static void search_invalidate(void) {
+  notebook.searchStale = true;
+  request_redraw();
+}
+
+/**
+ * @brief Take both indexes for writing, stopping any query that reads them
+ */
+static void search_write_begin(void) {
+  __atomic_add_fetch(&search_generation, 1, __ATOMIC_RELEASE);
+  pthread_rwlock_wrlock(&search_lock);
+}
+
+/**
+ * @brief Release the indexes after an update
+ */
+static void search_write_end(void) {
+  pthread_rwlock_unlock(&search_lock);
+  search_data_generation++;
+  search_index_dirty = true;
+}
+
+/* ============================================================================
+ * Trigram Index
+ * ============================================================================
+ * Fragments of identifiers, ticket numbers or half a word do not line up
+ * with the word index, so substring search has an index of its own: for
+ * every three consecutive bytes of a note's title and text (case-folded),
+ * the list of notes containing them. A fragment can only occur in notes that
+ * contain all of its trigrams, so intersecting those lists leaves a few
+ * candidates that are then checked against the actual text. A fragment of
+ * exactly three bytes needs no check.
+ *
+ * Trigrams are taken from bytes, so they work the same for any UTF-8 text.
+ */
+
+/**
+ * @brief The notes containing one trigram
+ */
+typedef struct {
+  unsigned key; /* The three bytes plus TRIGRAM_USED (0 = empty slot) */
+  int *docs;    /* Ids of the notes containing the trigram, sorted */
+  int count;    /* Entries in docs */
+  int capacity; /* Allocated entries in docs */
+} TrigramList;
+
+/**
+ * @brief The trigrams of one note, kept so it can be removed again
+ */
+typedef struct {
+  unsigned *keys; /* Distinct keys of the note, sorted */
+  int count;      /* Entries in keys */
+} TrigramDoc;
+
+/**
+ * @brief Trigram index over all notes
+ */
+typedef struct {
+  TrigramList *slots; /* Open-addressing table of trigram lists */
+  int slot_capacity;  /* Size of slots (a power of two) */
+  int slot_count;     /* Slots in use */
+  TrigramDoc *docs;   /* Per-note data, indexed by note id */
+  int doc_capacity;   /* Allocated entries in docs */
+} TrigramIndex;
+
+#define TRIGRAM_USED 0x1000000u /* Set in every key so that 0 means empty */
+
+static TrigramIndex trigram_index;  /* Trigrams of every note in the vault */
+static unsigned *trigram_keys;      /* Scratch list used while indexing */
+static size_t trigram_key_capacity; /* Allocated entries in trigram_keys */
+
+/**
+ * @brief Key of the trigram starting at text[0] (bytes already folded)
+ */
+static unsigned trigram_key(const char *text) {
+  return TRIGRAM_USED | (unsigned)(unsigned char)text[0] << 16 |
+         (unsigned)(unsigned char)text[1] << 8 | (unsigned char)text[2];
+}
+
+/**
+ * @brief Find the slot of a trigram
+ * @param idx The index
+ * @param key Trigram key
+ * @return The slot holding key, or the empty slot where it would go
+ */
+static TrigramList *trigram_slot(const TrigramIndex *idx, unsigned key) {
+  unsigned mask = (unsigned)idx->slot_capacity - 1;
+  unsigned s = (key * 2654435761u) & mask;
+  while (idx->slots[s].key != 0 && idx->slots[s].key != key)
+    s = (s + 1) & mask;
+  return &idx->slots[s];
+}
+
+/**
+ * @brief Double the slot table and move every list over
+ * @param idx The index
+ * @return False if memory ran out
+ */
+static bool trigram_grow_slots(TrigramIndex *idx) {
+  TrigramIndex grown = *idx;
+  grown.slot_capacity = idx->slot_capacity > 0 ? idx->slot_capacity * 2 : 4096;
+  grown.slots = calloc((size_t)grown.slot_capacity, sizeof(TrigramList));
+  if (grown.slots == NULL)
+    return false;
+
+  for (int i = 0; i < idx->slot_capacity; i++) {
+    if (idx->slots[i].key != 0)
+      *trigram_slot(&grown, idx->slots[i].key) = idx->slots[i];
+  }
+  free(idx->slots);
+  *idx = grown;
+  return true;
+}
+
+/**
+ * @brief Drop a note from the trigram index
+ * @param idx The index
+ * @param doc Note id
+ */
+static void trigram_index_remove(TrigramIndex *idx, int doc) {
+  if (doc < 0 || doc >= idx->doc_capacity)
+    return;
+
+  TrigramDoc *d = &idx->docs[doc];
+  for (int i = 0; i < d->count; i++) {
+    TrigramList *list = trigram_slot(idx, d->keys[i]);
+    int lo = 0, hi = list->count;
+    while (lo < hi) {
+      int mid = lo + (hi - lo) / 2;
+      if (list->docs[mid] < doc)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo < list->count && list->docs[lo] == doc) {
+      memmove(&list->docs[lo], &list->docs[lo + 1],
+              (size_t)(list->count - lo - 1) * sizeof(int));
+      list->count--;
+    }
+  }
+  free(d->keys);
+  memset(d, 0, sizeof(*d));
+}
+
+/**
+ * @brief Append the trigrams of a text to the scratch key list
+ * @param text The text, case-folded
+ * @param len Length of the text
+ * @param count In/out: keys collected so far
+ * @return False if memory ran out
+ */
+static bool trigram_collect(const char *text, size_t len, size_t *count) {
+  if (len < 3)
+    return true;
+  if (*count + len > trigram_key_capacity) {
+    size_t capacity = trigram_key_capacity > 0 ? trigram_key_capacity : 4096;
+    while (capacity < *count + len)
+      capacity *= 2;
+    unsigned *grown = realloc(trigram_keys, capacity * sizeof(unsigned));
+    if (grown == NULL)
+      return false;
+    trigram_keys = grown;
+    trigram_key_capacity = capacity;
+  }
+
+  for (size_t i = 0; i + 2 < len; i++)
+    trigram_keys[(*count)++] = trigram_key(text + i);
+  return true;
+}
+
+/**
+ * @brief Order trigram keys
+ */
+static int trigram_key_compare(const void *a, const void *b) {
+  unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief Add a note to the trigram index, replacing its previous trigrams
+ * @param idx The index
+ * @param doc Note id
+ * @param title The note's title
+ * @param body The note's text, case-folded
+ * @param len Length of the text
+ * @return False if memory ran out (the note is then not searchable)
+ */
+static bool trigram_index_add(TrigramIndex *idx, int doc, const char *title,
+                              const char *body, size_t len) {
+  if (doc < 0)
+    return false;
+  trigram_index_remove(idx, doc);
+
+  if (doc >= idx->doc_capacity) {
+    int capacity = idx->doc_capacity > 0 ? idx->doc_capacity : 64;
+    while (capacity <= doc)
+      capacity *= 2;
+    TrigramDoc *grown =
+        realloc(idx->docs, (size_t)capacity * sizeof(TrigramDoc));
+    if (grown == NULL)
+      return false;
+    memset(grown + idx->doc_capacity, 0,
+           (size_t)(capacity - idx->doc_capacity) * sizeof(TrigramDoc));
+    idx->docs = grown;
+    idx->doc_capacity = capacity;
+  }
+
+  /* Title and text separately, so no trigram spans the two */
+  char folded_title[2 * MAX_TITLE_LENGTH];
+  size_t title_len = case_fold(title, strlen(title), folded_title);
+  size_t count = 0;
+  if (!trigram_collect(folded_title, title_len, &count) ||
+      !trigram_collect(body, len, &count))
+    return false;
+  if (count == 0)
+    return true;
+  qsort(trigram_keys, count, sizeof(unsigned), trigram_key_compare);
+  size_t distinct = 1;
+  for (size_t i = 1; i < count; i++) {
+    if (trigram_keys[i] != trigram_keys[distinct - 1])
+      trigram_keys[distinct++] = trigram_keys[i];
+  }
+
+  TrigramDoc *d = &idx->docs[doc];
+  d->keys = malloc(distinct * sizeof(unsigned));
+  if (d->keys == NULL)
+    return false;
+
+  for (size_t i = 0; i < distinct; i++) {
+    /* Keep the table at most half full */
+    if ((idx->slot_count + 1) * 2 > idx->slot_capacity &&
+        !trigram_grow_slots(idx)) {
+      trigram_index_remove(idx, doc);
+      return false;
+    }
+    TrigramList *list = trigram_slot(idx, trigram_keys[i]);
+    if (list->key == 0) {
+      list->key = trigram_keys[i];
+      idx->slot_count++;
+    }
+    if (list->count == list->capacity) {
+      int capacity = list->capacity > 0 ? list->capacity * 2 : 4;
+      int *grown = realloc(list->docs, (size_t)capacity * sizeof(int));
+      if (grown == NULL) {
+        trigram_index_remove(idx, doc);
+        return false;
+      }
+      list->docs = grown;
+      list->capacity = capacity;
+    }
+
+    /* Usually an append: notes are indexed in id order at load */
+    int at = list->count;
+    while (at > 0 && list->docs[at - 1] > doc)
+      at--;
+    memmove(&list->docs[at + 1], &list->docs[at],
+            (size_t)(list->count - at) * sizeof(int));
+    list->docs[at] = doc;
+    list->count++;
+    d->keys[d->count++] = trigram_keys[i];
+  }
+  return true;
+}
+
+/**
+ * @brief Release everything the trigram index holds
+ * @param idx The index
+ */
+static void trigram_index_free(TrigramIndex *idx) {
+  for (int i = 0; i < idx->slot_capacity; i++)
+    free(idx->slots[i].docs);
+  for (int i = 0; i < idx->doc_capacity; i++)
+    free(idx->docs[i].keys);
+  free(idx->slots);
+  free(idx->docs);
+  memset(idx, 0, sizeof(*idx));
+  free(trigram_keys);
+  trigram_keys = NULL;
+  trigram_key_capacity = 0;
+}
+
+/* ============================================================================
+ * Index File
+ * ============================================================================
+ * Building the indexes reads every note, which would dominate startup on a
+ * large vault. So on exit both are written to INDEX_FILE, and on the next
+ * start that file is mapped read-only instead. Nothing in it is parsed up
+ * front: queries read its hash tables and lists in place, and the pages a
+ * query never touches are never read from disk.
+ *
+ * A note whose size and modification time still match its entry keeps it,
+ * taking the entry's number as note id. Every other note is indexed in
+ * memory as before. When a note changes later its entry is marked dead and
+ * the note goes to the in-memory indexes, so every note is in exactly one
+ * of the two (see Index Segments). The next save merges both.
+ *
+ * The file is native-endian: a header listing each section's offset and
+ * record count, then the sections. Those are checked against the file size
+ * when it is mapped; records are checked as they are read.
+ */
+
+#define INDEX_FILE_FOLDER VAULT_FOLDER "/.notes"
+#define INDEX_FILE INDEX_FILE_FOLDER "/index.bin"
+#define INDEX_FILE_MAGIC 0x31584449u /* "IDX1" */
+#define INDEX_FILE_VERSION 1u
+#define INDEX_FILE_TURKISH 0x1u /* Header flag: folded with Turkish rules */
+
+/**
+ * @brief The sections of the index file, in file order
+ */
+typedef enum {
+  INDEX_SECTION_DOCS,         /* IndexFileDoc per note, by note id */
+  INDEX_SECTION_TITLE_SLOTS,  /* Hash table of note id + 1 by title */
+  INDEX_SECTION_TERMS,        /* IndexFileTerm per term */
+  INDEX_SECTION_TERM_SLOTS,   /* Hash table of term id + 1 by text */
+  INDEX_SECTION_POSTINGS,     /* Posting lists of all terms */
+  INDEX_SECTION_POSITIONS,    /* Word positions of all notes */
+  INDEX_SECTION_TRIGRAMS,     /* Hash table of IndexFileTrigram by key */
+  INDEX_SECTION_TRIGRAM_DOCS, /* Note lists of all trigrams */
+  INDEX_SECTION_STRINGS,      /* Titles and terms, NUL-terminated */
+  INDEX_SECTION_COUNT
+} IndexSection;
+
+/**
+ * @brief Start of the index file
+ */
+typedef struct {
+  uint32_t magic;                       /* INDEX_FILE_MAGIC */
+  uint32_t version;                     /* INDEX_FILE_VERSION */
+  uint32_t flags;                       /* INDEX_FILE_TURKISH or 0 */
+  uint32_t reserved;                    /* Zero */
+  uint64_t total_length;                /* Sum of the lengths of all notes */
+  uint64_t offset[INDEX_SECTION_COUNT]; /* Byte offset of each section */
+  uint64_t count[INDEX_SECTION_COUNT];  /* Records in each section */
+} IndexFileHeader;
+
+/**
+ * @brief A note's entry in the index file
+ */
+typedef struct {
+  uint32_t title;          /* Offset of the title in the strings */
+  int32_t length;          /* Words in the title and text (for ranking) */
+  uint32_t positions;      /* First of its word positions */
+  uint32_t position_count; /* Number of word positions */
+  int64_t size;            /* Size of the .md file it was indexed from */
+  int64_t mtime;           /* Modification time of that file */
+} IndexFileDoc;
+
+/**
+ * @brief A term in the index file
+ */
+typedef struct {
+  uint32_t text;          /* Offset of the term in the strings */
+  uint32_t hash;          /* search_hash() of the term */
+  uint32_t postings;      /* First of its postings */
+  uint32_t posting_count; /* Number of postings */
+} IndexFileTerm;
+
+/**
+ * @brief A trigram slot in the index file
+ */
+typedef struct {
+  uint32_t key;   /* Trigram key (0 = empty slot) */
+  uint32_t docs;  /* First of its notes in the trigram note lists */
+  uint32_t count; /* Number of notes */
+} IndexFileTrigram;
+
+/* Record size of each section */
+static const size_t index_section_size[INDEX_SECTION_COUNT] = {
+    sizeof(IndexFileDoc),     sizeof(uint32_t), sizeof(IndexFileTerm),
+    sizeof(uint32_t),         sizeof(Posting),  sizeof(int),
+    sizeof(IndexFileTrigram), sizeof(int),      1};
+
+/**
+ * @brief The mapped index file
+ */
+typedef struct {
+  unsigned char *map;               /* The mapping (NULL if none) */
+  size_t map_size;                  /* Bytes mapped */
+  const IndexFileDoc *docs;         /* Entries by note id */
+  int doc_count;                    /* Entries in docs */
+  const uint32_t *title_slots;      /* Note id + 1 by title (0 = empty) */
+  unsigned title_mask;              /* Slots in title_slots, minus one */
+  const IndexFileTerm *terms;       /* Terms by id */
+  int term_count;                   /* Entries in terms */
+  const uint32_t *term_slots;       /* Term id + 1 by text (0 = empty) */
+  unsigned term_mask;               /* Slots in term_slots, minus one */
+  const Posting *postings;          /* Posting lists of all terms */
+  size_t posting_count;             /* Entries in postings */
+  const int *positions;             /* Word positions of all notes */
+  size_t position_count;            /* Entries in positions */
+  const IndexFileTrigram *trigrams; /* Trigram slots */
+  unsigned trigram_mask;            /* Slots in trigrams, minus one */
+  const int *trigram_docs;          /* Note lists of all trigrams */
+  size_t trigram_doc_count;         /* Entries in trigram_docs */
+  const char *strings;              /* Titles and terms */
+  size_t string_size;               /* Bytes in strings */
+  unsigned char *live;              /* Per entry: still current */
+  int live_count;                   /* Entries still current */
+  long live_length;                 /* Sum of their lengths */
+} IndexFile;
+
+static IndexFile index_file; /* The index as of the last exit */
+
+/**
+ * @brief Check that a slot count is a non-zero power of two
+ */
+static bool index_file_is_table(uint64_t count) {
+  return count > 0 && count <= INT32_MAX && (count & (count - 1)) == 0;
+}
+
+/**
+ * @brief Map the index file and check its header
+ * @return False if there is no usable file (index_file is then empty)
+ */
+static bool index_file_map(void) {
+  int fd = open(INDEX_FILE, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(IndexFileHeader))
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+
+  size_t size = (size_t)st.st_size;
+  const IndexFileHeader *h = map;
+  uint32_t flags = case_fold_turkish ? INDEX_FILE_TURKISH : 0;
+  bool valid = h->magic == INDEX_FILE_MAGIC &&
+               h->version == INDEX_FILE_VERSION && h->flags == flags;
+  for (int s = 0; s < INDEX_SECTION_COUNT && valid; s++) {
+    valid = h->offset[s] % 8 == 0 && h->offset[s] >= sizeof(*h) &&
+            h->offset[s] <= size &&
+            h->count[s] <= (size - h->offset[s]) / index_section_size[s] &&
+            h->count[s] <= INT32_MAX;
+  }
+  const char *strings = (const char *)map + h->offset[INDEX_SECTION_STRINGS];
+  size_t string_size = h->count[INDEX_SECTION_STRINGS];
+  valid = valid && index_file_is_table(h->count[INDEX_SECTION_TITLE_SLOTS]) &&
+          index_file_is_table(h->count[INDEX_SECTION_TERM_SLOTS]) &&
+          index_file_is_table(h->count[INDEX_SECTION_TRIGRAMS]) &&
+          string_size > 0 && strings[string_size - 1] == '\0';
+
+  IndexFile *f = &index_file;
+  f->doc_count = valid ? (int)h->count[INDEX_SECTION_DOCS] : 0;
+  f->live = valid ? calloc((size_t)f->doc_count + 1, 1) : NULL;
+  if (f->live == NULL) {
+    munmap(map, size);
+    return false;
+  }
+
+  unsigned char *base = map;
+  f->map = map;
+  f->map_size = size;
+  f->docs = (const void *)(base + h->offset[INDEX_SECTION_DOCS]);
+  f->title_slots = (const void *)(base + h->offset[INDEX_SECTION_TITLE_SLOTS]);
+  f->title_mask = (unsigned)h->count[INDEX_SECTION_TITLE_SLOTS] - 1;
+  f->terms = (const void *)(base + h->offset[INDEX_SECTION_TERMS]);
+  f->term_count = (int)h->count[INDEX_SECTION_TERMS];
+  f->term_slots = (const void *)(base + h->offset[INDEX_SECTION_TERM_SLOTS]);
+  f->term_mask = (unsigned)h->count[INDEX_SECTION_TERM_SLOTS] - 1;
+  f->postings = (const void *)(base + h->offset[INDEX_SECTION_POSTINGS]);
+  f->posting_count = h->count[INDEX_SECTION_POSTINGS];
+  f->positions = (const void *)(base + h->offset[INDEX_SECTION_POSITIONS]);
+  f->position_count = h->count[INDEX_SECTION_POSITIONS];
+  f->trigrams = (const void *)(base + h->offset[INDEX_SECTION_TRIGRAMS]);
+  f->trigram_mask = (unsigned)h->count[INDEX_SECTION_TRIGRAMS] - 1;
+  f->trigram_docs =
+      (const void *)(base + h->offset[INDEX_SECTION_TRIGRAM_DOCS]);
+  f->trigram_doc_count = h->count[INDEX_SECTION_TRIGRAM_DOCS];
+  f->strings = strings;
+  f->string_size = string_size;
+  return true;
+}
+
+/**
+ * @brief A string from the file's string section ("" if out of range)
+ */
+static const char *index_file_string(uint32_t offset) {
+  return offset < index_file.string_size ? index_file.strings + offset : "";
+}
+
+/**
+ * @brief Check whether an entry of the file is still a note's current one
+ */
+static bool index_file_live(int doc) {
+  return doc >= 0 && doc < index_file.doc_count && index_file.live[doc];
+}
+
+/**
+ * @brief Look up an entry by note title
+ * @return Note id in the file, or -1
+ */
+static int index_file_title_find(const char *title) {
+  if (index_file.map == NULL)
+    return -1;
+  unsigned mask = index_file.title_mask;
+  unsigned s = search_hash(title, strlen(title)) & mask;
+  for (unsigned n = 0; n <= mask; n++, s = (s + 1) & mask) {
+    uint32_t doc = index_file.title_slots[s];
+    if (doc == 0 || doc > (uint32_t)index_file.doc_count)
+      return -1;
+    if (strcmp(index_file_string(index_file.docs[doc - 1].title), title) == 0)
+      return (int)doc - 1;
+  }
+  return -1;
+}
+
+/**
+ * @brief Look up a term in the file
+ * @param text The folded term
+ * @param len Length of the term
+ * @return Term id in the file, or -1
+ */
+static int index_file_term_find(const char *text, size_t len) {
+  if (index_file.map == NULL)
+    return -1;
+  unsigned h = search_hash(text, len);
+  unsigned mask = index_file.term_mask;
+  unsigned s = h & mask;
+  for (unsigned n = 0; n <= mask; n++, s = (s + 1) & mask) {
+    uint32_t id = index_file.term_slots[s];
+    if (id == 0 || id > (uint32_t)index_file.term_count)
+      return -1;
+    const IndexFileTerm *term = &index_file.terms[id - 1];
+    const char *term_text = index_file_string(term->text);
+    if (term->hash == h && strncmp(term_text, text, len) == 0 &&
+        term_text[len] == '\0')
+      return (int)id - 1;
+  }
+  return -1;
+}
+
+/**
+ * @brief The posting list of a term in the file
+ * @param id Term id in the file
+ * @param count Receives the number of postings
+ */
+static const Posting *index_file_postings(int id, int *count) {
+  const IndexFileTerm *term = &index_file.terms[id];
+  if (term->postings > index_file.posting_count ||
+      term->posting_count > index_file.posting_count - term->postings) {
+    *count = 0;
+    return NULL;
+  }
+  *count = (int)term->posting_count;
+  return index_file.postings + term->postings;
+}
+
+/**
+ * @brief The word positions of an entry
+ * @param doc Note id in the file
+ * @param count Receives the number of positions
+ */
+static const int *index_file_positions(int doc, int *count) {
+  const IndexFileDoc *d = &index_file.docs[doc];
+  if (d->positions > index_file.position_count ||
+      d->position_count > index_file.position_count - d->positions) {
+    *count = 0;
+    return NULL;
+  }
+  *count = (int)d->position_count;
+  return index_file.positions + d->positions;
+}
+
+/**
+ * @brief Find a trigram's slot in the file
+ * @return The slot, or NULL if no note in the file contains the trigram
+ */
+static const IndexFileTrigram *index_file_trigram_find(unsigned key) {
+  if (index_file.map == NULL)
+    return NULL;
+  unsigned mask = index_file.trigram_mask;
+  unsigned s = (key * 2654435761u) & mask;
+  for (unsigned n = 0; n <= mask; n++, s = (s + 1) & mask) {
+    const IndexFileTrigram *slot = &index_file.trigrams[s];
+    if (slot->key == key)
+      return slot;
+    if (slot->key == 0)
+      return NULL;
+  }
+  return NULL;
+}
+
+/**
+ * @brief The notes of a trigram in the file
+ * @param slot The trigram's slot (may be NULL)
+ * @param count Receives the number of notes
+ */
+static const int *index_file_trigram_docs(const IndexFileTrigram *slot,
+                                          int *count) {
+  if (slot == NULL || slot->docs > index_file.trigram_doc_count ||
+      slot->count > index_file.trigram_doc_count - slot->docs) {
+    *count = 0;
+    return NULL;
+  }
+  *count = (int)slot->count;
+  return index_file.trigram_docs + slot->docs;
+}
+
+/**
+ * @brief Map the index file, before the vault is listed
+ *
+ * Note ids below the file's entry count are kept for the notes those
+ * entries belong to (see index_file_claim()); other notes are numbered
+ * after them.
+ */
+static void index_file_open(void) {
+  notebook.nextNoteId = index_file_map() ? index_file.doc_count : 0;
+}
+
+/**
+ * @brief Pick the id of a note found in the vault folder
+ *
+ * A note that has an entry in the file takes the entry's number. The entry
+ * only counts once the note's size and modification time are known to
+ * match it (see index_file_adopt()).
+ *
+ * @param title The note title
+ * @return The id for the note
+ */
+static int index_file_claim(const char *title) {
+  int doc = index_file.map != NULL ? index_file_title_find(title) : -1;
+  if (doc >= 0 && !index_file.live[doc])
+    return doc;
+  return notebook.nextNoteId++;
+}
+
+/**
+ * @brief Use a note's entry in the file if the note has not changed since
+ *
+ * Called with search_lock held for writing, once the note's size and
+ * modification time are known. A note whose entry is out of date keeps the
+ * entry's number as its id and is indexed in memory like an edited one.
+ *
+ * @param note The note
+ */
+static void index_file_adopt(Note *note) {
+  int doc = note->id;
+  if (note->indexed || note->modified || index_file.map == NULL ||
+      doc < 0 || doc >= index_file.doc_count || index_file.live[doc] ||
+      index_file.docs[doc].size != note->size ||
+      index_file.docs[doc].mtime != (int64_t)note->mtime)
+    return;
+  note->indexed = true;
+  index_file.live[doc] = 1;
+  index_file.live_count++;
+  index_file.live_length += index_file.docs[doc].length;
+}
+
+/**
+ * @brief Mark a note's entry in the file as out of date
+ *
+ * Called with search_lock held for writing, before the note is indexed in
+ * memory or deleted.
+ *
+ * @param doc Note id
+ */
+static void index_file_drop(int doc) {
+  if (!index_file_live(doc))
+    return;
+  index_file.live[doc] = 0;
+  index_file.live_count--;
+  index_file.live_length -= index_file.docs[doc].length;
+}
+
+/**
+ * @brief Unmap the index file
+ */
+static void index_file_close(void) {
+  if (index_file.map != NULL)
+    munmap(index_file.map, index_file.map_size);
+  free(index_file.live);
+  memset(&index_file, 0, sizeof(index_file));
+}
+
+/**
+ * @brief A section of the index file being written
+ */
+typedef struct {
+  char *data;      /* Section contents */
+  size_t size;     /* Bytes written */
+  size_t capacity; /* Bytes allocated */
+  bool failed;     /* Memory ran out along the way */
+} IndexBuffer;
+
+/**
+ * @brief Append bytes to a section being written
+ */
+static void index_buffer_put(IndexBuffer *b, const void *data, size_t size) {
+  if (b->failed || size == 0)
+    return;
+  if (b->size + size > b->capacity) {
+    size_t capacity = b->capacity > 0 ? b->capacity : 4096;
+    while (capacity < b->size + size)
+      capacity *= 2;
+    char *grown = realloc(b->data, capacity);
+    if (grown == NULL) {
+      b->failed = true;
+      return;
+    }
+    b->data = grown;
+    b->capacity = capacity;
+  }
+  memcpy(b->data + b->size, data, size);
+  b->size += size;
+}
+
+/**
+ * @brief Allocate an empty hash table section
+ * @param b The section
+ * @param entries Entries the table will hold (it is kept at most half full)
+ * @param slot_size Bytes per slot
+ * @return Number of slots (a power of two)
+ */
+static unsigned index_buffer_table(IndexBuffer *b, size_t entries,
+                                   size_t slot_size) {
+  size_t slots = 16;
+  while (slots < entries * 2)
+    slots *= 2;
+  b->data = calloc(slots, slot_size);
+  b->failed = b->data == NULL;
+  b->size = b->capacity = b->failed ? 0 : slots * slot_size;
+  return (unsigned)slots;
+}
+
+/**
+ * @brief Write one term, merging its postings from the file and memory
+ * @param sec The sections being written
+ * @param renumber New number of each note id (-1: not written)
+ * @param text The term
+ * @param file_id Its id in the file, or -1
+ * @param memory_id Its id in search_index, or -1
+ */
+static void index_file_put_term(IndexBuffer *sec, const int *renumber,
+                                const char *text, int file_id,
+                                int memory_id) {
+  int a_count = 0, b_count = 0;
+  const Posting *a = NULL, *b = NULL;
+  if (file_id >= 0)
+    a = index_file_postings(file_id, &a_count);
+  if (memory_id >= 0) {
+    b = search_index.terms[memory_id].postings;
+    b_count = search_index.terms[memory_id].posting_count;
+  }
+
+  /* Both lists are sorted by id and the renumbering keeps that order */
+  IndexFileTerm term = {0};
+  term.postings =
+      (uint32_t)(sec[INDEX_SECTION_POSTINGS].size / sizeof(Posting));
+  int i = 0, j = 0;
+  while (i < a_count || j < b_count) {
+    Posting p;
+    if (j >= b_count || (i < a_count && a[i].doc < b[j].doc)) {
+      p = a[i++];
+      if (!index_file_live(p.doc))
+        continue;
+    } else {
+      p = b[j++];
+    }
+    if (p.doc < 0 || p.doc >= notebook.nextNoteId || renumber[p.doc] < 0)
+      continue;
+    p.doc = renumber[p.doc];
+    index_buffer_put(&sec[INDEX_SECTION_POSTINGS], &p, sizeof(p));
+    term.posting_count++;
+  }
+  if (term.posting_count == 0)
+    return;
+
+  size_t len = strlen(text);
+  term.text = (uint32_t)sec[INDEX_SECTION_STRINGS].size;
+  term.hash = search_hash(text, len);
+  index_buffer_put(&sec[INDEX_SECTION_STRINGS], text, len + 1);
+  index_buffer_put(&sec[INDEX_SECTION_TERMS], &term, sizeof(term));
+}
+
+/**
+ * @brief Write one trigram, merging its notes from the file and memory
+ * @param sec The sections being written (trigram slots go to TRIGRAMS in
+ *            order; the table is built afterwards)
+ * @param renumber New number of each note id (-1: not written)
+ * @param key Trigram key
+ * @param file The trigram's slot in the file, or NULL
+ * @param memory Its list in trigram_index, or NULL
+ */
+static void index_file_put_trigram(IndexBuffer *sec, const int *renumber,
+                                   unsigned key, const IndexFileTrigram *file,
+                                   const TrigramList *memory) {
+  int a_count = 0, b_count = memory != NULL ? memory->count : 0;
+  const int *a = index_file_trigram_docs(file, &a_count);
+  const int *b = memory != NULL ? memory->docs : NULL;
+
+  IndexFileTrigram slot = {key, 0, 0};
+  slot.docs = (uint32_t)(sec[INDEX_SECTION_TRIGRAM_DOCS].size / sizeof(int));
+  int i = 0, j = 0;
+  while (i < a_count || j < b_count) {
+    int doc;
+    if (j >= b_count || (i < a_count && a[i] < b[j])) {
+      doc = a[i++];
+      if (!index_file_live(doc))
+        continue;
+    } else {
+      doc = b[j++];
+    }
+    if (doc < 0 || doc >= notebook.nextNoteId || renumber[doc] < 0)
+      continue;
+    index_buffer_put(&sec[INDEX_SECTION_TRIGRAM_DOCS], &renumber[doc],
+                     sizeof(int));
+    slot.count++;
+  }
+  if (slot.count > 0)
+    index_buffer_put(&sec[INDEX_SECTION_TRIGRAMS], &slot, sizeof(slot));
+}
+
+/**
+ * @brief Write the sections out, through a temporary file
+ * @return False if writing failed (the old file is then left alone)
+ */
+static bool index_file_write(IndexBuffer *sec, uint64_t total_length) {
+  IndexFileHeader header = {0};
+  header.magic = INDEX_FILE_MAGIC;
+  header.version = INDEX_FILE_VERSION;
+  header.flags = case_fold_turkish ? INDEX_FILE_TURKISH : 0;
+  header.total_length = total_length;
+  uint64_t offset = sizeof(header);
+  for (int s = 0; s < INDEX_SECTION_COUNT; s++) {
+    offset = (offset + 7) & ~(uint64_t)7;
+    header.offset[s] = offset;
+    header.count[s] = sec[s].size / index_section_size[s];
+    offset += sec[s].size;
+  }
+
+  mkdir(INDEX_FILE_FOLDER, 0700);
+  FILE *file = fopen(INDEX_FILE ".tmp", "wb");
+  if (file == NULL)
+    return false;
+  static const char padding[8];
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  uint64_t at = sizeof(header);
+  for (int s = 0; s < INDEX_SECTION_COUNT && ok; s++) {
+    size_t pad = (size_t)(header.offset[s] - at);
+    ok = fwrite(padding, 1, pad, file) == pad &&
+         fwrite(sec[s].data, 1, sec[s].size, file) == sec[s].size;
+    at = header.offset[s] + sec[s].size;
+  }
+  ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+  ok = fclose(file) == 0 && ok;
+  if (ok && rename(INDEX_FILE ".tmp", INDEX_FILE) == 0)
+    return true;
+  remove(INDEX_FILE ".tmp");
+  return false;
+}
+
+/**
+ * @brief Lay out both indexes as the sections of a new index file
+ * @param sec Receives the sections
+ * @param renumber Scratch: new number of each note id (-1: not written)
+ * @param notes Scratch: the note of each id, cleared
+ * @param total_length Receives the sum of the written notes' lengths
+ * @return False if memory ran out
+ */
+static bool index_file_collect(IndexBuffer *sec, int *renumber,
+                               const Note **notes, uint64_t *total_length) {
+  int limit = notebook.nextNoteId;
+  for (int i = 0; i < notebook.count; i++) {
+    const Note *note = &notebook.notes[i];
+    if (note->indexed && note->id >= 0 && note->id < limit)
+      notes[note->id] = note;
+  }
+  int doc_count = 0;
+  for (int id = 0; id < limit; id++) {
+    bool indexed = index_file_live(id) || (id < search_index.doc_capacity &&
+                                           search_index.docs[id].title != NULL);
+    renumber[id] = notes[id] != NULL && indexed ? doc_count++ : -1;
+  }
+
+  /* Offset 0 is the empty string, and the section always ends in a NUL */
+  index_buffer_put(&sec[INDEX_SECTION_STRINGS], "", 1);
+
+  /* Notes, with their word positions copied over unchanged */
+  unsigned mask = index_buffer_table(&sec[INDEX_SECTION_TITLE_SLOTS],
+                                     (size_t)doc_count, sizeof(uint32_t)) -
+                  1;
+  for (int id = 0; id < limit; id++) {
+    if (renumber[id] < 0)
+      continue;
+    const Note *note = notes[id];
+    IndexFileDoc d = {0};
+    const int *positions;
+    int count;
+    if (index_file_live(id)) {
+      positions = index_file_positions(id, &count);
+      d.length = index_file.docs[id].length;
+    } else {
+      positions = search_index.docs[id].positions;
+      count = search_index.docs[id].position_count;
+      d.length = search_index.docs[id].length;
+    }
+    d.title = (uint32_t)sec[INDEX_SECTION_STRINGS].size;
+    d.positions = (uint32_t)(sec[INDEX_SECTION_POSITIONS].size / sizeof(int));
+    d.position_count = (uint32_t)count;
+    d.size = note->size;
+    d.mtime = (int64_t)note->mtime;
+    index_buffer_put(&sec[INDEX_SECTION_STRINGS], note->title,
+                     strlen(note->title) + 1);
+    index_buffer_put(&sec[INDEX_SECTION_POSITIONS], positions,
+                     (size_t)count * sizeof(int));
+    index_buffer_put(&sec[INDEX_SECTION_DOCS], &d, sizeof(d));
+    *total_length += (uint64_t)d.length;
+
+    if (!sec[INDEX_SECTION_TITLE_SLOTS].failed) {
+      uint32_t *slots = (uint32_t *)sec[INDEX_SECTION_TITLE_SLOTS].data;
+      unsigned s = search_hash(note->title, strlen(note->title)) & mask;
+      while (slots[s] != 0)
+        s = (s + 1) & mask;
+      slots[s] = (uint32_t)renumber[id] + 1;
+    }
+  }
+
+  /* Terms of the file first, each merged with the same term in memory */
+  for (int id = 0; id < index_file.term_count; id++) {
+    const char *text = index_file_string(index_file.terms[id].text);
+    index_file_put_term(sec, renumber, text, id,
+                        search_term_find(&search_index, text, strlen(text)));
+  }
+  for (int id = 0; id < search_index.term_count; id++) {
+    const char *text = search_index.terms[id].text;
+    if (index_file_term_find(text, strlen(text)) < 0)
+      index_file_put_term(sec, renumber, text, -1, id);
+  }
+  size_t term_count = sec[INDEX_SECTION_TERMS].size / sizeof(IndexFileTerm);
+  mask = index_buffer_table(&sec[INDEX_SECTION_TERM_SLOTS], term_count,
+                            sizeof(uint32_t)) -
+         1;
+  if (sec[INDEX_SECTION_TERMS].failed || sec[INDEX_SECTION_TERM_SLOTS].failed)
+    return false;
+  const IndexFileTerm *terms = (const void *)sec[INDEX_SECTION_TERMS].data;
+  uint32_t *term_slots = (uint32_t *)sec[INDEX_SECTION_TERM_SLOTS].data;
+  for (size_t id = 0; id < term_count; id++) {
+    unsigned s = terms[id].hash & mask;
+    while (term_slots[s] != 0)
+      s = (s + 1) & mask;
+    term_slots[s] = (uint32_t)id + 1;
+  }
+
+  /* Trigrams the same way; their slots are collected first, then hashed */
+  IndexBuffer *trigrams = &sec[INDEX_SECTION_TRIGRAMS];
+  for (unsigned s = 0; index_file.map != NULL && s <= index_file.trigram_mask;
+       s++) {
+    unsigned key = index_file.trigrams[s].key;
+    if (key == 0)
+      continue;
+    const TrigramList *list = NULL;
+    if (trigram_index.slot_capacity > 0) {
+      list = trigram_slot(&trigram_index, key);
+      if (list->key == 0)
+        list = NULL;
+    }
+    index_file_put_trigram(sec, renumber, key, &index_file.trigrams[s], list);
+  }
+  for (int s = 0; s < trigram_index.slot_capacity; s++) {
+    const TrigramList *list = &trigram_index.slots[s];
+    if (list->key != 0 && index_file_trigram_find(list->key) == NULL)
+      index_file_put_trigram(sec, renumber, list->key, NULL, list);
+  }
+  IndexBuffer collected = *trigrams;
+  size_t trigram_count = collected.size / sizeof(IndexFileTrigram);
+  mask = index_buffer_table(trigrams, trigram_count, sizeof(IndexFileTrigram)) -
+         1;
+  if (!collected.failed && !trigrams->failed) {
+    const IndexFileTrigram *from = (const void *)collected.data;
+    IndexFileTrigram *slots = (void *)trigrams->data;
+    for (size_t i = 0; i < trigram_count; i++) {
+      unsigned s = (from[i].key * 2654435761u) & mask;
+      while (slots[s].key != 0)
+        s = (s + 1) & mask;
+      slots[s] = from[i];
+    }
+  }
+  bool failed = collected.failed;
+  free(collected.data);
+  for (int s = 0; s < INDEX_SECTION_COUNT; s++)
+    failed = failed || sec[s].failed;
+  return !failed;
+}
+
+/**
+ * @brief Write both indexes to the index file (on exit)
+ *
+ * The current entries of the file and the notes indexed in memory are
+ * merged and renumbered from 0 in note id order. Nothing is written if no
+ * note was indexed or dropped since the file was opened.
+ */
+static void index_file_save(void) {
+  if (!search_index_dirty)
+    return;
+
+  int limit = notebook.nextNoteId;
+  int *renumber = malloc((size_t)(limit + 1) * sizeof(int));
+  const Note **notes = calloc((size_t)limit + 1, sizeof(Note *));
+  IndexBuffer sec[INDEX_SECTION_COUNT];
+  memset(sec, 0, sizeof(sec));
+  uint64_t total_length = 0;
+  if (renumber != NULL && notes != NULL &&
+      index_file_collect(sec, renumber, notes, &total_length) &&
+      index_file_write(sec, total_length))
+    search_index_dirty = false;
+
+  for (int s = 0; s < INDEX_SECTION_COUNT; s++)
+    free(sec[s].data);
+  free(renumber);
+  free(notes);
+}
+
+/* ============================================================================
+ * Index Segments
+ * ============================================================================
+ * Queries run over two segments: the mapped index file and the in-memory
+ * indexes, which hold whatever changed since the file was written. A note
+ * is current in exactly one of them, so each query runs against both and
+ * the results are merged. These accessors hide where a segment's data
+ * lives; the file's entries that have been superseded read as absent.
+ */
+
+/**
+ * @brief Where a segment's data lives
+ */
+typedef enum {
+  SEGMENT_FILE,   /* index_file */
+  SEGMENT_MEMORY, /* search_index and trigram_index */
+  SEGMENT_COUNT
+} SearchSegment;
+
+/**
+ * @brief Look up a term in a segment
+ * @return Term id within the segment, or -1
+ */
+static int segment_term_find(SearchSegment seg, const char *text, size_t len) {
+  if (seg == SEGMENT_FILE)
+    return index_file_term_find(text, len);
+  return search_term_find(&search_index, text, len);
+}
+
+/**
+ * @brief Number of term ids in a segment
+ */
+static int segment_term_count(SearchSegment seg) {
+  return seg == SEGMENT_FILE ? index_file.term_count : search_index.term_count;
+}
+
+/**
+ * @brief Text of a term in a segment
+ */
+static const char *segment_term_text(SearchSegment seg, int id) {
+  if (seg == SEGMENT_FILE)
+    return index_file_string(index_file.terms[id].text);
+  return search_index.terms[id].text;
+}
+
+/**
+ * @brief Posting list of a term in a segment (may include dead entries)
+ * @param seg The segment
+ * @param id Term id within the segment
+ * @param count Receives the number of postings
+ */
+static const Posting *segment_postings(SearchSegment seg, int id, int *count) {
+  if (seg == SEGMENT_FILE)
+    return index_file_postings(id, count);
+  *count = search_index.terms[id].posting_count;
+  return search_index.terms[id].postings;
+}
+
+/**
+ * @brief Check whether a note is current in a segment
+ */
+static bool segment_has_doc(SearchSegment seg, int doc) {
+  if (seg == SEGMENT_FILE)
+    return index_file_live(doc);
+  return doc >= 0 && doc < search_index.doc_capacity &&
+         search_index.docs[doc].title != NULL;
+}
+
+/**
+ * @brief One past the highest note id a segment can hold
+ */
+static int segment_doc_limit(SearchSegment seg) {
+  return seg == SEGMENT_FILE ? index_file.doc_count : search_index.doc_capacity;
+}
+
+/**
+ * @brief Word positions of a note in a segment
+ * @param seg The segment
+ * @param doc Note id (current in the segment)
+ * @param count Receives the number of positions
+ */
+static const int *segment_positions(SearchSegment seg, int doc, int *count) {
+  if (seg == SEGMENT_FILE)
+    return index_file_positions(doc, count);
+  *count = search_index.docs[doc].position_count;
+  return search_index.docs[doc].positions;
+}
+
+/**
+ * @brief Notes containing a trigram in a segment (may include dead entries)
+ * @param seg The segment
+ * @param key Trigram key
+ * @param count Receives the number of notes
+ */
+static const int *segment_trigram_docs(SearchSegment seg, unsigned key,
+                                       int *count) {
+  if (seg == SEGMENT_FILE)
+    return index_file_trigram_docs(index_file_trigram_find(key), count);
+  *count = 0;
+  if (trigram_index.slot_capacity == 0)
+    return NULL;
+  const TrigramList *list = trigram_slot(&trigram_index, key);
+  *count = list->count;
+  return list->docs;
+}
+
+/**
+ * @brief The indexed title of a note
+ * @return The title, or NULL if the note is in neither segment
+ */
+static const char *search_doc_title(int doc) {
+  if (index_file_live(doc))
+    return index_file_string(index_file.docs[doc].title);
+  if (segment_has_doc(SEGMENT_MEMORY, doc))
+    return search_index.docs[doc].title;
+  return NULL;
+}
+
+/**
+ * @brief Words in an indexed note's title and text
+ */
+static int search_doc_length(int doc) {
+  if (index_file_live(doc))
+    return index_file.docs[doc].length;
+  return segment_has_doc(SEGMENT_MEMORY, doc) ? search_index.docs[doc].length
+                                              : 0;
+}
+
+/**
+ * @brief Check the positions of a quoted phrase in one note
+ * @param seg The segment holding the note
+ * @param doc Note id
+ * @param terms The phrase's terms, in order (ids within seg)
+ * @param count Number of terms in the phrase
+ * @return True if the terms occur next to each other somewhere in the note
+ */
+static bool search_phrase_matches(SearchSegment seg, int doc,
+                                  const QueryTerm *terms, int count) {
+  int position_count, n;
+  const int *positions = segment_positions(seg, doc, &position_count);
+  const Posting *list = segment_postings(seg, terms[0].id, &n);
+  const Posting *first = search_posting_find(list, n, doc);
+  if (first == NULL || first->pos_off < 0 || first->tf < 0 ||
+      first->pos_off > position_count - first->tf)
+    return false;
+  for (int k = 0; k < first->tf; k++) {
+    int start = positions[first->pos_off + k];
+    bool all = true;
+    for (int j = 1; j < count && all; j++) {
+      list = segment_postings(seg, terms[j].id, &n);
+      const Posting *p = search_posting_find(list, n, doc);
+      if (p == NULL || p->pos_off < 0 || p->tf < 0 ||
+          p->pos_off > position_count - p->tf)
+        return false;
+      const int *at = positions + p->pos_off;
+      int lo = 0, hi = p->tf;
+      while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (at[mid] < start + j)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      all = lo < p->tf && at[lo] == start + j;
+    }
+    if (all)
+      return true;
+  }
+  return false;
+}
+
+/**
+ * @brief Find the notes of one segment matching the word terms of a query
+ *
+ * Substring terms are left to the trigram index and ignored here.
+ *
+ * @param seg The segment
+ * @param terms The parsed query (term ids within seg are filled in)
+ * @param count Number of terms
+ * @param out Receives the matching note ids in increasing order; the caller
+ *            frees it
+ * @return Number of matches, or -1 if no term is handled by this index
+ */
+static int search_index_query(SearchSegment seg, QueryTerm *terms, int count,
+                              int **out) {
+  *out = NULL;
+
+  /* Every exact term must exist; the rarest one drives the intersection */
+  int driver = -1, driver_count = 0;
+  const QueryTerm *prefix = NULL;
+  for (int i = 0; i < count; i++) {
+    if (terms[i].substring)
+      continue;
+    if (terms[i].prefix) {
+      prefix = &terms[i];
+      continue;
+    }
+    terms[i].id = segment_term_find(seg, terms[i].text, terms[i].len);
+    if (terms[i].id < 0)
+      return 0;
+    int n;
+    segment_postings(seg, terms[i].id, &n);
+    if (driver < 0 || n < driver_count) {
+      driver = i;
+      driver_count = n;
+    }
+  }
+  if (driver < 0 && prefix == NULL)
+    return -1;
+
+  /* The prefix term matches the union of every term it starts */
+  int limit = segment_doc_limit(seg);
+  unsigned char *prefix_docs = NULL;
+  int prefix_count = 0;
+  if (prefix != NULL) {
+    prefix_docs = calloc((size_t)limit + 1, 1);
+    if (prefix_docs == NULL)
+      return 0;
+    for (int id = 0; id < segment_term_count(seg); id++) {
+      if (strncmp(segment_term_text(seg, id), prefix->text, prefix->len) != 0)
+        continue;
+      int n;
+      const Posting *list = segment_postings(seg, id, &n);
+      for (int k = 0; k < n; k++) {
+        int doc = list[k].doc;
+        if (segment_has_doc(seg, doc) && !prefix_docs[doc]) {
+          prefix_docs[doc] = 1;
+          prefix_count++;
+        }
+      }
+    }
+  }
+
+  int capacity = driver >= 0 ? driver_count : prefix_count;
+  int *results = malloc((size_t)(capacity > 0 ? capacity : 1) * sizeof(int));
+  if (results == NULL) {
+    free(prefix_docs);
+    return 0;
+  }
+
+  int found = 0;
+  if (driver < 0) {
+    for (int doc = 0; doc < limit; doc++) {
+      if (prefix_docs[doc])
+        results[found++] = doc;
+    }
+  } else {
+    const Posting *lead = segment_postings(seg, terms[driver].id, &capacity);
+    for (int k = 0; k < capacity; k++) {
+      int doc = lead[k].doc;
+      bool match = segment_has_doc(seg, doc) &&
+                   (prefix_docs == NULL || prefix_docs[doc]);
+      for (int i = 0; i < count && match; i++) {
+        if (i != driver && !terms[i].prefix && !terms[i].substring) {
+          int n;
+          const Posting *list = segment_postings(seg, terms[i].id, &n);
+          match = search_posting_find(list, n, doc) != NULL;
+        }
+      }
+
+      /* Positions are only consulted for quoted phrases */
+      for (int i = 0; i < count && match;) {
+        int run = i + 1;
+        while (run < count && terms[i].phrase >= 0 &&
+               terms[run].phrase == terms[i].phrase)
+          run++;
+        if (run - i > 1)
+          match = search_phrase_matches(seg, doc, &terms[i], run - i);
+        i = run;
+      }
+      if (match)
+        results[found++] = doc;
+    }
+  }
+
+  free(prefix_docs);
+  *out = results;
+  return found;
+}
+
+/**
+ * @brief Find the notes of one segment that contain every trigram of a
+ *        fragment
+ * @param seg The segment
+ * @param text The folded fragment (at least three bytes)
+ * @param len Length of the fragment
+ * @param out Receives candidate note ids in increasing order; the caller
+ *            frees it
+ * @return Number of candidates
+ */
+static int trigram_index_candidates(SearchSegment seg, const char *text,
+                                    size_t len, int **out) {
+  *out = NULL;
+  if (len < 3)
+    return 0;
+
+  /* Start from the shortest list and intersect the others into it */
+  const int *shortest = NULL;
+  int shortest_count = 0;
+  for (size_t i = 0; i + 3 <= len; i++) {
+    int n;
+    const int *list = segment_trigram_docs(seg, trigram_key(text + i), &n);
+    if (n == 0)
+      return 0;
+    if (shortest == NULL || n < shortest_count) {
+      shortest = list;
+      shortest_count = n;
+    }
+  }
+
+  int *docs = malloc((size_t)shortest_count * sizeof(int));
+  if (docs == NULL)
+    return 0;
+  int found = 0;
+  for (int k = 0; k < shortest_count; k++) {
+    if (segment_has_doc(seg, shortest[k]))
+      docs[found++] = shortest[k];
+  }
+
+  for (size_t i = 0; i + 3 <= len && found > 0; i++) {
+    int n;
+    const int *list = segment_trigram_docs(seg, trigram_key(text + i), &n);
+    if (list == shortest)
+      continue;
+    int kept = 0, k = 0;
+    for (int j = 0; j < found; j++) {
+      while (k < n && list[k] < docs[j])
+        k++;
+      if (k < n && list[k] == docs[j])
+        docs[kept++] = docs[j];
+    }
+    found = kept;
+  }
+  *out = docs;
+  return found;
+}
+
+/* ============================================================================
+ * Substring Scanner
+ * ============================================================================
+ * Brute-force substring search, used where the indexes cannot answer: the
+ * text of notes with unsaved edits or not indexed yet, and the check of
+ * trigram candidates. It compares the needle's first and last byte at 16
+ * or 32 positions at once. Only where both match are the bytes in between
+ * compared, so most of the text is rejected without a byte loop. This is
+ * W. Muła's "generic SIMD" algorithm. Search hands it case-folded text (see
+ * Case Folding), so it matches exactly. The kernels also have an ASCII-only
+ * case-insensitive mode, which accepts either case of those two bytes and
+ * compares the rest folded.
+ *
+ * The widest kernel the CPU supports is picked on first use: AVX2, SSE2
+ * (always there on x86-64) or a portable scalar loop. Each kernel is built
+ * once per mode, so the exact one does not compare against both cases.
+ *
+ * --bench-search, 64 MB of text, 20-byte needle, x86-64 with glibc 2.36:
+ *
+ *   strstr   exact 7.5-9 GB/s
+ *   avx2     exact 6.1 GB/s     case-insensitive 5.7 GB/s
+ *   sse2     exact 4.9 GB/s     case-insensitive 4.5 GB/s
+ *   scalar   exact 1.7 GB/s     case-insensitive 0.5 GB/s
+ *
+ * strstr() stays ahead on exact matches but cannot be used: the texts are
+ * ranges of larger buffers, not NUL-terminated, and may hold NUL bytes. The
+ * library's memmem(), which takes a length, is slower than the kernels
+ * there (1.2 GB/s for a 2-byte needle, 4.9 GB/s for a 20-byte one), so
+ * exact matches go through the kernels too.
+ */
+
+#define SUBSTRING_NONE ((size_t)-1) /* No match */
+
+/**
+ * @brief Signature shared by the substring kernels
+ */
+typedef size_t (*SubstringKernel)(const char *text, size_t len,
+                                  const char *needle, size_t needle_len,
+                                  bool fold);
+
+/**
+ * @brief Upper-case counterpart of a folded byte (ASCII only)
+ */
+static char search_unfold(char c) {
+  return (c >= 'a' && c <= 'z') ? (char)(c - 32) : c;
+}
+
+/**
+ * @brief Compare text with a needle, optionally ignoring ASCII case
+ * @param text Candidate text
+ * @param needle The needle (folded if fold is set)
+ * @param len Bytes to compare
+ * @param fold Compare case-insensitively
+ */
+static bool substring_equal(const char *text, const char *needle, size_t len,
+                            bool fold) {
+  if (!fold)
+    return memcmp(text, needle, len) == 0;
+  for (size_t i = 0; i < len; i++) {
+    if (search_fold(text[i]) != needle[i])
+      return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Portable kernel: memchr for the first byte, then check the rest
+ */
+static size_t substring_find_scalar(const char *text, size_t len,
+                                    const char *needle, size_t needle_len,
+                                    bool fold) {
+  if (needle_len > len)
+    return SUBSTRING_NONE;
+
+  size_t last = needle_len - 1;
+  size_t middle = needle_len >= 2 ? needle_len - 2 : 0;
+  size_t end = len - last;
+  for (size_t i = 0; i < end; i++) {
+    if (fold) {
+      if (search_fold(text[i]) != needle[0])
+        continue;
+    } else {
+      const char *hit = memchr(text + i, needle[0], end - i);
+      if (hit == NULL)
+        break;
+      i = (size_t)(hit - text);
+    }
+    if ((fold ? search_fold(text[i + last]) : text[i + last]) ==
+            needle[last] &&
+        substring_equal(text + i + 1, needle + 1, middle, fold))
+      return i;
+  }
+  return SUBSTRING_NONE;
+}
+
+#if defined(__SSE2__)
+/**
+ * @brief Body of the SSE2 kernel, inlined once per mode
+ */
+static inline __attribute__((always_inline)) size_t
+substring_scan_sse2(const char *text, size_t len, const char *needle,
+                    size_t needle_len, bool fold) {
+  if (needle_len > len)
+    return SUBSTRING_NONE;
+
+  size_t last = needle_len - 1;
+  size_t middle = needle_len >= 2 ? needle_len - 2 : 0;
+  char first_alt = fold ? search_unfold(needle[0]) : needle[0];
+  char last_alt = fold ? search_unfold(needle[last]) : needle[last];
+  const __m128i first_a = _mm_set1_epi8(needle[0]);
+  const __m128i first_b = _mm_set1_epi8(first_alt);
+  const __m128i last_a = _mm_set1_epi8(needle[last]);
+  const __m128i last_b = _mm_set1_epi8(last_alt);
+
+  size_t i = 0;
+  while (i + last + 16 <= len) {
+    /* Skip blocks without a candidate; nothing in this loop is a call, so
+     * the compiler keeps the needle bytes in registers */
+    unsigned mask = 0;
+    for (; i + last + 16 <= len; i += 16) {
+      __m128i head = _mm_loadu_si128((const __m128i *)(text + i));
+      __m128i tail = _mm_loadu_si128((const __m128i *)(text + i + last));
+      __m128i hit_head = _mm_or_si128(_mm_cmpeq_epi8(head, first_a),
+                                      _mm_cmpeq_epi8(head, first_b));
+      __m128i hit_tail = _mm_or_si128(_mm_cmpeq_epi8(tail, last_a),
+                                      _mm_cmpeq_epi8(tail, last_b));
+      mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(hit_head, hit_tail));
+      if (mask != 0)
+        break;
+    }
+    while (mask != 0) {
+      size_t at = i + (size_t)__builtin_ctz(mask);
+      if (substring_equal(text + at + 1, needle + 1, middle, fold))
+        return at;
+      mask &= mask - 1;
+    }
+    if (i + last + 16 <= len)
+      i += 16;
+  }
+
+  size_t rest =
+      substring_find_scalar(text + i, len - i, needle, needle_len, fold);
+  return rest == SUBSTRING_NONE ? rest : i + rest;
+}
+
+/**
+ * @brief SSE2 kernel: filters 16 positions per step
+ */
+static size_t substring_find_sse2(const char *text, size_t len,
+                                  const char *needle, size_t needle_len,
+                                  bool fold) {
+  return fold ? substring_scan_sse2(text, len, needle, needle_len, true)
+              : substring_scan_sse2(text, len, needle, needle_len, false);
+}
+#endif
+
+#if HAVE_AVX2_KERNEL
+/**
+ * @brief Body of the AVX2 kernel, inlined once per mode
+ */
+__attribute__((target("avx2"), always_inline)) static inline size_t
+substring_scan_avx2(const char *text, size_t len, const char *needle,
+                    size_t needle_len, bool fold) {
+  if (needle_len > len)
+    return SUBSTRING_NONE;
+
+  size_t last = needle_len - 1;
+  size_t middle = needle_len >= 2 ? needle_len - 2 : 0;
+  char first_alt = fold ? search_unfold(needle[0]) : needle[0];
+  char last_alt = fold ? search_unfold(needle[last]) : needle[last];
+  const __m256i first_a = _mm256_set1_epi8(needle[0]);
+  const __m256i first_b = _mm256_set1_epi8(first_alt);
+  const __m256i last_a = _mm256_set1_epi8(needle[last]);
+  const __m256i last_b = _mm256_set1_epi8(last_alt);
+
+  size_t i = 0;
+  while (i + last + 32 <= len) {
+    unsigned mask = 0;
+    for (; i + last + 32 <= len; i += 32) {
+      __m256i head = _mm256_loadu_si256((const __m256i *)(text + i));
+      __m256i tail = _mm256_loadu_si256((const __m256i *)(text + i + last));
+      __m256i hit_head = _mm256_or_si256(_mm256_cmpeq_epi8(head, first_a),
+                                         _mm256_cmpeq_epi8(head, first_b));
+      __m256i hit_tail = _mm256_or_si256(_mm256_cmpeq_epi8(tail, last_a),
+                                         _mm256_cmpeq_epi8(tail, last_b));
+      mask = (unsigned)_mm256_movemask_epi8(
+          _mm256_and_si256(hit_head, hit_tail));
+      if (mask != 0)
+        break;
+    }
+    while (mask != 0) {
+      size_t at = i + (size_t)__builtin_ctz(mask);
+      if (substring_equal(text + at + 1, needle + 1, middle, fold))
+        return at;
+      mask &= mask - 1;
+    }
+    if (i + last + 32 <= len)
+      i += 32;
+  }
+
+  size_t rest =
+      substring_find_scalar(text + i, len - i, needle, needle_len, fold);
+  return rest == SUBSTRING_NONE ? rest : i + rest;
+}
+
+/**
+ * @brief AVX2 kernel: filters 32 positions per step
+ */
+__attribute__((target("avx2"))) static size_t
+substring_find_avx2(const char *text, size_t len, const char *needle,
+                    size_t needle_len, bool fold) {
+  return fold ? substring_scan_avx2(text, len, needle, needle_len, true)
+              : substring_scan_avx2(text, len, needle, needle_len, false);
+}
+#endif
+
+/**
+ * @brief Pick the widest kernel the CPU supports
+ */
+static SubstringKernel substring_best_kernel(void) {
+#if HAVE_AVX2_KERNEL
+  if (__builtin_cpu_supports("avx2"))
+    return substring_find_avx2;
+#endif
+#if defined(__SSE2__)
+  return substring_find_sse2;
+#else
+  return substring_find_scalar;
+#endif
+}
+
+static SubstringKernel substring_kernel; /* Kernel chosen for this CPU */
+
+/**
+ * @brief Choose the substring kernel
+ *
+ * Happens on first use. Call it before starting threads that search, so that
+ * they only ever read substring_kernel.
+ */
+static void substring_init(void) {
+  if (substring_kernel == NULL)
+    substring_kernel = substring_best_kernel();
+}
+
+/**
+ * @brief Find the first occurrence of a needle in a text
+ * @param text The text
+ * @param len Length of the text
+ * @param needle The needle, already folded if fold is set
+ * @param needle_len Length of the needle
+ * @param fold Ignore ASCII case
+ * @return Offset of the match, or SUBSTRING_NONE
+ */
+static size_t substring_find(const char *text, size_t len, const char *needle,
+                             size_t needle_len, bool fold) {
+  if (needle_len == 0)
+    return 0;
+  substring_init();
+  return substring_kernel(text, len, needle, needle_len, fold);
+}
+
+/* ============================================================================
+ * Regex
+ * ============================================================================
+ * Search queries starting with '/' are regular expressions, and so is the
+ * pattern given to --grep. A pattern is parsed straight into a Thompson NFA
+ * over bytes, with each character class turned into the UTF-8 byte
+ * sequences of its codepoint ranges. The NFA is never simulated directly.
+ * Sets of its states become DFA states as the text calls for them, each
+ * with a 256-entry transition table filled in on first use. Matching is
+ * then one table lookup per byte and never backtracks, so no pattern takes
+ * more than linear time. The DFA cache is bounded: when it fills up, it is
+ * cleared and rebuilt from the state the match is in.
+ *
+ * Supported: literals, '.', classes with ranges and negation, \d \w \s and
+ * their negations, groups (also "(?:"), '|', the quantifiers * + ? {m,n},
+ * and ^ and $ at line boundaries. Matching is case-sensitive, and '.' does
+ * not match a line break. Like the search index, \w counts every non-ASCII
+ * character as a word character.
+ *
+ * While parsing, the literal strings every match must contain are collected
+ * (such as "TODO(" in `TODO\(\w+\)`). Search looks them up in the trigram
+ * index to pick the candidate notes before any text is read.
+ */
+
+#define REGEX_MAX_NFA 16384           /* NFA states a pattern may compile to */
+#define REGEX_MAX_REPEAT 1000         /* Largest count in {m,n} */
+#define REGEX_MAX_RANGES 256          /* Codepoint ranges in one class */
+#define REGEX_MAX_LITERALS 8          /* Required literals kept per pattern */
+#define REGEX_MAX_LITERAL 64          /* Longest required literal */
+#define REGEX_DFA_STATES 4096         /* DFA states cached before a reset */
+#define REGEX_UNBOUNDED (-1)          /* No upper limit on a repetition */
+#define REGEX_MAX_CODEPOINT 0x10FFFFu /* Highest Unicode codepoint */
+
+/**
+ * @brief What an NFA state does
+ */
+typedef enum {
+  REGEX_BYTE,       /* Consume a byte in [lo, hi] and go to out */
+  REGEX_SPLIT,      /* Go to both out and out1 */
+  REGEX_EMPTY,      /* Go to out */
+  REGEX_LINE_START, /* Go to out at the start of a line */
+  REGEX_LINE_END,   /* Go to out at the end of a line */
+  REGEX_MATCH,      /* The pattern has matched */
+} RegexOp;
+
+/**
+ * @brief One NFA state
+ */
+typedef struct {
+  unsigned char op; /* RegexOp */
+  unsigned char lo; /* Lowest byte accepted (REGEX_BYTE) */
+  unsigned char hi; /* Highest byte accepted (REGEX_BYTE) */
+  int out;          /* Next state (-1 until patched) */
+  int out1;         /* Second next state (REGEX_SPLIT) */
+} RegexState;
+
+/**
+ * @brief One DFA state: a set of NFA states
+ */
+typedef struct {
+  int *states;       /* The NFA states, sorted */
+  int count;         /* Entries in states */
+  bool line_start;   /* Reached right after a line break */
+  bool match;        /* The pattern has matched */
+  bool match_at_end; /* The pattern matches if the text ends here */
+  int next[256];     /* DFA state after each byte (-1: not built yet) */
+} RegexDfaState;
+
+/**
+ * @brief A compiled pattern
+ */
+typedef struct {
+  RegexState *nfa;  /* NFA states */
+  int nfa_count;    /* Entries in nfa */
+  int nfa_capacity; /* Allocated entries in nfa */
+  int start;        /* NFA start state */
+  int match_state;  /* The NFA's REGEX_MATCH state */
+  /* Strings every match contains, for prefiltering */
+  char literals[REGEX_MAX_LITERALS][REGEX_MAX_LITERAL + 1];
+  int literal_count;        /* Entries in literals */
+  RegexDfaState *dfa;       /* Cached DFA states */
+  int dfa_count;            /* Entries in dfa */
+  int dfa_capacity;         /* Allocated entries in dfa */
+  int *dfa_slots;           /* Hash table of DFA state + 1 (0 = empty) */
+  int dfa_start;            /* DFA state at the start of a text (-1: none) */
+  unsigned dfa_resets;      /* Times the cache was cleared */
+  int *set_a, *set_b;       /* Scratch state sets */
+  int *stack;               /* Scratch stack for closures */
+  unsigned *mark;           /* Per NFA state: closure it was last seen in */
+  unsigned mark_generation; /* Current closure */
+} Regex;
+
+/**
+ * @brief Pattern being parsed
+ */
+typedef struct {
+  Regex *re;         /* The pattern being built */
+  const char *at;    /* Next byte of the pattern */
+  const char *end;   /* End of the pattern */
+  const char *error; /* What went wrong (NULL while all is well) */
+} RegexParser;
+
+/**
+ * @brief A piece of NFA with one way in and one way out
+ */
+typedef struct {
+  int start;                        /* First state */
+  int end;                          /* REGEX_EMPTY state to patch */
+  bool exact;                       /* Matches exactly text, nothing else */
+  char text[REGEX_MAX_LITERAL + 1]; /* The string matched if exact */
+  size_t len;                       /* Length of text */
+} RegexFrag;
+
+/**
+ * @brief A codepoint range of a character class
+ */
+typedef struct {
+  unsigned lo, hi; /* First and last codepoint */
+} RegexRange;
+
+/**
+ * @brief A character class while it is parsed
+ */
+typedef struct {
+  RegexRange ranges[REGEX_MAX_RANGES]; /* Ranges, in any order */
+  int count;                           /* Entries in ranges */
+} RegexClass;
+
+/**
+ * @brief Add an NFA state
+ * @return The state's index (0, a scratch state, once the pattern fails)
+ */
+static int regex_state(RegexParser *p, RegexOp op, int lo, int hi, int out,
+                       int out1) {
+  Regex *re = p->re;
+  if (p->error != NULL && re->nfa_count > 0)
+    return 0;
+  if (re->nfa_count == REGEX_MAX_NFA) {
+    p->error = "pattern too large";
+    return 0;
+  }
+  if (re->nfa_count == re->nfa_capacity) {
+    int capacity = re->nfa_capacity > 0 ? re->nfa_capacity * 2 : 64;
+    RegexState *grown =
+        realloc(re->nfa, (size_t)capacity * sizeof(RegexState));
+    if (grown == NULL) {
+      p->error = "out of memory";
+      return 0;
+    }
+    re->nfa = grown;
+    re->nfa_capacity = capacity;
+  }
+  re->nfa[re->nfa_count] = (RegexState){(unsigned char)op, (unsigned char)lo,
+                                        (unsigned char)hi, out, out1};
+  return re->nfa_count++;
+}
+
+/**
+ * @brief A fragment that matches the empty string
+ */
+static RegexFrag regex_frag_empty(RegexParser *p) {
+  RegexFrag frag = {0};
+  frag.start = frag.end = regex_state(p, REGEX_EMPTY, 0, 0, -1, -1);
+  frag.exact = true;
+  return frag;
+}
+
+/**
+ * @brief A fragment whose single state of type op leads out of it
+ */
+static RegexFrag regex_frag_op(RegexParser *p, RegexOp op, int lo, int hi) {
+  RegexFrag frag = {0};
+  frag.end = regex_state(p, REGEX_EMPTY, 0, 0, -1, -1);
+  frag.start = regex_state(p, op, lo, hi, frag.end, -1);
+  return frag;
+}
+
+/**
+ * @brief Match a then b
+ */
+static RegexFrag regex_concat(RegexParser *p, RegexFrag a, RegexFrag b) {
+  p->re->nfa[a.end].out = b.start;
+  a.end = b.end;
+  a.exact = false;
+  return a;
+}
+
+/**
+ * @brief Match a or b
+ */
+static RegexFrag regex_alternate(RegexParser *p, RegexFrag a, RegexFrag b) {
+  RegexFrag frag = {0};
+  frag.end = regex_state(p, REGEX_EMPTY, 0, 0, -1, -1);
+  frag.start = regex_state(p, REGEX_SPLIT, 0, 0, a.start, b.start);
+  p->re->nfa[a.end].out = frag.end;
+  p->re->nfa[b.end].out = frag.end;
+  return frag;
+}
+
+/**
+ * @brief Match a any number of times, or at least once if plus
+ */
+static RegexFrag regex_loop(RegexParser *p, RegexFrag a, bool plus) {
+  RegexFrag frag = {0};
+  frag.end = regex_state(p, REGEX_EMPTY, 0, 0, -1, -1);
+  int split = regex_state(p, REGEX_SPLIT, 0, 0, a.start, frag.end);
+  p->re->nfa[a.end].out = split;
+  frag.start = plus ? a.start : split;
+  return frag;
+}
+
+/**
+ * @brief Match a or nothing
+ */
+static RegexFrag regex_optional(RegexParser *p, RegexFrag a) {
+  RegexFrag frag = {0};
+  frag.end = regex_state(p, REGEX_EMPTY, 0, 0, -1, -1);
+  frag.start = regex_state(p, REGEX_SPLIT, 0, 0, a.start, frag.end);
+  p->re->nfa[a.end].out = frag.end;
+  return frag;
+}
+
+/**
+ * @brief Match a fixed byte string
+ */
+static RegexFrag regex_bytes(RegexParser *p, const char *bytes, size_t len) {
+  RegexFrag frag = regex_frag_empty(p);
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = (unsigned char)bytes[i];
+    frag = regex_concat(p, frag, regex_frag_op(p, REGEX_BYTE, c, c));
+  }
+  frag.exact = len <= REGEX_MAX_LITERAL;
+  if (frag.exact) {
+    memcpy(frag.text, bytes, len);
+    frag.len = len;
+  }
+  return frag;
+}
+
+/**
+ * @brief Remember a string every match contains (for prefiltering)
+ */
+static void regex_keep_literal(RegexParser *p, const char *text,
+                               size_t len) {
+  Regex *re = p->re;
+  if (len < SEARCH_MIN_SUBSTRING || len > REGEX_MAX_LITERAL ||
+      re->literal_count == REGEX_MAX_LITERALS)
+    return;
+  memcpy(re->literals[re->literal_count], text, len);
+  re->literals[re->literal_count][len] = '\0';
+  re->literal_count++;
+}
+
+/**
+ * @brief Add the UTF-8 encodings of a codepoint range as alternatives
+ *
+ * The range is split until every part is a run of byte ranges, one per
+ * byte of the encoding (the method of Russ Cox's RE2).
+ *
+ * @param p The parser
+ * @param lo First codepoint
+ * @param hi Last codepoint
+ * @param frag In/out: the alternatives so far
+ * @param any In/out: whether frag holds any alternative yet
+ */
+static void regex_add_range(RegexParser *p, unsigned lo, unsigned hi,
+                            RegexFrag *frag, bool *any) {
+  static const unsigned limits[] = {0x7F, 0x7FF, 0xFFFF};
+  for (int i = 0; i < 3; i++) {
+    if (lo <= limits[i] && hi > limits[i]) {
+      regex_add_range(p, lo, limits[i], frag, any);
+      regex_add_range(p, limits[i] + 1, hi, frag, any);
+      return;
+    }
+  }
+
+  int n = hi <= 0x7F ? 1 : hi <= 0x7FF ? 2 : hi <= 0xFFFF ? 3 : 4;
+  for (int i = 1; i < n; i++) {
+    unsigned m = (1u << (6 * i)) - 1;
+    if ((lo & ~m) == (hi & ~m))
+      continue;
+    if ((lo & m) != 0) {
+      regex_add_range(p, lo, lo | m, frag, any);
+      regex_add_range(p, (lo | m) + 1, hi, frag, any);
+      return;
+    }
+    if ((hi & m) != m) {
+      regex_add_range(p, lo, (hi & ~m) - 1, frag, any);
+      regex_add_range(p, hi & ~m, hi, frag, any);
+      return;
+    }
+  }
+
+  char a[4], b[4];
+  encode_utf8(lo, a);
+  encode_utf8(hi, b);
+  RegexFrag seq = regex_frag_op(p, REGEX_BYTE, (unsigned char)a[0],
+                                (unsigned char)b[0]);
+  for (int i = 1; i < n; i++)
+    seq = regex_concat(p, seq,
+                       regex_frag_op(p, REGEX_BYTE, (unsigned char)a[i],
+                                     (unsigned char)b[i]));
+  *frag = *any ? regex_alternate(p, *frag, seq) : seq;
+  *any = true;
+}
+
+/**
+ * @brief Add a range to a class being parsed
+ */
+static void regex_class_add(RegexParser *p, RegexClass *cls, unsigned lo,
+                            unsigned hi) {
+  if (cls->count == REGEX_MAX_RANGES) {
+    p->error = "character class too large";
+    return;
+  }
+  cls->ranges[cls->count++] = (RegexRange){lo, hi};
+}
+
+/**
+ * @brief Order class ranges by their first codepoint
+ */
+static int regex_range_compare(const void *a, const void *b) {
+  const RegexRange *x = a, *y = b;
+  return (x->lo > y->lo) - (x->lo < y->lo);
+}
+
+/**
+ * @brief Sort and merge a class's ranges, optionally taking the complement
+ */
+static void regex_class_normalize(RegexClass *cls, bool negate) {
+  qsort(cls->ranges, (size_t)cls->count, sizeof(RegexRange),
+        regex_range_compare);
+  int merged = 0;
+  for (int i = 0; i < cls->count; i++) {
+    if (merged > 0 && cls->ranges[i].lo <= cls->ranges[merged - 1].hi + 1) {
+      if (cls->ranges[i].hi > cls->ranges[merged - 1].hi)
+        cls->ranges[merged - 1].hi = cls->ranges[i].hi;
+    } else {
+      cls->ranges[merged++] = cls->ranges[i];
+    }
+  }
+  cls->count = merged;
+  if (!negate)
+    return;
+
+  /* The gaps between n ranges are at most n + 1 ranges */
+  RegexRange gaps[REGEX_MAX_RANGES + 1];
+  int count = 0;
+  unsigned next = 0;
+  for (int i = 0; i < cls->count; i++) {
+    if (cls->ranges[i].lo > next)
+      gaps[count++] = (RegexRange){next, cls->ranges[i].lo - 1};
+    next = cls->ranges[i].hi + 1;
+  }
+  if (next <= REGEX_MAX_CODEPOINT)
+    gaps[count++] = (RegexRange){next, REGEX_MAX_CODEPOINT};
+  if (count > REGEX_MAX_RANGES)
+    count = REGEX_MAX_RANGES;
+  memcpy(cls->ranges, gaps, (size_t)count * sizeof(RegexRange));
+  cls->count = count;
+}
+
+/**
+ * @brief Add one of the classes \d \w \s (or, in upper case, its negation)
+ */
+static void regex_class_add_named(RegexParser *p, RegexClass *cls, char name) {
+  RegexClass named;
+  named.count = 0;
+  switch (name | 0x20) {
+  case 'd':
+    regex_class_add(p, &named, '0', '9');
+    break;
+  case 'w':
+    regex_class_add(p, &named, '0', '9');
+    regex_class_add(p, &named, 'A', 'Z');
+    regex_class_add(p, &named, '_', '_');
+    regex_class_add(p, &named, 'a', 'z');
+    regex_class_add(p, &named, 0x80, REGEX_MAX_CODEPOINT);
+    break;
+  default:
+    regex_class_add(p, &named, '\t', '\r');
+    regex_class_add(p, &named, ' ', ' ');
+    break;
+  }
+  regex_class_normalize(&named, name >= 'A' && name <= 'Z');
+  for (int i = 0; i < named.count; i++)
+    regex_class_add(p, cls, named.ranges[i].lo, named.ranges[i].hi);
+}
+
+/**
+ * @brief Build the fragment of a normalized class
+ */
+static RegexFrag regex_class_frag(RegexParser *p, const RegexClass *cls) {
+  if (cls->count == 1 && cls->ranges[0].lo == cls->ranges[0].hi) {
+    char bytes[4];
+    int n = encode_utf8(cls->ranges[0].lo, bytes);
+    return regex_bytes(p, bytes, (size_t)n);
+  }
+
+  RegexFrag frag = {0};
+  bool any = false;
+  for (int i = 0; i < cls->count; i++)
+    regex_add_range(p, cls->ranges[i].lo, cls->ranges[i].hi, &frag, &any);
+  if (!any)
+    frag = regex_frag_op(p, REGEX_BYTE, 1, 0); /* Matches nothing */
+  frag.exact = false;
+  return frag;
+}
+
+/**
+ * @brief Read the character after a backslash
+ * @param p The parser (just past the backslash)
+ * @param name Receives d, w, s, D, W or S for a class, or 0
+ * @param codepoint Receives the character otherwise
+ * @return False if the escape is not supported
+ */
+static bool regex_parse_escape(RegexParser *p, char *name,
+                               unsigned *codepoint) {
+  if (p->at >= p->end) {
+    p->error = "trailing backslash";
+    return false;
+  }
+  int c;
+  p->at += decode_utf8(p->at, (size_t)(p->end - p->at), &c);
+  *name = 0;
+  *codepoint = (unsigned)c;
+  switch (c) {
+  case 'd':
+  case 'D':
+  case 'w':
+  case 'W':
+  case 's':
+  case 'S':
+    *name = (char)c;
+    return true;
+  case 'n':
+    *codepoint = '\n';
+    return true;
+  case 't':
+    *codepoint = '\t';
+    return true;
+  case 'r':
+    *codepoint = '\r';
+    return true;
+  }
+  if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') ||
+      (c >= 'a' && c <= 'z')) {
+    p->error = "unsupported escape";
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Parse a bracketed class (p->at is past the '[')
+ */
+static RegexFrag regex_parse_class(RegexParser *p) {
+  RegexClass cls;
+  cls.count = 0;
+  bool negate = p->at < p->end && *p->at == '^';
+  if (negate)
+    p->at++;
+
+  for (bool first = true;; first = false) {
+    if (p->at >= p->end) {
+      p->error = "missing ]";
+      return regex_frag_empty(p);
+    }
+    if (*p->at == ']' && !first) {
+      p->at++;
+      break;
+    }
+
+    unsigned lo;
+    int c;
+    if (*p->at == '\\') {
+      char name;
+      p->at++;
+      if (!regex_parse_escape(p, &name, &lo))
+        return regex_frag_empty(p);
+      if (name != 0) {
+        regex_class_add_named(p, &cls, name);
+        continue;
+      }
+    } else {
+      p->at += decode_utf8(p->at, (size_t)(p->end - p->at), &c);
+      lo = (unsigned)c;
+    }
+
+    unsigned hi = lo;
+    if (p->end - p->at >= 2 && p->at[0] == '-' && p->at[1] != ']') {
+      p->at++;
+      char name = 0;
+      if (*p->at == '\\') {
+        p->at++;
+        if (!regex_parse_escape(p, &name, &hi))
+          return regex_frag_empty(p);
+      } else {
+        p->at += decode_utf8(p->at, (size_t)(p->end - p->at), &c);
+        hi = (unsigned)c;
+      }
+      if (name != 0 || hi < lo) {
+        p->error = "bad range in class";
+        return regex_frag_empty(p);
+      }
+    }
+    regex_class_add(p, &cls, lo, hi);
+  }
+
+  regex_class_normalize(&cls, negate);
+  return regex_class_frag(p, &cls);
+}
+
+static RegexFrag regex_parse_alternation(RegexParser *p);
+
+/**
+ * @brief Parse a single item: a character, class, group or anchor
+ */
+static RegexFrag regex_parse_atom(RegexParser *p) {
+  char c = *p->at;
+  if (c == '(') {
+    p->at++;
+    if (p->end - p->at >= 2 && p->at[0] == '?' && p->at[1] == ':')
+      p->at += 2;
+    RegexFrag frag = regex_parse_alternation(p);
+    if (p->at >= p->end || *p->at != ')') {
+      p->error = "missing )";
+      return frag;
+    }
+    p->at++;
+    return frag;
+  }
+  if (c == '*' || c == '+' || c == '?') {
+    p->error = "nothing to repeat";
+    return regex_frag_empty(p);
+  }
+
+  p->at++;
+  RegexFrag frag;
+  RegexClass cls;
+  cls.count = 0;
+  switch (c) {
+  case '[':
+    return regex_parse_class(p);
+  case '.':
+    regex_class_add(p, &cls, '\n', '\n');
+    regex_class_normalize(&cls, true);
+    return regex_class_frag(p, &cls);
+  case '^':
+  case '$':
+    frag = regex_frag_op(p, c == '^' ? REGEX_LINE_START : REGEX_LINE_END, 0,
+                         0);
+    frag.exact = true; /* Matches the empty string, so runs go on */
+    return frag;
+  case '\\': {
+    char name;
+    unsigned codepoint;
+    if (!regex_parse_escape(p, &name, &codepoint))
+      return regex_frag_empty(p);
+    if (name != 0) {
+      regex_class_add_named(p, &cls, name);
+      regex_class_normalize(&cls, false);
+      return regex_class_frag(p, &cls);
+    }
+    char bytes[4];
+    int n = encode_utf8(codepoint, bytes);
+    return regex_bytes(p, bytes, (size_t)n);
+  }
+  default: {
+    /* A literal character, copied byte for byte */
+    const char *start = p->at - 1;
+    int codepoint;
+    p->at = start + decode_utf8(start, (size_t)(p->end - start), &codepoint);
+    return regex_bytes(p, start, (size_t)(p->at - start));
+  }
+  }
+}
+
+/**
+ * @brief Parse a quantifier, if one follows
+ * @param p The parser (moved past the quantifier)
+ * @param min Receives the minimum count
+ * @param max Receives the maximum count (REGEX_UNBOUNDED for none)
+ * @return False if no quantifier follows
+ */
+static bool regex_parse_quantifier(RegexParser *p, int *min, int *max) {
+  if (p->at >= p->end)
+    return false;
+  switch (*p->at) {
+  case '*':
+    *min = 0;
+    *max = REGEX_UNBOUNDED;
+    break;
+  case '+':
+    *min = 1;
+    *max = REGEX_UNBOUNDED;
+    break;
+  case '?':
+    *min = 0;
+    *max = 1;
+    break;
+  case '{': {
+    /* Anything but {m}, {m,} or {m,n} is a literal brace */
+    const char *s = p->at + 1;
+    long lo = 0, hi;
+    if (s >= p->end || *s < '0' || *s > '9')
+      return false;
+    for (; s < p->end && *s >= '0' && *s <= '9'; s++)
+      lo = lo <= REGEX_MAX_REPEAT ? lo * 10 + (*s - '0') : lo;
+    hi = lo;
+    if (s < p->end && *s == ',') {
+      s++;
+      hi = REGEX_UNBOUNDED;
+      if (s < p->end && *s >= '0' && *s <= '9') {
+        hi = 0;
+        for (; s < p->end && *s >= '0' && *s <= '9'; s++)
+          hi = hi <= REGEX_MAX_REPEAT ? hi * 10 + (*s - '0') : hi;
+      }
+    }
+    if (s >= p->end || *s != '}')
+      return false;
+    if (lo > REGEX_MAX_REPEAT || hi > REGEX_MAX_REPEAT ||
+        (hi != REGEX_UNBOUNDED && hi < lo)) {
+      p->error = "bad repetition count";
+      return false;
+    }
+    *min = (int)lo;
+    *max = (int)hi;
+    p->at = s;
+    break;
+  }
+  default:
+    return false;
+  }
+  p->at++;
+
+  /* Lazy quantifiers find the same matches here */
+  if (p->at < p->end && *p->at == '?')
+    p->at++;
+  return true;
+}
+
+/**
+ * @brief Parse an item and its quantifier
+ *
+ * Counted repetitions need several copies of the item's NFA. The item is
+ * simply parsed again for each copy.
+ */
+static RegexFrag regex_parse_repeat(RegexParser *p) {
+  Regex *re = p->re;
+  const char *item = p->at;
+  int mark = re->literal_count;
+  RegexFrag frag = regex_parse_atom(p);
+  int min, max;
+  if (p->error != NULL || !regex_parse_quantifier(p, &min, &max))
+    return frag;
+  const char *after = p->at;
+  int kept = re->literal_count;
+  int next_min, next_max;
+  if (regex_parse_quantifier(p, &next_min, &next_max)) {
+    p->error = "nothing to repeat";
+    return frag;
+  }
+
+  /* Built back to front: the optional copies or the loop, then the
+   * required copies. The first copy is the one already parsed. */
+  RegexFrag result = {0};
+  bool have = false, parsed = false;
+  int required = min;
+  int optional = max == REGEX_UNBOUNDED ? 0 : max - min;
+  if (max == REGEX_UNBOUNDED) {
+    result = regex_loop(p, frag, min > 0);
+    have = parsed = true;
+    if (min > 0)
+      required--;
+  }
+  for (int i = 0; i < optional + required && p->error == NULL; i++) {
+    RegexFrag copy = frag;
+    if (parsed) {
+      p->at = item;
+      copy = regex_parse_atom(p);
+    }
+    parsed = true;
+    if (have)
+      copy = regex_concat(p, copy, result);
+    result = i < optional ? regex_optional(p, copy) : copy;
+    have = true;
+  }
+  if (!have)
+    result = regex_frag_empty(p);
+  p->at = after;
+
+  /* Only the first copy's literals count, and none if it is optional */
+  re->literal_count = min > 0 ? kept : mark;
+  result.exact = false;
+  if (min > 0 && frag.exact) {
+    if (min == max && frag.len * (size_t)min <= REGEX_MAX_LITERAL) {
+      result.exact = true;
+      result.len = 0;
+      for (int i = 0; i < min; i++, result.len += frag.len)
+        memcpy(result.text + result.len, frag.text, frag.len);
+    } else {
+      regex_keep_literal(p, frag.text, frag.len);
+    }
+  }
+  return result;
+}
+
+/**
+ * @brief Parse a sequence of items, up to '|', ')' or the end
+ */
+static RegexFrag regex_parse_concat(RegexParser *p) {
+  RegexFrag frag = regex_frag_empty(p);
+  char run[REGEX_MAX_LITERAL];
+  size_t run_len = 0;
+  bool exact = true;
+  while (p->at < p->end && *p->at != '|' && *p->at != ')' &&
+         p->error == NULL) {
+    RegexFrag item = regex_parse_repeat(p);
+
+    /* Consecutive fixed strings join into one literal */
+    if (item.exact && run_len + item.len <= REGEX_MAX_LITERAL) {
+      memcpy(run + run_len, item.text, item.len);
+      run_len += item.len;
+    } else {
+      regex_keep_literal(p, run, run_len);
+      run_len = 0;
+      if (item.exact) {
+        memcpy(run, item.text, item.len);
+        run_len = item.len;
+      }
+      exact = false;
+    }
+    frag = regex_concat(p, frag, item);
+  }
+
+  frag.exact = exact;
+  if (exact) {
+    memcpy(frag.text, run, run_len);
+    frag.len = run_len;
+  } else {
+    regex_keep_literal(p, run, run_len);
+  }
+  return frag;
+}
+
+/**
+ * @brief Parse alternatives separated by '|'
+ */
+static RegexFrag regex_parse_alternation(RegexParser *p) {
+  int mark = p->re->literal_count;
+  RegexFrag frag = regex_parse_concat(p);
+  bool alternated = false;
+  while (p->at < p->end && *p->at == '|' && p->error == NULL) {
+    p->at++;
+    frag = regex_alternate(p, frag, regex_parse_concat(p));
+    alternated = true;
+  }
+
+  /* No literal is required unless every alternative has it */
+  if (alternated) {
+    p->re->literal_count = mark;
+    frag.exact = false;
+  }
+  return frag;
+}
+
+/**
+ * @brief Release a compiled pattern
+ */
+static void regex_free(Regex *re) {
+  if (re == NULL)
+    return;
+  for (int i = 0; i < re->dfa_count; i++)
+    free(re->dfa[i].states);
+  free(re->dfa);
+  free(re->dfa_slots);
+  free(re->nfa);
+  free(re->set_a);
+  free(re->set_b);
+  free(re->stack);
+  free(re->mark);
+  free(re);
+}
+
+/**
+ * @brief Compile a pattern
+ * @param pattern The pattern
+ * @param len Length of the pattern
+ * @param error Receives a description of the problem if it fails
+ * @return The compiled pattern (free with regex_free()), or NULL
+ */
+static Regex *regex_compile(const char *pattern, size_t len,
+                            const char **error) {
+  Regex *re = calloc(1, sizeof(Regex));
+  if (re == NULL) {
+    *error = "out of memory";
+    return NULL;
+  }
+  RegexParser p = {re, pattern, pattern + len, NULL};
+  regex_state(&p, REGEX_EMPTY, 0, 0, -1, -1); /* Scratch state 0 */
+  RegexFrag frag = regex_parse_alternation(&p);
+  if (p.error == NULL && p.at < p.end)
+    p.error = "unmatched )";
+  if (frag.exact)
+    regex_keep_literal(&p, frag.text, frag.len);
+  re->match_state = regex_state(&p, REGEX_MATCH, 0, 0, -1, -1);
+  re->nfa[frag.end].out = re->match_state;
+  re->start = frag.start;
+
+  size_t n = (size_t)re->nfa_count;
+  re->set_a = malloc((n + 2) * sizeof(int));
+  re->set_b = malloc((n + 2) * sizeof(int));
+  re->stack = malloc((3 * n + 2) * sizeof(int));
+  re->mark = calloc(n, sizeof(unsigned));
+  re->dfa_slots = calloc(2 * REGEX_DFA_STATES, sizeof(int));
+  re->dfa_start = -1;
+  if (p.error == NULL &&
+      (re->set_a == NULL || re->set_b == NULL || re->stack == NULL ||
+       re->mark == NULL || re->dfa_slots == NULL))
+    p.error = "out of memory";
+  if (p.error != NULL) {
+    *error = p.error;
+    regex_free(re);
+    return NULL;
+  }
+  return re;
+}
+
+/**
+ * @brief Compare NFA state ids
+ */
+static int regex_int_compare(const void *a, const void *b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief Follow the empty moves from a set of NFA states
+ * @param re The pattern
+ * @param seeds States to start from
+ * @param count Entries in seeds
+ * @param line_start Whether ^ holds here
+ * @param line_end Whether $ holds here
+ * @param out Receives the states that consume a byte, match, or wait for
+ *            $, sorted
+ * @return Number of states in out
+ */
+static int regex_closure(Regex *re, const int *seeds, int count,
+                         bool line_start, bool line_end, int *out) {
+  if (++re->mark_generation == 0) {
+    memset(re->mark, 0, (size_t)re->nfa_count * sizeof(unsigned));
+    re->mark_generation = 1;
+  }
+  int top = 0, n = 0;
+  for (int i = 0; i < count; i++)
+    re->stack[top++] = seeds[i];
+
+  while (top > 0) {
+    int s = re->stack[--top];
+    if (s < 0 || re->mark[s] == re->mark_generation)
+      continue;
+    re->mark[s] = re->mark_generation;
+    const RegexState *st = &re->nfa[s];
+    switch (st->op) {
+    case REGEX_SPLIT:
+      re->stack[top++] = st->out1;
+      re->stack[top++] = st->out;
+      break;
+    case REGEX_EMPTY:
+      re->stack[top++] = st->out;
+      break;
+    case REGEX_LINE_START:
+      if (line_start)
+        re->stack[top++] = st->out;
+      break;
+    case REGEX_LINE_END:
+      if (line_end)
+        re->stack[top++] = st->out;
+      else
+        out[n++] = s;
+      break;
+    default:
+      out[n++] = s;
+      break;
+    }
+  }
+  qsort(out, (size_t)n, sizeof(int), regex_int_compare);
+  return n;
+}
+
+/**
+ * @brief Drop every cached DFA state
+ */
+static void regex_dfa_reset(Regex *re) {
+  for (int i = 0; i < re->dfa_count; i++)
+    free(re->dfa[i].states);
+  re->dfa_count = 0;
+  memset(re->dfa_slots, 0, 2 * REGEX_DFA_STATES * sizeof(int));
+  re->dfa_start = -1;
+  re->dfa_resets++;
+}
+
+/**
+ * @brief Find or add the DFA state for a set of NFA states
+ * @param re The pattern
+ * @param set The NFA states, sorted (as returned by regex_closure())
+ * @param count Entries in set
+ * @param line_start Whether the state follows a line break
+ * @return The DFA state, or -1 if memory ran out
+ */
+static int regex_dfa_add(Regex *re, const int *set, int count,
+                         bool line_start) {
+  unsigned h = 2166136261u ^ (unsigned)line_start;
+  for (int i = 0; i < count; i++)
+    h = (h ^ (unsigned)set[i]) * 16777619u;
+  unsigned mask = 2 * REGEX_DFA_STATES - 1;
+  unsigned s = h & mask;
+  for (; re->dfa_slots[s] != 0; s = (s + 1) & mask) {
+    const RegexDfaState *d = &re->dfa[re->dfa_slots[s] - 1];
+    if (d->count == count && d->line_start == line_start &&
+        memcmp(d->states, set, (size_t)count * sizeof(int)) == 0)
+      return re->dfa_slots[s] - 1;
+  }
+
+  if (re->dfa_count == REGEX_DFA_STATES) {
+    regex_dfa_reset(re);
+    for (s = h & mask; re->dfa_slots[s] != 0;)
+      s = (s + 1) & mask;
+  }
+  if (re->dfa_count == re->dfa_capacity) {
+    int capacity = re->dfa_capacity > 0 ? re->dfa_capacity * 2 : 16;
+    RegexDfaState *grown =
+        realloc(re->dfa, (size_t)capacity * sizeof(RegexDfaState));
+    if (grown == NULL)
+      return -1;
+    re->dfa = grown;
+    re->dfa_capacity = capacity;
+  }
+
+  RegexDfaState *d = &re->dfa[re->dfa_count];
+  d->states = malloc((size_t)(count + 1) * sizeof(int));
+  if (d->states == NULL)
+    return -1;
+  memcpy(d->states, set, (size_t)count * sizeof(int));
+  d->count = count;
+  d->line_start = line_start;
+  d->match = false;
+  for (int i = 0; i < count && !d->match; i++)
+    d->match = set[i] == re->match_state;
+
+  /* Whether $ would complete a match if the text ended here */
+  d->match_at_end = d->match;
+  int n = regex_closure(re, set, count, line_start, true, re->set_b);
+  for (int i = 0; i < n && !d->match_at_end; i++)
+    d->match_at_end = re->set_b[i] == re->match_state;
+  memset(d->next, -1, sizeof(d->next));
+  re->dfa_slots[s] = re->dfa_count + 1;
+  return re->dfa_count++;
+}
+
+/**
+ * @brief Build the DFA transition out of a state on one byte
+ * @param re The pattern
+ * @param from The DFA state
+ * @param c The byte
+ * @return The next DFA state, or -1 if memory ran out
+ */
+static int regex_dfa_step(Regex *re, int from, unsigned char c) {
+  const RegexDfaState *d = &re->dfa[from];
+  const int *set = d->states;
+  int count = d->count;
+  if (c == '\n') {
+    /* $ holds right before a line break */
+    count = regex_closure(re, d->states, d->count, d->line_start, true,
+                          re->set_a);
+    set = re->set_a;
+  }
+
+  /* The start state joins every step, so a match can begin anywhere */
+  int n = 0;
+  for (int i = 0; i < count; i++) {
+    const RegexState *st = &re->nfa[set[i]];
+    if (st->op == REGEX_BYTE && c >= st->lo && c <= st->hi)
+      re->set_b[n++] = st->out;
+    else if (st->op == REGEX_MATCH)
+      re->set_b[n++] = set[i];
+  }
+  re->set_b[n++] = re->start;
+  n = regex_closure(re, re->set_b, n, c == '\n', false, re->set_a);
+
+  unsigned resets = re->dfa_resets;
+  int to = regex_dfa_add(re, re->set_a, n, c == '\n');
+  if (to >= 0 && re->dfa_resets == resets)
+    re->dfa[from].next[c] = to;
+  return to;
+}
+
+/**
+ * @brief Check whether a pattern matches anywhere in a text
+ * @param re The pattern
+ * @param text The text
+ * @param len Length of the text
+ * @return True on a match (false also if memory ran out)
+ */
+static bool regex_search(Regex *re, const char *text, size_t len) {
+  if (re->dfa_start < 0) {
+    int n = regex_closure(re, &re->start, 1, true, false, re->set_a);
+    re->dfa_start = regex_dfa_add(re, re->set_a, n, true);
+    if (re->dfa_start < 0)
+      return false;
+  }
+
+  int s = re->dfa_start;
+  const unsigned char *bytes = (const unsigned char *)text;
+  for (size_t i = 0; i < len; i++) {
+    if (re->dfa[s].match)
+      return true;
+    int next = re->dfa[s].next[bytes[i]];
+    if (next < 0) {
+      next = regex_dfa_step(re, s, bytes[i]);
+      if (next < 0)
+        return false;
+    }
+    s = next;
+  }
+  return re->dfa[s].match_at_end;
+}
+
+/* ============================================================================
+ * Vault Loader
+ * ============================================================================
+ * Reading the vault is mostly waiting for the disk, or for the network when
+ * the vault lives on a mounted share. A pool of loader threads runs those
+ * waits side by side. The main thread hands out tasks (stat a note's file,
+ * or read and fold its text) and takes the results from a completion queue,
+ * in whatever order they finish.
+ *
+ * The threads only see the paths in their tasks, never the note table, so
+ * the main thread can keep editing notes while they run. Results name the
+ * note by id, and it is up to the main thread to find it again, or to drop
+ * the result if the note is gone.
+ */
+
+#define LOAD_MAX_THREADS 16      /* Upper bound on loader threads */
+#define LOAD_FRAME_BUDGET 0.008  /* Seconds per frame spent loading */
+#define LOAD_SEARCH_INTERVAL 0.5 /* Seconds between searches while loading */
+
+/**
+ * @brief What a loader task does
+ */
+typedef enum {
+  LOAD_STAT, /* Get the file's size and modification time */
+  LOAD_READ, /* Read the file and case-fold its text */
+} LoadKind;
+
+/**
+ * @brief A file for the loader threads
+ */
+typedef struct {
+  LoadKind kind;  /* What to do with the file */
+  int id;         /* Note the file belongs to */
+  char path[256]; /* Path of the file */
+} LoadTask;
+
+/**
+ * @brief A finished task, waiting in the completion queue
+ */
+typedef struct {
+  LoadKind kind; /* What was done */
+  int id;        /* Note the file belongs to */
+  bool ok;       /* The file could be read */
+  long size;     /* LOAD_STAT: size of the file in bytes */
+  time_t mtime;  /* LOAD_STAT: last modification time */
+  char *folded;  /* LOAD_READ: folded text (caller frees) */
+  size_t len;    /* LOAD_READ: length of folded */
+} LoadResult;
+
+/**
+ * @brief The loader threads and their two queues
+ */
+typedef struct {
+  pthread_t threads[LOAD_MAX_THREADS]; /* Running loader threads */
+  int thread_count;                    /* Entries in threads */
+  pthread_mutex_t lock;                /* Guards everything below */
+  pthread_cond_t wake;                 /* Signalled when tasks arrive */
+  pthread_cond_t done;                 /* Signalled when a task finishes */
+  LoadTask *tasks;                     /* Tasks, handed out in order */
+  int task_count;                      /* Entries in tasks */
+  int task_capacity;                   /* Allocated entries in tasks */
+  int task_next;                       /* First task not handed out yet */
+  LoadResult *results;                 /* Completion queue */
+  int result_count;                    /* Entries in results */
+  int result_capacity;                 /* Allocated entries in results */
+  int result_next;                     /* First result not taken yet */
+  int pending;                         /* Tasks whose result is not taken */
+  bool stop;                           /* Threads exit when set */
+} VaultLoader;
+
+static VaultLoader vault_loader = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                                   .wake = PTHREAD_COND_INITIALIZER,
+                                   .done = PTHREAD_COND_INITIALIZER};
+
+/**
+ * @brief Run one task
+ * @param task The task
+ * @param result Receives the outcome
+ */
+static void vault_loader_run(const LoadTask *task, LoadResult *result) {
+  memset(result, 0, sizeof(*result));
+  result->kind = task->kind;
+  result->id = task->id;
+
+  if (task->kind == LOAD_STAT) {
+    struct stat st;
+    result->ok = stat(task->path, &st) == 0;
+    if (result->ok) {
+      result->size = (long)st.st_size;
+      result->mtime = st.st_mtime;
+    }
+    return;
+  }
+
+  FILE *file = fopen(task->path, "r");
+  if (file == NULL)
+    return;
+  TextBuffer tb;
+  bool ok = text_buffer_load_file(&tb, file);
+  fclose(file);
+  if (!ok)
+    return;
+  result->folded = malloc(2 * tb.gap_start + 1);
+  if (result->folded != NULL) {
+    result->len = case_fold(tb.data, tb.gap_start, result->folded);
+    result->ok = true;
+  }
+  text_buffer_free(&tb);
+}
+
+/**
+ * @brief Make room in the completion queue for one more task's result
+ *
+ * Every task's result slot is reserved before the task is queued, so a
+ * finished task never finds the queue full. Results still to come and
+ * results not taken yet together need pending + result_next slots.
+ *
+ * @param vl The loader (lock held)
+ * @return False if memory ran out
+ */
+static bool vault_loader_reserve(VaultLoader *vl) {
+  int needed = vl->pending + vl->result_next + 1;
+  if (needed <= vl->result_capacity)
+    return true;
+  int capacity = vl->result_capacity > 0 ? vl->result_capacity : 256;
+  while (capacity < needed)
+    capacity *= 2;
+  LoadResult *grown =
+      realloc(vl->results, (size_t)capacity * sizeof(LoadResult));
+  if (grown == NULL)
+    return false;
+  vl->results = grown;
+  vl->result_capacity = capacity;
+  return true;
+}
+
+/**
+ * @brief Loader thread body: run tasks until told to stop
+ * @param arg Unused
+ * @return NULL
+ */
+static void *vault_loader_main(void *arg) {
+  (void)arg;
+  VaultLoader *vl = &vault_loader;
+  pthread_mutex_lock(&vl->lock);
+  for (;;) {
+    while (!vl->stop && vl->task_next == vl->task_count)
+      pthread_cond_wait(&vl->wake, &vl->lock);
+    if (vl->stop)
+      break;
+    LoadTask task = vl->tasks[vl->task_next++];
+    if (vl->task_next == vl->task_count)
+      vl->task_next = vl->task_count = 0;
+    pthread_mutex_unlock(&vl->lock);
+
+    LoadResult result;
+    vault_loader_run(&task, &result);
+
+    /* vault_loader_submit() made room for the result */
+    pthread_mutex_lock(&vl->lock);
+    vl->results[vl->result_count++] = result;
+    pthread_cond_broadcast(&vl->done);
+  }
+  pthread_mutex_unlock(&vl->lock);
+  return NULL;
+}
+
+/**
+ * @brief Queue a task, starting the loader threads on first use
+ *
+ * If no thread can be started, the task is run right away on the calling
+ * thread and its result queued.
+ *
+ * @param kind What to do with the file
+ * @param id Note the file belongs to
+ * @param path Path of the file
+ */
+static void vault_loader_submit(LoadKind kind, int id, const char *path) {
+  VaultLoader *vl = &vault_loader;
+  if (vl->thread_count == 0) {
+    /* The threads mostly wait for I/O, so there can be more than cores */
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    long wanted = cores > 0 ? 2 * cores : 1;
+    if (wanted > LOAD_MAX_THREADS)
+      wanted = LOAD_MAX_THREADS;
+    vl->stop = false;
+    while (vl->thread_count < wanted &&
+           pthread_create(&vl->threads[vl->thread_count], NULL,
+                          vault_loader_main, NULL) == 0)
+      vl->thread_count++;
+  }
+
+  LoadTask task = {kind, id, ""};
+  snprintf(task.path, sizeof(task.path), "%s", path);
+  pthread_mutex_lock(&vl->lock);
+  bool queued = vl->thread_count > 0 && vault_loader_reserve(vl);
+  if (queued && vl->task_count == vl->task_capacity) {
+    int capacity = vl->task_capacity > 0 ? vl->task_capacity * 2 : 256;
+    LoadTask *grown = realloc(vl->tasks, (size_t)capacity * sizeof(LoadTask));
+    if (grown != NULL) {
+      vl->tasks = grown;
+      vl->task_capacity = capacity;
+    }
+    queued = grown != NULL;
+  }
+  if (queued) {
+    vl->tasks[vl->task_count++] = task;
+    vl->pending++;
+    pthread_cond_signal(&vl->wake);
+  }
+  pthread_mutex_unlock(&vl->lock);
+  if (queued)
+    return;
+
+  /* No thread to run it, or no room to queue it: do it here. Without
+   * room for even the result, the task is dropped */
+  pthread_mutex_lock(&vl->lock);
+  bool reserved = vault_loader_reserve(vl);
+  if (reserved)
+    vl->pending++;
+  pthread_mutex_unlock(&vl->lock);
+  if (!reserved)
+    return;
+
+  LoadResult result;
+  vault_loader_run(&task, &result);
+  pthread_mutex_lock(&vl->lock);
+  vl->results[vl->result_count++] = result;
+  pthread_mutex_unlock(&vl->lock);
+}
+
+/**
+ * @brief Take the next finished task from the completion queue
+ * @param result Receives the result
+ * @param wait Block until a task finishes if none has yet
+ * @return False if no result is available (none pending, or not waiting)
+ */
+static bool vault_loader_take(LoadResult *result, bool wait) {
+  VaultLoader *vl = &vault_loader;
+  pthread_mutex_lock(&vl->lock);
+  while (wait && vl->result_next == vl->result_count && vl->pending > 0)
+    pthread_cond_wait(&vl->done, &vl->lock);
+  bool taken = vl->result_next < vl->result_count;
+  if (taken) {
+    *result = vl->results[vl->result_next++];
+    vl->pending--;
+    if (vl->result_next == vl->result_count)
+      vl->result_next = vl->result_count = 0;
+  }
+  pthread_mutex_unlock(&vl->lock);
+  return taken;
+}
+
+/**
+ * @brief Count the tasks whose results have not been taken yet
+ */
+static int vault_loader_pending(void) {
+  pthread_mutex_lock(&vault_loader.lock);
+  int pending = vault_loader.pending;
+  pthread_mutex_unlock(&vault_loader.lock);
+  return pending;
+}
+
+/**
+ * @brief Stop the loader threads, dropping queued tasks and results
+ */
+static void vault_loader_stop(void) {
+  VaultLoader *vl = &vault_loader;
+  pthread_mutex_lock(&vl->lock);
+  vl->stop = true;
+  pthread_cond_broadcast(&vl->wake);
+  pthread_mutex_unlock(&vl->lock);
+  for (int i = 0; i < vl->thread_count; i++)
+    pthread_join(vl->threads[i], NULL);
+  vl->thread_count = 0;
+
+  for (int i = vl->result_next; i < vl->result_count; i++)
+    free(vl->results[i].folded);
+  free(vl->tasks);
+  free(vl->results);
+  vl->tasks = NULL;
+  vl->results = NULL;
+  vl->task_count = vl->task_capacity = vl->task_next = 0;
+  vl->result_count = vl->result_capacity = vl->result_next = 0;
+  vl->pending = 0;
+}
+
+/* ============================================================================
+ * Replacing Files
+ * ============================================================================
+ * A note's file is replaced by writing the new text to a temporary file,
+ * syncing it and renaming it over the note. The rename itself is only safe
+ * from a crash once the folder holding the note is synced too; until then
+ * the old file can come back.
+ *
+ * The new file has to pass for the old one. It gets the old file's
+ * permissions, and a note that is a symlink is replaced at the file the
+ * link points to, so the link stays. A file with other hard links is
+ * overwritten in place instead, as a rename would cut it off from them;
+ * only that write can be torn by a crash.
+ */
+
+/**
+ * @brief The file a note's new text goes to (see file_target_init())
+ */
+typedef struct {
+  char path[PATH_MAX]; /* The file itself, symlinks resolved */
+  mode_t mode;         /* Its permissions */
+  bool exists;         /* There is a file yet (else path is the note's) */
+  bool in_place;       /* It has other hard links: overwrite, not rename */
+} FileTarget;
+
+/**
+ * @brief Find out where and how a note's file is replaced
+ * @param ft Receives the target
+ * @param path The note's file
+ */
+static void file_target_init(FileTarget *ft, const char *path) {
+  struct stat st;
+  ft->exists = stat(path, &st) == 0;
+  ft->mode = ft->exists ? st.st_mode & 07777 : 0;
+  ft->in_place = ft->exists && S_ISREG(st.st_mode) && st.st_nlink > 1;
+  if (!ft->exists || realpath(path, ft->path) == NULL)
+    snprintf(ft->path, sizeof(ft->path), "%s", path);
+}
+
+/**
+ * @brief Name a hidden staging file next to a target, on the same disk
+ * @param ft The target
+ * @param suffix What the file is for ("save", ...)
+ * @param out Receives the path
+ * @param out_size Size of out
+ * @return False if the path does not fit
+ */
+static bool file_target_sibling(const FileTarget *ft, const char *suffix,
+                                char *out, size_t out_size) {
+  const char *slash = strrchr(ft->path, '/');
+  int folder_len = slash != NULL ? (int)(slash - ft->path + 1) : 0;
+  int n = snprintf(out, out_size, "%.*s.%s.%s", folder_len, ft->path,
+                   ft->path + folder_len, suffix);
+  return n >= 0 && (size_t)n < out_size;
+}
+
+/**
+ * @brief Write a text to a file and flush it to disk
+ * @param path The file
+ * @param text The text
+ * @param len Length of the text
+ * @param like Target whose permissions the file gets, creating it if need
+ *             be; NULL to overwrite an existing file in place
+ * @return True if every byte reached the disk
+ */
+static bool file_write(const char *path, const char *text, size_t len,
+                       const FileTarget *like) {
+  int fd = open(path, O_WRONLY | O_TRUNC | (like != NULL ? O_CREAT : 0), 0666);
+  if (fd < 0)
+    return false;
+  bool ok = like == NULL || !like->exists || fchmod(fd, like->mode) == 0;
+  while (ok && len > 0) {
+    ssize_t n = write(fd, text, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    ok = n > 0;
+    if (ok) {
+      text += n;
+      len -= (size_t)n;
+    }
+  }
+  ok = ok && fsync(fd) == 0;
+  return close(fd) == 0 && ok;
+}
+
+/**
+ * @brief Flush the folder holding a file to disk
+ * @param path The file
+ * @return False if the folder could not be synced
+ */
+static bool file_sync_folder(const char *path) {
+  char folder[PATH_MAX];
+  const char *slash = strrchr(path, '/');
+  if (slash == NULL)
+    strcpy(folder, ".");
+  else if (slash == path)
+    strcpy(folder, "/");
+  else
+    snprintf(folder, sizeof(folder), "%.*s", (int)(slash - path), path);
+
+  int dir = open(folder, O_RDONLY);
+  if (dir < 0)
+    return false;
+  /* Some file systems cannot sync a folder, and keep renames anyway */
+  bool ok = fsync(dir) == 0 || errno == EINVAL;
+  close(dir);
+  return ok;
+}
+
+/**
+ * @brief Rename a file and make the rename survive a crash
+ * @param from The file
+ * @param to Its new name
+ * @return False if the file was not renamed, or the rename is not on disk
+ */
+static bool file_rename_durable(const char *from, const char *to) {
+  return rename(from, to) == 0 && file_sync_folder(to);
+}
+
+/* ============================================================================
+ * Note Writer
+ * ============================================================================
+ * Saving waits for the disk, which on a slow or network disk is long enough
+ * to drop frames. So the main thread only copies the note's text, and a
+ * writer thread puts the copy on disk: into a temporary file, synced, then
+ * renamed over the note's file with file_rename_durable(), so a crash leaves
+ * either the old text or the new one. Only then is the save reported back
+ * as durable.
+ *
+ * Jobs and results travel through two single-producer, single-consumer
+ * rings, one each way. Each side only ever advances its own index (with
+ * release stores, read with acquire loads by the other side), so neither
+ * takes a lock. A byte written to a pipe wakes the thread when jobs arrive,
+ * and another pipe lets the main thread wait for results when it must. The
+ * main thread never has more than WRITER_QUEUE_SIZE saves in flight, so
+ * neither ring can overflow.
+ */
+
+#define WRITER_QUEUE_SIZE 64 /* Saves in flight at most (a power of two) */
+
+/**
+ * @brief A save for the writer thread
+ */
+typedef struct {
+  int id;              /* Note the text belongs to */
+  unsigned generation; /* Note.generation when the text was copied */
+  char path[256];      /* File to replace */
+  char *text;          /* Copy of the text (the writer frees it) */
+  size_t len;          /* Bytes in text */
+} WriteJob;
+
+/**
+ * @brief A finished save
+ */
+typedef struct {
+  int id;              /* Note the text belongs to */
+  unsigned generation; /* Note.generation when the text was copied */
+  bool ok;             /* The text is on disk and will stay there */
+  long size;           /* Size of the written file */
+  time_t mtime;        /* Its modification time */
+  char *folded;        /* Folded text, for the indexes (caller frees) */
+  size_t folded_len;   /* Length of folded */
+} WriteResult;
+
+/**
+ * @brief The writer thread and its two rings
+ */
+typedef struct {
+  WriteJob jobs[WRITER_QUEUE_SIZE];       /* Ring of saves to do */
+  unsigned job_head;                      /* Next job to take (writer) */
+  unsigned job_tail;                      /* Next job to fill (main) */
+  WriteResult results[WRITER_QUEUE_SIZE]; /* Ring of finished saves */
+  unsigned result_head;                   /* Next result to take (main) */
+  unsigned result_tail;                   /* Next result to fill (writer) */
+  int in_flight;                          /* Saves not taken back (main) */
+  pthread_t thread;                       /* Writer thread */
+  bool running;                           /* The thread was started */
+  int wake[2];                            /* Jobs arrived; closed to stop */
+  int done[2];                            /* Results arrived */
+} NoteWriter;
+
+static NoteWriter note_writer;
+
+/**
+ * @brief Put one text on disk (writer thread)
+ * @param job The save
+ * @param result Receives the outcome
+ */
+static void note_writer_run(const WriteJob *job, WriteResult *result) {
+  memset(result, 0, sizeof(*result));
+  result->id = job->id;
+  result->generation = job->generation;
+
+  FileTarget target;
+  file_target_init(&target, job->path);
+  bool ok;
+  if (target.in_place) {
+    ok = file_write(target.path, job->text, job->len, NULL);
+  } else {
+    char tmp[PATH_MAX];
+    ok = file_target_sibling(&target, "save", tmp, sizeof(tmp));
+    if (ok && !(file_write(tmp, job->text, job->len, &target) &&
+                file_rename_durable(tmp, target.path))) {
+      remove(tmp);
+      ok = false;
+    }
+  }
+
+  struct stat st;
+  if (ok && stat(job->path, &st) == 0) {
+    result->ok = true;
+    result->size = (long)st.st_size;
+    result->mtime = st.st_mtime;
+    result->folded = malloc(2 * job->len + 1);
+    if (result->folded != NULL)
+      result->folded_len = case_fold(job->text, job->len, result->folded);
+  }
+  free(job->text);
+}
+
+/**
+ * @brief Writer thread body: save batches until the wake pipe closes
+ * @param arg Unused
+ * @return NULL
+ */
+static void *note_writer_main(void *arg) {
+  (void)arg;
+  NoteWriter *nw = &note_writer;
+  WriteResult batch[WRITER_QUEUE_SIZE];
+  for (;;) {
+    char bell[64];
+    ssize_t got = read(nw->wake[0], bell, sizeof(bell));
+    if (got < 0 && errno == EINTR)
+      continue;
+
+    /* Everything queued so far, including jobs that arrive meanwhile */
+    int count = 0;
+    unsigned head = nw->job_head;
+    while (head != __atomic_load_n(&nw->job_tail, __ATOMIC_ACQUIRE)) {
+      note_writer_run(&nw->jobs[head % WRITER_QUEUE_SIZE], &batch[count++]);
+      __atomic_store_n(&nw->job_head, ++head, __ATOMIC_RELEASE);
+    }
+    if (count > 0) {
+      unsigned tail = nw->result_tail;
+      for (int k = 0; k < count; k++)
+        nw->results[tail++ % WRITER_QUEUE_SIZE] = batch[k];
+      __atomic_store_n(&nw->result_tail, tail, __ATOMIC_RELEASE);
+      ssize_t rung = write(nw->done[1], "", 1);
+      (void)rung; /* A full pipe already holds unread wake-ups */
+    }
+
+    /* Closed (or broken): everything queued before is saved by now */
+    if (got <= 0)
+      break;
+  }
+  return NULL;
+}
+
+/**
+ * @brief Start the writer thread
+ * @return False if it could not be started
+ */
+static bool note_writer_start(void) {
+  NoteWriter *nw = &note_writer;
+  if (pipe(nw->wake) != 0)
+    return false;
+  if (pipe(nw->done) != 0) {
+    close(nw->wake[0]);
+    close(nw->wake[1]);
+    return false;
+  }
+  /* Neither side ever waits for room in a pipe */
+  fcntl(nw->wake[1], F_SETFL, O_NONBLOCK);
+  fcntl(nw->done[1], F_SETFL, O_NONBLOCK);
+  nw->running =
+      pthread_create(&nw->thread, NULL, note_writer_main, NULL) == 0;
+  if (!nw->running) {
+    for (int i = 0; i < 2; i++) {
+      close(nw->wake[i]);
+      close(nw->done[i]);
+    }
+  }
+  return nw->running;
+}
+
+/**
+ * @brief Queue a save, starting the writer thread on first use
+ *
+ * The caller makes sure that fewer than WRITER_QUEUE_SIZE saves are in
+ * flight. If no thread can be started, the save is done right away on the
+ * calling thread and its result queued.
+ *
+ * @param job The save (the text now belongs to the writer)
+ */
+static void note_writer_submit(const WriteJob *job) {
+  NoteWriter *nw = &note_writer;
+  nw->in_flight++;
+  if (nw->running || note_writer_start()) {
+    unsigned tail = nw->job_tail;
+    nw->jobs[tail % WRITER_QUEUE_SIZE] = *job;
+    __atomic_store_n(&nw->job_tail, tail + 1, __ATOMIC_RELEASE);
+    ssize_t rung = write(nw->wake[1], "", 1);
+    (void)rung; /* A full pipe already holds unread wake-ups */
+    return;
+  }
+
+  /* No thread to run it: do it here */
+  unsigned tail = nw->result_tail;
+  note_writer_run(job, &nw->results[tail % WRITER_QUEUE_SIZE]);
+  nw->result_tail = tail + 1;
+}
+
+/**
+ * @brief Take the next finished save
+ * @param result Receives the result
+ * @param wait Block until a save finishes if none has yet
+ * @return False if no result is available (none in flight, or not waiting)
+ */
+static bool note_writer_take(WriteResult *result, bool wait) {
+  NoteWriter *nw = &note_writer;
+  for (;;) {
+    unsigned tail = __atomic_load_n(&nw->result_tail, __ATOMIC_ACQUIRE);
+    if (nw->result_head != tail) {
+      *result = nw->results[nw->result_head++ % WRITER_QUEUE_SIZE];
+      nw->in_flight--;
+      return true;
+    }
+    if (!wait || nw->in_flight == 0 || !nw->running)
+      return false;
+    char bell[64];
+    if (read(nw->done[0], bell, sizeof(bell)) == 0)
+      return false;
+  }
+}
+
+/**
+ * @brief Stop the writer thread once everything queued is saved
+ *
+ * Results not taken yet are dropped.
+ */
+static void note_writer_stop(void) {
+  NoteWriter *nw = &note_writer;
+  if (nw->running) {
+    close(nw->wake[1]);
+    pthread_join(nw->thread, NULL);
+    close(nw->wake[0]);
+    close(nw->done[0]);
+    close(nw->done[1]);
+    nw->running = false;
+  }
+  WriteResult result;
+  while (note_writer_take(&result, false))
+    free(result.folded);
+}
+
+/* ============================================================================
+ * Metadata Cache
+ * ============================================================================
+ * The sidebar needs every note's title before anything else, and change
+ * detection needs each file's size and modification time. META_FILE keeps
+ * both for every note, in sidebar order, as of the last exit. The next start
+ * reads it with a single fread() and fills the note table from it, so the
+ * whole sidebar is there in the first frame however large the vault is, and
+ * notes whose index file entry matches are searchable right away.
+ *
+ * The folder is still listed and every file stat()ed afterwards, but only
+ * to reconcile: files the cache does not know are added, notes whose files
+ * are gone are removed, and notes whose files changed are read again.
+ *
+ * The file is native-endian: a header, one record per note, then the
+ * titles, NUL-terminated. Each record also names the record that comes at
+ * its position in title order, so a listed file is found in the cache by
+ * binary search without sorting anything on load.
+ */
+
+#define META_FILE INDEX_FILE_FOLDER "/meta.bin"
+#define META_FILE_MAGIC 0x3154454Du /* "MET1" */
+#define META_FILE_VERSION 1u
+
+/**
+ * @brief Start of the metadata cache
+ */
+typedef struct {
+  uint32_t magic;   /* META_FILE_MAGIC */
+  uint32_t version; /* META_FILE_VERSION */
+  uint32_t count;   /* Records after the header */
+  uint32_t strings; /* Bytes of titles after the records */
+} MetaFileHeader;
+
+/**
+ * @brief A note's record in the metadata cache
+ */
+typedef struct {
+  int64_t size;    /* Size of the .md file */
+  int64_t mtime;   /* Modification time of the file */
+  uint32_t title;  /* Offset of the title in the strings */
+  uint32_t sorted; /* Record at this record's position in title order */
+} MetaFileNote;
+
+/**
+ * @brief The metadata cache, while the vault is being listed
+ */
+typedef struct {
+  char *data;                /* The whole file (NULL if none) */
+  const MetaFileNote *notes; /* Records, in sidebar order */
+  int count;                 /* Entries in notes */
+  const char *strings;       /* Titles */
+  size_t string_size;        /* Bytes in strings */
+  int *ids;                  /* Note id of each record (-1 if none) */
+  bool *listed;              /* Per record: its file was listed */
+} MetaFile;
+
+static MetaFile meta_file; /* The note table as of the last exit */
+
+/**
+ * @brief A title from the cache ("" if out of range)
+ */
+static const char *meta_file_title(int record) {
+  uint32_t offset = meta_file.notes[record].title;
+  return offset < meta_file.string_size ? meta_file.strings + offset : "";
+}
+
+/**
+ * @brief Release the cache
+ */
+static void meta_file_close(void) {
+  free(meta_file.data);
+  free(meta_file.ids);
+  free(meta_file.listed);
+  memset(&meta_file, 0, sizeof(meta_file));
+}
+
+/**
+ * @brief Read the cache and check it
+ *
+ * Besides the header, the titles must be strictly increasing in title
+ * order, which makes the order a permutation without repeated titles.
+ *
+ * @return False if there is no usable cache (meta_file is then empty)
+ */
+static bool meta_file_read(void) {
+  FILE *file = fopen(META_FILE, "rb");
+  if (file == NULL)
+    return false;
+  struct stat st;
+  size_t size = 0;
+  char *data = NULL;
+  if (fstat(fileno(file), &st) == 0 &&
+      st.st_size >= (off_t)sizeof(MetaFileHeader)) {
+    size = (size_t)st.st_size;
+    data = malloc(size);
+  }
+  bool ok = data != NULL && fread(data, 1, size, file) == size;
+  fclose(file);
+
+  const MetaFileHeader *h = (const MetaFileHeader *)data;
+  size_t records = ok ? (size - sizeof(*h)) / sizeof(MetaFileNote) : 0;
+  ok = ok && h->magic == META_FILE_MAGIC && h->version == META_FILE_VERSION &&
+       h->count <= records && h->count <= INT32_MAX &&
+       h->strings ==
+           size - sizeof(*h) - (size_t)h->count * sizeof(MetaFileNote) &&
+       h->strings > 0 && data[size - 1] == '\0';
+  if (!ok) {
+    free(data);
+    return false;
+  }
+
+  MetaFile *m = &meta_file;
+  m->data = data;
+  m->notes = (const MetaFileNote *)(data + sizeof(*h));
+  m->count = (int)h->count;
+  m->strings = (const char *)(m->notes + m->count);
+  m->string_size = h->strings;
+  for (int k = 0; k < m->count && ok; k++) {
+    uint32_t record = m->notes[k].sorted;
+    ok = record < (uint32_t)m->count &&
+         (k == 0 || strcmp(meta_file_title((int)m->notes[k - 1].sorted),
+                           meta_file_title((int)record)) < 0);
+  }
+  m->ids = ok ? malloc(((size_t)m->count + 1) * sizeof(int)) : NULL;
+  m->listed = ok ? calloc((size_t)m->count + 1, sizeof(bool)) : NULL;
+  if (m->ids == NULL || m->listed == NULL) {
+    meta_file_close();
+    return false;
+  }
+  for (int k = 0; k < m->count; k++)
+    m->ids[k] = -1;
+  return true;
+}
+
+/**
+ * @brief Look up a record by title
+ * @return The record, or -1
+ */
+static int meta_file_find(const char *title) {
+  int lo = 0;
+  int hi = meta_file.count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    int record = (int)meta_file.notes[mid].sorted;
+    int cmp = strcmp(meta_file_title(record), title);
+    if (cmp == 0)
+      return record;
+    if (cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return -1;
+}
+
+/**
+ * @brief Order note places by the notes' titles
+ */
+static int note_title_compare(const void *a, const void *b) {
+  return strcmp(notebook.notes[*(const int *)a].title,
+                notebook.notes[*(const int *)b].title);
+}
+
+/**
+ * @brief Write the note table to the cache, through a temporary file
+ *
+ * Only once the vault is fully loaded; before that the table lacks the
+ * notes not listed yet.
+ */
+static void meta_file_save(void) {
+  int count = notebook.count;
+  MetaFileNote *records = malloc(((size_t)count + 1) * sizeof(MetaFileNote));
+  int *order = malloc(((size_t)count + 1) * sizeof(int));
+  if (records == NULL || order == NULL) {
+    free(records);
+    free(order);
+    return;
+  }
+  for (int i = 0; i < count; i++)
+    order[i] = i;
+  if (count > 0)
+    qsort(order, count, sizeof(int), note_title_compare);
+
+  uint32_t strings = 0;
+  for (int i = 0; i < count; i++) {
+    const Note *note = &notebook.notes[i];
+    records[i].size = note->size;
+    records[i].mtime = (int64_t)note->mtime;
+    records[i].title = strings;
+    records[i].sorted = (uint32_t)order[i];
+    strings += (uint32_t)strlen(note->title) + 1;
+  }
+
+  MetaFileHeader header = {META_FILE_MAGIC, META_FILE_VERSION,
+                           (uint32_t)count, strings + 1};
+  mkdir(INDEX_FILE_FOLDER, 0700);
+  FILE *file = fopen(META_FILE ".tmp", "wb");
+  bool ok = file != NULL &&
+            fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(records, sizeof(MetaFileNote), (size_t)count, file) ==
+                (size_t)count;
+  for (int i = 0; i < count && ok; i++) {
+    const char *title = notebook.notes[i].title;
+    ok = fwrite(title, 1, strlen(title) + 1, file) == strlen(title) + 1;
+  }
+  /* A final NUL, so an empty table still has strings to check */
+  ok = ok && fputc('\0', file) != EOF;
+  if (file != NULL) {
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+  }
+  if (!ok || rename(META_FILE ".tmp", META_FILE) != 0)
+    remove(META_FILE ".tmp");
+  free(records);
+  free(order);
+}
+
+/* ============================================================================
+ * File System Operations
+ * ============================================================================
+ * The vault is loaded while the window is already up. The note table comes
+ * from the metadata cache if there is one, and the note that was open at
+ * the last exit (named in STATE_FILE) is read first, so it can be edited
+ * straight away. The folder is then listed a slice per frame, each new
+ * title showing in the sidebar as it is found, while the loader threads
+ * look up the notes' sizes and modification times and read the notes the
+ * index file does not cover (see load_notes_step()).
+ */
+
+#define STATE_FILE INDEX_FILE_FOLDER "/state" /* Title of the open note */
+
+/**
+ * @brief Progress of loading the vault
+ */
+typedef struct {
+  DIR *dir;                     /* Vault folder while it is being listed */
+  char first[MAX_TITLE_LENGTH]; /* Note read before listing ("" if none) */
+  bool changed;                 /* Notes changed since the query last ran */
+  double search_time;           /* When the query last ran during the load */
+  int *unlisted;                /* Ids of cached notes whose files are gone */
+  int unlisted_count;           /* Entries in unlisted */
+} LoadProgress;
+
+static LoadProgress load_progress;
+
+/**
+ * @brief Ensure the vault folder exists, create if needed
+ */
+static void ensure_vault_exists(void) {
+  struct stat st = {0};
+  if (stat(VAULT_FOLDER, &st) == -1) {
+    mkdir(VAULT_FOLDER, 0700);
+  }
+}
+
+/**
+ * @brief Build the path of the .md file for a title
+ * @param title The note title
+ * @param out Output buffer
+ * @param out_size Size of the output buffer
+ */
+static void title_filepath(const char *title, char *out, size_t out_size) {
+  snprintf(out, out_size, "%s/%s.md", VAULT_FOLDER, title);
+}
+
+/**
+ * @brief Build the path of a note's .md file from its title
+ * @param note The note
+ * @param out Output buffer
+ * @param out_size Size of the output buffer
+ */
+static void note_filepath(const Note *note, char *out, size_t out_size) {
+  title_filepath(note->title, out, out_size);
+}
+
+/**
+ * @brief Grow the note table so it can hold at least one more note
+ * @return True if there is room for another note
+ */
+static bool reserve_note_slot(void) {
+  if (notebook.count < notebook.capacity)
+    return true;
+
+  int new_capacity = notebook.capacity > 0 ? notebook.capacity * 2 : 64;
+  Note *grown = realloc(notebook.notes, new_capacity * sizeof(Note));
+  if (grown == NULL)
+    return false;
+
+  notebook.notes = grown;
+  notebook.capacity = new_capacity;
+  return true;
+}
+
+/**
+ * @brief Read a note's body from disk if it is not resident yet
+ * @param note The note to load
+ * @return True if the note's content is available
+ */
+static bool load_note_content(Note *note) {
+  if (note->content.data != NULL)
+    return true;
+
+  char filepath[256];
+  note_filepath(note, filepath, sizeof(filepath));
+  FILE *file = fopen(filepath, "r");
+  bool ok = file ? text_buffer_map_file(&note->content, file)
+                 : text_buffer_init(&note->content, NULL, 0);
+  if (file)
+    fclose(file);
+  if (!ok)
+    return false;
+
+  if (!line_index_build(&note->lines, &note->content)) {
+    text_buffer_free(&note->content);
+    return false;
+  }
+
+  /* The only full count; edits keep the totals up to date from here on */
+  TextStats stats = text_buffer_stats(&note->content);
+  note->word_count = stats.words;
+  note->char_count = stats.chars;
+  note->generation++;
+  return true;
+}
+
+/**
+ * @brief Drop a note's case-folded copy (after edits, or with its body)
+ * @param note The note
+ */
+static void free_note_folded(Note *note) {
+  free(note->folded);
+  note->folded = NULL;
+  note->folded_len = 0;
+}
+
+/**
+ * @brief Fold a note's text, all in front of its gap (a TextBufferRead)
+ * @param arg The note, with room for the folded text allocated
+ */
+static void note_fold(const TextBuffer *tb, void *arg) {
+  Note *note = arg;
+  note->folded_len = case_fold(tb->data, tb->gap_start, note->folded);
+}
+
+/**
+ * @brief Get a note's case-folded text, folding it on first use
+ * @param note The note (must be loaded)
+ * @return The folded text (folded_len bytes), or NULL if memory ran out
+ */
+static const char *note_folded_text(Note *note) {
+  if (note->folded != NULL)
+    return note->folded;
+
+  TextBuffer *tb = &note->content;
+  text_buffer_move_gap(tb, text_buffer_length(tb));
+  note->folded = malloc(2 * tb->gap_start + 1);
+  if (note->folded == NULL)
+    return NULL;
+  text_buffer_read(tb, note_fold, note);
+  return note->folded;
+}
+
+/**
+ * @brief Free a note's body and everything derived from it
+ * @param note The note
+ */
+static void free_note_content(Note *note) {
+  text_buffer_free(&note->content);
+  line_index_free(&note->lines);
+  free_note_folded(note);
+}
+
+/**
+ * @brief Release a note's body if it can be reloaded from disk
+ * @param note The note to unload
+ */
+static void unload_note_content(Note *note) {
+  if (note->modified || note->content.data == NULL)
+    return;
+
+  free_note_content(note);
+}
+
+/**
+ * @brief Make a note the current one, loading its body on first use
+ * @param index Index of the note to select
+ */
+static void select_note(int index) {
+  if (index < 0 || index >= notebook.count)
+    return;
+
+  if (notebook.selected != index && notebook.selected >= 0 &&
+      notebook.selected < notebook.count) {
+    unload_note_content(&notebook.notes[notebook.selected]);
+  }
+
+  Note *note = &notebook.notes[index];
+  notebook.selected = index;
+  load_note_content(note);
+  notebook.cursorPos = 0;
+  notebook.preferredColumn = -1;
+  notebook.editorScroll = notebook.editorScrollTarget = 0;
+  cursor_blink_reset();
+}
+
+/**
+ * @brief Put a note's folded text in both indexes (search_lock held)
+ * @param note The note
+ * @param folded The folded text
+ * @param len Length of the folded text
+ */
+static void index_note_add(Note *note, const char *folded, size_t len) {
+  index_file_drop(note->id);
+  note->indexed =
+      search_index_add(&search_index, note->id, note->title, folded, len) &&
+      trigram_index_add(&trigram_index, note->id, note->title, folded, len);
+}
+
+/**
+ * @brief Index a note's text in the search index
+ *
+ * The resident body is used when there is one (it matches the file right
+ * after a save, and new notes have no file yet); otherwise the file is read.
+ *
+ * @param note The note
+ */
+static void index_note(Note *note) {
+  note->indexed = false;
+  if (note->content.data != NULL) {
+    const char *folded = note_folded_text(note);
+    if (folded == NULL)
+      return;
+    search_write_begin();
+    index_note_add(note, folded, note->folded_len);
+    search_write_end();
+    return;
+  }
+
+  char filepath[256];
+  note_filepath(note, filepath, sizeof(filepath));
+  FILE *file = fopen(filepath, "r");
+  if (file == NULL)
+    return;
+
+  /* After loading, the whole text sits in front of the gap */
+  TextBuffer tb;
+  bool ok = text_buffer_load_file(&tb, file);
+  fclose(file);
+  if (!ok)
+    return;
+  char *folded = malloc(2 * tb.gap_start + 1);
+  if (folded != NULL) {
+    size_t folded_len = case_fold(tb.data, tb.gap_start, folded);
+    search_write_begin();
+    index_note_add(note, folded, folded_len);
+    search_write_end();
+    free(folded);
+  }
+  text_buffer_free(&tb);
+}
+
+/**
+ * @brief Drop a note from the note table and the indexes
+ *
+ * The selected note stays selected; if it is the one dropped, the note that
+ * takes its place is. Listed search results keep pointing at the same notes
+ * until the next query runs.
+ *
+ * @param index Index of the note
+ */
+static void remove_note(int index) {
+  search_write_begin();
+  index_file_drop(notebook.notes[index].id);
+  search_index_remove(&search_index, notebook.notes[index].id);
+  trigram_index_remove(&trigram_index, notebook.notes[index].id);
+  search_write_end();
+  free_note_content(&notebook.notes[index]);
+
+  /* Shift remaining notes to fill the gap */
+  memmove(&notebook.notes[index], &notebook.notes[index + 1],
+          (notebook.count - index - 1) * sizeof(Note));
+  notebook.count--;
+  notebook.removals++;
+
+  int kept = 0;
+  for (int k = 0; k < notebook.searchResultCount; k++) {
+    int i = notebook.searchResults[k];
+    if (i != index)
+      notebook.searchResults[kept++] = i > index ? i - 1 : i;
+  }
+  notebook.searchResultCount = kept;
+
+  /* Adjust selection */
+  if (index < notebook.selected) {
+    notebook.selected--;
+  } else if (index == notebook.selected) {
+    if (notebook.selected >= notebook.count) {
+      notebook.selected = notebook.count - 1;
+    }
+    if (notebook.selected < 0) {
+      notebook.selected = 0;
+    }
+    if (notebook.count > 0) {
+      select_note(notebook.selected);
+    }
+  }
+  search_invalidate();
+}
+
+/**
+ * @brief Add the welcome note to an empty vault
+ */
+static void create_welcome_note(void) {
+  if (!reserve_note_slot())
+    return;
+  Note *note = &notebook.notes[0];
+  memset(note, 0, sizeof(*note));
+  note->id = notebook.nextNoteId++;
+  strcpy(note->title, "Welcome");
+
+#if IS_MACOS
+  const char *welcome =
+      "# Welcome to Notes! 📝\n\n"
+      "This is your personal notebook, inspired by Obsidian.\n\n"
+      "## Features\n\n"
+      "- **Create** new notes with the + button\n"
+      "- **Edit** notes in the editor panel\n"
+      "- **Delete** notes with right-click\n"
+      "- **Search** notes with ⌘F\n\n"
+      "## Keyboard Shortcuts\n\n"
+      "- `⌘N` - New note\n"
+      "- `⌘S` - Save note\n"
+      "- `⌘F` - Search\n\n"
+      "Supports Turkish keyboard: ş, ğ, ü, ö, ç, ı\n\n"
+      "Start writing your notes!\n";
+#else
+  const char *welcome =
+      "# Welcome to Notes! 📝\n\n"
+      "This is your personal notebook, inspired by Obsidian.\n\n"
+      "## Features\n\n"
+      "- **Create** new notes with the + button\n"
+      "- **Edit** notes in the editor panel\n"
+      "- **Delete** notes with right-click\n"
+      "- **Search** notes with Ctrl+F\n\n"
+      "## Keyboard Shortcuts\n\n"
+      "- `Ctrl+N` - New note\n"
+      "- `Ctrl+S` - Save note\n"
+      "- `Ctrl+F` - Search\n\n"
+      "Supports Turkish keyboard: ş, ğ, ü, ö, ç, ı\n\n"
+      "Start writing your notes!\n";
+#endif
+  if (!text_buffer_init(&note->content, welcome, strlen(welcome)))
+    return;
+  if (!line_index_build(&note->lines, &note->content)) {
+    text_buffer_free(&note->content);
+    return;
+  }
+  TextStats stats = text_buffer_stats(&note->content);
+  note->word_count = stats.words;
+  note->char_count = stats.chars;
+  note->modified = true;
+  index_note(note);
+  notebook.count = 1;
+  select_note(0);
+}
+
+/**
+ * @brief Check whether a frame's share of loading is used up
+ * @param start When the frame's loading started
+ * @param budget Seconds to spend, or a negative value for no limit
+ * @return True if loading should go on in the next frame
+ */
+static bool load_over_budget(double start, double budget) {
+  if (budget < 0 || GetTime() - start <= budget)
+    return false;
+  /* More may be waiting: come back without sleeping */
+  background_busy |= BACKGROUND_BACKLOG;
+  return true;
+}
+
+/**
+ * @brief Add a note found in the vault folder to the note table
+ *
+ * The loader threads look up its size and modification time, for change
+ * detection.
+ *
+ * @param name File name, or title
+ * @param len Length of the title within name (below MAX_TITLE_LENGTH)
+ * @return False if there is no room for another note
+ */
+static bool load_notes_add(const char *name, size_t len) {
+  if (!reserve_note_slot())
+    return false;
+  Note *note = &notebook.notes[notebook.count];
+  memset(note, 0, sizeof(*note));
+  memcpy(note->title, name, len);
+  note->title[len] = '\0';
+  note->id = index_file_claim(note->title);
+  notebook.count++;
+
+  char filepath[256];
+  note_filepath(note, filepath, sizeof(filepath));
+  vault_loader_submit(LOAD_STAT, note->id, filepath);
+  return true;
+}
+
+/**
+ * @brief Fill the note table from the metadata cache
+ *
+ * Notes whose index file entry matches their cached size and modification
+ * time use it right away. The stat pass that follows the listing catches
+ * the files that changed since.
+ *
+ * @param selected Title of the note to select ("" for the first one)
+ */
+static void load_notes_cached(const char *selected) {
+  bool dirty = search_index_dirty;
+  search_write_begin();
+  for (int k = 0; k < meta_file.count && reserve_note_slot(); k++) {
+    const MetaFileNote *record = &meta_file.notes[k];
+    Note *note = &notebook.notes[notebook.count++];
+    memset(note, 0, sizeof(*note));
+    snprintf(note->title, MAX_TITLE_LENGTH, "%s", meta_file_title(k));
+    note->id = index_file_claim(note->title);
+    note->size = (long)record->size;
+    note->mtime = (time_t)record->mtime;
+    index_file_adopt(note);
+    meta_file.ids[k] = note->id;
+  }
+  search_write_end();
+  /* Adopted entries need no new index file */
+  search_index_dirty = dirty;
+
+  int record = selected[0] != '\0' ? meta_file_find(selected) : -1;
+  if (record >= 0 && record < notebook.count)
+    select_note(record);
+  else if (notebook.count > 0)
+    select_note(0);
+}
+
+/**
+ * @brief Start loading the vault: the last open note, then the folder
+ */
+static void load_notes_begin(void) {
+  notebook.count = 0;
+  background_busy |= BACKGROUND_LOAD;
+  char *title = load_progress.first;
+  title[0] = '\0';
+  FILE *file = fopen(STATE_FILE, "r");
+  if (file != NULL) {
+    if (fgets(title, MAX_TITLE_LENGTH, file) == NULL)
+      title[0] = '\0';
+    title[strcspn(title, "\n")] = '\0';
+    fclose(file);
+  }
+
+  char filepath[256];
+  struct stat st;
+  title_filepath(title, filepath, sizeof(filepath));
+  if (meta_file_read()) {
+    /* The cached notes are listed like any others */
+    load_notes_cached(title);
+    title[0] = '\0';
+  } else if (title[0] == '\0' || stat(filepath, &st) != 0 ||
+             !load_notes_add(title, strlen(title))) {
+    title[0] = '\0';
+  } else {
+    select_note(0);
+  }
+  load_progress.changed = true;
+  load_progress.dir = opendir(VAULT_FOLDER);
+}
+
+/**
+ * @brief List the next part of the vault folder
+ * @param start When the frame's loading started
+ * @param budget Seconds to spend, or a negative value to list all of it
+ * @return True if notes were added
+ */
+static bool load_notes_list(double start, double budget) {
+  bool added = false;
+  for (;;) {
+    if (load_over_budget(start, budget))
+      return added;
+    struct dirent *entry = readdir(load_progress.dir);
+    if (entry == NULL)
+      break;
+    const char *ext = strrchr(entry->d_name, '.');
+    if (entry->d_type != DT_REG || ext == NULL || strcmp(ext, ".md") != 0)
+      continue;
+
+    /* Extract title from filename (remove .md extension) */
+    size_t name_len = strlen(entry->d_name) - 3;
+    if (name_len >= MAX_TITLE_LENGTH)
+      name_len = MAX_TITLE_LENGTH - 1;
+    if (strlen(load_progress.first) == name_len &&
+        memcmp(load_progress.first, entry->d_name, name_len) == 0)
+      continue;
+    if (meta_file.data != NULL) {
+      /* A cached note only needs its size and modification time checked */
+      char title[MAX_TITLE_LENGTH];
+      memcpy(title, entry->d_name, name_len);
+      title[name_len] = '\0';
+      int record = meta_file_find(title);
+      if (record >= 0) {
+        if (!meta_file.listed[record] && meta_file.ids[record] >= 0) {
+          char filepath[256];
+          title_filepath(title, filepath, sizeof(filepath));
+          vault_loader_submit(LOAD_STAT, meta_file.ids[record], filepath);
+        }
+        meta_file.listed[record] = true;
+        continue;
+      }
+    }
+    if (!load_notes_add(entry->d_name, name_len))
+      break;
+    added = true;
+    if (notebook.count == 1)
+      select_note(0);
+  }
+
+  /* Listed (or out of room for notes) */
+  closedir(load_progress.dir);
+  load_progress.dir = NULL;
+  if (meta_file.data != NULL) {
+    /* Cached notes not listed are removed by load_notes_prune() */
+    int *unlisted = malloc(((size_t)meta_file.count + 1) * sizeof(int));
+    int count = 0;
+    for (int k = 0; k < meta_file.count && unlisted != NULL; k++) {
+      if (!meta_file.listed[k] && meta_file.ids[k] >= 0)
+        unlisted[count++] = meta_file.ids[k];
+    }
+    load_progress.unlisted = unlisted;
+    load_progress.unlisted_count = count;
+    meta_file_close();
+  }
+  if (notebook.count == 0) {
+    create_welcome_note();
+    added = true;
+  }
+  return added;
+}
+
+/**
+ * @brief Map note ids to their places in the note table
+ * @return notebook.nextNoteId entries, -1 for ids without a note; NULL if
+ *         memory ran out
+ */
+static int *load_note_places(void) {
+  int limit = notebook.nextNoteId;
+  int *place = malloc((size_t)(limit + 1) * sizeof(int));
+  if (place == NULL)
+    return NULL;
+  for (int id = 0; id < limit; id++)
+    place[id] = -1;
+  for (int i = 0; i < notebook.count; i++)
+    place[notebook.notes[i].id] = i;
+  return place;
+}
+
+/**
+ * @brief Act on one finished loader task (search_lock held for writing)
+ *
+ * A note's size and modification time tell whether its index file entry is
+ * current. If not, its text is indexed: right away when it is resident,
+ * otherwise once a loader thread has read and folded it.
+ *
+ * @param note The note the task was for
+ * @param result The task's result
+ * @return True if the note was indexed in memory
+ */
+static bool load_note_result(Note *note, const LoadResult *result) {
+  if (result->kind == LOAD_STAT) {
+    if (result->ok && note->indexed && !note->modified &&
+        (note->size != result->size || note->mtime != result->mtime)) {
+      /* Adopted on the metadata cache's word, but the file changed since */
+      index_file_drop(note->id);
+      note->indexed = false;
+    }
+    if (result->ok) {
+      note->size = result->size;
+      note->mtime = result->mtime;
+    }
+    index_file_adopt(note);
+    if (note->indexed)
+      return false;
+    if (note->content.data == NULL) {
+      char filepath[256];
+      note_filepath(note, filepath, sizeof(filepath));
+      vault_loader_submit(LOAD_READ, note->id, filepath);
+      return false;
+    }
+    const char *folded = note_folded_text(note);
+    if (folded != NULL)
+      index_note_add(note, folded, note->folded_len);
+    return folded != NULL;
+  }
+
+  /* A note indexed in the meantime (it was saved, say) is skipped */
+  if (!result->ok || note->indexed)
+    return false;
+  index_note_add(note, result->folded, result->len);
+  return true;
+}
+
+/**
+ * @brief Do a frame's share of loading the vault
+ *
+ * Lists the next part of the folder, then takes what the loader threads
+ * have finished. Results for notes deleted in the meantime are dropped.
+ * All results of one call go in under one write lock.
+ *
+ * Taking the write lock stops a running query. While notes keep arriving,
+ * the query is run again only every LOAD_SEARCH_INTERVAL, and no results
+ * are taken while it runs, so it still shows matches during a long load.
+ * Until then, notes that are not indexed yet only match by title.
+ *
+ * @param budget Seconds to spend, or a negative value to load everything
+ */
+static void load_notes_step(double budget) {
+  background_busy &= ~BACKGROUND_BACKLOG;
+  if (!(background_busy & BACKGROUND_LOAD))
+    return;
+  if (budget >= 0 && (background_busy & BACKGROUND_SEARCH))
+    return;
+  double start = budget >= 0 ? GetTime() : 0;
+  if (load_progress.dir != NULL && load_notes_list(start, budget))
+    load_progress.changed = true;
+
+  int *place = NULL;
+  bool indexed = false;
+  bool dirty = search_index_dirty;
+  LoadResult result;
+  while (!load_over_budget(start, budget) &&
+         vault_loader_take(&result, budget < 0)) {
+    if (place == NULL) {
+      place = load_note_places();
+      if (place == NULL) {
+        free(result.folded);
+        break;
+      }
+      search_write_begin();
+    }
+    if (result.id < notebook.nextNoteId && place[result.id] >= 0) {
+      Note *note = &notebook.notes[place[result.id]];
+      bool was_indexed = note->indexed;
+      if (load_note_result(note, &result))
+        indexed = true;
+      /* Cached notes found unchanged leave the query's results as they are */
+      if (note->indexed != was_indexed)
+        load_progress.changed = true;
+    }
+    free(result.folded);
+  }
+  if (place != NULL) {
+    search_write_end();
+    free(place);
+    /* Entries found current need no new index file */
+    if (!indexed)
+      search_index_dirty = dirty;
+  }
+
+  bool done = load_progress.dir == NULL && vault_loader_pending() == 0;
+  if (done) {
+    background_busy &= ~BACKGROUND_LOAD;
+    request_redraw();
+    /* Entries of deleted notes are dropped by the next save */
+    if (index_file.live_count < index_file.doc_count)
+      search_index_dirty = true;
+  }
+  if (load_progress.changed) {
+    request_redraw();
+    if (done || budget < 0 ||
+        start - load_progress.search_time >= LOAD_SEARCH_INTERVAL) {
+      load_progress.search_time = start;
+      load_progress.changed = false;
+      search_invalidate();
+    }
+  }
+}
+
+/**
+ * @brief Remove the cached notes whose files were not listed
+ *
+ * Notes edited in the meantime stay; saving them writes their files again.
+ * The window calls this only while the quick switcher and the replace panel
+ * are closed, since both hold places in the note table.
+ */
+static void load_notes_prune(void) {
+  if (load_progress.unlisted == NULL)
+    return;
+  int *place = load_note_places();
+  bool *gone = calloc((size_t)notebook.count + 1, sizeof(bool));
+  for (int k = 0; k < load_progress.unlisted_count && place && gone; k++) {
+    int id = load_progress.unlisted[k];
+    if (id < notebook.nextNoteId && place[id] >= 0 &&
+        !notebook.notes[place[id]].modified)
+      gone[place[id]] = true;
+  }
+  if (place != NULL && gone != NULL) {
+    /* From the back, so the places still to remove stay valid */
+    for (int i = notebook.count - 1; i >= 0; i--) {
+      if (gone[i])
+        remove_note(i);
+    }
+    free(load_progress.unlisted);
+    load_progress.unlisted = NULL;
+    load_progress.unlisted_count = 0;
+    if (notebook.count == 0)
+      create_welcome_note();
+  }
+  free(place);
+  free(gone);
+}
+
+/**
+ * @brief Load and index the whole vault before returning
+ *
+ * For the command line tools; the window loads it a frame at a time.
+ */
+static void load_notes(void) {
+  load_notes_begin();
+  while (background_busy & BACKGROUND_LOAD)
+    load_notes_step(-1);
+  load_notes_prune();
+}
+
+/**
+ * @brief Act on a finished save
+ *
+ * The note is marked saved only if it was not edited after its text was
+ * copied; otherwise those edits still need a save of their own. A failed
+ * save leaves the note modified.
+ *
+ * @param result The save's result
+ */
+static void save_finish(const WriteResult *result) {
+  Note *note = NULL;
+  for (int i = 0; i < notebook.count && note == NULL; i++) {
+    if (notebook.notes[i].id == result->id)
+      note = &notebook.notes[i];
+  }
+  if (note == NULL || !result->ok)
+    return;
+  note->size = result->size;
+  note->mtime = result->mtime;
+  request_redraw();
+  if (note->generation != result->generation)
+    return;
+  note->modified = false;
+
+  /* Keep the index in step with what is on disk */
+  if (result->folded != NULL) {
+    search_write_begin();
+    index_note_add(note, result->folded, result->folded_len);
+    search_write_end();
+  } else {
+    index_note(note);
+  }
+  search_invalidate();
+}
+
+/**
+ * @brief Take the saves the writer thread has finished
+ * @param wait Wait until no save is in flight any more
+ */
+static void save_poll(bool wait) {
+  WriteResult result;
+  while (note_writer_take(&result, wait)) {
+    save_finish(&result);
+    free(result.folded);
+  }
+  if (note_writer.in_flight == 0)
+    background_busy &= ~BACKGROUND_SAVE;
+}
+
+/**
+ * @brief Save a single note to disk
+ *
+ * Only copies the text; the writer thread writes it, and the note stays
+ * marked modified until the file is durable (see save_finish()).
+ *
+ * @param note Pointer to the note to save
+ */
+static void save_note(Note *note) {
+  if (!note->modified || note->content.data == NULL)
+    return;
+
+  WriteJob job = {0};
+  job.id = note->id;
+  job.generation = note->generation;
+  note_filepath(note, job.path, sizeof(job.path));
+  job.len = text_buffer_length(&note->content);
+  job.text = malloc(job.len + 1);
+  if (job.text == NULL)
+    return;
+  text_buffer_copy(&note->content, 0, job.len, job.text);
+
+  if (note_writer.in_flight == WRITER_QUEUE_SIZE)
+    save_poll(true);
+  note_writer_submit(&job);
+  background_busy |= BACKGROUND_SAVE;
+}
+
+/**
+ * @brief Bring a note's state in line with its file, after the file changed
+ *
+ * A resident body is read again from the file. If the note is the selected
+ * one, the cursor is kept inside the new text, on a character boundary.
+ *
+ * @param note The note
+ */
+static void reload_note(Note *note) {
+  bool resident = note->content.data != NULL;
+  free_note_content(note);
+  note->modified = false;
+  if (resident)
+    load_note_content(note);
+
+  char filepath[256];
+  struct stat st;
+  note_filepath(note, filepath, sizeof(filepath));
+  if (stat(filepath, &st) == 0) {
+    note->size = (long)st.st_size;
+    note->mtime = st.st_mtime;
+  }
+  index_note(note);
+  request_redraw();
+
+  if (notebook.selected >= 0 && notebook.selected < notebook.count &&
+      note == &notebook.notes[notebook.selected]) {
+    const TextBuffer *tb = &note->content;
+    size_t len = tb->data != NULL ? text_buffer_length(tb) : 0;
+    size_t pos = notebook.cursorPos < len ? notebook.cursorPos : len;
+    while (pos > 0 && pos < len && (text_buffer_at(tb, pos) & 0xC0) == 0x80)
+      pos--;
+    notebook.cursorPos = pos;
+  }
+}
+
+/**
+ * @brief Save all notes to disk, waiting until every one is written
+ */
+static void save_all_notes(void) {
+  for (int i = 0; i < notebook.count; i++) {
+    save_note(&notebook.notes[i]);
+  }
+  save_poll(true);
+}
+
+/**
+ * @brief Remember the selected note, to open it first on the next start
+ */
+static void state_save(void) {
+  if (notebook.selected < 0 || notebook.selected >= notebook.count)
+    return;
+  mkdir(INDEX_FILE_FOLDER, 0700);
+  FILE *file = fopen(STATE_FILE, "w");
+  if (file == NULL)
+    return;
+  fprintf(file, "%s\n", notebook.notes[notebook.selected].title);
+  fclose(file);
+}
+
+/**
+ * @brief Release the note table and every resident note body
+ */
+static void free_notes(void) {
+  for (int i = 0; i < notebook.count; i++) {
+    free_note_content(&notebook.notes[i]);
+  }
+  free(notebook.notes);
+  notebook.notes = NULL;
+  notebook.count = 0;
+  notebook.capacity = 0;
+  free(notebook.searchResults);
+  notebook.searchResults = NULL;
+  if (load_progress.dir != NULL)
+    closedir(load_progress.dir);
+  load_progress.dir = NULL;
+  free(load_progress.unlisted);
+  load_progress.unlisted = NULL;
+  load_progress.unlisted_count = 0;
+  meta_file_close();
+  vault_loader_stop();
+  note_writer_stop();
+  search_index_free(&search_index);
+  trigram_index_free(&trigram_index);
+  index_file_close();
+}
+
+/**
+ * @brief Create a new empty note
+ */
+static void create_new_note(void) {
+  if (!reserve_note_slot())
+    return;
+
+  Note *note = &notebook.notes[notebook.count];
+  memset(note, 0, sizeof(*note));
+  note->id = notebook.nextNoteId++;
+  if (!text_buffer_init(&note->content, NULL, 0))
+    return;
+  if (!line_index_build(&note->lines, &note->content)) {
+    text_buffer_free(&note->content);
+    return;
+  }
+
+  /* Generate unique title */
+  int note_num = notebook.count + 1;
+  snprintf(note->title, MAX_TITLE_LENGTH, "Untitled %d", note_num);
+
+  note->modified = true;
+  index_note(note);
+
+  notebook.count++;
+  select_note(notebook.count - 1);
+  search_invalidate();
+}
+
+/**
+ * @brief Delete a note by index
+ * @param index Index of the note to delete
+ */
+static void delete_note(int index) {
+  if (index < 0 || index >= notebook.count)
+    return;
+  /* A save still in flight would bring the file back */
+  save_poll(true);
+
+  /* Delete the file from disk */
+  char filepath[256];
+  note_filepath(&notebook.notes[index], filepath, sizeof(filepath));
+  remove(filepath);
+  remove_note(index);
+}
+
+/* ============================================================================
+ * Vault Watcher
+ * ============================================================================
+ * Other programs change the vault too: a sync tool or a git pull rewrites
+ * notes, a script adds the daily note. A watcher thread follows the vault
+ * folder, and the main thread brings only the notes named in its events up
+ * to date, along with their index entries.
+ *
+ * On Linux the thread waits on inotify. Elsewhere it lists the folder every
+ * WATCH_POLL_INTERVAL and compares names, sizes and modification times with
+ * the previous listing. Either way it only collects the names of files that
+ * changed. A burst of events for one file (an editor saving through a
+ * temporary file, a sync writing in chunks) becomes a single update once the
+ * file has been quiet for WATCH_DEBOUNCE.
+ *
+ * The main thread then compares each file with its note. The app's own
+ * saves leave the note's size and modification time equal to the file's,
+ * so they are skipped. A note with unsaved edits is left alone; saving it
+ * writes the edits over the file. When events were lost (inotify's queue
+ * overflowed, or too many files changed at once to list them), every note
+ * and every file is checked instead.
+ */
+
+#define WATCH_DEBOUNCE 0.3      /* Seconds a file must be quiet */
+#define WATCH_POLL_INTERVAL 2.0 /* Seconds between listings without inotify */
+#define WATCH_MAX_EVENTS 1024   /* Changed files kept before checking all */
+
+/**
+ * @brief A changed file, waiting for its burst of events to end
+ */
+typedef struct {
+  char name[256]; /* File name in the vault folder */
+  double time;    /* When the main thread first saw it (-1 = not yet) */
+} WatchEvent;
+
+/**
+ * @brief A file in the previous listing (when polling)
+ */
+typedef struct {
+  char name[256]; /* File name in the vault folder */
+  long size;      /* Size in bytes */
+  time_t mtime;   /* Last modification time */
+} WatchFile;
+
+/**
+ * @brief The watcher thread and the changes it collected
+ */
+typedef struct {
+  pthread_t thread;     /* Watcher thread */
+  bool running;         /* The thread was started */
+  int inotify_fd;       /* inotify instance (-1 when polling) */
+  int wake[2];          /* Pipe closed to make the thread exit */
+  WatchFile *files;     /* Previous listing, by name (thread only) */
+  int file_count;       /* Entries in files */
+  pthread_mutex_t lock; /* Guards everything below */
+  WatchEvent *events;   /* Changed files, one entry per name */
+  int event_count;      /* Entries in events */
+  int event_capacity;   /* Allocated entries in events */
+  bool rescan;          /* Events were lost: check every note and file */
+  double rescan_time;   /* Like WatchEvent.time, for rescan */
+} VaultWatcher;
+
+static VaultWatcher vault_watcher = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                                     .inotify_fd = -1};
+
+/**
+ * @brief Get the title of a note file
+ * @param name File name in the vault folder
+ * @param title Receives the title (MAX_TITLE_LENGTH bytes)
+ * @return False if the file is not a note, or its title does not fit
+ */
+static bool watch_title(const char *name, char *title) {
+  size_t len = strlen(name);
+  if (len <= 3 || strcmp(name + len - 3, ".md") != 0 ||
+      len - 3 >= MAX_TITLE_LENGTH)
+    return false;
+  memcpy(title, name, len - 3);
+  title[len - 3] = '\0';
+  return true;
+}
+
+/**
+ * @brief Forget the collected changes and check everything (lock held)
+ */
+static void watch_lose_events(VaultWatcher *vw) {
+  vw->event_count = 0;
+  vw->rescan = true;
+  vw->rescan_time = -1;
+}
+
+/**
+ * @brief Record that a file changed (watcher thread)
+ *
+ * A file that is already waiting starts its quiet period over.
+ *
+ * @param name File name in the vault folder
+ */
+static void watch_file_changed(const char *name) {
+  char title[MAX_TITLE_LENGTH];
+  if (!watch_title(name, title))
+    return;
+
+  VaultWatcher *vw = &vault_watcher;
+  pthread_mutex_lock(&vw->lock);
+  int i = 0;
+  while (i < vw->event_count && strcmp(vw->events[i].name, name) != 0)
+    i++;
+  if (vw->rescan) {
+    /* Everything is checked anyway; wait for this burst to end too */
+    vw->rescan_time = -1;
+  } else if (i < vw->event_count) {
+    vw->events[i].time = -1;
+  } else if (vw->event_count == WATCH_MAX_EVENTS) {
+    watch_lose_events(vw);
+  } else {
+    if (vw->event_count == vw->event_capacity) {
+      int capacity = vw->event_capacity > 0 ? vw->event_capacity * 2 : 16;
+      WatchEvent *grown =
+          realloc(vw->events, (size_t)capacity * sizeof(WatchEvent));
+      if (grown != NULL) {
+        vw->events = grown;
+        vw->event_capacity = capacity;
+      }
+    }
+    if (vw->event_count < vw->event_capacity) {
+      WatchEvent *event = &vw->events[vw->event_count++];
+      snprintf(event->name, sizeof(event->name), "%s", name);
+      event->time = -1;
+    } else {
+      watch_lose_events(vw);
+    }
+  }
+  pthread_mutex_unlock(&vw->lock);
+}
+
+#if HAVE_INOTIFY
+/**
+ * @brief Take the events inotify has queued (watcher thread)
+ */
+static void watch_read_events(VaultWatcher *vw) {
+  union {
+    struct inotify_event event; /* For the alignment */
+    char bytes[4096];
+  } buffer;
+  ssize_t len = read(vw->inotify_fd, buffer.bytes, sizeof(buffer.bytes));
+  ssize_t at = 0;
+  while (at < len) {
+    const struct inotify_event *event =
+        (const struct inotify_event *)(buffer.bytes + at);
+    if (event->mask & IN_Q_OVERFLOW) {
+      pthread_mutex_lock(&vw->lock);
+      watch_lose_events(vw);
+      pthread_mutex_unlock(&vw->lock);
+    } else if (event->len > 0 && !(event->mask & IN_ISDIR)) {
+      watch_file_changed(event->name);
+    }
+    at += (ssize_t)(sizeof(struct inotify_event) + event->len);
+  }
+}
+#endif
+
+/**
+ * @brief Order listed files by name
+ */
+static int watch_file_compare(const void *a, const void *b) {
+  return strcmp(((const WatchFile *)a)->name, ((const WatchFile *)b)->name);
+}
+
+/**
+ * @brief List the vault folder and report what changed since the previous
+ *        listing (watcher thread, when polling)
+ * @param report False for the first listing, which only sets the baseline
+ */
+static void watch_list_folder(VaultWatcher *vw, bool report) {
+  DIR *dir = opendir(VAULT_FOLDER);
+  if (dir == NULL)
+    return;
+  WatchFile *files = NULL;
+  int count = 0;
+  int capacity = 0;
+  bool ok = true;
+  struct dirent *entry;
+  while (ok && (entry = readdir(dir)) != NULL) {
+    char title[MAX_TITLE_LENGTH];
+    char filepath[256];
+    struct stat st;
+    if (!watch_title(entry->d_name, title))
+      continue;
+    title_filepath(title, filepath, sizeof(filepath));
+    if (stat(filepath, &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+    if (count == capacity) {
+      capacity = capacity > 0 ? capacity * 2 : 256;
+      WatchFile *grown = realloc(files, (size_t)capacity * sizeof(WatchFile));
+      ok = grown != NULL;
+      if (!ok)
+        break;
+      files = grown;
+    }
+    WatchFile *file = &files[count++];
+    snprintf(file->name, sizeof(file->name), "%s", entry->d_name);
+    file->size = (long)st.st_size;
+    file->mtime = st.st_mtime;
+  }
+  closedir(dir);
+  if (!ok) {
+    /* A partial listing would report files as removed; keep the old one */
+    free(files);
+    return;
+  }
+  if (count > 0)
+    qsort(files, count, sizeof(WatchFile), watch_file_compare);
+
+  /* Walk both sorted listings side by side */
+  int i = 0;
+  int j = 0;
+  while (report && (i < vw->file_count || j < count)) {
+    int order = i == vw->file_count ? 1
+                : j == count        ? -1
+                                    : strcmp(vw->files[i].name, files[j].name);
+    if (order < 0) {
+      watch_file_changed(vw->files[i++].name);
+    } else if (order > 0) {
+      watch_file_changed(files[j++].name);
+    } else {
+      if (vw->files[i].size != files[j].size ||
+          vw->files[i].mtime != files[j].mtime)
+        watch_file_changed(files[j].name);
+      i++;
+      j++;
+    }
+  }
+  free(vw->files);
+  vw->files = files;
+  vw->file_count = count;
+}
+
+/**
+ * @brief Watcher thread body: collect changes until the wake pipe closes
+ * @param arg Unused
+ * @return NULL
+ */
+static void *watch_main(void *arg) {
+  (void)arg;
+  VaultWatcher *vw = &vault_watcher;
+  bool polling = vw->inotify_fd < 0;
+  if (polling)
+    watch_list_folder(vw, false);
+
+  struct pollfd fds[2] = {{vw->wake[0], POLLIN, 0},
+                          {vw->inotify_fd, POLLIN, 0}};
+  for (;;) {
+    int ready = poll(fds, polling ? 1 : 2,
+                     polling ? (int)(WATCH_POLL_INTERVAL * 1000) : -1);
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready < 0 || fds[0].revents != 0)
+      break;
+#if HAVE_INOTIFY
+    if (!polling && fds[1].revents != 0)
+      watch_read_events(vw);
+#endif
+    if (polling && ready == 0)
+      watch_list_folder(vw, true);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Start watching the vault folder
+ *
+ * Falls back to polling when inotify is missing or out of watches. If no
+ * thread can be started, changes are only seen on the next start.
+ */
+static void watch_start(void) {
+  VaultWatcher *vw = &vault_watcher;
+  if (pipe(vw->wake) != 0)
+    return;
+#if HAVE_INOTIFY
+  vw->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  uint32_t mask = IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                  IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+  if (vw->inotify_fd >= 0 &&
+      inotify_add_watch(vw->inotify_fd, VAULT_FOLDER, mask) < 0) {
+    close(vw->inotify_fd);
+    vw->inotify_fd = -1;
+  }
+#endif
+  vw->running = pthread_create(&vw->thread, NULL, watch_main, NULL) == 0;
+  if (!vw->running) {
+    close(vw->wake[0]);
+    close(vw->wake[1]);
+    if (vw->inotify_fd >= 0)
+      close(vw->inotify_fd);
+    vw->inotify_fd = -1;
+  }
+}
+
+/**
+ * @brief Stop the watcher thread, dropping changes not taken in yet
+ */
+static void watch_stop(void) {
+  VaultWatcher *vw = &vault_watcher;
+  if (!vw->running)
+    return;
+  close(vw->wake[1]);
+  pthread_join(vw->thread, NULL);
+  vw->running = false;
+  close(vw->wake[0]);
+  if (vw->inotify_fd >= 0)
+    close(vw->inotify_fd);
+  vw->inotify_fd = -1;
+
+  free(vw->files);
+  free(vw->events);
+  vw->files = NULL;
+  vw->events = NULL;
+  vw->file_count = vw->event_count = vw->event_capacity = 0;
+  vw->rescan = false;
+}
+
+/**
+ * @brief Bring one note in line with its file
+ * @param title Title of the note
+ * @param index The note's place in the table, or -1 if it has none yet
+ * @param gone Set at index when the note's file was removed
+ * @return True if a note or the indexes changed
+ */
+static bool watch_update(const char *title, int index, bool *gone) {
+  char filepath[256];
+  struct stat st;
+  title_filepath(title, filepath, sizeof(filepath));
+  bool exists = stat(filepath, &st) == 0 && S_ISREG(st.st_mode);
+  if (index < 0) {
+    /* A new file loads like the ones found at startup */
+    if (!exists || !load_notes_add(title, strlen(title)))
+      return false;
+    background_busy |= BACKGROUND_LOAD;
+    if (notebook.count == 1)
+      select_note(0);
+    return true;
+  }
+
+  Note *note = &notebook.notes[index];
+  if (note->modified)
+    return false;
+  if (!exists) {
+    gone[index] = true;
+    return true;
+  }
+  if (note->size == (long)st.st_size && note->mtime == st.st_mtime)
+    return false;
+  if (note->content.data != NULL) {
+    reload_note(note);
+    return true;
+  }
+
+  /* Not resident: a loader thread reads and indexes the new text */
+  note->indexed = false;
+  note->size = (long)st.st_size;
+  note->mtime = st.st_mtime;
+  vault_loader_submit(LOAD_READ, note->id, filepath);
+  background_busy |= BACKGROUND_LOAD;
+  return true;
+}
+
+/**
+ * @brief Find a note by title
+ * @param order Note places sorted by title
+ * @param count Entries in order
+ * @param title The title
+ * @return The note's place, or -1 if there is no such note
+ */
+static int watch_find(const int *order, int count, const char *title) {
+  int lo = 0;
+  int hi = count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    int cmp = strcmp(notebook.notes[order[mid]].title, title);
+    if (cmp == 0)
+      return order[mid];
+    if (cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return -1;
+}
+
+/**
+ * @brief Take in the files that changed
+ * @param events Files whose burst of events ended
+ * @param count Entries in events
+ * @param rescan Check every note and every file instead
+ */
+static void watch_apply(const WatchEvent *events, int count, bool rescan) {
+  int notes = notebook.count;
+  int *order = malloc((size_t)(notes + 1) * sizeof(int));
+  bool *gone = calloc((size_t)notes + 1, sizeof(bool));
+  if (order == NULL || gone == NULL) {
+    free(order);
+    free(gone);
+    return;
+  }
+  for (int i = 0; i < notes; i++)
+    order[i] = i;
+  if (notes > 0)
+    qsort(order, notes, sizeof(int), note_title_compare);
+
+  bool changed = false;
+  char title[MAX_TITLE_LENGTH];
+  for (int k = 0; k < count; k++) {
+    if (watch_title(events[k].name, title))
+      changed |= watch_update(title, watch_find(order, notes, title), gone);
+  }
+  if (rescan) {
+    for (int i = 0; i < notes; i++)
+      changed |= watch_update(notebook.notes[i].title, i, gone);
+    DIR *dir = opendir(VAULT_FOLDER);
+    struct dirent *entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+      if (entry->d_type == DT_REG && watch_title(entry->d_name, title) &&
+          watch_find(order, notes, title) < 0)
+        changed |= watch_update(title, -1, gone);
+    }
+    if (dir != NULL)
+      closedir(dir);
+  }
+
+  /* From the back, so the places still to remove stay valid */
+  for (int i = notes - 1; i >= 0; i--) {
+    if (gone[i])
+      remove_note(i);
+  }
+  free(order);
+  free(gone);
+  if (changed)
+    search_invalidate();
+}
+
+/**
+ * @brief Take in the files that have been quiet long enough
+ *
+ * Called every frame. Changes wait until the vault is loaded, since the
+ * loader may still pick them up itself.
+ */
+static void watch_poll(void) {
+  VaultWatcher *vw = &vault_watcher;
+  if (!vw->running || (background_busy & BACKGROUND_LOAD))
+    return;
+
+  double now = GetTime();
+  pthread_mutex_lock(&vw->lock);
+  bool rescan = false;
+  if (vw->rescan) {
+    if (vw->rescan_time < 0)
+      vw->rescan_time = now;
+    rescan = now - vw->rescan_time >= WATCH_DEBOUNCE;
+    vw->rescan = !rescan;
+  }
+
+  /* Quiet files move out, the others stay in order */
+  WatchEvent *quiet = NULL;
+  int quiet_count = 0;
+  if (vw->event_count > 0)
+    quiet = malloc((size_t)vw->event_count * sizeof(WatchEvent));
+  int kept = 0;
+  for (int i = 0; i < vw->event_count; i++) {
+    WatchEvent *event = &vw->events[i];
+    if (event->time < 0)
+      event->time = now;
+    if (quiet != NULL && now - event->time >= WATCH_DEBOUNCE)
+      quiet[quiet_count++] = *event;
+    else
+      vw->events[kept++] = *event;
+  }
+  vw->event_count = kept;
+  if (kept > 0 || vw->rescan)
+    background_busy |= BACKGROUND_WATCH;
+  else
+    background_busy &= ~BACKGROUND_WATCH;
+  pthread_mutex_unlock(&vw->lock);
+
+  if (quiet_count > 0 || rescan)
+    watch_apply(quiet, quiet_count, rescan);
+  free(quiet);
+}
+
+/* ============================================================================
+ * Search
+ * ============================================================================
+ * Runs the search box's query against both indexes and keeps the sidebar's
+ * result list. Word terms and phrases are answered by the search index and
+ * fragments by the trigram index. Candidates for fragments longer than a
+ * trigram are then checked against the note's text. That is the resident
+ * body if the note is loaded, otherwise the file.
+ *
+ * The indexes only hold saved text. Notes with unsaved edits, and notes
+ * that could not be indexed, are scanned in full with the substring scanner.
+ *
+ * Matches are ranked with BM25 (Robertson et al.) from the term frequencies
+ * and note lengths the search index keeps. Only the best SEARCH_MAX_RANKED
+ * are picked, through a bounded heap, and listed best first.
+ *
+ * Queries run on a worker thread so that a large vault never stalls
+ * drawing. Each submission bumps search_generation. A running query checks
+ * it between notes and gives up once it no longer matches. When the query
+ * only grew (see search_query_refines()), the new run filters the previous
+ * results instead of starting over.
+ *
+ * A query starting with '/' is a regular expression instead (see Regex).
+ * Its required literals pick the candidates from the trigram index. Each
+ * candidate's title and text, as typed and not folded, then go through the
+ * DFA. Regex matches are listed in note id order.
+ */
+
+/**
+ * @brief Check whether a query word starts at an offset, on word boundaries
+ * @param text The text, case-folded
+ * @param len Length of the text
+ * @param pos Offset to check
+ * @param term The word (folded)
+ * @param prefix Whether the word may continue past the term
+ */
+static bool text_word_at(const char *text, size_t len, size_t pos,
+                         const QueryTerm *term, bool prefix) {
+  if (pos + term->len > len ||
+      memcmp(text + pos, term->text, term->len) != 0)
+    return false;
+  if (pos > 0 && search_is_term_byte((unsigned char)text[pos - 1]))
+    return false;
+  size_t end = pos + term->len;
+  return prefix || end == len ||
+         !search_is_term_byte((unsigned char)text[end]);
+}
+
+/**
+ * @brief Find the next occurrence of a query word as a whole word
+ * @param text The text, case-folded
+ * @param len Length of the text
+ * @param from Offset to start at
+ * @param term The word (folded)
+ * @param prefix Whether the word may continue past the term
+ * @return Offset of the word, or SUBSTRING_NONE
+ */
+static size_t text_find_word(const char *text, size_t len, size_t from,
+                             const QueryTerm *term, bool prefix) {
+  while (from < len) {
+    size_t at =
+        substring_find(text + from, len - from, term->text, term->len, false);
+    if (at == SUBSTRING_NONE)
+      return SUBSTRING_NONE;
+    at += from;
+    if (text_word_at(text, len, at, term, prefix))
+      return at;
+    from = at + 1;
+  }
+  return SUBSTRING_NONE;
+}
+
+/**
+ * @brief Check one query term, or one quoted phrase, against a text
+ * @param text The text, case-folded
+ * @param len Length of the text
+ * @param terms The term, or the phrase's terms in order
+ * @param count Number of terms (more than one for a phrase)
+ */
+static bool text_matches_terms(const char *text, size_t len,
+                               const QueryTerm *terms, int count) {
+  if (terms[0].substring)
+    return substring_find(text, len, terms[0].text, terms[0].len, false) !=
+           SUBSTRING_NONE;
+
+  for (size_t from = 0;;) {
+    size_t at = text_find_word(text, len, from, &terms[0], terms[0].prefix);
+    if (at == SUBSTRING_NONE)
+      return false;
+
+    /* The rest of a phrase must follow, separated only by non-word bytes */
+    size_t pos = at + terms[0].len;
+    bool all = true;
+    for (int j = 1; j < count && all; j++) {
+      while (pos < len && !search_is_term_byte((unsigned char)text[pos]))
+        pos++;
+      all = text_word_at(text, len, pos, &terms[j], false);
+      pos += terms[j].len;
+    }
+    if (all)
+      return true;
+    from = at + 1;
+  }
+}
+
+/**
+ * @brief Check a note's title and text against a query
+ * @param title The note's title (also names its file)
+ * @param text The note's case-folded text, or NULL to read it from the file
+ *             if needed
+ * @param len Length of text
+ * @param terms The parsed query
+ * @param count Number of terms
+ * @param all Check every term; otherwise only the fragments the trigram
+ *            index cannot settle on its own
+ * @return True if every checked term occurs in the title or the text
+ */
+static bool doc_matches(const char *title, const char *text, size_t len,
+                        const QueryTerm *terms, int count, bool all) {
+  char folded_title[2 * MAX_TITLE_LENGTH];
+  size_t title_len = case_fold(title, strlen(title), folded_title);
+  bool need_text = false;
+  for (int i = 0, run; i < count; i = run) {
+    run = i + 1;
+    while (run < count && terms[i].phrase >= 0 &&
+           terms[run].phrase == terms[i].phrase)
+      run++;
+    bool checked = all || (terms[i].substring && terms[i].len > 3);
+    if (checked &&
+        !text_matches_terms(folded_title, title_len, &terms[i], run - i))
+      need_text = true;
+  }
+  if (!need_text)
+    return true;
+
+  /* A freshly loaded buffer has all of its text in front of the gap */
+  char *folded = NULL;
+  if (text == NULL) {
+    char filepath[256];
+    title_filepath(title, filepath, sizeof(filepath));
+    FILE *file = fopen(filepath, "r");
+    if (file == NULL)
+      return false;
+    TextBuffer loaded;
+    bool ok = text_buffer_load_file(&loaded, file);
+    fclose(file);
+    if (!ok)
+      return false;
+    folded = malloc(2 * loaded.gap_start + 1);
+    if (folded != NULL)
+      len = case_fold(loaded.data, loaded.gap_start, folded);
+    text_buffer_free(&loaded);
+    if (folded == NULL)
+      return false;
+    text = folded;
+  }
+
+  bool match = true;
+  for (int i = 0, run; i < count && match; i = run) {
+    run = i + 1;
+    while (run < count && terms[i].phrase >= 0 &&
+           terms[run].phrase == terms[i].phrase)
+      run++;
+    if (!all && !(terms[i].substring && terms[i].len > 3))
+      continue;
+    match = text_matches_terms(folded_title, title_len, &terms[i], run - i) ||
+            text_matches_terms(text, len, &terms[i], run - i);
+  }
+  free(folded);
+  return match;
+}
+
+/**
+ * @brief Check whether the indexes hold a note's current text
+ */
+static bool note_index_current(const Note *note) {
+  return note->indexed && !note->modified;
+}
+
+/**
+ * @brief Order ints ascending
+ */
+static int compare_ints(const void *a, const void *b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief Bounded heap of the best entries offered to it
+ *
+ * The root is the worst entry kept, so a new entry either loses against it
+ * right away or replaces it. Ranking a whole vault this way allocates nothing
+ * and never sorts more than the entries kept.
+ */
+typedef struct {
+  void *items;                                 /* capacity entries */
+  size_t size;                                 /* Bytes per entry */
+  int capacity;                                /* Entries kept at most */
+  int count;                                   /* Entries in use */
+  bool (*better)(const void *a, const void *b); /* a ranks above b */
+} TopHeap;
+
+/**
+ * @brief Address of a heap entry
+ */
+static char *top_heap_at(const TopHeap *heap, int i) {
+  return (char *)heap->items + (size_t)i * heap->size;
+}
+
+/**
+ * @brief Swap two heap entries byte by byte
+ */
+static void top_heap_swap(const TopHeap *heap, int i, int j) {
+  char *a = top_heap_at(heap, i), *b = top_heap_at(heap, j);
+  for (size_t k = 0; k < heap->size; k++) {
+    char c = a[k];
+    a[k] = b[k];
+    b[k] = c;
+  }
+}
+
+/**
+ * @brief Move an entry down until no child ranks below it
+ * @param heap The heap
+ * @param i Index of the entry
+ * @param count Entries that belong to the heap
+ */
+static void top_heap_sift_down(const TopHeap *heap, int i, int count) {
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= count)
+      return;
+    if (child + 1 < count &&
+        heap->better(top_heap_at(heap, child), top_heap_at(heap, child + 1)))
+      child++;
+    if (heap->better(top_heap_at(heap, child), top_heap_at(heap, i)))
+      return;
+    top_heap_swap(heap, i, child);
+    i = child;
+  }
+}
+
+/**
+ * @brief Offer an entry to a bounded heap
+ * @param heap The heap
+ * @param item The entry (heap->size bytes, copied if kept)
+ */
+static void top_heap_offer(TopHeap *heap, const void *item) {
+  if (heap->count < heap->capacity) {
+    int i = heap->count++;
+    memcpy(top_heap_at(heap, i), item, heap->size);
+    while (i > 0 && heap->better(top_heap_at(heap, (i - 1) / 2),
+                                 top_heap_at(heap, i))) {
+      top_heap_swap(heap, i, (i - 1) / 2);
+      i = (i - 1) / 2;
+    }
+    return;
+  }
+  if (heap->count == 0 || !heap->better(item, top_heap_at(heap, 0)))
+    return;
+  memcpy(top_heap_at(heap, 0), item, heap->size);
+  top_heap_sift_down(heap, 0, heap->count);
+}
+
+/**
+ * @brief Put a heap's entries in order, best first
+ *
+ * The worst entry is moved behind the shrinking heap until one is left, so
+ * the array ends up sorted without a second comparator. The heap is no
+ * longer a heap afterwards.
+ */
+static void top_heap_sort(TopHeap *heap) {
+  for (int n = heap->count; n > 1; n--) {
+    top_heap_swap(heap, 0, n - 1);
+    top_heap_sift_down(heap, 0, n - 1);
+  }
+}
+
+#define BM25_K1 1.2f          /* BM25 term frequency saturation */
+#define BM25_B 0.75f          /* BM25 document length normalization */
+#define SEARCH_MAX_RANKED 200 /* Best results listed in the sidebar */
+
+/**
+ * @brief How a query word is compared with the words of a note
+ */
+typedef enum {
+  SEARCH_WORD_EXACT,  /* The whole word */
+  SEARCH_WORD_PREFIX, /* The start of a word (the one being typed) */
+  SEARCH_WORD_INSIDE, /* Anywhere in a word (part of a fragment) */
+} SearchWordKind;
+
+/**
+ * @brief A query word as used for ranking
+ */
+typedef struct {
+  char text[SEARCH_MAX_TERM]; /* Folded word */
+  size_t len;                 /* Length of text */
+  SearchWordKind kind;        /* How it is compared */
+  float idf;                  /* BM25 weight of the word across the vault */
+} SearchWord;
+
+/**
+ * @brief The words of a query and the vault statistics they are scored with
+ */
+typedef struct {
+  SearchWord words[SEARCH_MAX_QUERY_TERMS]; /* Words to score */
+  int word_count;                           /* Entries in words */
+  float avg_length;                         /* Mean note length in words */
+} SearchRanker;
+
+/**
+ * @brief Check whether a word of a note counts for a query word
+ */
+static bool search_word_matches(const SearchWord *word, const char *text,
+                                size_t len) {
+  switch (word->kind) {
+  case SEARCH_WORD_EXACT:
+    return len == word->len && memcmp(text, word->text, len) == 0;
+  case SEARCH_WORD_PREFIX:
+    return len >= word->len && memcmp(text, word->text, word->len) == 0;
+  default:
+    return substring_find(text, len, word->text, word->len, false) !=
+           SUBSTRING_NONE;
+  }
+}
+
+/**
+ * @brief Weight of one query word in one note (the BM25 formula)
+ * @param idf The word's inverse document frequency
+ * @param tf Occurrences of the word in the note
+ * @param length Words in the note
+ * @param avg_length Mean words per note
+ */
+static float bm25_weight(float idf, int tf, int length, float avg_length) {
+  float norm = BM25_K1 * (1 - BM25_B + BM25_B * length / avg_length);
+  return idf * tf * (BM25_K1 + 1) / (tf + norm);
+}
+
+/**
+ * @brief Add up one term's frequencies in the notes being scored
+ * @param seg The segment holding the term
+ * @param id Term id within the segment
+ * @param docs Ids of the notes being scored, sorted
+ * @param doc_count Entries in docs
+ * @param tf Per-note frequencies to add to
+ * @return Number of notes containing the term
+ */
+static int search_rank_term(SearchSegment seg, int id, const int *docs,
+                            int doc_count, int *tf) {
+  int n, df = 0;
+  const Posting *list = segment_postings(seg, id, &n);
+  for (int k = 0; k < n; k++) {
+    if (!segment_has_doc(seg, list[k].doc))
+      continue;
+    df++;
+    const int *hit = bsearch(&list[k].doc, docs, (size_t)doc_count,
+                             sizeof(int), compare_ints);
+    if (hit != NULL)
+      tf[hit - docs] += list[k].tf;
+  }
+  return df;
+}
+
+/**
+ * @brief Score indexed notes against a query with BM25
+ *
+ * A prefix or fragment word counts every term it matches, as if they were
+ * one word: their frequencies in a note add up, and so do their document
+ * frequencies (capped at the number of notes) for its idf. Word weights
+ * are stored in the ranker for scoring notes that are not indexed.
+ *
+ * @param terms The parsed query
+ * @param count Number of terms
+ * @param ranker Receives the query's words and statistics
+ * @param docs Ids of the notes to score, sorted
+ * @param doc_count Entries in docs
+ * @param scores Receives the score of each note in docs
+ * @return False if memory ran out
+ */
+static bool search_index_rank(const QueryTerm *terms, int count,
+                              SearchRanker *ranker, const int *docs,
+                              int doc_count, float *scores) {
+  /* Fragments are split into the words they touch */
+  ranker->word_count = 0;
+  for (int i = 0; i < count && ranker->word_count < SEARCH_MAX_QUERY_TERMS;
+       i++) {
+    SearchWord *word = &ranker->words[ranker->word_count];
+    if (!terms[i].substring) {
+      if (terms[i].len > SEARCH_MAX_TERM)
+        continue;
+      memcpy(word->text, terms[i].text, terms[i].len);
+      word->len = terms[i].len;
+      word->kind = terms[i].prefix ? SEARCH_WORD_PREFIX : SEARCH_WORD_EXACT;
+      ranker->word_count++;
+      continue;
+    }
+    size_t at = 0;
+    while (ranker->word_count < SEARCH_MAX_QUERY_TERMS &&
+           search_next_term(terms[i].text, terms[i].len, &at, word->text,
+                            &word->len)) {
+      word->kind = SEARCH_WORD_INSIDE;
+      word = &ranker->words[++ranker->word_count];
+    }
+  }
+  int notes = search_index.doc_count + index_file.live_count;
+  long total_length = search_index.total_length + index_file.live_length;
+  if (notes == 0)
+    notes = 1;
+  ranker->avg_length = total_length > 0 ? (float)total_length / notes : 1.0f;
+
+  int *tf = malloc((size_t)(doc_count + 1) * sizeof(int));
+  if (tf == NULL)
+    return false;
+  for (int j = 0; j < doc_count; j++)
+    scores[j] = 0;
+
+  for (int w = 0; w < ranker->word_count; w++) {
+    SearchWord *word = &ranker->words[w];
+    memset(tf, 0, (size_t)doc_count * sizeof(int));
+    long df = 0;
+    for (int seg = 0; seg < SEGMENT_COUNT; seg++) {
+      if (word->kind == SEARCH_WORD_EXACT) {
+        int id = segment_term_find(seg, word->text, word->len);
+        if (id >= 0)
+          df += search_rank_term(seg, id, docs, doc_count, tf);
+        continue;
+      }
+      for (int id = 0; id < segment_term_count(seg); id++) {
+        const char *text = segment_term_text(seg, id);
+        if (search_word_matches(word, text, strlen(text)))
+          df += search_rank_term(seg, id, docs, doc_count, tf);
+      }
+    }
+
+    if (df > notes)
+      df = notes;
+    word->idf = logf(1.0f + (notes - df + 0.5f) / (df + 0.5f));
+    for (int j = 0; j < doc_count; j++) {
+      if (tf[j] > 0)
+        scores[j] += bm25_weight(word->idf, tf[j], search_doc_length(docs[j]),
+                                 ranker->avg_length);
+    }
+  }
+  free(tf);
+  return true;
+}
+
+/**
+ * @brief Score a note the indexes do not hold, by reading its words
+ * @param ranker The query, as prepared by search_index_rank()
+ * @param title The note's title
+ * @param text The note's case-folded text
+ * @param len Length of text
+ * @return The note's BM25 score
+ */
+static float search_text_rank(const SearchRanker *ranker, const char *title,
+                              const char *text, size_t len) {
+  char folded_title[2 * MAX_TITLE_LENGTH];
+  size_t title_len = case_fold(title, strlen(title), folded_title);
+  int tf[SEARCH_MAX_QUERY_TERMS] = {0};
+  int length = 0;
+
+  const char *parts[2] = {folded_title, text};
+  size_t part_len[2] = {title_len, len};
+  for (int p = 0; p < 2; p++) {
+    char term[SEARCH_MAX_TERM];
+    size_t term_len, at = 0;
+    while (search_next_term(parts[p], part_len[p], &at, term, &term_len)) {
+      length++;
+      for (int w = 0; w < ranker->word_count; w++) {
+        if (search_word_matches(&ranker->words[w], term, term_len))
+          tf[w]++;
+      }
+    }
+  }
+
+  float score = 0;
+  for (int w = 0; w < ranker->word_count; w++) {
+    if (tf[w] > 0)
+      score += bm25_weight(ranker->words[w].idf, tf[w], length,
+                           ranker->avg_length);
+  }
+  return score;
+}
+
+/**
+ * @brief A note the indexes are behind on, as handed to the search worker
+ */
+typedef struct {
+  int id;                       /* Note id */
+  char title[MAX_TITLE_LENGTH]; /* Title (also names the file) */
+  char *text;                   /* Unsaved text, folded unless the query is a
+                                   regex (NULL: not read yet, so only the
+                                   title is matched) */
+  size_t len;                   /* Length of text */
+} SearchScanNote;
+
+/**
+ * @brief One run of a query
+ *
+ * Everything the worker needs is copied in when the job is submitted, so
+ * the worker never looks at the note table.
+ */
+typedef struct {
+  unsigned generation;          /* Submission this job answers */
+  unsigned data_generation;     /* search_data_generation at submission */
+  char query[SEARCH_MAX_QUERY]; /* The query as typed */
+  int *within;                  /* Only these ids can match (NULL: any) */
+  int within_count;             /* Entries in within */
+  SearchScanNote *scan;         /* Notes to scan instead, sorted by id */
+  int scan_count;               /* Entries in scan */
+  int *results;                 /* Matching note ids, sorted */
+  int result_count;             /* Entries in results */
+  int *ranked;                  /* The best of them, best first */
+  int ranked_count;             /* Entries in ranked */
+  bool invalid;                 /* The query is a regex that does not compile */
+} SearchJob;
+
+/**
+ * @brief The background thread that runs queries
+ */
+typedef struct {
+  pthread_t thread;     /* The worker */
+  pthread_mutex_t lock; /* Guards the fields below */
+  pthread_cond_t wake;  /* Signalled when a job arrives or on shutdown */
+  bool started;         /* Thread is running (queries run inline if not) */
+  bool quit;            /* Worker should exit */
+  bool running;         /* Worker is busy with a job */
+  SearchJob *pending;   /* Latest submitted job, not started yet */
+  SearchJob *done;      /* Finished job waiting for the main thread */
+} SearchWorker;
+
+static SearchWorker search_worker = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                                     .wake = PTHREAD_COND_INITIALIZER};
+
+/* The last completed query, kept so that a longer query can filter it */
+static char search_cached_query[SEARCH_MAX_QUERY];
+static int *search_cached_ids;      /* Its matching note ids, sorted */
+static int search_cached_count;     /* Entries in search_cached_ids */
+static unsigned search_cached_data; /* search_data_generation it ran at */
+
+/**
+ * @brief Release a job and everything it owns
+ */
+static void search_job_free(SearchJob *job) {
+  if (job == NULL)
+    return;
+  for (int i = 0; i < job->scan_count; i++)
+    free(job->scan[i].text);
+  free(job->scan);
+  free(job->within);
+  free(job->results);
+  free(job->ranked);
+  free(job);
+}
+
+/**
+ * @brief Check whether a newer submission has made a job pointless
+ */
+static bool search_job_cancelled(const SearchJob *job) {
+  return __atomic_load_n(&search_generation, __ATOMIC_ACQUIRE) !=
+         job->generation;
+}
+
+/**
+ * @brief Order scan notes by id
+ */
+static int search_scan_compare(const void *a, const void *b) {
+  const SearchScanNote *x = a, *y = b;
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+/**
+ * @brief Find a note in a job's scan list
+ * @return The scan entry, or NULL if the note's index entry is current
+ */
+static const SearchScanNote *search_scan_find(const SearchJob *job, int id) {
+  if (job->scan_count == 0)
+    return NULL;
+  SearchScanNote key = {.id = id};
+  return bsearch(&key, job->scan, (size_t)job->scan_count,
+                 sizeof(SearchScanNote), search_scan_compare);
+}
+
+/**
+ * @brief A match and its score
+ */
+typedef struct {
+  int doc;     /* Note id */
+  float score; /* BM25 score */
+} SearchHit;
+
+/**
+ * @brief Check whether one match ranks above another
+ */
+static bool search_hit_better(const void *a, const void *b) {
+  const SearchHit *x = a, *y = b;
+  if (x->score != y->score)
+    return x->score > y->score;
+  return x->doc < y->doc;
+}
+
+/**
+ * @brief Score a job's matches and keep the best, best first
+ * @param job The job, with results still in the order they were found:
+ *            indexed notes by id, then the scanned ones
+ * @param terms The parsed query
+ * @param count Number of terms
+ * @param indexed Results that came from the indexes
+ * @return False if memory ran out
+ */
+static bool search_job_rank(SearchJob *job, const QueryTerm *terms, int count,
+                            int indexed) {
+  float *scores = malloc((size_t)(job->result_count + 1) * sizeof(float));
+  if (scores == NULL)
+    return false;
+  SearchRanker ranker;
+  if (!search_index_rank(terms, count, &ranker, job->results, indexed,
+                         scores)) {
+    free(scores);
+    return false;
+  }
+  for (int k = indexed; k < job->result_count; k++) {
+    const SearchScanNote *note = search_scan_find(job, job->results[k]);
+    scores[k] = note != NULL && note->text != NULL
+                    ? search_text_rank(&ranker, note->title, note->text,
+                                       note->len)
+                    : 0;
+  }
+
+  SearchHit hits[SEARCH_MAX_RANKED];
+  TopHeap heap = {hits, sizeof(SearchHit), SEARCH_MAX_RANKED, 0,
+                  search_hit_better};
+  for (int k = 0; k < job->result_count; k++)
+    top_heap_offer(&heap, &(SearchHit){job->results[k], scores[k]});
+  free(scores);
+  top_heap_sort(&heap);
+  int kept = heap.count;
+
+  job->ranked = malloc((size_t)(kept + 1) * sizeof(int));
+  if (job->ranked == NULL)
+    return false;
+  for (int k = 0; k < kept; k++)
+    job->ranked[k] = hits[k].doc;
+  job->ranked_count = kept;
+  return true;
+}
+
+/**
+ * @brief Find the indexed notes matching a query in one segment
+ *
+ * The word matches are intersected with the candidates of every fragment.
+ *
+ * @param seg The segment
+ * @param terms The parsed query
+ * @param count Number of terms
+ * @param out Receives the note ids in increasing order; the caller frees it
+ * @return Number of matches
+ */
+static int search_segment_query(SearchSegment seg, QueryTerm *terms,
+                                int count, int **out) {
+  int *docs;
+  int found = search_index_query(seg, terms, count, &docs);
+  for (int i = 0; i < count && found != 0; i++) {
+    if (!terms[i].substring)
+      continue;
+    int *candidates;
+    int n = trigram_index_candidates(seg, terms[i].text, terms[i].len,
+                                     &candidates);
+    if (found < 0) {
+      docs = candidates;
+      found = n;
+      continue;
+    }
+    int kept = 0, k = 0;
+    for (int j = 0; j < found; j++) {
+      while (k < n && candidates[k] < docs[j])
+        k++;
+      if (k < n && candidates[k] == docs[j])
+        docs[kept++] = docs[j];
+    }
+    found = kept;
+    free(candidates);
+  }
+  if (found < 0)
+    found = 0;
+  *out = docs;
+  return found;
+}
+
+/**
+ * @brief Find the indexed notes matching a query in both segments
+ * @param terms The parsed query
+ * @param count Number of terms
+ * @param out Receives the note ids in increasing order; the caller frees it
+ * @return Number of matches, or -1 if memory ran out
+ */
+static int search_segments_query(QueryTerm *terms, int count, int **out) {
+  int *file_docs, *memory_docs;
+  int a = search_segment_query(SEGMENT_FILE, terms, count, &file_docs);
+  int b = search_segment_query(SEGMENT_MEMORY, terms, count, &memory_docs);
+
+  /* A note is current in one segment only, so the lists are disjoint */
+  int *docs = malloc((size_t)(a + b + 1) * sizeof(int));
+  int found = 0;
+  if (docs != NULL) {
+    int i = 0, j = 0;
+    while (i < a || j < b) {
+      if (j >= b || (i < a && file_docs[i] < memory_docs[j]))
+        docs[found++] = file_docs[i++];
+      else
+        docs[found++] = memory_docs[j++];
+    }
+  }
+  free(file_docs);
+  free(memory_docs);
+  *out = docs;
+  return docs != NULL ? found : -1;
+}
+
+/**
+ * @brief List every indexed note
+ * @param out Receives the note ids in increasing order; the caller frees it
+ * @return Number of notes, or -1 if memory ran out
+ */
+static int search_indexed_docs(int **out) {
+  int limit = segment_doc_limit(SEGMENT_FILE);
+  if (segment_doc_limit(SEGMENT_MEMORY) > limit)
+    limit = segment_doc_limit(SEGMENT_MEMORY);
+  *out = malloc((size_t)(limit + 1) * sizeof(int));
+  if (*out == NULL)
+    return -1;
+  int found = 0;
+  for (int doc = 0; doc < limit; doc++) {
+    if (search_doc_title(doc) != NULL)
+      (*out)[found++] = doc;
+  }
+  return found;
+}
+
+/**
+ * @brief Find the indexed notes that may match a regex
+ *
+ * These are the notes containing all of its required literals, or every
+ * indexed note if it has none.
+ *
+ * @param re The pattern
+ * @param out Receives the note ids in increasing order; the caller frees it
+ * @return Number of notes, or -1 if memory ran out
+ */
+static int search_regex_candidates(const Regex *re, int **out) {
+  QueryTerm terms[REGEX_MAX_LITERALS];
+  int count = 0;
+  for (int i = 0; i < re->literal_count; i++) {
+    QueryTerm *t = &terms[count++];
+    t->len = case_fold(re->literals[i], strlen(re->literals[i]), t->text);
+    t->phrase = -1;
+    t->prefix = false;
+    t->substring = true;
+    t->id = -1;
+  }
+  return count > 0 ? search_segments_query(terms, count, out)
+                   : search_indexed_docs(out);
+}
+
+/**
+ * @brief Check a note's title and text against a regex
+ * @param re The pattern
+ * @param title The note's title (also names its file)
+ * @param text The note's text, or NULL to read it from the file
+ * @param len Length of text
+ */
+static bool search_regex_matches(Regex *re, const char *title,
+                                 const char *text, size_t len) {
+  if (regex_search(re, title, strlen(title)))
+    return true;
+  if (text != NULL)
+    return regex_search(re, text, len);
+
+  char filepath[256];
+  title_filepath(title, filepath, sizeof(filepath));
+  FILE *file = fopen(filepath, "r");
+  if (file == NULL)
+    return false;
+  TextBuffer loaded;
+  bool ok = text_buffer_load_file(&loaded, file);
+  fclose(file);
+  if (!ok)
+    return false;
+  bool match = regex_search(re, loaded.data, loaded.gap_start);
+  text_buffer_free(&loaded);
+  return match;
+}
+
+/**
+ * @brief Run a regex query (the query without its leading '/')
+ * @param job The job; results are stored in it
+ * @return False if the job was cancelled or memory ran out
+ */
+static bool search_job_run_regex(SearchJob *job) {
+  const char *pattern = job->query + 1;
+  const char *error;
+  Regex *re = regex_compile(pattern, strlen(pattern), &error);
+  if (re == NULL) {
+    job->invalid = true;
+    return true;
+  }
+
+  int *docs;
+  int found = search_regex_candidates(re, &docs);
+  job->results = malloc((size_t)(found + job->scan_count + 1) * sizeof(int));
+  if (found < 0 || job->results == NULL) {
+    free(docs);
+    regex_free(re);
+    return false;
+  }
+
+  bool complete = true;
+  for (int k = 0; k < found && complete; k++) {
+    complete = !search_job_cancelled(job);
+    if (search_scan_find(job, docs[k]) != NULL)
+      continue;
+    const char *title = search_doc_title(docs[k]);
+    if (complete && title != NULL &&
+        search_regex_matches(re, title, NULL, 0))
+      job->results[job->result_count++] = docs[k];
+  }
+  for (int i = 0; i < job->scan_count && complete; i++) {
+    complete = !search_job_cancelled(job);
+    if (!complete)
+      break;
+    const SearchScanNote *note = &job->scan[i];
+    bool match =
+        note->text != NULL
+            ? search_regex_matches(re, note->title, note->text, note->len)
+            : regex_search(re, note->title, strlen(note->title));
+    if (match)
+      job->results[job->result_count++] = note->id;
+  }
+  free(docs);
+  regex_free(re);
+  if (!complete)
+    return false;
+
+  qsort(job->results, (size_t)job->result_count, sizeof(int), compare_ints);
+  job->ranked_count = job->result_count < SEARCH_MAX_RANKED
+                          ? job->result_count
+                          : SEARCH_MAX_RANKED;
+  job->ranked = malloc((size_t)(job->ranked_count + 1) * sizeof(int));
+  if (job->ranked == NULL)
+    return false;
+  memcpy(job->ranked, job->results, (size_t)job->ranked_count * sizeof(int));
+  return true;
+}
+
+/**
+ * @brief Check whether a query is a regular expression
+ */
+static bool search_is_regex(const char *query) { return query[0] == '/'; }
+
+/**
+ * @brief Run a query (on the worker, with search_lock held for reading)
+ * @param job The job; results are stored in it
+ * @return False if the job was cancelled or memory ran out
+ */
+static bool search_job_run(SearchJob *job) {
+  if (search_is_regex(job->query))
+    return search_job_run_regex(job);
+
+  QueryTerm terms[SEARCH_MAX_QUERY_TERMS];
+  int count = search_parse_query(job->query, terms);
+  if (search_job_cancelled(job))
+    return false;
+
+  int *docs;
+  int found = search_segments_query(terms, count, &docs);
+  if (found < 0)
+    return false;
+
+  /* A refinement only has to look at what the shorter query matched */
+  if (job->within != NULL) {
+    int kept = 0, k = 0;
+    for (int j = 0; j < found; j++) {
+      while (k < job->within_count && job->within[k] < docs[j])
+        k++;
+      if (k < job->within_count && job->within[k] == docs[j])
+        docs[kept++] = docs[j];
+    }
+    found = kept;
+  }
+
+  job->results = malloc((size_t)(found + job->scan_count + 1) * sizeof(int));
+  if (job->results == NULL) {
+    free(docs);
+    return false;
+  }
+
+  for (int k = 0; k < found; k++) {
+    if (search_job_cancelled(job)) {
+      free(docs);
+      return false;
+    }
+
+    /* Notes being scanned are skipped here: their index entry is stale */
+    if (search_scan_find(job, docs[k]) != NULL)
+      continue;
+    const char *title = search_doc_title(docs[k]);
+    if (title != NULL && doc_matches(title, NULL, 0, terms, count, false))
+      job->results[job->result_count++] = docs[k];
+  }
+  free(docs);
+  int indexed = job->result_count;
+
+  for (int i = 0; i < job->scan_count; i++) {
+    if (search_job_cancelled(job))
+      return false;
+    const SearchScanNote *note = &job->scan[i];
+    /* An empty text leaves only the title to match */
+    const char *text = note->text != NULL ? note->text : "";
+    if (doc_matches(note->title, text, note->len, terms, count, true))
+      job->results[job->result_count++] = note->id;
+  }
+  if (!search_job_rank(job, terms, count, indexed))
+    return false;
+  qsort(job->results, (size_t)job->result_count, sizeof(int), compare_ints);
+  return true;
+}
+
+/**
+ * @brief Worker thread: run the latest job, hand it back, wait for more
+ */
+static void *search_worker_main(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&search_worker.lock);
+  for (;;) {
+    while (!search_worker.quit && search_worker.pending == NULL)
+      pthread_cond_wait(&search_worker.wake, &search_worker.lock);
+    if (search_worker.quit)
+      break;
+
+    SearchJob *job = search_worker.pending;
+    search_worker.pending = NULL;
+    search_worker.running = true;
+    pthread_mutex_unlock(&search_worker.lock);
+
+    pthread_rwlock_rdlock(&search_lock);
+    bool complete = search_job_run(job);
+    pthread_rwlock_unlock(&search_lock);
+
+    pthread_mutex_lock(&search_worker.lock);
+    search_worker.running = false;
+    if (complete && !search_job_cancelled(job)) {
+      search_job_free(search_worker.done);
+      search_worker.done = job;
+    } else {
+      search_job_free(job);
+    }
+  }
+  pthread_mutex_unlock(&search_worker.lock);
+  return NULL;
+}
+
+/**
+ * @brief Start the search worker (queries run on the main thread if this
+ *        fails)
+ */
+static void search_worker_start(void) {
+  substring_init();
+  search_worker.started = pthread_create(&search_worker.thread, NULL,
+                                         search_worker_main, NULL) == 0;
+}
+
+/**
+ * @brief Stop the search worker and drop any job it still holds
+ */
+static void search_worker_stop(void) {
+  pthread_mutex_lock(&search_worker.lock);
+  search_worker.quit = true;
+  __atomic_add_fetch(&search_generation, 1, __ATOMIC_RELEASE);
+  pthread_cond_signal(&search_worker.wake);
+  pthread_mutex_unlock(&search_worker.lock);
+  if (search_worker.started)
+    pthread_join(search_worker.thread, NULL);
+  search_worker.started = false;
+
+  search_job_free(search_worker.pending);
+  search_job_free(search_worker.done);
+  search_worker.pending = search_worker.done = NULL;
+  free(search_cached_ids);
+  search_cached_ids = NULL;
+}
+
+/**
+ * @brief Check whether a query can only match a subset of an earlier one
+ *
+ * True when the new query extends the old one and the old one's last
+ * fragment either was finished (followed by a space) or was already matched
+ * as a substring. Quotes are left out, since closing one changes meaning.
+ */
+static bool search_query_refines(const char *old, const char *query) {
+  size_t n = strlen(old);
+  if (n == 0 || strncmp(query, old, n) != 0 || strchr(query, '"') != NULL ||
+      search_is_regex(query))
+    return false;
+  if (old[n - 1] == ' ' || old[n - 1] == '\t')
+    return true;
+
+  size_t start = n;
+  while (start > 0 && old[start - 1] != ' ' && old[start - 1] != '\t')
+    start--;
+  return n - start >= SEARCH_MIN_SUBSTRING;
+}
+
+/**
+ * @brief Install a finished job's results in the sidebar
+ * @param job The job (taken over)
+ */
+static void search_apply(SearchJob *job) {
+  if (job->generation != search_generation) {
+    search_job_free(job);
+    return;
+  }
+
+  /* Map note ids back to positions in the note table, keeping the order */
+  int *indices = malloc((size_t)(job->ranked_count + 1) * sizeof(int));
+  int *index_of = malloc((size_t)(notebook.nextNoteId + 1) * sizeof(int));
+  if (indices == NULL || index_of == NULL) {
+    free(indices);
+    free(index_of);
+    search_job_free(job);
+    return;
+  }
+  for (int i = 0; i < notebook.nextNoteId; i++)
+    index_of[i] = -1;
+  for (int i = 0; i < notebook.count; i++)
+    index_of[notebook.notes[i].id] = i;
+  int kept = 0;
+  for (int k = 0; k < job->ranked_count; k++) {
+    int id = job->ranked[k];
+    if (id < notebook.nextNoteId && index_of[id] >= 0)
+      indices[kept++] = index_of[id];
+  }
+  free(index_of);
+
+  free(notebook.searchResults);
+  notebook.searchResults = indices;
+  notebook.searchResultCount = kept;
+  notebook.searchMatchCount = job->result_count;
+  notebook.searchInvalid = job->invalid;
+  request_redraw();
+
+  /* Keep the ids so that typing more can filter them */
+  free(search_cached_ids);
+  search_cached_ids = job->results;
+  search_cached_count = job->result_count;
+  search_cached_data = job->data_generation;
+  memcpy(search_cached_query, job->query, sizeof(search_cached_query));
+  job->results = NULL;
+  search_job_free(job);
+}
+
+/**
+ * @brief Start running the search query again
+ *
+ * The sidebar keeps showing the previous results until the worker is done;
+ * search_poll() picks the new ones up. A query without any terms leaves the
+ * sidebar unfiltered.
+ */
+static void search_refresh(void) {
+  notebook.searchStale = false;
+  request_redraw();
+
+  /* Anything still queued or running is out of date from here on */
+  pthread_mutex_lock(&search_worker.lock);
+  unsigned generation =
+      __atomic_add_fetch(&search_generation, 1, __ATOMIC_RELEASE);
+  search_job_free(search_worker.pending);
+  search_worker.pending = NULL;
+  pthread_mutex_unlock(&search_worker.lock);
+
+  QueryTerm terms[SEARCH_MAX_QUERY_TERMS];
+  SearchJob *job = NULL;
+  bool regex = search_is_regex(notebook.searchQuery);
+  if (notebook.showSearch &&
+      (regex ? notebook.searchQuery[1] != '\0'
+             : search_parse_query(notebook.searchQuery, terms) > 0))
+    job = calloc(1, sizeof(SearchJob));
+  if (job == NULL) {
+    free(notebook.searchResults);
+    notebook.searchResults = NULL;
+    notebook.searchResultCount = 0;
+    notebook.searchInvalid = false;
+    return;
+  }
+  job->generation = generation;
+  job->data_generation = search_data_generation;
+  memcpy(job->query, notebook.searchQuery, sizeof(job->query));
+
+  if (search_cached_ids != NULL &&
+      search_cached_data == search_data_generation &&
+      search_query_refines(search_cached_query, job->query)) {
+    job->within = malloc((size_t)(search_cached_count + 1) * sizeof(int));
+    if (job->within != NULL) {
+      memcpy(job->within, search_cached_ids,
+             (size_t)search_cached_count * sizeof(int));
+      job->within_count = search_cached_count;
+    }
+  }
+
+  /* Copy out the notes whose index entries are stale. Those that are not
+   * resident are still waiting for a loader thread, and match by title */
+  for (int i = 0; i < notebook.count; i++) {
+    Note *note = &notebook.notes[i];
+    if (note_index_current(note))
+      continue;
+    if (job->within != NULL &&
+        bsearch(&note->id, job->within, (size_t)job->within_count,
+                sizeof(int), compare_ints) == NULL)
+      continue;
+    if (job->scan_count % 16 == 0) {
+      SearchScanNote *grown = realloc(
+          job->scan, (size_t)(job->scan_count + 16) * sizeof(SearchScanNote));
+      if (grown == NULL)
+        break;
+      job->scan = grown;
+    }
+
+    SearchScanNote *scan = &job->scan[job->scan_count];
+    scan->id = note->id;
+    memcpy(scan->title, note->title, sizeof(scan->title));
+    scan->text = NULL;
+    scan->len = 0;
+    if (note->content.data != NULL && regex) {
+      scan->len = text_buffer_length(&note->content);
+      scan->text = malloc(scan->len + 1);
+      if (scan->text == NULL)
+        break;
+      text_buffer_copy(&note->content, 0, scan->len, scan->text);
+    } else if (note->content.data != NULL) {
+      const char *folded = note_folded_text(note);
+      if (folded == NULL)
+        break;
+      scan->len = note->folded_len;
+      scan->text = malloc(scan->len + 1);
+      if (scan->text == NULL)
+        break;
+      memcpy(scan->text, folded, scan->len);
+    }
+    job->scan_count++;
+  }
+  if (job->scan_count > 0)
+    qsort(job->scan, (size_t)job->scan_count, sizeof(SearchScanNote),
+          search_scan_compare);
+
+  if (!search_worker.started) {
+    if (search_job_run(job))
+      search_apply(job);
+    else
+      search_job_free(job);
+    return;
+  }
+
+  pthread_mutex_lock(&search_worker.lock);
+  search_worker.pending = job;
+  pthread_cond_signal(&search_worker.wake);
+  pthread_mutex_unlock(&search_worker.lock);
+  background_busy |= BACKGROUND_SEARCH;
+}
+
+/**
+ * @brief Pick up the worker's results, if there are any (main thread)
+ */
+static void search_poll(void) {
+  if (!(background_busy & BACKGROUND_SEARCH))
+    return;
+
+  pthread_mutex_lock(&search_worker.lock);
+  SearchJob *job = search_worker.done;
+  search_worker.done = NULL;
+  bool busy = search_worker.pending != NULL || search_worker.running;
+  pthread_mutex_unlock(&search_worker.lock);
+
+  if (job != NULL)
+    search_apply(job);
+  if (!busy) {
+    background_busy &= ~BACKGROUND_SEARCH;
+    request_redraw();
+  }
+}
+
+/* ============================================================================
+ * Quick Switcher
+ * ============================================================================
+ * Ctrl+O opens an overlay that jumps to a note by typing part of its title.
+ * The typed characters have to appear in the title in order, but not next to
+ * each other: "mtgnts" (or "mtg nts", spaces are ignored) finds "Meeting
+ * notes". Matches are ranked the way fzf ranks them. Every matched character
+ * scores, characters at the start of a word or right after the previous
+ * match score extra, and skipped characters in between cost a little.
+ *
+ * The switcher keeps every title, and a folded copy of it, packed back to
+ * back in one array, so ranking walks that array instead of touching a whole
+ * Note per title. A title is only scored if the query's bytes occur in its
+ * folded copy in order. The array is extended as notes are added at the end
+ * of the table and rebuilt after remove_note() shifts them.
+ *
+ * Only the best SWITCHER_RESULTS matches are kept, in a bounded heap, so
+ * ranking never sorts the full list. Ranking 100k titles takes 1-7 ms,
+ * depending on how many survive the first pass (see --bench-switcher).
+ */
+
+#define SWITCHER_RESULTS 10       /* Matches listed by the quick switcher */
+#define FUZZY_SCORE_MATCH 16      /* Every matched character */
+#define FUZZY_GAP_START (-3)      /* First skipped character of a gap */
+#define FUZZY_GAP_EXTENSION (-1)  /* Every further skipped character */
+#define FUZZY_BONUS_BOUNDARY 8    /* Match at the start of a word */
+#define FUZZY_BONUS_CAMEL 7       /* Match at a camelCase or digit hump */
+#define FUZZY_BONUS_CONSECUTIVE 4 /* Match right after the previous one */
+#define FUZZY_FIRST_MULTIPLIER 2  /* Weight of the first character's bonus */
+
+/**
+ * @brief Character classes that decide where a word starts
+ */
+typedef enum {
+  FUZZY_CLASS_OTHER, /* Whitespace and punctuation */
+  FUZZY_CLASS_LOWER, /* Lowercase ASCII letters and non-ASCII bytes */
+  FUZZY_CLASS_UPPER, /* Uppercase ASCII letters */
+  FUZZY_CLASS_DIGIT, /* ASCII digits */
+} FuzzyClass;
+
+/**
+ * @brief A switcher query, folded and split into characters
+ */
+typedef struct {
+  char text[128];           /* Folded query without whitespace */
+  unsigned char start[129]; /* Offset of each character, then the end */
+  int char_count;           /* Characters in text */
+} FuzzyPattern;
+
+/**
+ * @brief A ranked title
+ */
+typedef struct {
+  int note;   /* Index of the note */
+  int score;  /* Fuzzy score of its title */
+  int length; /* Bytes in the title (shorter wins a tie) */
+} SwitcherMatch;
+
+/**
+ * @brief State of the quick switcher overlay
+ */
+typedef struct {
+  bool open;                     /* The overlay is shown and has focus */
+  char query[128];               /* Text typed into the overlay */
+  int results[SWITCHER_RESULTS]; /* Best matching notes, best first */
+  int result_count;              /* Entries in results */
+  int selected;                  /* Highlighted entry in results */
+} QuickSwitcher;
+
+/**
+ * @brief Every title and its folded copy, packed for ranking
+ */
+typedef struct {
+  char *text;        /* Each title, then its folded copy, each with a NUL */
+  size_t length;     /* Bytes used in text */
+  size_t capacity;   /* Bytes allocated for text */
+  uint32_t *start;   /* Offset of each note's title in text, then the end */
+  int count;         /* Notes packed */
+  int slots;         /* Entries allocated in start */
+  unsigned removals; /* notebook.removals when packing started */
+} SwitcherTitles;
+
+static QuickSwitcher switcher;         /* The overlay (closed until Ctrl+O) */
+static SwitcherTitles switcher_titles; /* Packed titles (grown on demand) */
+
+/**
+ * @brief Classify a title byte for the word-start bonuses
+ */
+static FuzzyClass fuzzy_class(unsigned char c) {
+  if (c >= 'a' && c <= 'z')
+    return FUZZY_CLASS_LOWER;
+  if (c >= 'A' && c <= 'Z')
+    return FUZZY_CLASS_UPPER;
+  if (c >= '0' && c <= '9')
+    return FUZZY_CLASS_DIGIT;
+  return c >= 0x80 ? FUZZY_CLASS_LOWER : FUZZY_CLASS_OTHER;
+}
+
+/**
+ * @brief Bonus for matching a character of one class after another
+ */
+static int fuzzy_bonus(FuzzyClass prev, FuzzyClass cls) {
+  if (cls == FUZZY_CLASS_OTHER || prev == FUZZY_CLASS_OTHER)
+    return FUZZY_BONUS_BOUNDARY;
+  if ((prev == FUZZY_CLASS_LOWER && cls == FUZZY_CLASS_UPPER) ||
+      (prev != FUZZY_CLASS_DIGIT && cls == FUZZY_CLASS_DIGIT))
+    return FUZZY_BONUS_CAMEL;
+  return 0;
+}
+
+/**
+ * @brief Prepare a query for matching
+ * @param pattern Receives the pattern
+ * @param query NUL-terminated query (at most 127 bytes)
+ */
+static void fuzzy_pattern_init(FuzzyPattern *pattern, const char *query) {
+  size_t query_len = strlen(query);
+  int len = 0;
+  pattern->char_count = 0;
+  for (size_t i = 0; i < query_len;) {
+    char folded[4];
+    int consumed;
+    int n = case_fold_next(query + i, query_len - i, folded, &consumed);
+    i += consumed;
+    if (folded[0] == ' ' || folded[0] == '\t')
+      continue;
+    if (len + n > (int)sizeof(pattern->text))
+      break;
+    pattern->start[pattern->char_count++] = (unsigned char)len;
+    memcpy(pattern->text + len, folded, (size_t)n);
+    len += n;
+  }
+  pattern->start[pattern->char_count] = (unsigned char)len;
+}
+
+/**
+ * @brief Check whether a pattern character occurs at a title offset
+ *
+ * ASCII goes straight through the folding table. Other characters are
+ * folded one at a time, only where a title has them.
+ *
+ * @return Bytes of the title character that matched, or 0
+ */
+static size_t fuzzy_char_at(const FuzzyPattern *pattern, int k,
+                            const char *text, size_t len, size_t i) {
+  const char *c = pattern->text + pattern->start[k];
+  size_t n = pattern->start[k + 1] - pattern->start[k];
+  unsigned char b = (unsigned char)text[i];
+  if (b < 0x80 && case_fold_table[b] < 0x80)
+    return n == 1 && case_fold_table[b] == (unsigned char)c[0];
+  if ((b & 0xC0) == 0x80)
+    return 0;
+
+  char folded[4];
+  int consumed;
+  int folded_len = case_fold_next(text + i, len - i, folded, &consumed);
+  if ((size_t)folded_len != n || memcmp(folded, c, n) != 0)
+    return 0;
+  return (size_t)consumed;
+}
+
+/**
+ * @brief Fuzzy-match a title against a pattern
+ *
+ * As in fzf's first algorithm: the earliest place where the whole pattern
+ * has matched is found going forward, then the tightest match ending there
+ * going backward, and that window is scored.
+ *
+ * @param pattern The pattern (at least one character)
+ * @param text The title
+ * @param len Bytes in the title
+ * @param score Receives the score (higher is better)
+ * @param matched Receives which title bytes matched (NULL if not needed)
+ * @return True if every pattern character occurs in order
+ */
+static bool fuzzy_match(const FuzzyPattern *pattern, const char *text,
+                        size_t len, int *score, bool *matched) {
+  int count = pattern->char_count;
+  int k = 0;
+  size_t end = 0;
+  for (size_t i = 0; i < len; i++) {
+    size_t size = fuzzy_char_at(pattern, k, text, len, i);
+    if (size > 0 && ++k == count) {
+      end = i + size;
+      break;
+    }
+  }
+  if (k < count)
+    return false;
+
+  size_t start = 0;
+  k = count - 1;
+  for (size_t i = end; i-- > 0;) {
+    if (fuzzy_char_at(pattern, k, text, len, i) > 0 && k-- == 0) {
+      start = i;
+      break;
+    }
+  }
+
+  FuzzyClass prev =
+      start > 0 ? fuzzy_class((unsigned char)text[start - 1])
+                : FUZZY_CLASS_OTHER;
+  int total = 0;
+  int consecutive = 0;
+  int first_bonus = 0;
+  bool in_gap = false;
+  k = 0;
+  for (size_t i = start; i < end;) {
+    FuzzyClass cls = fuzzy_class((unsigned char)text[i]);
+    size_t next = i + 1;
+    size_t size = k < count ? fuzzy_char_at(pattern, k, text, len, i) : 0;
+    if (size > 0) {
+      /* A run of matches keeps the bonus of the word start it began at */
+      int bonus = fuzzy_bonus(prev, cls);
+      if (consecutive == 0) {
+        first_bonus = bonus;
+      } else {
+        if (bonus >= FUZZY_BONUS_BOUNDARY && bonus > first_bonus)
+          first_bonus = bonus;
+        if (bonus < first_bonus)
+          bonus = first_bonus;
+        if (bonus < FUZZY_BONUS_CONSECUTIVE)
+          bonus = FUZZY_BONUS_CONSECUTIVE;
+      }
+      total += FUZZY_SCORE_MATCH +
+               (k == 0 ? bonus * FUZZY_FIRST_MULTIPLIER : bonus);
+      next = i + size;
+      if (matched != NULL)
+        memset(matched + i, 1, next - i);
+      k++;
+      consecutive++;
+      in_gap = false;
+    } else {
+      total += in_gap ? FUZZY_GAP_EXTENSION : FUZZY_GAP_START;
+      in_gap = true;
+      consecutive = 0;
+      first_bonus = 0;
+      while (next < end && (text[next] & 0xC0) == 0x80)
+        next++;
+    }
+    prev = cls;
+    i = next;
+  }
+
+  *score = total;
+  return true;
+}
+
+/**
+ * @brief Rule out a title that cannot match a pattern
+ *
+ * A title character matches when it folds to the pattern character, so every
+ * byte of the pattern occurs, in order, in a matching title's folded copy.
+ *
+ * @param pattern The pattern
+ * @param folded The title, folded
+ * @param len Bytes in folded
+ * @return False if the title cannot match
+ */
+static bool fuzzy_may_match(const FuzzyPattern *pattern, const char *folded,
+                            size_t len) {
+  const char *end = folded + len;
+  for (int i = 0; i < pattern->start[pattern->char_count]; i++) {
+    const char *at = memchr(folded, pattern->text[i], (size_t)(end - folded));
+    if (at == NULL)
+      return false;
+    folded = at + 1;
+  }
+  return true;
+}
+
+/**
+ * @brief Bring the packed titles up to date with the note table
+ * @return False if memory ran out (the packed titles are then incomplete)
+ */
+static bool switcher_titles_update(void) {
+  SwitcherTitles *packed = &switcher_titles;
+  if (packed->removals != notebook.removals || packed->count > notebook.count) {
+    packed->count = 0;
+    packed->length = 0;
+    packed->removals = notebook.removals;
+  }
+
+  for (; packed->count < notebook.count; packed->count++) {
+    if (packed->count + 1 >= packed->slots) {
+      int slots = packed->slots > 0 ? packed->slots * 2 : 256;
+      uint32_t *grown =
+          realloc(packed->start, (size_t)slots * sizeof(uint32_t));
+      if (grown == NULL)
+        return false;
+      packed->start = grown;
+      packed->slots = slots;
+    }
+    const char *title = notebook.notes[packed->count].title;
+    size_t len = strlen(title);
+    size_t need = packed->length + 3 * len + 2;
+    if (need > packed->capacity) {
+      size_t capacity = packed->capacity > 0 ? packed->capacity * 2 : 4096;
+      while (need > capacity)
+        capacity *= 2;
+      char *grown = realloc(packed->text, capacity);
+      if (grown == NULL)
+        return false;
+      packed->text = grown;
+      packed->capacity = capacity;
+    }
+    packed->start[packed->count] = (uint32_t)packed->length;
+    memcpy(packed->text + packed->length, title, len + 1);
+    packed->length += len + 1;
+    packed->length += case_fold(title, len, packed->text + packed->length);
+    packed->text[packed->length++] = '\0';
+  }
+  packed->start[packed->count] = (uint32_t)packed->length;
+  return true;
+}
+
+/**
+ * @brief Release the packed titles
+ */
+static void switcher_titles_free(void) {
+  free(switcher_titles.text);
+  free(switcher_titles.start);
+  memset(&switcher_titles, 0, sizeof(switcher_titles));
+}
+
+/**
+ * @brief Check whether one ranked title goes before another
+ */
+static bool switcher_better(const void *a, const void *b) {
+  const SwitcherMatch *x = a, *y = b;
+  if (x->score != y->score)
+    return x->score > y->score;
+  if (x->length != y->length)
+    return x->length < y->length;
+  return x->note < y->note;
+}
+
+/**
+ * @brief Rank every note's title against the switcher's query
+ *
+ * An empty query lists the first notes in sidebar order.
+ */
+static void switcher_refresh(void) {
+  FuzzyPattern pattern;
+  fuzzy_pattern_init(&pattern, switcher.query);
+
+  const SwitcherTitles *packed = &switcher_titles;
+  bool use_packed = pattern.char_count > 0 && switcher_titles_update();
+
+  SwitcherMatch matches[SWITCHER_RESULTS];
+  TopHeap heap = {matches, sizeof(SwitcherMatch), SWITCHER_RESULTS, 0,
+                  switcher_better};
+  for (int i = 0; i < notebook.count; i++) {
+    if (pattern.char_count == 0) {
+      if (heap.count == SWITCHER_RESULTS)
+        break;
+      top_heap_offer(&heap, &(SwitcherMatch){i, 0, 0});
+      continue;
+    }
+    const char *title = notebook.notes[i].title;
+    size_t len;
+    if (use_packed) {
+      title = packed->text + packed->start[i];
+      len = strlen(title);
+      const char *folded = title + len + 1;
+      if (!fuzzy_may_match(&pattern, folded,
+                           packed->text + packed->start[i + 1] - folded - 1))
+        continue;
+    } else {
+      len = strlen(title);
+    }
+    int score;
+    if (fuzzy_match(&pattern, title, len, &score, NULL))
+      top_heap_offer(&heap, &(SwitcherMatch){i, score, (int)len});
+  }
+  top_heap_sort(&heap);
+
+  for (int k = 0; k < heap.count; k++)
+    switcher.results[k] = matches[k].note;
+  switcher.result_count = heap.count;
+  switcher.selected = 0;
+  request_redraw();
+}
+
+/**
+ * @brief Open or close the quick switcher
+ *
+ * Escape closes the overlay while it is open instead of quitting.
+ */
+static void switcher_set_open(bool open) {
+  switcher.open = open;
+  switcher.query[0] = '\0';
+  SetExitKey(open ? KEY_NULL : KEY_ESCAPE);
+  cursor_blink_reset();
+  if (open)
+    switcher_refresh();
+}
+
+/* ============================================================================
+ * Vault Replace
+ * ============================================================================
+ * Ctrl+R opens a panel that replaces text in every note at once. While the
+ * text to find is typed, the panel lists the notes containing it with the
+ * number of matches in each; Enter rewrites them all.
+ *
+ * Matching is exact (case matters) and covers note bodies, not titles. The
+ * trigram index rules out the notes that cannot contain the text, as it
+ * does for search; the rest are read and counted on worker threads, one per
+ * core, that take notes from a shared counter until none are left. Notes
+ * with unsaved edits are scanned, and rewritten, from their resident text.
+ *
+ * The preview is counted in the background, as search queries are, so typing
+ * never waits for the vault to be read. Its job carries copies of the titles
+ * and unsaved texts it needs, and the panel lists the previous counts until
+ * it is done. Every keystroke bumps replace_generation, which stops the
+ * workers of an older preview at their next note.
+ *
+ * The rewrite is one batch. Every new text is written to a temporary file
+ * in vault/.notes and flushed to disk first, and each original is kept
+ * under a hard link. Only then are the temporary files renamed over the
+ * notes. If anything fails before the last rename, the originals are put
+ * back, so either every note is replaced or none is.
+ */
+
+#define REPLACE_MAX_THREADS 16 /* Upper bound on scanning threads */
+#define REPLACE_ROWS 10        /* Notes listed in the preview */
+
+/**
+ * @brief A note the replace panel scans or rewrites
+ */
+typedef struct {
+  int note;       /* Index of the note */
+  long count;     /* Matches in its text */
+  char *text;     /* Rewritten text; in a preview, a copy of the unsaved
+                     text until it is counted (NULL: read the file) */
+  size_t len;     /* Length of text */
+  uint32_t title; /* Offset of the title in ReplaceJob.titles (previews) */
+} ReplaceNote;
+
+/**
+ * @brief Work shared by the scanning threads
+ */
+typedef struct {
+  const char *find;    /* Text to find */
+  size_t find_len;     /* Length of find */
+  const char *with;    /* Replacement */
+  size_t with_len;     /* Length of with */
+  bool rewrite;        /* Build the rewritten texts, not just count */
+  ReplaceNote *notes;  /* Notes to process */
+  int count;           /* Entries in notes */
+  int next;            /* Next entry to take (atomic) */
+  bool failed;         /* A note could not be read or memory ran out */
+  char *titles;        /* Previews: the notes' titles, so the workers never
+                          look at the note table (NULL when rewriting) */
+  char find_copy[128]; /* Previews: find, as it was typed when started */
+  unsigned generation; /* replace_generation the preview was started at */
+  bool finished;       /* The preview thread is done with it (atomic) */
+} ReplaceJob;
+
+/**
+ * @brief State of the replace panel
+ */
+typedef struct {
+  bool open;                /* The panel is shown and has focus */
+  char find[128];           /* Text to find */
+  char with[128];           /* Replacement */
+  bool with_focused;        /* Typing goes to the replacement */
+  ReplaceNote *hits;        /* Notes with matches, in sidebar order */
+  int hit_count;            /* Entries in hits */
+  long match_count;         /* Matches in all of them */
+  char status[128];         /* Outcome of the last replace */
+  ReplaceJob *preview;      /* Preview being counted (NULL if none) */
+  pthread_t preview_thread; /* Thread counting it */
+} VaultReplace;
+
+static VaultReplace replace_panel;  /* The panel (closed until Ctrl+R) */
+static unsigned replace_generation; /* Bumped per preview; stops old ones */
+
+/**
+ * @brief Count, and optionally replace, the matches in a text
+ * @param job The job
+ * @param text The text
+ * @param len Length of the text
+ * @param out Receives the rewritten text when rewriting (caller frees)
+ * @param out_len Receives its length
+ * @return Number of matches, or -1 if memory ran out
+ */
+static long replace_text(const ReplaceJob *job, const char *text, size_t len,
+                         char **out, size_t *out_len) {
+  long count = 0;
+  for (size_t at = 0; at < len;) {
+    size_t found = substring_find(text + at, len - at, job->find,
+                                  job->find_len, false);
+    if (found == SUBSTRING_NONE)
+      break;
+    count++;
+    at += found + job->find_len;
+  }
+  if (!job->rewrite || count == 0)
+    return count;
+
+  size_t size = len - (size_t)count * job->find_len +
+                (size_t)count * job->with_len;
+  char *result = malloc(size + 1);
+  if (result == NULL)
+    return -1;
+  size_t n = 0;
+  for (size_t at = 0; at < len;) {
+    size_t found = substring_find(text + at, len - at, job->find,
+                                  job->find_len, false);
+    if (found == SUBSTRING_NONE)
+      found = len - at;
+    memcpy(result + n, text + at, found);
+    n += found;
+    at += found;
+    if (at < len) {
+      memcpy(result + n, job->with, job->with_len);
+      n += job->with_len;
+      at += job->find_len;
+    }
+  }
+  *out = result;
+  *out_len = n;
+  return count;
+}
+
+/**
+ * @brief Scan one note of a job
+ *
+ * A resident body is read without touching its gap, so the main thread's
+ * buffers stay as they are while the workers run.
+ *
+ * @return False if the note could not be read or memory ran out
+ */
+static bool replace_job_note(ReplaceJob *job, ReplaceNote *entry) {
+  TextBuffer loaded;
+  const char *text;
+  size_t len = 0;
+  char *copy = NULL;
+  char filepath[256];
+  if (job->titles != NULL) {
+    /* A preview: the unsaved text was copied in when it was started */
+    copy = entry->text;
+    len = entry->len;
+    entry->text = NULL;
+    title_filepath(job->titles + entry->title, filepath, sizeof(filepath));
+  } else {
+    const Note *note = &notebook.notes[entry->note];
+    if (note->content.data != NULL) {
+      len = text_buffer_length(&note->content);
+      copy = malloc(len + 1);
+      if (copy == NULL)
+        return false;
+      text_buffer_copy(&note->content, 0, len, copy);
+    }
+    note_filepath(note, filepath, sizeof(filepath));
+  }
+
+  if (copy != NULL) {
+    text = copy;
+  } else {
+    FILE *file = fopen(filepath, "r");
+    if (file == NULL)
+      return false;
+    bool ok = text_buffer_load_file(&loaded, file);
+    fclose(file);
+    if (!ok)
+      return false;
+    text = loaded.data;
+    len = loaded.gap_start;
+  }
+
+  entry->count = replace_text(job, text, len, &entry->text, &entry->len);
+  if (copy != NULL)
+    free(copy);
+  else
+    text_buffer_free(&loaded);
+  return entry->count >= 0;
+}
+
+/**
+ * @brief Thread body: process notes until the job runs out of them
+ * @param arg The ReplaceJob
+ * @return NULL
+ */
+static void *replace_worker(void *arg) {
+  ReplaceJob *job = arg;
+  for (;;) {
+    int k = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+    if (k >= job->count)
+      break;
+    if (job->titles != NULL &&
+        __atomic_load_n(&replace_generation, __ATOMIC_ACQUIRE) !=
+            job->generation)
+      break;
+    if (!replace_job_note(job, &job->notes[k]))
+      __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Process every note of a job, on as many cores as there are
+ *
+ * The calling thread works too, so a job still finishes if no thread can
+ * be started.
+ *
+ * @return False if some note could not be read or memory ran out
+ */
+static bool replace_run(ReplaceJob *job) {
+  /* Pick the scanner kernel before the threads race to do it */
+  substring_init();
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int extra = (int)(cores > REPLACE_MAX_THREADS ? REPLACE_MAX_THREADS : cores);
+  if (extra > job->count)
+    extra = job->count;
+  extra--;
+
+  pthread_t threads[REPLACE_MAX_THREADS];
+  int started = 0;
+  while (started < extra &&
+         pthread_create(&threads[started], NULL, replace_worker, job) == 0)
+    started++;
+  replace_worker(job);
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  return !job->failed;
+}
+
+/**
+ * @brief List the notes that may contain a text
+ *
+ * These are the notes whose indexed text has all trigrams of (the start
+ * of) the text, and every note the indexes are not current for.
+ *
+ * @param find The text (at least one byte)
+ * @param out Receives the entries in sidebar order; the caller frees it
+ * @return Number of notes, or -1 if memory ran out
+ */
+static int replace_candidates(const char *find, ReplaceNote **out) {
+  /* The start of the text, cut at a character boundary, fits a term */
+  size_t len = strlen(find);
+  if (len > SEARCH_MAX_QUERY / 2 - 1)
+    len = SEARCH_MAX_QUERY / 2 - 1;
+  while (len > 0 && (find[len] & 0xC0) == 0x80)
+    len--;
+  QueryTerm term = {.phrase = -1, .substring = true, .id = -1};
+  term.len = case_fold(find, len, term.text);
+
+  int *docs = NULL;
+  int found = 0;
+  if (term.len >= 3) {
+    found = search_segments_query(&term, 1, &docs);
+    if (found < 0)
+      return -1;
+  }
+
+  *out = malloc((size_t)(notebook.count + 1) * sizeof(ReplaceNote));
+  if (*out == NULL) {
+    free(docs);
+    return -1;
+  }
+  int count = 0;
+  for (int i = 0; i < notebook.count; i++) {
+    const Note *note = &notebook.notes[i];
+    if (term.len >= 3 && note_index_current(note) &&
+        bsearch(&note->id, docs, (size_t)found, sizeof(int),
+                compare_ints) == NULL)
+      continue;
+    (*out)[count++] = (ReplaceNote){i, 0, NULL, 0, 0};
+  }
+  free(docs);
+  return count;
+}
+
+/**
+ * @brief Release a preview job and whatever it still holds
+ */
+static void replace_job_free(ReplaceJob *job) {
+  if (job == NULL)
+    return;
+  for (int k = 0; k < job->count; k++)
+    free(job->notes[k].text);
+  free(job->notes);
+  free(job->titles);
+  free(job);
+}
+
+/**
+ * @brief Copy out what a preview's workers need to know about its notes
+ *
+ * The titles, packed back to back, name the files to read; notes with
+ * unsaved edits have their text copied instead.
+ *
+ * @return False if memory ran out
+ */
+static bool replace_job_prepare(ReplaceJob *job) {
+  size_t size = 1;
+  for (int k = 0; k < job->count; k++)
+    size += strlen(notebook.notes[job->notes[k].note].title) + 1;
+  job->titles = malloc(size);
+  if (job->titles == NULL)
+    return false;
+
+  size_t used = 0;
+  for (int k = 0; k < job->count; k++) {
+    ReplaceNote *entry = &job->notes[k];
+    const Note *note = &notebook.notes[entry->note];
+    size_t len = strlen(note->title);
+    memcpy(job->titles + used, note->title, len + 1);
+    entry->title = (uint32_t)used;
+    used += len + 1;
+
+    if (note->content.data != NULL) {
+      entry->len = text_buffer_length(&note->content);
+      entry->text = malloc(entry->len + 1);
+      if (entry->text == NULL)
+        return false;
+      text_buffer_copy(&note->content, 0, entry->len, entry->text);
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Thread body: count the matches of a preview
+ * @param arg The ReplaceJob
+ * @return NULL
+ */
+static void *replace_preview_main(void *arg) {
+  ReplaceJob *job = arg;
+  replace_run(job);
+  __atomic_store_n(&job->finished, true, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/**
+ * @brief List the notes a counted preview found matches in
+ * @param job The job (taken over)
+ */
+static void replace_preview_apply(ReplaceJob *job) {
+  free(replace_panel.hits);
+  replace_panel.match_count = 0;
+  int hits = 0;
+  for (int k = 0; k < job->count; k++) {
+    if (job->notes[k].count > 0) {
+      job->notes[hits++] = job->notes[k];
+      replace_panel.match_count += job->notes[k].count;
+    }
+  }
+  replace_panel.hits = job->notes;
+  replace_panel.hit_count = hits;
+  job->notes = NULL;
+  job->count = 0;
+  replace_job_free(job);
+  request_redraw();
+}
+
+/**
+ * @brief Wait for the preview being counted, then list its notes
+ * @param cancel Stop its workers first and drop what they counted
+ */
+static void replace_preview_finish(bool cancel) {
+  ReplaceJob *job = replace_panel.preview;
+  if (job == NULL)
+    return;
+  if (cancel)
+    __atomic_add_fetch(&replace_generation, 1, __ATOMIC_RELEASE);
+  pthread_join(replace_panel.preview_thread, NULL);
+  replace_panel.preview = NULL;
+  background_busy &= ~BACKGROUND_REPLACE;
+  request_redraw();
+  if (cancel)
+    replace_job_free(job);
+  else
+    replace_preview_apply(job);
+}
+
+/**
+ * @brief List the preview's notes once its thread is done (main thread)
+ */
+static void replace_poll(void) {
+  if (replace_panel.preview != NULL &&
+      __atomic_load_n(&replace_panel.preview->finished, __ATOMIC_ACQUIRE))
+    replace_preview_finish(false);
+}
+
+/**
+ * @brief Start counting the matches of the panel's text in every note again
+ *
+ * The panel keeps listing the previous counts until replace_poll() picks up
+ * the new ones.
+ */
+static void replace_refresh(void) {
+  replace_preview_finish(true);
+  request_redraw();
+  if (replace_panel.find[0] == '\0') {
+    free(replace_panel.hits);
+    replace_panel.hits = NULL;
+    replace_panel.hit_count = 0;
+    replace_panel.match_count = 0;
+    return;
+  }
+
+  ReplaceJob *job = calloc(1, sizeof(ReplaceJob));
+  if (job == NULL)
+    return;
+  memcpy(job->find_copy, replace_panel.find, sizeof(job->find_copy));
+  job->find = job->find_copy;
+  job->find_len = strlen(job->find_copy);
+  job->count = replace_candidates(job->find, &job->notes);
+  if (job->count < 0) {
+    job->count = 0;
+    replace_job_free(job);
+    return;
+  }
+  if (!replace_job_prepare(job)) {
+    replace_job_free(job);
+    return;
+  }
+
+  job->generation = __atomic_load_n(&replace_generation, __ATOMIC_ACQUIRE);
+  if (pthread_create(&replace_panel.preview_thread, NULL,
+                     replace_preview_main, job) != 0) {
+    /* No thread to spare: count on this one instead */
+    replace_run(job);
+    replace_preview_apply(job);
+    return;
+  }
+  replace_panel.preview = job;
+  background_busy |= BACKGROUND_REPLACE;
+}
+
+/**
+ * @brief How one note of a replace was staged (see replace_commit())
+ */
+typedef struct {
+  bool in_place;       /* Overwritten in place (it has other hard links) */
+  bool backed_up;      /* The original is kept, to be put back on failure */
+  TextBuffer original; /* Old text of a note overwritten in place */
+} ReplaceStage;
+
+/**
+ * @brief Get the target of a note and its staging files during a replace
+ * @return False if the staging files' paths do not fit
+ */
+static bool replace_target(const Note *note, FileTarget *target, char *tmp,
+                           char *backup, size_t size) {
+  char path[256];
+  note_filepath(note, path, sizeof(path));
+  file_target_init(target, path);
+  return file_target_sibling(target, "replace", tmp, size) &&
+         file_target_sibling(target, "replace-backup", backup, size);
+}
+
+/**
+ * @brief Put the rewritten texts in place as one batch
+ *
+ * Nothing is replaced until every temporary file is on disk and every
+ * original is kept: under a backup link, or read into memory for a note
+ * overwritten in place. A failed step puts back the notes replaced so far.
+ *
+ * @param notes The notes and their new texts
+ * @param count Number of notes
+ * @return True if every note was replaced; false if none was
+ */
+static bool replace_commit(const ReplaceNote *notes, int count) {
+  FileTarget target;
+  char tmp[PATH_MAX], backup[PATH_MAX];
+
+  /* Stage: new texts in temporary files, originals kept */
+  int staged = 0;
+  ReplaceStage *stages = calloc((size_t)count + 1, sizeof(ReplaceStage));
+  bool ok = stages != NULL;
+  for (; staged < count && ok; staged++) {
+    ReplaceStage *stage = &stages[staged];
+    ok = replace_target(&notebook.notes[notes[staged].note], &target, tmp,
+                        backup, sizeof(tmp));
+    if (!ok)
+      break;
+    /* A backup left behind by a crash would pass for another hard link */
+    if (remove(backup) == 0)
+      file_target_init(&target, target.path);
+    stage->in_place = target.in_place;
+    if (stage->in_place) {
+      FILE *file = fopen(target.path, "rb");
+      ok = file != NULL && text_buffer_load_file(&stage->original, file);
+      if (file != NULL)
+        fclose(file);
+      stage->backed_up = ok;
+      continue;
+    }
+    ok = file_write(tmp, notes[staged].text, notes[staged].len, &target);
+    if (ok && link(target.path, backup) == 0)
+      stage->backed_up = true;
+    else if (ok && target.exists)
+      ok = false; /* An original exists but could not be kept */
+  }
+  bool committing = ok;
+
+  /* Commit: move every temporary file over its note */
+  int replaced = 0;
+  for (; ok && replaced < count; replaced++) {
+    replace_target(&notebook.notes[notes[replaced].note], &target, tmp,
+                   backup, sizeof(tmp));
+    if (stages[replaced].in_place)
+      ok = file_write(target.path, notes[replaced].text, notes[replaced].len,
+                      NULL);
+    else
+      ok = rename(tmp, target.path) == 0;
+    if (!ok)
+      break;
+  }
+
+  /* Make the renames durable, syncing each folder once per run of notes */
+  char synced[PATH_MAX] = "";
+  for (int k = 0; ok && k < count; k++) {
+    if (stages[k].in_place)
+      continue;
+    replace_target(&notebook.notes[notes[k].note], &target, tmp, backup,
+                   sizeof(tmp));
+    int folder_len = (int)(strrchr(target.path, '/') - target.path);
+    if ((int)strlen(synced) == folder_len &&
+        strncmp(synced, target.path, (size_t)folder_len) == 0)
+      continue;
+    ok = file_sync_folder(target.path);
+    snprintf(synced, sizeof(synced), "%.*s", folder_len, target.path);
+  }
+
+  /* Put back what was replaced (and a note that failed half way), then
+   * drop the staging files */
+  for (int k = 0; k < staged; k++) {
+    ReplaceStage *stage = &stages[k];
+    if (!replace_target(&notebook.notes[notes[k].note], &target, tmp, backup,
+                        sizeof(tmp)))
+      continue;
+    if (!ok && committing && k <= replaced) {
+      if (stage->in_place)
+        file_write(target.path, stage->original.data,
+                   text_buffer_length(&stage->original), NULL);
+      else if (stage->backed_up)
+        file_rename_durable(backup, target.path);
+      else if (k < replaced)
+        remove(target.path); /* The note was new */
+    }
+    if (stage->in_place && stage->backed_up)
+      text_buffer_free(&stage->original);
+    remove(tmp);
+    remove(backup);
+  }
+  free(stages);
+  return ok;
+}
+
+/**
+ * @brief Replace every match in every listed note
+ */
+static void replace_apply(void) {
+  /* The notes listed must be the ones the current text was counted in */
+  replace_preview_finish(false);
+  if (replace_panel.hit_count == 0)
+    return;
+  /* A save still in flight would write over the replaced text */
+  save_poll(true);
+
+  ReplaceJob job = {0};
+  job.find = replace_panel.find;
+  job.find_len = strlen(replace_panel.find);
+  job.with = replace_panel.with;
+  job.with_len = strlen(replace_panel.with);
+  job.rewrite = true;
+  job.notes = replace_panel.hits;
+  job.count = replace_panel.hit_count;
+
+  /* Count again while rewriting, in case a note changed since the preview */
+  bool ok = replace_run(&job);
+  long matches = 0;
+  int rewritten = 0;
+  for (int k = 0; k < job.count; k++) {
+    if (job.notes[k].count > 0) {
+      job.notes[rewritten++] = job.notes[k];
+      matches += job.notes[k].count;
+    }
+  }
+  ok = ok && replace_commit(job.notes, rewritten);
+
+  if (ok) {
+    /* The files now hold everything the notes had, unsaved edits included */
+    for (int k = 0; k < rewritten; k++)
+      reload_note(&notebook.notes[job.notes[k].note]);
+    snprintf(replace_panel.status, sizeof(replace_panel.status),
+             "Replaced %ld match%s in %d note%s", matches,
+             matches == 1 ? "" : "es", rewritten, rewritten == 1 ? "" : "s");
+    /* Those matches are gone; the recount lists any the new text brought */
+    replace_panel.hit_count = 0;
+    replace_panel.match_count = 0;
+    search_invalidate();
+  } else {
+    strcpy(replace_panel.status, "Could not replace; no note was changed");
+  }
+
+  for (int k = 0; k < rewritten; k++)
+    free(job.notes[k].text);
+  replace_refresh();
+}
+
+/**
+ * @brief Open or close the replace panel
+ *
+ * Escape closes the panel while it is open instead of quitting.
+ */
+static void replace_set_open(bool open) {
+  replace_panel.open = open;
+  replace_panel.status[0] = '\0';
+  SetExitKey(open ? KEY_NULL : KEY_ESCAPE);
+  cursor_blink_reset();
+  if (open) {
+    replace_refresh();
+  } else {
+    replace_preview_finish(true);
+    free(replace_panel.hits);
+    replace_panel.hits = NULL;
+    replace_panel.hit_count = 0;
+  }
+}
+
+/* ============================================================================
+ * Editing
+ * ============================================================================
+ * All changes to a note's text go through note_insert_text() and
+ * note_delete_text() so that the text buffer and the line index stay in sync.
+ * The cursor is a byte offset into the selected note (notebook.cursorPos)
+ * that always sits on a UTF-8 character boundary.
+ */
+
+/**
+ * @brief Insert text into a note
+ * @param note The note (must be loaded)
+ * @param pos Byte offset to insert at
+ * @param bytes Text to insert
+ * @param len Length of the text in bytes
+ * @return True on success
+ */
+static bool note_insert_text(Note *note, size_t pos, const char *bytes,
+                             size_t len) {
+  if (len == 0)
+    return true;
+
+  TextStats delta = text_stats_insert_delta(&note->content, pos, bytes, len);
+  if (!text_buffer_insert(&note->content, pos, bytes, len))
+    return false;
+  if (!line_index_insert(&note->lines, pos, bytes, len)) {
+    text_buffer_delete(&note->content, pos, len);
+    return false;
+  }
+  note->word_count += delta.words;
+  note->char_count += delta.chars;
+  note->modified = true;
+  note->generation++;
+  free_note_folded(note);
+  search_data_generation++;
+  request_redraw();
+  return true;
+}
+
+/**
+ * @brief Delete a byte range from a note
+ * @param note The note (must be loaded)
+ * @param pos Start of the range
+ * @param len Length of the range in bytes
+ */
+static void note_delete_text(Note *note, size_t pos, size_t len) {
+  size_t total = text_buffer_length(&note->content);
+  if (pos >= total || len == 0)
+    return;
+  if (len > total - pos)
+    len = total - pos;
+
+  /* The deletion copies a mapped body anyway; do it before it is counted */
+  if (!text_buffer_unshare(&note->content) ||
+      !line_index_delete(&note->lines, pos, len))
+    return;
+  TextStats delta = text_stats_delete_delta(&note->content, pos, len);
+  text_buffer_delete(&note->content, pos, len);
+  note->word_count += delta.words;
+  note->char_count += delta.chars;
+  note->modified = true;
+  note->generation++;
+  free_note_folded(note);
+  search_data_generation++;
+  request_redraw();
+}
+
+/**
+ * @brief Find the start of the UTF-8 character after a position
+ * @param tb The buffer
+ * @param pos Text position
+ * @return Position of the first byte of the following character
+ */
+static size_t text_buffer_next_char(const TextBuffer *tb, size_t pos) {
+  size_t len = text_buffer_length(tb);
+  if (pos >= len)
+    return len;
+
+  pos++;
+  while (pos < len && (text_buffer_at(tb, pos) & 0xC0) == 0x80) {
+    pos++;
+  }
+  return pos;
+}
+
+/**
+ * @brief Get the offset where a line's text ends (before its '\n')
+ * @param note The note
+ * @param line Line number
+ * @param start Receives the line's start offset (may be NULL)
+ * @return Offset one past the line's last character
+ */
+static size_t note_line_end(const Note *note, int line, size_t *start) {
+  size_t len;
+  size_t line_start = line_index_line_start(&note->lines, line, &len);
+  if (start)
+    *start = line_start;
+  size_t end = line_start + len;
+  if (len > 0 && text_buffer_at(&note->content, end - 1) == '\n')
+    end--;
+  return end;
+}
+
+/**
+ * @brief Count the characters between a line's start and an offset
+ * @param note The note
+ * @param pos Byte offset
+ * @return Column of the offset in UTF-8 characters
+ */
+static int note_column_of(const Note *note, size_t pos) {
+  size_t start;
+  line_index_line_at(&note->lines, pos, &start);
+
+  int column = 0;
+  while (start < pos) {
+    start = text_buffer_next_char(&note->content, start);
+    column++;
+  }
+  return column;
+}
+
+/**
+ * @brief Get the offset of a column on a line, clamped to the line's end
+ * @param note The note
+ * @param line Line number
+ * @param column Column in UTF-8 characters
+ * @return Byte offset
+ */
+static size_t note_offset_at_column(const Note *note, int line, int column) {
+  size_t pos;
+  size_t end = note_line_end(note, line, &pos);
+  while (column > 0 && pos < end) {
+    pos = text_buffer_next_char(&note->content, pos);
+    column--;
+  }
+  return pos;
+}
+
+/**
+ * @brief Move the cursor to an offset, forgetting the remembered column
+ * @param pos New cursor offset
+ */
+static void cursor_set(size_t pos) {
+  notebook.cursorPos = pos;
+  notebook.preferredColumn = -1;
+  notebook.scrollToCursor = true;
+  cursor_blink_reset();
+}
+
+/**
+ * @brief Move the cursor up or down by a number of lines
+ * @param note The selected note
+ * @param delta Lines to move (negative moves up)
+ */
+static void cursor_move_lines(const Note *note, int delta) {
+  /* Keep the column of the first vertical move so short lines don't eat it */
+  if (notebook.preferredColumn < 0)
+    notebook.preferredColumn = note_column_of(note, notebook.cursorPos);
+
+  int line = line_index_line_at(&note->lines, notebook.cursorPos, NULL);
+  int target = line + delta;
+  int last = line_index_count(&note->lines) - 1;
+  if (target < 0)
+    target = 0;
+  if (target > last)
+    target = last;
+
+  notebook.cursorPos =
+      note_offset_at_column(note, target, notebook.preferredColumn);
+  notebook.scrollToCursor = true;
+  cursor_blink_reset();
+}
+
+/**
+ * @brief Check whether a key was pressed or is auto-repeating
+ * @param key The raylib key code
+ * @return True if the key should act this frame
+ */
+static bool is_key_pressed_or_repeat(int key) {
+  return IsKeyPressed(key) || IsKeyPressedRepeat(key);
+}
+
+/**
+ * @brief Decode the character at a text position
+ * @param tb The buffer
+ * @param pos Text position (must be < text_buffer_length)
+ * @param codepoint Receives the codepoint
+ * @return Number of bytes in the character
+ */
+static int text_buffer_decode(const TextBuffer *tb, size_t pos,
+                              int *codepoint) {
+  char bytes[4];
+  size_t avail = text_buffer_length(tb) - pos;
+  if (avail > sizeof(bytes))
+    avail = sizeof(bytes);
+  text_buffer_copy(tb, pos, avail, bytes);
+  return decode_utf8(bytes, avail, codepoint);
+}
+
+/**
+ * @brief Measure a byte range of a note as drawn with a font
+ * @param font Font to measure with
+ * @param font_size Font size in pixels
+ * @param tb The text
+ * @param start Start of the range
+ * @param len Length of the range in bytes
+ * @return Width of the range in pixels
+ */
+static float measure_text_range(Font font, int font_size, const TextBuffer *tb,
+                                size_t start, size_t len) {
+  GlyphMetrics *gm = glyph_metrics_get(font, font_size);
+  float width = 0;
+  size_t end = start + len;
+  while (start < end) {
+    int codepoint;
+    start += text_buffer_decode(tb, start, &codepoint);
+    width += glyph_advance(gm, codepoint);
+  }
+  return width > 0 ? width - TEXT_SPACING : 0;
+}
+
+/**
+ * @brief Map a point in the editor to the nearest text offset
+ * @param note The selected note
+ * @param point Mouse position in window coordinates
+ * @return Byte offset under the point
+ */
+static size_t editor_offset_at_point(const Note *note, Vector2 point) {
+  if (editor_line_count == 0)
+    return text_buffer_length(&note->content);
+
+  /* Pick the visual line drawn at that height (clamped to the drawn ones) */
+  int index = 0;
+  while (index < editor_line_count - 1 &&
+         point.y >= editor_lines[index + 1].y) {
+    index++;
+  }
+  const EditorLine *line = &editor_lines[index];
+
+  /* Walk the characters until the point is closer to the next boundary */
+  GlyphMetrics *gm = glyph_metrics_get(line->font, line->font_size);
+  size_t pos = line->start + line->skip;
+  size_t end = line->start + line->len;
+  float x = line->x;
+  while (pos < end) {
+    int codepoint;
+    int size = text_buffer_decode(&note->content, pos, &codepoint);
+    float advance = glyph_advance(gm, codepoint);
+    if (point.x < x + advance / 2)
+      break;
+    x += advance;
+    pos += size;
+  }
+  return pos;
+}
+
+/**
+ * @brief Handle cursor movement and editing keys for the selected note
+ * @param note The selected note (must be loaded)
+ */
+static void handle_editor_keys(Note *note) {
+  TextBuffer *content = &note->content;
+  size_t len = text_buffer_length(content);
+  int page_lines = (WINDOW_HEIGHT - HEADER_HEIGHT - 130) / EDITOR_LINE_HEIGHT;
+
+  if (is_key_pressed_or_repeat(KEY_LEFT))
+    cursor_set(text_buffer_prev_char(content, notebook.cursorPos));
+  if (is_key_pressed_or_repeat(KEY_RIGHT))
+    cursor_set(text_buffer_next_char(content, notebook.cursorPos));
+  if (is_key_pressed_or_repeat(KEY_UP))
+    cursor_move_lines(note, -1);
+  if (is_key_pressed_or_repeat(KEY_DOWN))
+    cursor_move_lines(note, 1);
+  if (is_key_pressed_or_repeat(KEY_PAGE_UP))
+    cursor_move_lines(note, -page_lines);
+  if (is_key_pressed_or_repeat(KEY_PAGE_DOWN))
+    cursor_move_lines(note, page_lines);
+
+  if (IsKeyPressed(KEY_HOME)) {
+    if (is_modifier_down()) {
+      cursor_set(0);
+    } else {
+      size_t start;
+      line_index_line_at(&note->lines, notebook.cursorPos, &start);
+      cursor_set(start);
+    }
+  }
+  if (IsKeyPressed(KEY_END)) {
+    if (is_modifier_down()) {
+      cursor_set(len);
+    } else {
+      int line = line_index_line_at(&note->lines, notebook.cursorPos, NULL);
+      cursor_set(note_line_end(note, line, NULL));
+    }
+  }
+
+  /* Delete (forward, handles multi-byte UTF-8) */
+  if (is_key_pressed_or_repeat(KEY_DELETE)) {
+    size_t next = text_buffer_next_char(content, notebook.cursorPos);
+    note_delete_text(note, notebook.cursorPos, next - notebook.cursorPos);
+    cursor_set(notebook.cursorPos);
+  }
+}
+
+/* ============================================================================
+ * Find in Note
+ * ============================================================================
+ * Ctrl+G opens a find bar over the editor that looks for text in the open
+ * note. Every match in view is highlighted. Enter and Shift+Enter (or Ctrl+G
+ * and Ctrl+Shift+G) move the cursor to the next and previous match.
+ *
+ * Matches are found with Boyer-Moore-Horspool. For each byte a table holds
+ * how far the query can shift when that byte ends a failed window, so most
+ * windows are rejected after a single comparison and long queries skip
+ * through the text almost their own length at a time. The search runs in
+ * place over the two halves of the gap buffer; matches that straddle the gap
+ * are found in a small window copied from both sides of it. ASCII letters
+ * match either case, other characters match exactly.
+ *
+ * The matches are found once per change to the note (Note.generation) and
+ * kept sorted. Drawing a line finds its first match by binary search, and
+ * stepping to the next or previous match only moves an index.
+ */
+
+/**
+ * @brief State of the find bar and the matches in the selected note
+ */
+typedef struct {
+  bool open;                  /* The bar is shown and takes typing */
+  char query[128];            /* Text typed into the bar */
+  unsigned char pattern[128]; /* Query with ASCII letters folded */
+  size_t pattern_len;         /* Bytes in pattern */
+  unsigned char fold[256];    /* Byte -> folded byte */
+  size_t shift[256];          /* Horspool shift for each folded byte */
+  size_t *matches;            /* Offsets of the matches, ascending */
+  int match_count;            /* Entries in matches */
+  int match_capacity;         /* Allocated entries in matches */
+  int current;                /* Match the cursor is on (-1 if none) */
+  int note_id;                /* Note the matches were found in (-1 if none) */
+  unsigned generation;        /* Note.generation they were found at */
+} FindBar;
+
+static FindBar find_bar; /* The find bar (closed until Ctrl+G) */
+
+/**
+ * @brief Build the folded pattern and the shift table for the query
+ */
+static void find_prepare(void) {
+  for (int c = 0; c < 256; c++) {
+    bool ascii = c < 0x80 && case_fold_table[c] < 0x80;
+    find_bar.fold[c] = ascii ? (unsigned char)case_fold_table[c]
+                             : (unsigned char)c;
+  }
+
+  size_t m = strlen(find_bar.query);
+  for (size_t i = 0; i < m; i++)
+    find_bar.pattern[i] = find_bar.fold[(unsigned char)find_bar.query[i]];
+  find_bar.pattern_len = m;
+
+  /* A byte not in the query lets the window move past it entirely; one that
+   * is moves the window to line up with its last occurrence */
+  for (int c = 0; c < 256; c++)
+    find_bar.shift[c] = m;
+  for (size_t i = 0; i + 1 < m; i++)
+    find_bar.shift[find_bar.pattern[i]] = m - 1 - i;
+
+  find_bar.note_id = -1;
+  find_bar.current = -1;
+}
+
+/**
+ * @brief Record a match
+ * @param pos Text offset of the match
+ * @return False if memory ran out
+ */
+static bool find_add_match(size_t pos) {
+  if (find_bar.match_count == find_bar.match_capacity) {
+    int capacity =
+        find_bar.match_capacity > 0 ? find_bar.match_capacity * 2 : 64;
+    size_t *grown = realloc(find_bar.matches, capacity * sizeof(size_t));
+    if (grown == NULL)
+      return false;
+    find_bar.matches = grown;
+    find_bar.match_capacity = capacity;
+  }
+  find_bar.matches[find_bar.match_count++] = pos;
+  return true;
+}
+
+/**
+ * @brief Find the matches that lie inside one run of bytes
+ *
+ * Matches never overlap: the scan goes on after the end of each one.
+ *
+ * @param text The bytes
+ * @param len Number of bytes
+ * @param base Text offset of the first byte
+ * @param from First text offset a match may start at (moved past each match)
+ * @return False if memory ran out
+ */
+static bool find_scan(const unsigned char *text, size_t len, size_t base,
+                      size_t *from) {
+  const unsigned char *fold = find_bar.fold;
+  const unsigned char *pattern = find_bar.pattern;
+  size_t m = find_bar.pattern_len;
+  unsigned char last = pattern[m - 1];
+
+  size_t i = *from > base ? *from - base : 0;
+  while (i + m <= len) {
+    unsigned char c = fold[text[i + m - 1]];
+    if (c == last) {
+      size_t k = 0;
+      while (k + 1 < m && fold[text[i + k]] == pattern[k])
+        k++;
+      if (k + 1 == m) {
+        if (!find_add_match(base + i))
+          return false;
+        i += m;
+        *from = base + i;
+        continue;
+      }
+    }
+    i += find_bar.shift[c];
+  }
+  return true;
+}
+
+/**
+ * @brief Find the query's matches in a buffer (a TextBufferRead)
+ * @param arg Unused
+ */
+static void find_scan_buffer(const TextBuffer *tb, void *arg) {
+  (void)arg;
+  find_bar.match_count = 0;
+
+  /* Before the gap, across it, then after it, so matches stay in order */
+  const unsigned char *data = (const unsigned char *)tb->data;
+  size_t m = find_bar.pattern_len;
+  size_t tail = tb->capacity - tb->gap_end;
+  size_t from = 0;
+  if (!find_scan(data, tb->gap_start, 0, &from))
+    return;
+  if (m > 1 && tb->gap_start > 0 && tail > 0) {
+    /* Only a match that starts before the gap and ends after it fits */
+    unsigned char window[2 * sizeof(find_bar.pattern)];
+    size_t before = tb->gap_start < m - 1 ? tb->gap_start : m - 1;
+    size_t after = tail < m - 1 ? tail : m - 1;
+    memcpy(window, data + tb->gap_start - before, before);
+    memcpy(window + before, data + tb->gap_end, after);
+    if (!find_scan(window, before + after, tb->gap_start - before, &from))
+      return;
+  }
+  find_scan(data + tb->gap_end, tail, tb->gap_start, &from);
+}
+
+/**
+ * @brief Find the query's matches in a note unless they are current
+ * @param note The note (must be loaded)
+ */
+static void find_refresh(const Note *note) {
+  if (find_bar.note_id == note->id && find_bar.generation == note->generation)
+    return;
+  find_bar.note_id = note->id;
+  find_bar.generation = note->generation;
+  find_bar.match_count = 0;
+  find_bar.current = -1;
+  if (find_bar.pattern_len > 0)
+    text_buffer_read(&note->content, find_scan_buffer, NULL);
+}
+
+/**
+ * @brief Get the first match that starts at or after an offset
+ * @param pos Text offset
+ * @return Index into find_bar.matches (match_count if there is none)
+ */
+static int find_match_from(size_t pos) {
+  int lo = 0;
+  int hi = find_bar.match_count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (find_bar.matches[mid] < pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/**
+ * @brief Move the cursor to a match, or to the nearest one from the cursor
+ *
+ * While the cursor is still on the current match, stepping just moves to
+ * the neighbouring entry. Otherwise the match is looked up from the cursor.
+ * Both wrap around at either end of the note.
+ *
+ * @param note The selected note (must be loaded)
+ * @param direction 1 for the next match, -1 for the previous one, 0 for the
+ *                  match at the cursor or the first one after it
+ */
+static void find_step(Note *note, int direction) {
+  find_refresh(note);
+  int count = find_bar.match_count;
+  request_redraw();
+  if (count == 0)
+    return;
+
+  size_t pos = notebook.cursorPos;
+  int next;
+  if (direction != 0 && find_bar.current >= 0 &&
+      find_bar.matches[find_bar.current] == pos) {
+    next = find_bar.current + direction;
+  } else if (direction > 0) {
+    next = find_match_from(pos + 1);
+  } else if (direction < 0) {
+    next = find_match_from(pos) - 1;
+  } else {
+    next = find_match_from(pos);
+  }
+  next = (next + count) % count;
+  find_bar.current = next;
+  cursor_set(find_bar.matches[next]);
+}
+
+/**
+ * @brief Open or close the find bar
+ *
+ * The query is kept for the next time the bar opens. Escape closes the bar
+ * while it is open instead of quitting.
+ *
+ * @param open True to open the bar
+ */
+static void find_set_open(bool open) {
+  find_bar.open = open;
+  SetExitKey(open ? KEY_NULL : KEY_ESCAPE);
+  cursor_blink_reset();
+  if (open) {
+    find_prepare();
+  } else {
+    free(find_bar.matches);
+    find_bar.matches = NULL;
+    find_bar.match_count = find_bar.match_capacity = 0;
+    find_bar.note_id = -1;
+  }
+}
+
+/**
+ * @brief Highlight the matches on one drawn line
+ * @param note The note being drawn
+ * @param start Offset of the first drawn byte of the line
+ * @param end Offset one past the line's last byte
+ * @param font Font the line is drawn with
+ * @param font_size Font size the line is drawn with
+ * @param x Where the first drawn character is placed
+ * @param y Top of the line
+ */
+static void find_draw_highlights(const Note *note, size_t start, size_t end,
+                                 Font font, int font_size, int x, int y) {
+  if (!find_bar.open || find_bar.note_id != note->id ||
+      find_bar.generation != note->generation)
+    return;
+
+  size_t m = find_bar.pattern_len;
+  for (int i = find_match_from(start + 1 > m ? start + 1 - m : 0);
+       i < find_bar.match_count && find_bar.matches[i] < end; i++) {
+    size_t from = find_bar.matches[i];
+    size_t to = from + m;
+    if (from < start)
+      from = start;
+    if (to > end)
+      to = end;
+    float left = x + measure_text_range(font, font_size, &note->content,
+                                        start, from - start);
+    float right = x + measure_text_range(font, font_size, &note->content,
+                                         start, to - start);
+    DrawRectangle((int)left, y, (int)(right - left) + 2, EDITOR_LINE_HEIGHT,
+                  i == find_bar.current ? FIND_CURRENT : FIND_MATCH);
+  }
+}
+
+/* ============================================================================
+ * Layout Cache
+ * ============================================================================
+ * The editor's word wrap is cached per paragraph (line of the note) on the
+ * paragraph's line index node. A frame only wraps paragraphs that have no
+ * cached layout yet: ones that were just edited, or that scroll into view for
+ * the first time. Changing the wrap width drops the whole cache.
+ */
+
+static char *layout_scratch;           /* Reusable copy of a paragraph */
+static size_t layout_scratch_capacity; /* Allocated bytes in layout_scratch */
+
+/**
+ * @brief Get a scratch buffer with room for at least len bytes
+ * @param len Number of bytes needed
+ * @return The buffer, or NULL if out of memory
+ */
+static char *layout_scratch_reserve(size_t len) {
+  if (len > layout_scratch_capacity) {
+    size_t new_capacity = layout_scratch_capacity > 0 ? layout_scratch_capacity
+                                                      : 1024;
+    while (new_capacity < len) {
+      new_capacity *= 2;
+    }
+    char *grown = realloc(layout_scratch, new_capacity);
+    if (grown == NULL)
+      return NULL;
+    layout_scratch = grown;
+    layout_scratch_capacity = new_capacity;
+  }
+  return layout_scratch;
+}
+
+/**
+ * @brief Detect the markdown style of a paragraph from its first bytes
+ * @param text The paragraph text
+ * @param len Length of the paragraph in bytes
+ * @param skip Receives the number of markup bytes that are not drawn
+ * @return The paragraph's style
+ */
+static LineStyle line_style_of(const char *text, size_t len, int *skip) {
+  if (len >= 2 && text[0] == '#' && text[1] == ' ') {
+    *skip = 2;
+    return LINE_STYLE_H1;
+  }
+  if (len >= 3 && text[0] == '#' && text[1] == '#' && text[2] == ' ') {
+    *skip = 3;
+    return LINE_STYLE_H2;
+  }
+  if (len >= 2 && text[0] == '-' && text[1] == ' ') {
+    *skip = 2;
+    return LINE_STYLE_BULLET;
+  }
+  *skip = 0;
+  return LINE_STYLE_TEXT;
+}
+
+/**
+ * @brief Get the font a style is drawn with
+ */
+static Font line_style_font(LineStyle style) {
+  return (style == LINE_STYLE_H1 || style == LINE_STYLE_H2) ? boldFont
+                                                            : mainFont;
+}
+
+/**
+ * @brief Get the font size a style is drawn with
+ */
+static int line_style_font_size(LineStyle style) {
+  switch (style) {
+  case LINE_STYLE_H1:
+    return 24;
+  case LINE_STYLE_H2:
+    return 20;
+  default:
+    return 18;
+  }
+}
+
+/**
+ * @brief Get the text color a style is drawn with
+ */
+static Color line_style_color(LineStyle style) {
+  switch (style) {
+  case LINE_STYLE_H1:
+    return ACCENT_PURPLE;
+  case LINE_STYLE_H2:
+    return ACCENT_BLUE;
+  default:
+    return TEXT_PRIMARY;
+  }
+}
+
+/**
+ * @brief Get the horizontal indent of a style's text (room for the bullet)
+ */
+static int line_style_indent(LineStyle style) {
+  return style == LINE_STYLE_BULLET ? 15 : 0;
+}
+
+/**
+ * @brief Set the wrap width of a note's layout, dropping it if it changed
+ * @param note The note (must be loaded)
+ * @param width Maximum width of a visual line in pixels
+ */
+static void layout_set_width(Note *note, float width) {
+  if (note->layout_width == width)
+    return;
+
+  LineIndex *li = &note->lines;
+  for (int i = 0; i < li->node_count; i++) {
+    free(li->nodes[i].wraps);
+    li->nodes[i].wraps = NULL;
+    li->nodes[i].wrap_count = 0;
+  }
+  note->layout_width = width;
+
+  /* Re-estimate the height of every paragraph from the body font's 'n' */
+  GlyphMetrics *gm = glyph_metrics_get(mainFont, 18);
+  int per_line = (int)(width / glyph_advance(gm, 'n'));
+  li->wrap_estimate = per_line > 0 ? per_line : 1;
+  line_index_reset_heights(li, li->root);
+}
+
+/**
+ * @brief Word wrap a paragraph unless its layout is already cached
+ * @param note The note (must be loaded)
+ * @param line Line number of the paragraph
+ * @param start_out Receives the byte offset of the paragraph (may be NULL)
+ * @return Line index node of the paragraph, or -1 on failure
+ */
+static int layout_paragraph(Note *note, int line, size_t *start_out) {
+  size_t start = 0;
+  int node = line_index_node_at(&note->lines, line, &start);
+  if (start_out)
+    *start_out = start;
+  if (node < 0 || note->lines.nodes[node].wraps != NULL)
+    return node;
+
+  /* Work on a contiguous copy of the paragraph without its '\n' */
+  size_t len = note->lines.nodes[node].len;
+  if (len > 0 && text_buffer_at(&note->content, start + len - 1) == '\n')
+    len--;
+  char *text = layout_scratch_reserve(len + 1);
+  if (text == NULL)
+    return -1;
+  text_buffer_copy(&note->content, start, len, text);
+  text[len] = '\0';
+
+  int skip;
+  LineStyle style = line_style_of(text, len, &skip);
+  GlyphMetrics *gm = glyph_metrics_get(line_style_font(style),
+                                       line_style_font_size(style));
+  float max_width = note->layout_width - line_style_indent(style);
+
+  VisualLine *wraps = NULL;
+  int count = 0, capacity = 0;
+  size_t pos = 0;
+  do {
+    /*
+     * Add up advances until the line overflows, then break at its last
+     * space, or before the overflowing character if there is no space.
+     */
+    size_t from = pos + (count == 0 ? skip : 0);
+    size_t end = from;
+    size_t last_space = from;
+    float advance = 0, space_width = 0;
+    while (end < len) {
+      int codepoint;
+      int size = decode_utf8(text + end, len - end, &codepoint);
+      if (codepoint == ' ') {
+        last_space = end;
+        space_width = advance;
+      }
+
+      float next = advance + glyph_advance(gm, codepoint);
+      if (next - TEXT_SPACING > max_width && end > from) {
+        if (last_space > from) {
+          end = last_space;
+          advance = space_width;
+        }
+        break;
+      }
+      advance = next;
+      end += size;
+    }
+
+    if (count == capacity) {
+      capacity = capacity > 0 ? capacity * 2 : 4;
+      VisualLine *grown = realloc(wraps, capacity * sizeof(VisualLine));
+      if (grown == NULL) {
+        free(wraps);
+        return -1;
+      }
+      wraps = grown;
+    }
+
+    VisualLine *vl = &wraps[count];
+    vl->start = pos;
+    vl->len = end - pos;
+    vl->width = advance > 0 ? advance - TEXT_SPACING : 0;
+    vl->style = (unsigned char)style;
+    vl->skip = (unsigned char)(count == 0 ? skip : 0);
+    count++;
+
+    /* A space that caused the wrap is not drawn on either line */
+    pos = end;
+    if (pos < len && text[pos] == ' ')
+      pos++;
+  } while (pos < len);
+
+  note->lines.nodes[node].wraps = wraps;
+  note->lines.nodes[node].wrap_count = count;
+
+  /* Replace the estimated height now that the real one is known */
+  if (note->lines.nodes[node].height != count)
+    line_index_set_height(&note->lines, note->lines.root, line, count);
+  return node;
+}
+
+/**
+ * @brief Get the visual line that holds an offset, counted from the top
+ * @param note The note (must be loaded)
+ * @param pos Byte offset
+ * @return Visual line number
+ */
+static long layout_visual_line_of(Note *note, size_t pos) {
+  int line = line_index_line_at(&note->lines, pos, NULL);
+  size_t start;
+  int node = layout_paragraph(note, line, &start);
+  long visual = line_index_height_before(&note->lines, line);
+  if (node < 0)
+    return visual;
+
+  /* The offset belongs to the last row that starts at or before it */
+  const LineNode *paragraph = &note->lines.nodes[node];
+  int row = 0;
+  while (row + 1 < paragraph->wrap_count &&
+         start + paragraph->wraps[row + 1].start <= pos) {
+    row++;
+  }
+  return visual + row;
+}
+
+/**
+ * @brief Draw one cached visual line and remember it for hit-testing
+ * @param note The note being drawn
+ * @param vl The visual line
+ * @param paragraph_start Byte offset of the line's paragraph
+ * @param x Left edge of the text area
+ * @param y Top of the line
+ */
+static void draw_visual_line(const Note *note, const VisualLine *vl,
+                             size_t paragraph_start, int x, int y) {
+  LineStyle style = (LineStyle)vl->style;
+  Font font = line_style_font(style);
+  int font_size = line_style_font_size(style);
+  int text_x = x + line_style_indent(style);
+
+  size_t len = vl->len - vl->skip;
+  char *text = layout_scratch_reserve(len + 1);
+  if (text == NULL)
+    return;
+  text_buffer_copy(&note->content, paragraph_start + vl->start + vl->skip, len,
+                   text);
+  text[len] = '\0';
+
+  if (style == LINE_STYLE_BULLET && vl->skip > 0) {
+    DrawTextEx(mainFont, "•", (Vector2){x, y}, font_size, 1, ACCENT_PURPLE);
+  }
+  size_t text_start = paragraph_start + vl->start + vl->skip;
+  find_draw_highlights(note, text_start, text_start + len, font, font_size,
+                       text_x, y);
+  DrawTextEx(font, text, (Vector2){text_x, y}, font_size, 1,
+             line_style_color(style));
+
+  /* Remember where the line went for the cursor and mouse hit-tests */
+  if (editor_line_count < MAX_EDITOR_LINES) {
+    EditorLine *drawn = &editor_lines[editor_line_count++];
+    drawn->start = paragraph_start + vl->start;
+    drawn->len = vl->len;
+    drawn->skip = vl->skip;
+    drawn->x = text_x;
+    drawn->y = y;
+    drawn->font = font;
+    drawn->font_size = font_size;
+  }
+}
+
+/* ============================================================================
+ * Drawing Functions
+ * ============================================================================
+ */
+
+/**
+ * @brief Draw the header bar
+ */
+static void draw_header(void) {
+  /* Background */
+  DrawRectangle(0, 0, WINDOW_WIDTH, HEADER_HEIGHT, BG_HEADER);
+  DrawRectangle(0, HEADER_HEIGHT - 1, WINDOW_WIDTH, 1, BORDER_COLOR);
+
+  /* App title */
+  DrawTextEx(mainFont, "📓 Notes", (Vector2){20, 14}, 22, 1, TEXT_PRIMARY);
+
+  /* Current note title */
+  if (notebook.count > 0 && notebook.selected >= 0) {
+    Note *note = &notebook.notes[notebook.selected];
+    char title_display[150];
+    snprintf(title_display, sizeof(title_display), " / %s%s", note->title,
+             note->modified ? " •" : "");
+    DrawTextEx(mainFont, title_display, (Vector2){130, 14}, 22, 1,
+               TEXT_SECONDARY);
+  }
+
+  /* Search box (when visible) */
+  if (notebook.showSearch) {
+    DrawRectangleRounded((Rectangle){WINDOW_WIDTH - 250, 10, 230, 30}, 0.3f, 8,
+                         BG_SIDEBAR);
+    DrawTextEx(mainFont, "🔍", (Vector2){WINDOW_WIDTH - 240, 14}, 18, 1,
+               TEXT_SECONDARY);
+    if (notebook.searchQuery[0] == '\0' && !notebook.searchFocused) {
+      DrawTextEx(mainFont, "Search notes", (Vector2){WINDOW_WIDTH - 215, 14},
+                 18, 1, TEXT_MUTED);
+    }
+    DrawTextEx(mainFont, notebook.searchQuery,
+               (Vector2){WINDOW_WIDTH - 215, 14}, 18, 1, TEXT_PRIMARY);
+
+    /* Caret, blinking in step with the editor cursor */
+    cursor_drawn_visible = cursor_visible();
+    if (notebook.searchFocused && !switcher.open && cursor_drawn_visible) {
+      Vector2 size = MeasureTextEx(mainFont, notebook.searchQuery, 18, 1);
+      DrawRectangle(WINDOW_WIDTH - 213 + (int)size.x, 15, 2, 20,
+                    ACCENT_PURPLE);
+    }
+  }
+}
+
+/**
+ * @brief Number of rows in the sidebar's note list
+ */
+static int sidebar_row_count(void) {
+  return notebook.searchResults != NULL ? notebook.searchResultCount
+                                        : notebook.count;
+}
+
+/**
+ * @brief Draw the sidebar with note list
+ */
+static void draw_sidebar(void) {
+  /* Background */
+  DrawRectangle(0, HEADER_HEIGHT, SIDEBAR_WIDTH, WINDOW_HEIGHT - HEADER_HEIGHT,
+                BG_SIDEBAR);
+  DrawRectangle(SIDEBAR_WIDTH - 1, HEADER_HEIGHT, 1, WINDOW_HEIGHT,
+                BORDER_COLOR);
+
+  /* Section header (the number of matches while a search is active) */
+  char section[48] = "NOTES";
+  if (notebook.searchResults != NULL &&
+      notebook.searchMatchCount > notebook.searchResultCount) {
+    snprintf(section, sizeof(section), "TOP %d OF %d RESULTS",
+             notebook.searchResultCount, notebook.searchMatchCount);
+  } else if (notebook.searchResults != NULL) {
+    snprintf(section, sizeof(section), "%d RESULT%s",
+             notebook.searchResultCount,
+             notebook.searchResultCount == 1 ? "" : "S");
+  }
+  if (notebook.searchInvalid) {
+    strcpy(section, "INVALID PATTERN");
+  }
+  if (background_busy & BACKGROUND_SEARCH) {
+    strcpy(section, "SEARCHING...");
+  }
+  DrawTextEx(mainFont, section, (Vector2){20, HEADER_HEIGHT + 15}, 12, 1,
+             TEXT_MUTED);
+
+  /* New note button */
+  Rectangle new_btn = {15, HEADER_HEIGHT + 40, SIDEBAR_WIDTH - 30, 35};
+  bool hover_new = CheckCollisionPointRec(GetMousePosition(), new_btn);
+  DrawRectangleRounded(new_btn, 0.2f, 8, hover_new ? ACCENT_PURPLE : BG_HOVER);
+  DrawTextEx(mainFont, "+ New Note", (Vector2){new_btn.x + 70, new_btn.y + 8},
+             16, 1, TEXT_PRIMARY);
+
+  if (hover_new && IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) {
+    create_new_note();
+  }
+
+  /* Note list (only the rows inside the visible area are visited) */
+  int start_y = HEADER_HEIGHT + 90;
+  int item_height = 40;
+  int first = notebook.scrollOffset / item_height;
+  int visible = (WINDOW_HEIGHT - start_y) / item_height + 2;
+
+  int rows = sidebar_row_count();
+  for (int row = first; row < rows && row < first + visible; row++) {
+    int y = start_y + row * item_height - notebook.scrollOffset;
+    int i = notebook.searchResults != NULL ? notebook.searchResults[row] : row;
+
+    /* Skip items outside visible area */
+    if (y < HEADER_HEIGHT + 85 || y > WINDOW_HEIGHT - item_height)
+      continue;
+
+    Rectangle item_rect = {10, y, SIDEBAR_WIDTH - 20, item_height - 5};
+    bool hover = CheckCollisionPointRec(GetMousePosition(), item_rect);
+    bool selected = (i == notebook.selected);
+
+    /* Draw background */
+    if (selected) {
+      DrawRectangleRounded(item_rect, 0.2f, 8, BG_SELECTED);
+    } else if (hover) {
+      DrawRectangleRounded(item_rect, 0.2f, 8, BG_HOVER);
+    }
+
+    /* Draw note title with icon */
+    Note *note = &notebook.notes[i];
+    char display[150];
+    snprintf(display, sizeof(display), "📄 %s%s", note->title,
+             note->modified ? " •" : "");
+    DrawTextEx(mainFont, display, (Vector2){item_rect.x + 10, item_rect.y + 10},
+               15, 1, selected ? TEXT_PRIMARY : TEXT_SECONDARY);
+
+    /* Handle clicks */
+    if (hover && IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) {
+      select_note(i);
+    }
+
+    /* Right-click to delete */
+    if (hover && IsMouseButtonPressed(MOUSE_BUTTON_RIGHT)) {
+      delete_note(i);
+      break;
+    }
+  }
+}
+
+/**
+ * @brief Draw the main editor area
+ */
+static void draw_editor(void) {
+  int editor_x = SIDEBAR_WIDTH;
+  int editor_y = HEADER_HEIGHT;
+  int editor_width = WINDOW_WIDTH - SIDEBAR_WIDTH;
+  int editor_height = WINDOW_HEIGHT - HEADER_HEIGHT;
+
+  /* Background */
+  DrawRectangle(editor_x, editor_y, editor_width, editor_height, BG_EDITOR);
 
   /* Empty state */
   if (notebook.count == 0 || notebook.selected < 0) {
-    const char *empty_msg = "Create a new note to get started";
+    const char *empty_msg = load_progress.dir != NULL
+                                ? "Loading notes..."
+                                : "Create a new note to get started";
     Vector2 text_size = MeasureTextEx(mainFont, empty_msg, 20, 1);
     DrawTextEx(mainFont, empty_msg,
                (Vector2){editor_x + (editor_width - text_size.x) / 2,
@@ -507,6 +10718,8 @@ static void draw_editor(void) {
   }
 
   Note *note = &notebook.notes[notebook.selected];
+  if (note->content.data == NULL)
+    return;
 
   /* Layout */
   int padding = 40;
@@ -522,82 +10735,107 @@ static void draw_editor(void) {
   DrawRectangle(content_x, content_y + 45, content_width, 1, BORDER_COLOR);
 
   /* Draw content with word wrap and markdown styling */
-  int text_y = content_y + 60;
-  int line_height = 24;
+  int line_height = EDITOR_LINE_HEIGHT;
   int max_width = content_width - 20;
+  int view_height = EDITOR_TEXT_BOTTOM - EDITOR_TEXT_TOP;
+  editor_line_count = 0;
 
-  char *content = note->content;
-  char line[256];
-  int char_index = 0;
+  TextBuffer *content = &note->content;
+  LineIndex *lines = &note->lines;
+  layout_set_width(note, max_width);
+  if (find_bar.open)
+    find_refresh(note);
 
-  while (content[char_index] != '\0' && text_y < WINDOW_HEIGHT - 30) {
-    /* Find line boundaries */
-    int line_len = 0;
-    int last_space = -1;
+  /* Follow the cursor after it moved, then ease towards the target */
+  if (notebook.scrollToCursor) {
+    float cursor_top = layout_visual_line_of(note, notebook.cursorPos) *
+                       (float)line_height;
+    if (cursor_top < notebook.editorScrollTarget)
+      notebook.editorScrollTarget = cursor_top;
+    if (cursor_top + line_height > notebook.editorScrollTarget + view_height)
+      notebook.editorScrollTarget = cursor_top + line_height - view_height;
+    notebook.scrollToCursor = false;
+  }
+  float max_scroll = (float)(line_index_height(lines) * line_height) -
+                     view_height + line_height;
+  if (notebook.editorScrollTarget > max_scroll)
+    notebook.editorScrollTarget = max_scroll;
+  if (notebook.editorScrollTarget < 0)
+    notebook.editorScrollTarget = 0;
 
-    while (content[char_index + line_len] != '\0' &&
-           content[char_index + line_len] != '\n') {
-      if (content[char_index + line_len] == ' ') {
-        last_space = line_len;
-      }
+  float step = GetFrameTime() * SCROLL_SMOOTHING;
+  notebook.editorScroll +=
+      (notebook.editorScrollTarget - notebook.editorScroll) *
+      (step < 1 ? step : 1);
+  if (fabsf(notebook.editorScrollTarget - notebook.editorScroll) < 0.5f)
+    notebook.editorScroll = notebook.editorScrollTarget;
 
-      /* Check if line exceeds width */
-      strncpy(line, content + char_index, line_len + 1);
-      line[line_len + 1] = '\0';
-      Vector2 size = MeasureTextEx(mainFont, line, 18, 1);
+  /*
+   * Jump straight to the paragraph at the top of the viewport. Laying it out
+   * can change its estimated height, so look it up again until it is stable.
+   */
+  long first_visual = (long)(notebook.editorScroll / line_height);
+  int row = 0;
+  int p = line_index_line_at_height(lines, first_visual, &row);
+  while (layout_paragraph(note, p, NULL) >= 0) {
+    int again = line_index_line_at_height(lines, first_visual, &row);
+    if (again == p)
+      break;
+    p = again;
+  }
+  int text_y = EDITOR_TEXT_TOP - (int)(notebook.editorScroll -
+                                       first_visual * (float)line_height);
 
-      if (size.x > max_width && last_space > 0) {
-        line_len = last_space;
-        break;
-      }
-      line_len++;
-    }
-
-    /* Extract the line */
-    strncpy(line, content + char_index, line_len);
-    line[line_len] = '\0';
-
-    /* Apply markdown styling */
-    Color line_color = TEXT_PRIMARY;
-    int font_size = 18;
-
-    if (line[0] == '#' && line[1] == ' ') {
-      /* H1 heading */
-      line_color = ACCENT_PURPLE;
-      font_size = 24;
-      DrawTextEx(boldFont, line + 2, (Vector2){content_x, text_y}, font_size, 1,
-                 line_color);
-    } else if (line[0] == '#' && line[1] == '#' && line[2] == ' ') {
-      /* H2 heading */
-      line_color = ACCENT_BLUE;
-      font_size = 20;
-      DrawTextEx(boldFont, line + 3, (Vector2){content_x, text_y}, font_size, 1,
-                 line_color);
-    } else if (line[0] == '-' && line[1] == ' ') {
-      /* Bullet point */
-      DrawTextEx(mainFont, "•", (Vector2){content_x, text_y}, font_size, 1,
-                 ACCENT_PURPLE);
-      DrawTextEx(mainFont, line + 2, (Vector2){content_x + 15, text_y},
-                 font_size, 1, line_color);
-    } else {
-      /* Normal text */
-      DrawTextEx(mainFont, line, (Vector2){content_x, text_y}, font_size, 1,
-                 line_color);
+  /* Draw visual lines until the viewport is full, wrapping uncached ones */
+  BeginScissorMode(editor_x, EDITOR_TEXT_TOP, editor_width, view_height);
+  int paragraph_count = line_index_count(lines);
+  for (; p < paragraph_count && text_y < EDITOR_TEXT_BOTTOM; p++, row = 0) {
+    size_t start;
+    int node = layout_paragraph(note, p, &start);
+    if (node < 0)
+      break;
+
+    const LineNode *paragraph = &lines->nodes[node];
+    for (int k = row; k < paragraph->wrap_count && text_y < EDITOR_TEXT_BOTTOM;
+         k++) {
+      draw_visual_line(note, &paragraph->wraps[k], start, content_x, text_y);
+      text_y += line_height;
     }
+  }
 
-    /* Move to next line */
-    char_index += line_len;
-    if (content[char_index] == '\n')
-      char_index++;
-    else if (content[char_index] == ' ')
-      char_index++;
+  /* Blinking cursor, placed on the visual line that holds it */
+  cursor_drawn_visible = cursor_visible();
+  if (cursor_drawn_visible && !search_has_focus() && !switcher.open) {
+    for (int i = 0; i < editor_line_count; i++) {
+      const EditorLine *drawn = &editor_lines[i];
+      if (notebook.cursorPos < drawn->start ||
+          notebook.cursorPos > drawn->start + drawn->len)
+        continue;
 
-    text_y += line_height;
+      int cursor_x = drawn->x;
+      size_t text_start = drawn->start + drawn->skip;
+      if (notebook.cursorPos > text_start) {
+        cursor_x += (int)measure_text_range(drawn->font, drawn->font_size,
+                                            content, text_start,
+                                            notebook.cursorPos - text_start);
+      }
+      DrawRectangle(cursor_x, drawn->y, 2, line_height, ACCENT_PURPLE);
+      break;
+    }
   }
+  EndScissorMode();
 
-  /* Blinking cursor */
-  if ((int)(GetTime() * 2) % 2 == 0) {
-    DrawRectangle(content_x, text_y, 2, line_height, ACCENT_PURPLE);
+  /* Scrollbar thumb, sized by the share of the note that is visible */
+  float total = (float)(line_index_height(lines) * line_height);
+  if (total > view_height) {
+    float thumb = view_height * view_height / total;
+    if (thumb < 20)
+      thumb = 20;
+    float thumb_y = EDITOR_TEXT_TOP + (view_height - thumb) *
+                                          (notebook.editorScroll / max_scroll);
+    DrawRectangleRounded(
+        (Rectangle){editor_x + editor_width - 8, thumb_y, 4, thumb}, 1.0f, 4,
+        BG_HOVER);
   }
 }
 
@@ -613,25 +10851,21 @@ static void draw_status_bar(void) {
 
   /* Statistics */
   char status[128];
-  if (notebook.count > 0 && notebook.selected >= 0) {
+  if (notebook.count > 0 && notebook.selected >= 0 &&
+      notebook.notes[notebook.selected].content.data != NULL) {
     Note *note = &notebook.notes[notebook.selected];
-    int char_count = strlen(note->content);
-    int word_count = 0;
-    bool in_word = false;
-
-    for (int i = 0; note->content[i]; i++) {
-      if (note->content[i] == ' ' || note->content[i] == '\n') {
-        in_word = false;
-      } else if (!in_word) {
-        in_word = true;
-        word_count++;
-      }
-    }
-    snprintf(status, sizeof(status), "%d notes | %d words | %d characters",
-             notebook.count, word_count, char_count);
+    snprintf(status, sizeof(status), "%d notes | %ld words | %ld characters",
+             notebook.count, note->word_count, note->char_count);
   } else {
     snprintf(status, sizeof(status), "%d notes", notebook.count);
   }
+  size_t len = strlen(status);
+  if (load_progress.dir != NULL) {
+    snprintf(status + len, sizeof(status) - len, " | loading notes...");
+  } else if (background_busy & BACKGROUND_LOAD) {
+    snprintf(status + len, sizeof(status) - len, " | indexing %d notes...",
+             vault_loader_pending());
+  }
 
   DrawTextEx(mainFont, status, (Vector2){15, bar_y + 5}, 14, 1, TEXT_MUTED);
 
@@ -647,15 +10881,409 @@ static void draw_status_bar(void) {
              TEXT_MUTED);
 }
 
+/**
+ * @brief Screen rectangle of the find bar
+ */
+static Rectangle find_bar_rect(void) {
+  return (Rectangle){WINDOW_WIDTH - 340, HEADER_HEIGHT + 8, 320, 34};
+}
+
+/**
+ * @brief Draw the find bar in the top right corner of the editor
+ */
+static void draw_find_bar(void) {
+  Rectangle bar = find_bar_rect();
+  DrawRectangleRounded(bar, 0.3f, 8, BG_SIDEBAR);
+
+  Vector2 text_pos = {bar.x + 12, bar.y + 8};
+  if (find_bar.query[0] == '\0') {
+    DrawTextEx(mainFont, "Find in note", text_pos, 18, 1, TEXT_MUTED);
+  }
+  DrawTextEx(mainFont, find_bar.query, text_pos, 18, 1, TEXT_PRIMARY);
+  cursor_drawn_visible = cursor_visible();
+  if (cursor_drawn_visible && !switcher.open) {
+    Vector2 size = MeasureTextEx(mainFont, find_bar.query, 18, 1);
+    DrawRectangle((int)(text_pos.x + size.x) + 2, (int)bar.y + 7, 2, 20,
+                  ACCENT_PURPLE);
+  }
+
+  /* Position of the current match, once the query has matches */
+  char count[32] = "";
+  if (find_bar.query[0] != '\0' && find_bar.note_id >= 0) {
+    if (find_bar.match_count == 0) {
+      strcpy(count, "No results");
+    } else if (find_bar.current >= 0) {
+      snprintf(count, sizeof(count), "%d of %d", find_bar.current + 1,
+               find_bar.match_count);
+    } else {
+      snprintf(count, sizeof(count), "%d found", find_bar.match_count);
+    }
+  }
+  Vector2 size = MeasureTextEx(mainFont, count, 14, 1);
+  DrawTextEx(mainFont, count,
+             (Vector2){bar.x + bar.width - size.x - 12, bar.y + 10}, 14, 1,
+             TEXT_MUTED);
+}
+
+/**
+ * @brief Screen rectangle of the replace panel
+ */
+static Rectangle replace_panel_rect(void) {
+  int rows = replace_panel.hit_count < REPLACE_ROWS ? replace_panel.hit_count
+                                                    : REPLACE_ROWS;
+  return (Rectangle){(WINDOW_WIDTH - 560) / 2, HEADER_HEIGHT + 40, 560,
+                     150 + rows * 30};
+}
+
+/**
+ * @brief Draw one input field of the replace panel
+ */
+static void draw_replace_field(Rectangle field, const char *text,
+                               const char *placeholder, bool focused) {
+  DrawRectangleRounded(field, 0.2f, 8, BG_EDITOR);
+  Vector2 text_pos = {field.x + 12, field.y + 9};
+  if (text[0] == '\0') {
+    DrawTextEx(mainFont, placeholder, text_pos, 18, 1, TEXT_MUTED);
+  }
+  DrawTextEx(mainFont, text, text_pos, 18, 1, TEXT_PRIMARY);
+  if (focused && cursor_drawn_visible) {
+    Vector2 size = MeasureTextEx(mainFont, text, 18, 1);
+    DrawRectangle((int)(text_pos.x + size.x) + 2, (int)field.y + 8, 2, 20,
+                  ACCENT_PURPLE);
+  }
+}
+
+/**
+ * @brief Draw the replace panel over the rest of the window
+ */
+static void draw_replace_panel(void) {
+  DrawRectangle(0, 0, WINDOW_WIDTH, WINDOW_HEIGHT, (Color){0, 0, 0, 120});
+  Rectangle panel = replace_panel_rect();
+  DrawRectangleRounded(panel, 0.05f, 8, BG_SIDEBAR);
+
+  cursor_drawn_visible = cursor_visible();
+  Rectangle field = {panel.x + 8, panel.y + 8, panel.width - 16, 36};
+  draw_replace_field(field, replace_panel.find, "Find in all notes",
+                     !replace_panel.with_focused);
+  field.y += 44;
+  draw_replace_field(field, replace_panel.with, "Replace with",
+                     replace_panel.with_focused);
+
+  /* Totals, or what the last replace did */
+  char summary[160];
+  if (replace_panel.status[0] != '\0') {
+    snprintf(summary, sizeof(summary), "%s", replace_panel.status);
+  } else if (replace_panel.find[0] == '\0') {
+    strcpy(summary, "Tab switches fields, Enter replaces");
+  } else if (background_busy & BACKGROUND_REPLACE) {
+    strcpy(summary, "Counting...");
+  } else if (replace_panel.hit_count == 0) {
+    strcpy(summary, "No matches");
+  } else {
+    snprintf(summary, sizeof(summary), "%ld match%s in %d note%s",
+             replace_panel.match_count,
+             replace_panel.match_count == 1 ? "" : "es",
+             replace_panel.hit_count, replace_panel.hit_count == 1 ? "" : "s");
+  }
+  DrawTextEx(mainFont, summary, (Vector2){panel.x + 20, panel.y + 104}, 14, 1,
+             TEXT_MUTED);
+
+  /* Matches per note, for the first notes */
+  for (int row = 0; row < replace_panel.hit_count && row < REPLACE_ROWS;
+       row++) {
+    const ReplaceNote *hit = &replace_panel.hits[row];
+    float y = panel.y + 132 + row * 30;
+    DrawTextEx(mainFont, notebook.notes[hit->note].title,
+               (Vector2){panel.x + 20, y}, 16, 1, TEXT_SECONDARY);
+    char count[24];
+    snprintf(count, sizeof(count), "%ld", hit->count);
+    Vector2 size = MeasureTextEx(mainFont, count, 16, 1);
+    DrawTextEx(mainFont, count,
+               (Vector2){panel.x + panel.width - size.x - 20, y}, 16, 1,
+               ACCENT_BLUE);
+  }
+}
+
+/**
+ * @brief Screen rectangle of the quick switcher's panel
+ */
+static Rectangle switcher_panel_rect(void) {
+  int rows = switcher.result_count > 0 ? switcher.result_count : 1;
+  return (Rectangle){(WINDOW_WIDTH - 560) / 2, HEADER_HEIGHT + 40, 560,
+                     64 + rows * 36};
+}
+
+/**
+ * @brief Screen rectangle of one row in the quick switcher
+ */
+static Rectangle switcher_row_rect(int row) {
+  Rectangle panel = switcher_panel_rect();
+  return (Rectangle){panel.x + 8, panel.y + 56 + row * 36, panel.width - 16,
+                     34};
+}
+
+/**
+ * @brief Draw the quick switcher over the rest of the window
+ */
+static void draw_switcher(void) {
+  DrawRectangle(0, 0, WINDOW_WIDTH, WINDOW_HEIGHT, (Color){0, 0, 0, 120});
+  Rectangle panel = switcher_panel_rect();
+  DrawRectangleRounded(panel, 0.05f, 8, BG_SIDEBAR);
+
+  /* Query with a blinking caret */
+  Rectangle input = {panel.x + 8, panel.y + 8, panel.width - 16, 40};
+  DrawRectangleRounded(input, 0.2f, 8, BG_EDITOR);
+  Vector2 text_pos = {input.x + 12, input.y + 11};
+  if (switcher.query[0] == '\0') {
+    DrawTextEx(mainFont, "Open note...", text_pos, 18, 1, TEXT_MUTED);
+  }
+  DrawTextEx(mainFont, switcher.query, text_pos, 18, 1, TEXT_PRIMARY);
+  cursor_drawn_visible = cursor_visible();
+  if (cursor_drawn_visible) {
+    Vector2 size = MeasureTextEx(mainFont, switcher.query, 18, 1);
+    DrawRectangle((int)(text_pos.x + size.x) + 2, (int)input.y + 10, 2, 20,
+                  ACCENT_PURPLE);
+  }
+
+  if (switcher.result_count == 0) {
+    DrawTextEx(mainFont, "No matching notes",
+               (Vector2){input.x + 12, panel.y + 64}, 16, 1, TEXT_MUTED);
+    return;
+  }
+
+  FuzzyPattern pattern;
+  fuzzy_pattern_init(&pattern, switcher.query);
+  GlyphMetrics *gm = glyph_metrics_get(mainFont, 16);
+  for (int row = 0; row < switcher.result_count; row++) {
+    Rectangle rect = switcher_row_rect(row);
+    bool selected = row == switcher.selected;
+    if (selected) {
+      DrawRectangleRounded(rect, 0.2f, 8, BG_SELECTED);
+    }
+    const char *title = notebook.notes[switcher.results[row]].title;
+    Vector2 pos = {rect.x + 12, rect.y + 9};
+    DrawTextEx(mainFont, title, pos, 16, 1,
+               selected ? TEXT_PRIMARY : TEXT_SECONDARY);
+
+    /* Draw the matched characters again in the accent color */
+    size_t len = strlen(title);
+    bool matched[MAX_TITLE_LENGTH] = {0};
+    int score;
+    if (pattern.char_count == 0 ||
+        !fuzzy_match(&pattern, title, len, &score, matched))
+      continue;
+    float x = pos.x;
+    for (size_t i = 0; i < len;) {
+      int codepoint;
+      int size = decode_utf8(title + i, len - i, &codepoint);
+      if (matched[i]) {
+        DrawTextCodepoint(mainFont, codepoint, (Vector2){x, pos.y}, 16,
+                          ACCENT_BLUE);
+      }
+      x += glyph_advance(gm, codepoint);
+      i += size;
+    }
+  }
+}
+
 /* ============================================================================
  * Input Handling
  * ============================================================================
  */
 
+/**
+ * @brief Apply this frame's typing and Backspace to a one-line text field
+ *
+ * Backspace drops the whole last character, not just its final byte.
+ *
+ * @param field NUL-terminated UTF-8 text
+ * @param size Bytes available in field
+ * @return True if the text changed
+ */
+static bool text_field_edit(char *field, size_t size) {
+  size_t len = strlen(field);
+  bool changed = false;
+
+  int codepoint = GetCharPressed();
+  while (codepoint > 0) {
+    char utf8[4];
+    int utf8_len = encode_utf8(codepoint, utf8);
+    if (codepoint >= 32 && len + utf8_len < size) {
+      memcpy(field + len, utf8, utf8_len);
+      len += utf8_len;
+      field[len] = '\0';
+      changed = true;
+    }
+    codepoint = GetCharPressed();
+  }
+
+  if (is_key_pressed_or_repeat(KEY_BACKSPACE) && len > 0) {
+    do {
+      len--;
+    } while (len > 0 && (field[len] & 0xC0) == 0x80);
+    field[len] = '\0';
+    changed = true;
+  }
+  return changed;
+}
+
+/**
+ * @brief Edit the search query while the search box has focus
+ *
+ * Enter opens the first result and hands the keyboard back to the editor.
+ */
+static void handle_search_input(void) {
+  if (text_field_edit(notebook.searchQuery, sizeof(notebook.searchQuery))) {
+    notebook.scrollOffset = 0;
+    cursor_blink_reset();
+    search_refresh();
+  }
+
+  if (IsKeyPressed(KEY_ENTER) && notebook.searchResults != NULL &&
+      notebook.searchResultCount > 0) {
+    select_note(notebook.searchResults[0]);
+    notebook.searchFocused = false;
+    request_redraw();
+  }
+}
+
+/**
+ * @brief Edit the find bar's query and step through the matches
+ *
+ * Every change to the query moves the cursor to the first match at or after
+ * it. Enter goes to the next match and Shift+Enter to the previous one.
+ *
+ * @param note The selected note (must be loaded)
+ */
+static void handle_find_input(Note *note) {
+  if (text_field_edit(find_bar.query, sizeof(find_bar.query))) {
+    cursor_blink_reset();
+    find_prepare();
+    find_step(note, 0);
+  }
+
+  if (is_key_pressed_or_repeat(KEY_ENTER)) {
+    bool shift = IsKeyDown(KEY_LEFT_SHIFT) || IsKeyDown(KEY_RIGHT_SHIFT);
+    find_step(note, shift ? -1 : 1);
+  }
+  if (IsKeyPressed(KEY_ESCAPE)) {
+    find_set_open(false);
+  }
+}
+
+/**
+ * @brief Handle keys and clicks while the replace panel is open
+ *
+ * Tab moves between the two fields and Enter replaces. Escape, the shortcut
+ * again or a click outside the panel closes it.
+ */
+static void handle_replace_input(void) {
+  char *field =
+      replace_panel.with_focused ? replace_panel.with : replace_panel.find;
+  if (text_field_edit(field, sizeof(replace_panel.find))) {
+    replace_panel.status[0] = '\0';
+    cursor_blink_reset();
+    request_redraw();
+    if (!replace_panel.with_focused)
+      replace_refresh();
+  }
+
+  if (IsKeyPressed(KEY_TAB)) {
+    replace_panel.with_focused = !replace_panel.with_focused;
+    cursor_blink_reset();
+  }
+  if (IsKeyPressed(KEY_ENTER)) {
+    replace_apply();
+  }
+
+  Vector2 mouse = GetMousePosition();
+  bool outside = (IsMouseButtonPressed(MOUSE_BUTTON_LEFT) ||
+                  IsMouseButtonPressed(MOUSE_BUTTON_RIGHT)) &&
+                 !CheckCollisionPointRec(mouse, replace_panel_rect());
+  if (outside || IsKeyPressed(KEY_ESCAPE) ||
+      (is_modifier_down() && IsKeyPressed(KEY_R))) {
+    replace_set_open(false);
+  }
+}
+
+/**
+ * @brief Handle keys and clicks while the quick switcher is open
+ *
+ * Enter or a click opens the highlighted note. Escape, the shortcut again or
+ * a click outside the panel closes the switcher.
+ */
+static void handle_switcher_input(void) {
+  if (text_field_edit(switcher.query, sizeof(switcher.query))) {
+    cursor_blink_reset();
+    switcher_refresh();
+  }
+
+  /* Arrow keys and the mouse move the highlight */
+  if (is_key_pressed_or_repeat(KEY_DOWN) &&
+      switcher.selected + 1 < switcher.result_count) {
+    switcher.selected++;
+    request_redraw();
+  }
+  if (is_key_pressed_or_repeat(KEY_UP) && switcher.selected > 0) {
+    switcher.selected--;
+    request_redraw();
+  }
+
+  int open = -1;
+  if (IsKeyPressed(KEY_ENTER) && switcher.result_count > 0) {
+    open = switcher.results[switcher.selected];
+  }
+  Vector2 mouse = GetMousePosition();
+  Vector2 mouse_delta = GetMouseDelta();
+  bool clicked = IsMouseButtonPressed(MOUSE_BUTTON_LEFT);
+  for (int row = 0; row < switcher.result_count; row++) {
+    if (!CheckCollisionPointRec(mouse, switcher_row_rect(row)))
+      continue;
+    if (mouse_delta.x != 0 || mouse_delta.y != 0) {
+      switcher.selected = row;
+    }
+    if (clicked) {
+      open = switcher.results[row];
+    }
+  }
+
+  bool outside = (clicked || IsMouseButtonPressed(MOUSE_BUTTON_RIGHT)) &&
+                 !CheckCollisionPointRec(mouse, switcher_panel_rect());
+  if (open >= 0 || outside || IsKeyPressed(KEY_ESCAPE) ||
+      (is_modifier_down() && IsKeyPressed(KEY_O))) {
+    switcher_set_open(false);
+  }
+  if (open >= 0) {
+    select_note(open);
+  }
+}
+
 /**
  * @brief Process all user input
  */
 static void handle_input(void) {
+  /* Results of a query or replace preview that finished since the last
+   * frame, saves that reached the disk, and the next part of the vault
+   * while it loads */
+  search_poll();
+  replace_poll();
+  save_poll(false);
+  load_notes_step(LOAD_FRAME_BUDGET);
+
+  /* The quick switcher and the replace panel take all input while open.
+   * They hold places in the note table, so notes whose files went away or
+   * were changed by other programs are only taken in once they are closed */
+  if (switcher.open) {
+    handle_switcher_input();
+    return;
+  }
+  if (replace_panel.open) {
+    handle_replace_input();
+    return;
+  }
+  load_notes_prune();
+  watch_poll();
+
   /* Keyboard shortcuts */
   if (is_modifier_down()) {
     if (IsKeyPressed(KEY_N)) {
@@ -667,74 +11295,131 @@ static void handle_input(void) {
       }
     }
     if (IsKeyPressed(KEY_F)) {
-      notebook.showSearch = !notebook.showSearch;
-      if (!notebook.showSearch) {
+      /* Open and focus the search box; close it if it already has focus */
+      if (find_bar.open) {
+        find_set_open(false);
+      }
+      if (search_has_focus()) {
+        notebook.showSearch = false;
         notebook.searchQuery[0] = '\0';
+      } else {
+        notebook.showSearch = true;
+      }
+      notebook.searchFocused = notebook.showSearch;
+      notebook.scrollOffset = 0;
+      cursor_blink_reset();
+      search_refresh();
+    }
+    if (IsKeyPressed(KEY_O)) {
+      switcher_set_open(true);
+      return;
+    }
+    if (IsKeyPressed(KEY_R)) {
+      replace_set_open(true);
+      return;
+    }
+    if (IsKeyPressed(KEY_G) && notebook.selected >= 0 &&
+        notebook.notes[notebook.selected].content.data != NULL) {
+      /* Open the find bar; once open, step through the matches */
+      if (find_bar.open) {
+        bool shift = IsKeyDown(KEY_LEFT_SHIFT) || IsKeyDown(KEY_RIGHT_SHIFT);
+        find_step(&notebook.notes[notebook.selected], shift ? -1 : 1);
+      } else {
+        find_set_open(true);
+        notebook.searchFocused = false;
       }
     }
   }
 
-  /* Text input (supports Unicode / Turkish) */
-  if (notebook.count > 0 && notebook.selected >= 0) {
+  /* Clicking into the editor takes focus away from the search box */
+  Vector2 mouse = GetMousePosition();
+  if (search_has_focus() && IsMouseButtonPressed(MOUSE_BUTTON_LEFT) &&
+      mouse.x > SIDEBAR_WIDTH && mouse.y > HEADER_HEIGHT) {
+    notebook.searchFocused = false;
+    request_redraw();
+  }
+
+  /* Clicking into the text, or a note without a body, closes the find bar */
+  bool has_body = notebook.selected >= 0 &&
+                  notebook.notes[notebook.selected].content.data != NULL;
+  if (find_bar.open &&
+      (!has_body || (IsMouseButtonPressed(MOUSE_BUTTON_LEFT) &&
+                     mouse.x > SIDEBAR_WIDTH && mouse.y > HEADER_HEIGHT &&
+                     !CheckCollisionPointRec(mouse, find_bar_rect())))) {
+    find_set_open(false);
+  }
+
+  if (search_has_focus()) {
+    handle_search_input();
+  } else if (find_bar.open) {
+    handle_find_input(&notebook.notes[notebook.selected]);
+  } else if (notebook.count > 0 && notebook.selected >= 0 &&
+             notebook.notes[notebook.selected].content.data != NULL) {
+    /* Text input (supports Unicode / Turkish) */
     Note *note = &notebook.notes[notebook.selected];
+    TextBuffer *content = &note->content;
 
     /* Process Unicode character input */
     int codepoint = GetCharPressed();
     while (codepoint > 0) {
       if (codepoint >= 32) { /* Printable characters only */
-        int len = strlen(note->content);
-        char utf8[5] = {0};
+        char utf8[4];
         int utf8_len = encode_utf8(codepoint, utf8);
 
-        if (len + utf8_len < MAX_CONTENT_LENGTH - 1) {
-          strcat(note->content, utf8);
-          note->modified = true;
+        if (note_insert_text(note, notebook.cursorPos, utf8, utf8_len)) {
+          cursor_set(notebook.cursorPos + utf8_len);
         }
       }
       codepoint = GetCharPressed();
     }
 
     /* Backspace (handles multi-byte UTF-8) */
-    if (IsKeyPressed(KEY_BACKSPACE) || IsKeyPressedRepeat(KEY_BACKSPACE)) {
-      int len = strlen(note->content);
-      if (len > 0) {
-        int char_bytes = get_last_utf8_char_bytes(note->content, len);
-        note->content[len - char_bytes] = '\0';
-        note->modified = true;
+    if (is_key_pressed_or_repeat(KEY_BACKSPACE)) {
+      if (notebook.cursorPos > 0) {
+        size_t prev = text_buffer_prev_char(content, notebook.cursorPos);
+        note_delete_text(note, prev, notebook.cursorPos - prev);
+        cursor_set(prev);
       }
     }
 
     /* Enter key */
     if (IsKeyPressed(KEY_ENTER)) {
-      int len = strlen(note->content);
-      if (len < MAX_CONTENT_LENGTH - 1) {
-        note->content[len] = '\n';
-        note->content[len + 1] = '\0';
-        note->modified = true;
+      if (note_insert_text(note, notebook.cursorPos, "\n", 1)) {
+        cursor_set(notebook.cursorPos + 1);
       }
     }
 
     /* Tab key (insert 4 spaces) */
     if (IsKeyPressed(KEY_TAB)) {
-      int len = strlen(note->content);
-      if (len < MAX_CONTENT_LENGTH - 4) {
-        strcat(note->content, "    ");
-        note->modified = true;
+      if (note_insert_text(note, notebook.cursorPos, "    ", 4)) {
+        cursor_set(notebook.cursorPos + 4);
       }
     }
+
+    /* Arrow keys, Home/End, PageUp/PageDown, Delete */
+    handle_editor_keys(note);
+
+    /* Click to place the cursor */
+    if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT) && mouse.x > SIDEBAR_WIDTH &&
+        mouse.y > HEADER_HEIGHT + 100) {
+      cursor_set(editor_offset_at_point(note, mouse));
+    }
   }
 
-  /* Sidebar scrolling */
+  /* Sidebar and editor scrolling */
   float wheel = GetMouseWheelMove();
   if (wheel != 0) {
     Vector2 mouse = GetMousePosition();
-    if (mouse.x < SIDEBAR_WIDTH) {
+    if (mouse.x >= SIDEBAR_WIDTH) {
+      /* Clamped to the note's height when the editor is drawn */
+      notebook.editorScrollTarget -= wheel * SCROLL_LINES * EDITOR_LINE_HEIGHT;
+    } else {
       notebook.scrollOffset -= (int)(wheel * 30);
       if (notebook.scrollOffset < 0) {
         notebook.scrollOffset = 0;
       }
       int max_scroll =
-          notebook.count * 40 - (WINDOW_HEIGHT - HEADER_HEIGHT - 100);
+          sidebar_row_count() * 40 - (WINDOW_HEIGHT - HEADER_HEIGHT - 100);
       if (max_scroll < 0)
         max_scroll = 0;
       if (notebook.scrollOffset > max_scroll) {
@@ -742,14 +11427,314 @@ static void handle_input(void) {
       }
     }
   }
+
+  /* Saves, new notes and deletes since the last frame change the results */
+  if (notebook.searchStale) {
+    search_refresh();
+  }
+}
+
+/* ============================================================================
+ * Command Line Tools
+ * ============================================================================
+ * Options that do their work and exit without opening a window.
+ */
+
+#define BENCH_SEARCH_BYTES (64u << 20) /* Text scanned by --bench-search */
+#define BENCH_SEARCH_ROUNDS 5          /* Best of this many runs is reported */
+#define BENCH_SWITCHER_TITLES 100000   /* Titles ranked by --bench-switcher */
+
+/**
+ * @brief Monotonic time in seconds, for measurements
+ */
+static double bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Time one substring kernel over the benchmark text
+ * @param name Label printed for the kernel
+ * @param kernel The kernel (NULL to time strstr)
+ * @param text NUL-terminated text
+ * @param needle Needle as passed to the kernel
+ * @param fold Case-insensitive search
+ * @param expected Offset the needle must be found at
+ */
+static void bench_substring_kernel(const char *name, SubstringKernel kernel,
+                                   const char *text, const char *needle,
+                                   bool fold, size_t expected) {
+  double best = 0;
+  size_t found = SUBSTRING_NONE;
+  for (int round = 0; round < BENCH_SEARCH_ROUNDS; round++) {
+    double start = bench_now();
+    if (kernel == NULL) {
+      const char *hit = strstr(text, needle);
+      found = hit != NULL ? (size_t)(hit - text) : SUBSTRING_NONE;
+    } else {
+      found =
+          kernel(text, BENCH_SEARCH_BYTES, needle, strlen(needle), fold);
+    }
+    double elapsed = bench_now() - start;
+    if (round == 0 || elapsed < best)
+      best = elapsed;
+  }
+
+  printf("  %-8s %-17s %7.2f GB/s%s\n", name,
+         fold ? "case-insensitive" : "exact",
+         (double)expected / best / 1e9,
+         found == expected ? "" : "  (wrong result!)");
+}
+
+/**
+ * @brief Measure the substring scanner against strstr (--bench-search)
+ *
+ * The needle sits at the very end of a large block of generated prose, so
+ * every kernel has to scan all of it.
+ *
+ * @return Process exit status
+ */
+static int run_search_benchmark(void) {
+  char *text = malloc(BENCH_SEARCH_BYTES + 1);
+  if (text == NULL) {
+    fprintf(stderr, "Not enough memory for the benchmark\n");
+    return 1;
+  }
+
+  /* Lowercase words of 1-8 letters with the odd line break */
+  unsigned seed = 12345;
+  for (size_t i = 0; i < BENCH_SEARCH_BYTES;) {
+    seed = seed * 1103515245u + 12345u;
+    size_t word = 1 + (seed >> 16) % 8;
+    for (size_t k = 0; k < word && i < BENCH_SEARCH_BYTES; k++) {
+      seed = seed * 1103515245u + 12345u;
+      text[i++] = (char)('a' + (seed >> 16) % 26);
+    }
+    if (i < BENCH_SEARCH_BYTES)
+      text[i++] = (seed >> 24) % 12 == 0 ? '\n' : ' ';
+  }
+  const char *needle = "needle in a haystack";
+  size_t expected = BENCH_SEARCH_BYTES - strlen(needle);
+  memcpy(text + expected, needle, strlen(needle));
+  text[BENCH_SEARCH_BYTES] = '\0';
+
+  printf("Searching %u MB for a %zu-byte needle (best of %d runs)\n",
+         BENCH_SEARCH_BYTES >> 20, strlen(needle), BENCH_SEARCH_ROUNDS);
+  bench_substring_kernel("strstr", NULL, text, needle, false, expected);
+  bench_substring_kernel("scalar", substring_find_scalar, text, needle, false,
+                         expected);
+  bench_substring_kernel("scalar", substring_find_scalar, text, needle, true,
+                         expected);
+#if defined(__SSE2__)
+  bench_substring_kernel("sse2", substring_find_sse2, text, needle, false,
+                         expected);
+  bench_substring_kernel("sse2", substring_find_sse2, text, needle, true,
+                         expected);
+#endif
+#if HAVE_AVX2_KERNEL
+  if (__builtin_cpu_supports("avx2")) {
+    bench_substring_kernel("avx2", substring_find_avx2, text, needle, false,
+                           expected);
+    bench_substring_kernel("avx2", substring_find_avx2, text, needle, true,
+                           expected);
+  }
+#endif
+
+  free(text);
+  return 0;
+}
+
+/**
+ * @brief Measure the quick switcher's ranking (--bench-switcher)
+ *
+ * Ranks a vault of generated titles the way typing in the switcher does.
+ *
+ * @return Process exit status
+ */
+static int run_switcher_benchmark(void) {
+  static const char *words[] = {
+      "Meeting", "notes",  "project", "plan",    "weekly", "review",
+      "ideas",   "Reading", "list",   "journal", "draft",  "budget",
+      "Travel",  "recipe", "roadmap", "retro",   "design", "todo"};
+  static const char *queries[] = {"m", "mtg", "proj plan", "wkrv2024",
+                                  "xyzzy"};
+  int word_count = (int)(sizeof(words) / sizeof(words[0]));
+
+  Note *notes = calloc(BENCH_SWITCHER_TITLES, sizeof(Note));
+  if (notes == NULL) {
+    fprintf(stderr, "Not enough memory for the benchmark\n");
+    return 1;
+  }
+  unsigned seed = 12345;
+  for (int i = 0; i < BENCH_SWITCHER_TITLES; i++) {
+    char *title = notes[i].title;
+    int len = 0;
+    int words_in_title = 2 + i % 4;
+    for (int w = 0; w < words_in_title; w++) {
+      seed = seed * 1103515245u + 12345u;
+      len += snprintf(title + len, MAX_TITLE_LENGTH - len, "%s%s",
+                      w > 0 ? " " : "", words[(seed >> 16) % word_count]);
+    }
+    snprintf(title + len, MAX_TITLE_LENGTH - len, " %d", 2000 + i % 30);
+  }
+  notebook.notes = notes;
+  notebook.count = BENCH_SWITCHER_TITLES;
+
+  printf("Ranking %d titles (best of %d runs)\n", BENCH_SWITCHER_TITLES,
+         BENCH_SEARCH_ROUNDS);
+  for (size_t q = 0; q < sizeof(queries) / sizeof(queries[0]); q++) {
+    snprintf(switcher.query, sizeof(switcher.query), "%s", queries[q]);
+    double best = 0;
+    for (int round = 0; round < BENCH_SEARCH_ROUNDS; round++) {
+      double start = bench_now();
+      switcher_refresh();
+      double elapsed = bench_now() - start;
+      if (round == 0 || elapsed < best)
+        best = elapsed;
+    }
+    printf("  %-10s %7.2f ms  %s\n", queries[q], best * 1e3,
+           switcher.result_count > 0 ? notes[switcher.results[0]].title
+                                     : "(no match)");
+  }
+
+  notebook.notes = NULL;
+  notebook.count = 0;
+  free(notes);
+  switcher_titles_free();
+  return 0;
+}
+
+/**
+ * @brief Print the lines of the vault's notes that match a regex (--grep)
+ *
+ * Prints "title:line:text" for every matching line, like grep -n. Notes
+ * without the pattern's required literals are skipped through the index,
+ * which is brought up to date (and saved) on the way.
+ *
+ * @param pattern The pattern (see Regex)
+ * @return Process exit status: 0 if a line matched, 1 if none did, 2 on
+ *         error
+ */
+static int run_grep(const char *pattern) {
+  const char *error;
+  Regex *re = regex_compile(pattern, strlen(pattern), &error);
+  if (re == NULL) {
+    fprintf(stderr, "Invalid pattern: %s\n", error);
+    return 2;
+  }
+
+  index_file_open();
+  load_notes();
+  int *docs;
+  int found = search_regex_candidates(re, &docs);
+  unsigned char *candidate = calloc((size_t)notebook.nextNoteId + 1, 1);
+  if (found < 0 || candidate == NULL) {
+    fprintf(stderr, "Not enough memory to search\n");
+    free(docs);
+    free(candidate);
+    free_notes();
+    regex_free(re);
+    return 2;
+  }
+  for (int k = 0; k < found; k++)
+    candidate[docs[k]] = 1;
+  free(docs);
+
+  bool matched = false;
+  for (int i = 0; i < notebook.count; i++) {
+    Note *note = &notebook.notes[i];
+    char filepath[256];
+    note_filepath(note, filepath, sizeof(filepath));
+    FILE *file = candidate[note->id] ? fopen(filepath, "r") : NULL;
+    if (file == NULL)
+      continue;
+    TextBuffer tb;
+    bool ok = text_buffer_load_file(&tb, file);
+    fclose(file);
+    if (!ok)
+      continue;
+
+    /* A freshly loaded buffer has all of its text in front of the gap */
+    const char *text = tb.data;
+    size_t len = tb.gap_start;
+    if (regex_search(re, text, len)) {
+      int line = 1;
+      for (size_t start = 0; start < len; line++) {
+        const char *eol = memchr(text + start, '\n', len - start);
+        size_t end = eol != NULL ? (size_t)(eol - text) : len;
+        if (regex_search(re, text + start, end - start)) {
+          printf("%s:%d:%.*s\n", note->title, line, (int)(end - start),
+                 text + start);
+          matched = true;
+        }
+        start = end + 1;
+      }
+    }
+    text_buffer_free(&tb);
+  }
+
+  free(candidate);
+  index_file_save();
+  free_notes();
+  regex_free(re);
+  return matched ? 0 : 1;
 }
 
 /* ============================================================================
  * Main Entry Point
  * ============================================================================
+ * Startup is timed from the top of main() and logged: the first
+ * interactive frame is the first one drawn with the selected note loaded
+ * and taking input, and the vault is loaded once every note is listed and
+ * indexed.
+ */
+
+/**
+ * @brief Startup milestones reached so far
+ */
+typedef struct {
+  double launch;    /* bench_now() at the top of main() */
+  bool interactive; /* The first interactive frame was drawn */
+  bool loaded;      /* The vault finished loading */
+} StartupTimes;
+
+static StartupTimes startup;
+
+/**
+ * @brief Log the startup milestones reached since the last call
+ * @param drew A frame was just drawn
  */
+static void startup_report(bool drew) {
+  double elapsed = (bench_now() - startup.launch) * 1e3;
+  if (drew && !startup.interactive && notebook.selected >= 0 &&
+      notebook.selected < notebook.count &&
+      notebook.notes[notebook.selected].content.data != NULL) {
+    startup.interactive = true;
+    TraceLog(LOG_INFO, "STARTUP: First interactive frame after %.1f ms",
+             elapsed);
+  }
+  if (!startup.loaded && !(background_busy & BACKGROUND_LOAD)) {
+    startup.loaded = true;
+    TraceLog(LOG_INFO, "STARTUP: Vault loaded after %.1f ms (%d notes)",
+             elapsed, notebook.count);
+  }
+}
+
+int main(int argc, char **argv) {
+  startup.launch = bench_now();
+  case_fold_init();
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--low-power") == 0)
+      low_power_mode = true;
+    if (strcmp(argv[i], "--bench-search") == 0)
+      return run_search_benchmark();
+    if (strcmp(argv[i], "--bench-switcher") == 0)
+      return run_switcher_benchmark();
+    if (strcmp(argv[i], "--grep") == 0 && i + 1 < argc)
+      return run_grep(argv[i + 1]);
+  }
 
-int main(void) {
   /* Configure window */
   SetConfigFlags(FLAG_MSAA_4X_HINT | FLAG_WINDOW_RESIZABLE);
   InitWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "Notes - Obsidian-like Notebook");
@@ -759,18 +11744,23 @@ int main(void) {
   mainFont = GetFontDefault();
   boldFont = GetFontDefault();
 
-  /* Initialize file system */
+  /* Initialize file system; the vault loads while the window runs */
   ensure_vault_exists();
-  load_notes();
-
-  if (notebook.count > 0) {
-    notebook.selected = 0;
-  }
+  index_file_open();
+  search_worker_start();
+  watch_start();
+  load_notes_begin();
 
-  /* Main loop */
+  /* Main loop: draw only when something changed, otherwise sleep */
   while (!WindowShouldClose()) {
     handle_input();
 
+    if (!frame_needs_redraw()) {
+      startup_report(false);
+      idle_wait();
+      continue;
+    }
+
     BeginDrawing();
     ClearBackground(BG_DARK);
 
@@ -778,12 +11768,35 @@ int main(void) {
     draw_editor();
     draw_header();
     draw_status_bar();
+    if (find_bar.open) {
+      draw_find_bar();
+    }
+    if (replace_panel.open) {
+      draw_replace_panel();
+    }
+    if (switcher.open) {
+      draw_switcher();
+    }
 
     EndDrawing();
+    startup_report(true);
   }
 
   /* Save all notes before exit */
+  watch_stop();
   save_all_notes();
+  state_save();
+  search_worker_stop();
+  replace_preview_finish(true);
+  /* Until the vault is loaded, the file still has entries for notes not
+   * seen yet; keep it as it is */
+  if (!(background_busy & BACKGROUND_LOAD)) {
+    index_file_save();
+    meta_file_save();
+  }
+  free_notes();
+  switcher_titles_free();
+  glyph_metrics_free();
 
   CloseWindow();
   return 0;